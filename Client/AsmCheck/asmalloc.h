@@ -0,0 +1,311 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmalloc.h : memory accounting and allocation for a single assembly
+// validation
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <new>
+
+#define ARENA_ALIGNMENT     8
+#define ARENA_INITIAL_SIZE  (8 * 1024)      // held inline, enough for a small organism
+#define ARENA_CHUNK_SIZE    (64 * 1024)
+#define ARENA_ALIGN(n)      (((n) + ARENA_ALIGNMENT - 1) & ~(SIZE_T)(ARENA_ALIGNMENT - 1))
+
+// Small blocks are rounded up to a size class: every multiple of
+// ARENA_ALIGNMENT up to ARENA_FINE_LIMIT, then every power of two up to
+// ARENA_SMALL_LIMIT.  Larger blocks get a chunk of their own.
+#define ARENA_FINE_LIMIT    128
+#define ARENA_SMALL_LIMIT   (ARENA_CHUNK_SIZE / 4)
+#define ARENA_FINE_CLASSES  (ARENA_FINE_LIMIT / ARENA_ALIGNMENT)
+#define ARENA_CLASSES       (ARENA_FINE_CLASSES + 7)    // 256 through 16K
+
+// Allocator for the transient state of one validation.  Small blocks
+// are carved from the inline block, then from chunks of
+// ARENA_CHUNK_SIZE, and go back on a free list of their size class when
+// freed, so containers that are cleared and refilled for every member
+// reuse the same memory.  A large block is a chunk of its own, handed
+// back to the heap when it is freed.  Reset and the destructor free
+// every chunk at once.
+class Arena {
+private:
+	struct Chunk {
+		Chunk* prev;
+		Chunk* next;
+		SIZE_T size;
+	};
+
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	ULONGLONG _initial[ARENA_INITIAL_SIZE / sizeof(ULONGLONG)];
+	Chunk* _chunks;
+	BYTE* _next;
+	BYTE* _end;
+	SIZE_T _reserved;
+	FreeBlock* _free[ARENA_CLASSES];
+
+	static int ClassOf(SIZE_T bytes) {
+		if ( bytes <= ARENA_FINE_LIMIT )
+			return (bytes <= ARENA_ALIGNMENT) ? 0 : (int)(ARENA_ALIGN(bytes) / ARENA_ALIGNMENT) - 1;
+
+		int cls = ARENA_FINE_CLASSES;
+		for (SIZE_T size = 2 * ARENA_FINE_LIMIT; size < bytes; size *= 2)
+			cls++;
+		return cls;
+	}
+
+	static SIZE_T ClassSize(int cls) {
+		if ( cls < ARENA_FINE_CLASSES )
+			return (SIZE_T)(cls + 1) * ARENA_ALIGNMENT;
+		return (SIZE_T)(2 * ARENA_FINE_LIMIT) << (cls - ARENA_FINE_CLASSES);
+	}
+
+	static SIZE_T ChunkHeader() { return ARENA_ALIGN(sizeof(Chunk)); }
+
+	// aligned start of a new chunk of size bytes
+	BYTE* NewChunk(SIZE_T size) {
+		Chunk* chunk = (Chunk*) ::operator new(ChunkHeader() + size);
+		chunk->prev = NULL;
+		chunk->next = _chunks;
+		chunk->size = size;
+		if ( NULL != _chunks )
+			_chunks->prev = chunk;
+		_chunks = chunk;
+		_reserved += ChunkHeader() + size;
+		return (BYTE*)chunk + ChunkHeader();
+	}
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+public:
+	Arena() {
+		_chunks = NULL;
+		_reserved = 0;
+		Reset();
+	}
+
+	~Arena() {
+		Reset();
+	}
+
+	// bytes a block of the given size actually takes
+	static SIZE_T GetBlockSize(SIZE_T bytes) {
+		return (bytes > ARENA_SMALL_LIMIT) ? ARENA_ALIGN(bytes) : ClassSize(ClassOf(bytes));
+	}
+
+	void* Allocate(SIZE_T bytes) {
+		if ( bytes > ARENA_SMALL_LIMIT )
+			return NewChunk(ARENA_ALIGN(bytes));
+
+		int cls = ClassOf(bytes);
+		if ( NULL != _free[cls] ) {
+			FreeBlock* block = _free[cls];
+			_free[cls] = block->next;
+			return block;
+		}
+
+		bytes = ClassSize(cls);
+		if ( bytes > (SIZE_T)(_end - _next) ) {
+			// the rest of the old chunk is left behind
+			_next = NewChunk(ARENA_CHUNK_SIZE);
+			_end = _next + ARENA_CHUNK_SIZE;
+		}
+
+		void* p = _next;
+		_next += bytes;
+		return p;
+	}
+
+	void Free(void* p, SIZE_T bytes) {
+		if ( NULL == p )
+			return;
+
+		if ( bytes > ARENA_SMALL_LIMIT ) {
+			Chunk* chunk = (Chunk*)((BYTE*)p - ChunkHeader());
+			if ( NULL != chunk->prev )
+				chunk->prev->next = chunk->next;
+			else
+				_chunks = chunk->next;
+			if ( NULL != chunk->next )
+				chunk->next->prev = chunk->prev;
+
+			_reserved -= ChunkHeader() + chunk->size;
+			::operator delete(chunk);
+			return;
+		}
+
+		int cls = ClassOf(bytes);
+		FreeBlock* block = (FreeBlock*)p;
+		block->next = _free[cls];
+		_free[cls] = block;
+	}
+
+	// frees every chunk and starts over in the inline block
+	void Reset() {
+		while ( NULL != _chunks ) {
+			Chunk* next = _chunks->next;
+			::operator delete(_chunks);
+			_chunks = next;
+		}
+
+		_next = (BYTE*)_initial;
+		_end = _next + sizeof(_initial);
+		_reserved = 0;
+		for (int cls = 0; cls < ARENA_CLASSES; cls++)
+			_free[cls] = NULL;
+	}
+
+	// bytes taken from the heap, beyond the inline block
+	SIZE_T GetReserved() { return _reserved; }
+};
+
+// Tracks the bytes held by the transient state of one validation.
+// Callers that can do without an allocation (caches, report nodes)
+// ask CanAfford first and skip the work when the budget is spent;
+// everything else is simply charged so the peak stays accurate.
+// Memory taken through Allocate comes from the budget's arena and is
+// charged at the size the arena really hands out; Free puts it back for
+// reuse.  The peak covers the heap the arena holds as well, free lists
+// included.  An allocation that can't be done without cannot be refused,
+// so one past the limit is made and the budget is marked overcommitted;
+// the validation polls Overcommitted and gives up.
+class MemoryBudget {
+private:
+	SIZE_T _limit;
+	SIZE_T _used;
+	SIZE_T _peak;
+	bool _exceeded;
+	bool _overcommitted;
+	Arena _arena;
+
+	void UpdatePeak() {
+		SIZE_T held = max(_used, _arena.GetReserved());
+		if ( held > _peak )
+			_peak = held;
+	}
+
+public:
+	MemoryBudget() {
+		_limit = DEFAULT_MEMORY_BUDGET;
+		_used = _peak = 0;
+		_exceeded = false;
+		_overcommitted = false;
+	}
+
+	void SetLimit(SIZE_T limit) {
+		_limit = limit ? limit : DEFAULT_MEMORY_BUDGET;
+	}
+
+	bool CanAfford(SIZE_T bytes) {
+		if ( _used + bytes <= _limit )
+			return true;
+
+		_exceeded = true;
+		return false;
+	}
+
+	void Charge(SIZE_T bytes) {
+		_used += bytes;
+		UpdatePeak();
+	}
+
+	void Release(SIZE_T bytes) {
+		_used -= (bytes < _used) ? bytes : _used;
+	}
+
+	void* Allocate(SIZE_T bytes) {
+		void* p = _arena.Allocate(bytes);
+		Charge(Arena::GetBlockSize(bytes));
+
+		if ( _used > _limit || _arena.GetReserved() > _limit )
+			_exceeded = _overcommitted = true;
+		return p;
+	}
+
+	void Free(void* p, SIZE_T bytes) {
+		_arena.Free(p, bytes);
+		Release(Arena::GetBlockSize(bytes));
+	}
+
+	SIZE_T GetLimit() { return _limit; }
+	SIZE_T GetUsed() { return _used; }
+	SIZE_T GetPeak() { return _peak; }
+	bool Exceeded() { return _exceeded; }
+	bool Overcommitted() { return _overcommitted; }
+};
+
+// STL allocator that takes its memory from a MemoryBudget, so a
+// container's nodes come from the arena and go away with the validation.
+// A default constructed allocator has no budget and uses the heap.
+template <class T>
+class TrackedAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef SIZE_T size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <class U>
+	struct rebind {
+		typedef TrackedAllocator<U> other;
+	};
+
+	MemoryBudget* _budget;
+
+	TrackedAllocator() : _budget(NULL) {}
+	TrackedAllocator(MemoryBudget* budget) : _budget(budget) {}
+	TrackedAllocator(const TrackedAllocator<T>& other) : _budget(other._budget) {}
+
+	template <class U>
+	TrackedAllocator(const TrackedAllocator<U>& other) : _budget(other._budget) {}
+
+	pointer address(reference r) const { return &r; }
+	const_pointer address(const_reference r) const { return &r; }
+
+	pointer allocate(size_type n, const void* /* hint */ = 0) {
+		if ( NULL != _budget )
+			return (pointer)_budget->Allocate(n * sizeof(T));
+		return (pointer) ::operator new(n * sizeof(T));
+	}
+
+	void deallocate(pointer p, size_type n) {
+		if ( NULL != _budget )
+			_budget->Free(p, n * sizeof(T));
+		else
+			::operator delete(p);
+	}
+
+	void construct(pointer p, const T& val) { new((void*)p) T(val); }
+	void destroy(pointer p) { p->~T(); }
+
+	size_type max_size() const {
+		size_type n = (size_type)(-1) / sizeof(T);
+		return (0 < n ? n : 1);
+	}
+};
+
+template <class T, class U>
+inline bool operator==(const TrackedAllocator<T>& lhs, const TrackedAllocator<U>& rhs) {
+	return lhs._budget == rhs._budget;
+}
+
+template <class T, class U>
+inline bool operator!=(const TrackedAllocator<T>& lhs, const TrackedAllocator<U>& rhs) {
+	return lhs._budget != rhs._budget;
+}
+
+// rough size of a std::map/std::set node around a value of the given size
+#define TREE_NODE_COST(valueSize) ((valueSize) + 4 * sizeof(void*))
+
+// rough cost of one element node in the XML report
+#define DOM_NODE_COST 256
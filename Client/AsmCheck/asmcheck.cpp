@@ -14,7 +14,6 @@
 #pragma warning(default: 4127 4063 4100 4189 4245 4244)
 
 #include <corerror.h>
-#include <StrongName.h>
 #include "asmcheck.h"
 #include <memory>
 
@@ -37,14 +36,35 @@
 
 [assembly:System::Reflection::AssemblyVersionAttribute("2.0.50522.7")];
 
-CRITICAL_SECTION osCritSec;
-OSVERSIONINFOA g_osVersion;
+// Set once while the loader lock is held and only read afterwards, so
+// IsWin9x needs no lock.
+static bool g_isWin9x;
+static bool g_knownNames;
 
-BOOL APIENTRY DllMain( HANDLE /* hModule */, DWORD  ul_reason_for_call, LPVOID /* lpReserved */)
+static bool InternKnownNames();
+
+BOOL APIENTRY DllMain( HANDLE /* hModule */, DWORD  ul_reason_for_call, LPVOID lpReserved)
 {
 	switch (ul_reason_for_call) {
 		case DLL_PROCESS_ATTACH:
-			InitializeCriticalSection(&osCritSec);
+            {
+				OSVERSIONINFOA os;
+				os.dwOSVersionInfoSize = sizeof(OSVERSIONINFOA);
+
+				// VER_PLATFORM_WIN32_WINDOWS indicates:
+				// Win95, Win98, or WinME (all ANSI)
+				// VER_PLATFORM_WIN32_NT indicates:
+				// NT 3.5, NT 4, Win2K, WinXP, or Windows.NET Server (all Unicode)
+				g_isWin9x = !GetVersionExA(&os) || os.dwPlatformId == VER_PLATFORM_WIN32_WINDOWS;
+				g_knownNames = InternKnownNames();
+
+				g_scheduler.Initialize();
+			}
+			break;
+
+		case DLL_PROCESS_DETACH:
+			// lpReserved is set when the whole process is exiting
+			g_scheduler.Shutdown(NULL != lpReserved);
 			break;
 	}
 
@@ -52,115 +72,64 @@ BOOL APIENTRY DllMain( HANDLE /* hModule */, DWORD  ul_reason_for_call, LPVOID /
 }
 
 
-#undef OPDEF
-
-typedef enum opcode_t {
-#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
-#include "opcode.def"
-#undef OPDEF
-	CEE_COUNT,			/* number of instructions and macros pre-defined */
-} OPCODE;
-
 #define IsBadInstr(n)   ((n) >= CEE_COUNT) ? 1 : _badInstrTable[(n)]
 
-typedef enum opcode_format_t {
-	InlineNone      = 0,  // no inline args
-	InlineVar       = 1,  // local variable       (U2 (U1 if Short on))
-	InlineI         = 2,  // an signed integer    (I4 (I1 if Short on))
-	InlineR         = 3,  // a real number        (R8 (R4 if Short on))
-	InlineBrTarget  = 4,  // branch target        (I4 (I1 if Short on))
-	InlineI8        = 5,
-	InlineMethod    = 6,   // method token (U4)
-	InlineField     = 7,   // field token  (U4)
-	InlineType      = 8,   // type token   (U4)
-	InlineString    = 9,   // string TOKEN (U4)
-	InlineSig       = 10,  // signature tok (U4)
-	InlineRVA       = 11,  // ldptr token  (U4)
-	InlineTok       = 12,  // a metadata token of unknown type (U4)
-	InlineSwitch    = 13,  // count (U4), pcrel1 (U4) .... pcrelN (U4)
-	InlinePhi       = 14,  // count (U1), var1 (U2) ... varN (U2)
-	ShortInline     = 16,					      // if this bit is set, the format is the 'short' format
-	PrimaryMask     = (ShortInline-1),			  // mask these off to get primary enumeration above
-	ShortInlineVar  = (ShortInline + InlineVar),
-	ShortInlineI    = (ShortInline + InlineI),
-	ShortInlineR    = (ShortInline + InlineR),
-	ShortInlineBrTarget = (ShortInline + InlineBrTarget),
-} OPCODE_FORMAT;
-
-
-
-typedef struct {
-	char *  pszName;
-	USHORT   Ref; // reference codes
-	BYTE    Type; // Inline0 etc.
-	BYTE    Len;  // std mapping
-	BYTE    Std1;
-	BYTE    Std2;
-} opcodeinfo_t;
+// opcode.def spells the stack behaviour out per slot, as in Pop1+Pop1
+#define Pop0    0
+#define Pop1    1
+#define PopI    1
+#define PopI8   1
+#define PopR4   1
+#define PopR8   1
+#define PopRef  1
+#define VarPop  OPCODE_VAR_STACK
+#define Push0   0
+#define Push1   1
+#define PushI   1
+#define PushI8  1
+#define PushR4  1
+#define PushR8  1
+#define PushRef 1
+#define VarPush OPCODE_VAR_STACK
 
 opcodeinfo_t OpcodeInfo[] =
 {
-#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) s,c,args,l,s1,s2,
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) s,c,args,l,s1,s2,pop,push,
 #include "opcode.def"
 #undef OPDEF
 };
 
-
-OSVERSIONINFOA* InternalGetOSVersion()
-{
-	if ( g_osVersion.dwOSVersionInfoSize == 0 )
-    {
-		__try
-        {
-			EnterCriticalSection(&osCritSec);
-
-			if ( g_osVersion.dwOSVersionInfoSize == 0 )
-            {
-				g_osVersion.dwOSVersionInfoSize = sizeof(OSVERSIONINFOA);
-				GetVersionExA(&g_osVersion);
-			}
-		}
-
-		__finally
-        {
-			LeaveCriticalSection(&osCritSec);
-		}
-	}
-
-	return &g_osVersion;
-}
-
+#undef Pop0
+#undef Pop1
+#undef PopI
+#undef PopI8
+#undef PopR4
+#undef PopR8
+#undef PopRef
+#undef VarPop
+#undef Push0
+#undef Push1
+#undef PushI
+#undef PushI8
+#undef PushR4
+#undef PushR8
+#undef PushRef
+#undef VarPush
 
 
 bool IsWin9x() {
-	OSVERSIONINFOA* os = InternalGetOSVersion();
-
-	if ( NULL == os )
-		return true;
-
-	// VER_PLATFORM_WIN32_WINDOWS indicates:
-	// Win95, Win98, or WinME (all ANSI)
-	// VER_PLATFORM_WIN32_NT indicates:
-	// NT 3.5, NT 4, Win2K, WinXP, or Windows.NET Server (all Unicode)
-	return(os->dwPlatformId == VER_PLATFORM_WIN32_WINDOWS);
+	return g_isWin9x;
 }
 
 
-BOOL ValidateCanonicalizedName(LPCWSTR path, BOOL fForce) {
-	BOOL result = FALSE;
-	BOOLEAN verified = FALSE;
-	BOOLEAN force = (BOOLEAN)fForce;
-
-	BOOL success = StrongNameSignatureVerificationEx(path,
-													 force,		// force verification, even if registry disallows
-													 &verified);
+// The signature is checked by asmsign rather than the runtime, so there
+// is no registry skip list and verification is always forced.
+BOOL ValidateCanonicalizedName(LPCWSTR path, BOOL /* fForce */) {
+	ManagedAssembly assembly;
 
 	// if we fail, assume that it's not verifiable,
 	// and therefore not loadable
-	if ( success && verified )
-		result = TRUE;
-
-	return result;
+	return assembly.VerifyStrongName(path) == STRONG_NAME_VALID;
 }
 
 // the return value has been new'ed, if it's non-null it must be deleted []
@@ -224,6 +193,49 @@ WCHAR* CanonicalizePath(LPCWSTR asmName) {
 	return path;
 }
 
+// the scheduling class of a validation, ASMCHECK_PRIORITY_DEFAULT
+// leaves it to the entry point
+static PriorityClass GetPriority(const ASMCHECK_OPTIONS* options, PriorityClass defaultPriority)
+{
+	if ( NULL == options || !ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, priority) )
+		return defaultPriority;
+
+	switch ( options->priority )
+    {
+		case ASMCHECK_PRIORITY_INTERACTIVE:
+			return InteractivePriority;
+		case ASMCHECK_PRIORITY_BULK:
+			return BulkPriority;
+	}
+
+	return defaultPriority;
+}
+
+static ULONG GetDeadline(const ASMCHECK_OPTIONS* options)
+{
+	if ( NULL == options || !ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, deadline) )
+		return 0;
+
+	return options->deadline;
+}
+
+// the cancel flag and time limit a validation waits for its slot under
+static const volatile LONG* GetCancel(const ASMCHECK_OPTIONS* options)
+{
+	if ( NULL == options || !ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, cancel) )
+		return NULL;
+
+	return options->cancel;
+}
+
+static ULONG GetTimeLimit(const ASMCHECK_OPTIONS* options)
+{
+	if ( NULL == options || !ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, timeLimit) )
+		return 0;
+
+	return options->timeLimit;
+}
+
 extern "C" BOOL _declspec(dllexport)ValidateStrongName(LPCWSTR asmName)
 {
 	BOOL result = FALSE;
@@ -272,11 +284,338 @@ extern "C" BOOL _declspec(dllexport) CheckAssemblyWithReporting(LPCWSTR asmName,
 	return CheckAssemblyInternal(asmName, xmlFile, REPORT_FLAGS_XML);
 }
 
+// entry point for callers that need to tune the validation
+// (memory budget, reporting) or want statistics back
+// returns TRUE if assembly is valid (passes all tests)
+// stats may be NULL, otherwise its cbSize must be set
+extern "C" BOOL _declspec(dllexport) CheckAssemblyWithOptions(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats) {
+	return CheckAssemblyInternal(asmName, options, stats);
+}
+
+// CheckAssemblyWithOptions, with the verdict and every diagnostic the
+// XML report would have handed back in result instead, so a caller
+// building a message needn't write and parse a report file; options
+// and stats may be NULL, result must have its sizes set and be freed
+// with FreeCheckResult
+extern "C" BOOL _declspec(dllexport) CheckAssemblyWithResult(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats, ASMCHECK_RESULT* result) {
+	if ( NULL == result || !ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, cbDiagnostic) )
+		return FALSE;
+
+	ClearCheckResult(result);
+	return CheckAssemblyInternal(asmName, options, stats, InteractivePriority, result);
+}
+
+extern "C" void _declspec(dllexport) FreeCheckResult(ASMCHECK_RESULT* result) {
+	if ( NULL == result || !ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, diagnostics) )
+		return;
+
+	delete [] (BYTE*)result->diagnostics;
+	ClearCheckResult(result);
+}
+
+// what the stages of a CheckAssemblyBatch pipeline share
+struct BatchContext {
+	LPWSTR* paths;
+	const ASMCHECK_OPTIONS* options;
+	BOOL* results;
+	ASMCHECK_STATS* stats;
+	MappedImage* images;
+	BOOL result;
+};
+
+static void LoadAssembly(void* context, ULONG i)
+{
+	BatchContext* batch = (BatchContext*)context;
+	const ASMCHECK_OPTIONS* options = batch->options;
+
+	// once cancelled the rest of the batch isn't read at all; a file
+	// that isn't mapped goes on with a NULL view and fails
+	if ( NULL != options && ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, cancel) &&
+		 NULL != options->cancel && 0 != *options->cancel )
+		return;
+
+	if ( MapImage(batch->paths[i], &batch->images[i]) )
+		PrefaultImage(batch->images[i]);
+}
+
+static void ValidateAssembly(void* context, ULONG i)
+{
+	BatchContext* batch = (BatchContext*)context;
+	ASMCHECK_STATS* stats = batch->stats;
+	ASMCHECK_STATS* assemblyStats = (NULL != stats) ?
+		(ASMCHECK_STATS*)((BYTE*)stats + (SIZE_T)i * stats->cbSize) : NULL;
+
+	// the slot is taken per assembly, so waiting interactive
+	// validations go ahead between assemblies
+	SchedulerSlot slot(GetPriority(batch->options, BulkPriority), GetDeadline(batch->options),
+					   GetCancel(batch->options), GetTimeLimit(batch->options));
+	ManagedAssembly a(batch->options);
+	AssemblyStatistics statistics;
+
+	a.AfterWait(slot);
+
+	if ( NULL != assemblyStats )
+		a.AddVisitor(&statistics);
+
+	a.AttachImage(batch->images[i]);
+	batch->results[i] = a.Validate(batch->paths[i]) ? TRUE : FALSE;
+
+	a.GetStats(assemblyStats);
+	statistics.GetStats(assemblyStats);
+}
+
+// the retire stage has one thread, so the verdicts are gathered unlocked
+static void RetireAssembly(void* context, ULONG i)
+{
+	BatchContext* batch = (BatchContext*)context;
+
+	UnmapImage(&batch->images[i]);
+	if ( !batch->results[i] )
+		batch->result = FALSE;
+}
+
+// xmlFile, summaryFile and listingFile each name one file, which every
+// assembly of a batch would write over
+static bool NamesOutputFile(const ASMCHECK_OPTIONS* options)
+{
+	if ( NULL == options )
+		return false;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, xmlFile) && NULL != options->xmlFile )
+		return true;
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, summaryFile) && NULL != options->summaryFile )
+		return true;
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, listingFile) && NULL != options->listingFile )
+		return true;
+
+	return false;
+}
+
+// entry point for revalidating many stored assemblies
+// the batch runs through a pipeline: files are mapped and paged in by
+// the load threads, at most options->prefetchDepth ahead of the
+// validation threads, and unmapped once validated, so the disks and the
+// processors are kept busy at the same time (see asmpipe.h)
+// results receives one verdict per name; stats may be NULL, otherwise
+// it is an array of count blocks that all have cbSize set
+// options may not name an output file, which would be shared by the
+// whole batch; the call then fails with ERROR_INVALID_PARAMETER
+// (E_INVALIDARG) and every result is FALSE
+// returns TRUE if every assembly is valid
+extern "C" BOOL _declspec(dllexport) CheckAssemblyBatch(LPCWSTR* asmNames, ULONG count, const ASMCHECK_OPTIONS* options, BOOL* results, ASMCHECK_STATS* stats) {
+	BOOL result = TRUE;
+
+	if ( NULL == asmNames || NULL == results )
+		return FALSE;
+
+	if ( NamesOutputFile(options) )
+    {
+		for (ULONG i = 0; i < count; i++)
+			results[i] = FALSE;
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	ULONG depth = 0;
+	if ( NULL != options && ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, prefetchDepth) )
+		depth = options->prefetchDepth;
+
+	ULONG loadThreads = 0, validateThreads = 0;
+	if ( NULL != options && ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, validateThreads) )
+    {
+		loadThreads = options->loadThreads;
+		validateThreads = options->validateThreads;
+	}
+
+	LPWSTR* paths = new LPWSTR[ count ];
+	for (ULONG i = 0; i < count; i++)
+    {
+		paths[i] = CanonicalizePath(asmNames[i]);
+		if ( NULL == paths[i] )
+        {
+			// the loader fails to open it and the verdict is FALSE
+			paths[i] = new WCHAR[1];
+			paths[i][0] = L'\0';
+		}
+	}
+
+	MappedImage* images = new MappedImage[ count ];
+	for (ULONG i = 0; i < count; i++)
+    {
+		images[i].file = INVALID_HANDLE_VALUE;
+		images[i].map = NULL;
+		images[i].view = NULL;
+		images[i].size = 0;
+	}
+
+	BatchContext batch;
+	batch.paths = paths;
+	batch.options = options;
+	batch.results = results;
+	batch.stats = stats;
+	batch.images = images;
+	batch.result = TRUE;
+
+	BatchPipeline pipeline;
+	pipeline.SetStage(LoadStage, LoadAssembly, loadThreads);
+	pipeline.SetStage(ValidateStage, ValidateAssembly, validateThreads);
+	pipeline.SetStage(RetireStage, RetireAssembly, 1);
+
+	if ( pipeline.Run(count, depth, &batch) )
+		result = batch.result;
+    else
+    {
+		for (ULONG i = 0; i < count; i++)
+			results[i] = CheckAssemblyInternal(paths[i], options, NULL, BulkPriority);
+		for (ULONG i = 0; i < count; i++)
+        {
+			if ( !results[i] )
+				result = FALSE;
+		}
+	}
+
+	for (ULONG i = 0; i < count; i++)
+		delete [] paths[i];
+	delete [] paths;
+	delete [] images;
+
+	return result;
+}
+
+// writes the process lifetime metrics in Prometheus text format to
+// file, for the node exporter's textfile collector; the text goes to
+// file.tmp first and is renamed over file, so a scrape never sees a
+// partial dump
+extern "C" BOOL _declspec(dllexport) DumpMetrics(LPCWSTR file) {
+	std::string text;
+	AssemblyErrorInfo::WriteMetrics(text);
+
+	std::wstring tempFile = file;
+	tempFile += L".tmp";
+
+	HANDLE handle = CreateFileW(tempFile.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( handle == INVALID_HANDLE_VALUE )
+		return FALSE;
+
+	DWORD written = 0;
+	BOOL result = WriteFile(handle, text.c_str(), (DWORD)text.size(), &written, NULL) &&
+				  written == (DWORD)text.size();
+	CloseHandle(handle);
+
+	if ( result )
+		result = MoveFileExW(tempFile.c_str(), file, MOVEFILE_REPLACE_EXISTING);
+	if ( !result )
+		DeleteFileW(tempFile.c_str());
+
+	return result;
+}
+
+// copies the metrics text into buffer, NUL terminated
+// needed receives the size the whole text takes, terminator included;
+// returns FALSE, copying nothing, if buffer is smaller than that
+extern "C" BOOL _declspec(dllexport) GetMetricsText(LPSTR buffer, ULONG size, ULONG* needed) {
+	std::string text;
+	AssemblyErrorInfo::WriteMetrics(text);
+
+	ULONG length = (ULONG)text.size() + 1;
+	if ( NULL != needed )
+		*needed = length;
+
+	if ( NULL == buffer || size < length )
+		return FALSE;
+
+	CopyMemory(buffer, text.c_str(), length);
+	return TRUE;
+}
+
+// writes the allowlist used with CHECK_FLAGS_ALLOWLIST: the public and
+// protected members of the given assemblies, e.g. all of OrganismBase
+// and a curated part of the class library; returns FALSE if an assembly
+// can't be read or the file can't be written
+extern "C" BOOL _declspec(dllexport) BuildAllowlist(const ASMCHECK_ALLOWLIST_SOURCE* sources, ULONG count, LPCWSTR allowlistFile) {
+	AllowlistBuilder builder;
+	BOOL result = TRUE;
+
+	if ( NULL == sources || NULL == allowlistFile )
+		return FALSE;
+
+	for (ULONG i = 0; i < count && result; i++)
+    {
+		MappedImage image;
+		if ( !MapImage(sources[i].asmName, &image) )
+        {
+			ASMTRACE(L"asmcheck: Can't open %s\n", sources[i].asmName);
+			result = FALSE;
+			break;
+		}
+
+		MetaDataTables tables;
+		PIMAGE_NT_HEADERS headers = RtlpImageNtHeader((PVOID)image.view);
+		HRESULT hr = tables.Init(image.view, image.size, headers);
+		if ( SUCCEEDED(hr) )
+			hr = builder.AddAssembly(tables, sources[i].types, sources[i].typeCount);
+
+		if ( FAILED(hr) )
+        {
+			ASMTRACE(L"asmcheck: Can't read metadata: %s\n", sources[i].asmName);
+			result = FALSE;
+		}
+
+		UnmapImage(&image);
+	}
+
+	if ( result )
+		result = builder.Write(allowlistFile);
+
+	ASMTRACE2(L"asmcheck: %u members approved in %s\n", builder.GetKeyCount(), allowlistFile);
+	return result;
+}
+
+// applies a policy to a reference summary written with
+// ASMCHECK_OPTIONS.summaryFile, without opening the assembly again, so a
+// new banned type can be screened against every stored organism
+// violations receives the number of policy violations found; returns
+// TRUE if there are none, FALSE if there are or the summary or the
+// policy can't be read
+extern "C" BOOL _declspec(dllexport) EvaluateSummary(LPCWSTR summaryFile, const ASMCHECK_POLICY* policy, ULONG* violations) {
+	MappedImage image;
+	ReferenceSummaryView summary;
+	BOOL result = FALSE;
+
+	if ( NULL != violations )
+		*violations = 0;
+
+	if ( NULL == summaryFile || !MapImage(summaryFile, &image) )
+		return FALSE;
+
+	if ( summary.Attach(image.view, image.size) )
+		result = EvaluateSummaryInternal(summary, policy, violations);
+	else
+		ASMTRACE(L"asmcheck: Bad summary: %s\n", summaryFile);
+
+	UnmapImage(&image);
+	return result;
+}
+
 BOOL CheckAssemblyInternal(LPCWSTR asmName, unsigned int flags) {
 	return CheckAssemblyInternal(asmName, NULL, flags);
 }
 
 BOOL CheckAssemblyInternal(LPCWSTR asmName, LPCWSTR xmlFile, unsigned int flags) {
+	ASMCHECK_OPTIONS options;
+	BZERO(&options, sizeof(options));
+	options.cbSize = sizeof(options);
+	options.reportFlags = flags;
+	options.xmlFile = xmlFile;
+
+	return CheckAssemblyInternal(asmName, &options, NULL);
+}
+
+BOOL CheckAssemblyInternal(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats) {
+	return CheckAssemblyInternal(asmName, options, stats, InteractivePriority);
+}
+
+BOOL CheckAssemblyInternal(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats, PriorityClass defaultPriority, ASMCHECK_RESULT* checkResult) {
 	BOOL result = FALSE;
 
 	LPCWSTR path = CanonicalizePath(asmName);
@@ -284,11 +623,24 @@ BOOL CheckAssemblyInternal(LPCWSTR asmName, LPCWSTR xmlFile, unsigned int flags)
 
 	if ( NULL != path )
     {
-		ManagedAssembly a(flags, xmlFile);
+		SchedulerSlot slot(GetPriority(options, defaultPriority), GetDeadline(options),
+						   GetCancel(options), GetTimeLimit(options));
+		ManagedAssembly a(options);
+		AssemblyStatistics statistics;
+
+		a.AfterWait(slot);
+
+		if ( NULL != stats )
+			a.AddVisitor(&statistics);
+		if ( NULL != checkResult )
+			a.CollectResult();
 
 		if ( a.Validate(path) ) {
 			result = TRUE;
 		}
+		a.GetStats(stats);
+		statistics.GetStats(stats);
+		a.GetResult(checkResult);
 		delete [] path;
 
 	}
@@ -321,9 +673,83 @@ OPCODE DecodeOpcode(const BYTE *pCode, DWORD *pdwLen) {
 	return opcode;
 }
 
-const WCHAR* ManagedAssembly::_ErrorFormatStr = L"%s.%s [%s]\n";
+// A switch is sized from its count without walking its targets, so every
+// instruction is decoded in constant time and a body in time linear in
+// its size, whatever counts a crafted body claims.
+bool DecodeInstruction(const BYTE* code, DWORD left, OPCODE* opcode, DWORD* length, DWORD* operandSize)
+{
+	*operandSize = 0;
+
+	// a two byte opcode cut off after its prefix
+	if ( 0 == left || (code[0] == CEE_PREFIX1 && left < 2) )
+		return false;
+
+	*opcode = DecodeOpcode(code, length);
+	if ( *length > left )
+		return false;
+
+	const BYTE* operand = code + *length;
+	left -= *length;
+
+	switch ( (*opcode < CEE_COUNT) ? OpcodeInfo[*opcode].Type : InlineNone )
+    {
+		default:
+			break;
+
+		case ShortInlineI:
+		case ShortInlineVar:
+		case ShortInlineBrTarget:
+			*operandSize = 1;
+			break;
+
+		case InlineVar:
+			*operandSize = 2;
+			break;
+
+		case InlineI:
+		case InlineRVA:
+		case ShortInlineR:
+		case InlineBrTarget:
+		case InlineString:
+		case InlineSig:
+		case InlineField:
+		case InlineType:
+		case InlineTok:
+		case InlineMethod:
+			*operandSize = 4;
+			break;
 
-ManagedAssembly::ManagedAssembly()
+		case InlineI8:
+		case InlineR:
+			*operandSize = 8;
+			break;
+
+		case InlineSwitch:
+            {
+				if ( left < 4 )
+					return false;
+
+				DWORD numCases = GET_UNALIGNED_DWORD(operand);
+				if ( numCases > (left - 4) / 4 )
+					return false;
+
+				*operandSize = 4 + 4 * numCases;
+			}
+			break;
+
+		case InlinePhi:
+			if ( left < 1 )
+				return false;
+			*operandSize = 1 + 2 * (DWORD)operand[0];
+			break;
+	}
+
+	return *operandSize <= left;
+}
+
+const WCHAR* ManagedAssembly::_ErrorFormatStr = L"%s.%s [%s]";
+
+ManagedAssembly::ManagedAssembly() : INIT_ASSEMBLY_CACHES
 {
 	ZeroInit();
 	CreateBadInstructionTable();
@@ -331,7 +757,7 @@ ManagedAssembly::ManagedAssembly()
 	FinalInitialize();
 }
 
-ManagedAssembly::ManagedAssembly(unsigned int reportFlags)
+ManagedAssembly::ManagedAssembly(unsigned int reportFlags) : INIT_ASSEMBLY_CACHES
 {
 	ZeroInit();
 	CreateBadInstructionTable();
@@ -340,7 +766,7 @@ ManagedAssembly::ManagedAssembly(unsigned int reportFlags)
 	FinalInitialize();
 }
 
-ManagedAssembly::ManagedAssembly(unsigned int reportFlags, LPCWSTR xmlFile)
+ManagedAssembly::ManagedAssembly(unsigned int reportFlags, LPCWSTR xmlFile) : INIT_ASSEMBLY_CACHES
 {
 	ZeroInit();
 	CreateBadInstructionTable();
@@ -350,6 +776,184 @@ ManagedAssembly::ManagedAssembly(unsigned int reportFlags, LPCWSTR xmlFile)
 	FinalInitialize();
 }
 
+ManagedAssembly::ManagedAssembly(const ASMCHECK_OPTIONS* options) : INIT_ASSEMBLY_CACHES
+{
+	ZeroInit();
+	CreateBadInstructionTable();
+
+	ApplyOptions(options);
+	FinalInitialize();
+}
+
+void ManagedAssembly::ApplyOptions(const ASMCHECK_OPTIONS* options)
+{
+	if ( NULL == options )
+		return;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, reportFlags) )
+		_reportFlags = options->reportFlags;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, xmlFile) )
+		_saveFile = options->xmlFile;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, memoryBudget) )
+		_budget.SetLimit(options->memoryBudget);
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, checkFlags) )
+		_checkFlags = options->checkFlags;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxTableRows) && options->maxTableRows != 0 )
+		_maxTableRows = options->maxTableRows;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxHeapSize) && options->maxHeapSize != 0 )
+		_maxHeapSize = options->maxHeapSize;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxILBytes) && options->maxILBytes != 0 )
+		_maxILBytes = options->maxILBytes;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxMethodSize) && options->maxMethodSize != 0 )
+		_maxMethodSize = options->maxMethodSize;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxSwitchTargets) && options->maxSwitchTargets != 0 )
+		_maxSwitchTargets = options->maxSwitchTargets;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, allowlistFile) )
+		_allowlistFile = options->allowlistFile;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, timeLimit) )
+		_timeLimit = options->timeLimit;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, cancel) )
+		_cancel = options->cancel;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, summaryFile) && NULL != options->summaryFile )
+    {
+		_summaryFile = options->summaryFile;
+		_summary.SetTables(&_tables);
+		AddVisitor(&_summary);
+	}
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, fingerprintIndex) && NULL != options->fingerprintIndex )
+    {
+		_indexFile = options->fingerprintIndex;
+		_fingerprinter.SetTables(&_tables);
+	}
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxTurnCost) )
+		_maxTurnCost = options->maxTurnCost;
+
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, maxTurnAllocations) )
+		_maxTurnAllocations = options->maxTurnAllocations;
+
+	// one pass over the flow graphs serves both estimates
+	if ( 0 != _maxTurnCost || 0 != _maxTurnAllocations )
+    {
+		_costEstimator.SetPoll(this);
+		AddVisitor(&_costEstimator);
+	}
+
+	// last, so what the other visitors report at an instruction is
+	// known by the time it is written
+	if ( ASMCHECK_HAS_FIELD(options, ASMCHECK_OPTIONS, listingFile) && NULL != options->listingFile )
+    {
+		_listingFile = options->listingFile;
+		_listing.SetTables(&_tables);
+		_listing.SetFile(_listingFile);
+		AddVisitor(&_listing);
+	}
+}
+
+// Registers an analyzer for the events it asks for.  The visitor
+// must outlive the call to Validate.
+bool ManagedAssembly::AddVisitor(AssemblyVisitor* visitor)
+{
+	DWORD events = visitor->GetEvents();
+
+	for (int ev = 0; ev < VisitorEventCount; ev++)
+    {
+		if ( (events & VISITOR_EVENT_MASK(ev)) && _visitorCount[ev] >= MAX_VISITORS )
+			return false;
+	}
+
+	for (int ev = 0; ev < VisitorEventCount; ev++)
+    {
+		if ( events & VISITOR_EVENT_MASK(ev) )
+			_visitors[ev][_visitorCount[ev]++] = visitor;
+	}
+
+	return true;
+}
+
+void ManagedAssembly::GetStats(ASMCHECK_STATS* stats)
+{
+	if ( NULL == stats )
+		return;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, peakMemory) )
+		stats->peakMemory = _budget.GetPeak();
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, budgetExceeded) )
+		stats->budgetExceeded = _budget.Exceeded() || _reportTruncated;
+
+	if ( 0 != _maxTurnCost )
+    {
+		if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, estimatedTurnCost) )
+			stats->estimatedTurnCost = (ULONG)min(_costEstimator.GetTurnCost(), (ULONGLONG)MAXULONG);
+
+		if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, loopCount) )
+			stats->loopCount = _costEstimator.GetLoopCount();
+	}
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, costExceeded) )
+		stats->costExceeded = _costExceeded;
+
+	if ( 0 != _maxTurnAllocations && ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, estimatedTurnAllocations) )
+		stats->estimatedTurnAllocations = (ULONG)min(_costEstimator.GetTurnAllocations(), (ULONGLONG)MAXULONG);
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, allocationsExceeded) )
+		stats->allocationsExceeded = _allocationsExceeded;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, strongNameStatus) )
+		stats->strongNameStatus = _strongNameStatus;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, limitExceeded) )
+		stats->limitExceeded = _limitExceeded;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, verdict) )
+		stats->verdict = _verdict;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, indexedMethodCount) )
+		stats->indexedMethodCount = _fingerprints.GetKnownCount();
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, similarMethodCount) )
+		stats->similarMethodCount = _similarCount;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, similarAssembly) )
+		CopyMemory(stats->similarAssembly, _similarAssembly, sizeof(stats->similarAssembly));
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, contentHash) )
+    {
+		if ( _hasContentHash )
+			CopyMemory(stats->contentHash, _contentHash, sizeof(stats->contentHash));
+		else
+			BZERO(stats->contentHash, sizeof(stats->contentHash));
+	}
+}
+
+void ManagedAssembly::GetResult(ASMCHECK_RESULT* result)
+{
+	if ( NULL == result )
+		return;
+
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, verdict) )
+		result->verdict = _verdict;
+
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, truncated) )
+		result->truncated = _reportTruncated;
+
+	_result.Detach(result);
+}
+
 void ManagedAssembly::FinalInitialize()
 {
 	// UsingXml relies on _xmlInited being true,
@@ -378,6 +982,11 @@ void ManagedAssembly::FinalInitialize()
 ManagedAssembly::~ManagedAssembly()
 {
 	if ( _xmlInited ) {
+		if ( _reportTruncated ) {
+			CComQIPtr<IXMLDOMElement> rootElement(_rootDomNode);
+			rootElement->setAttribute(CComBSTR(L"truncated"), CComVariant(L"true"));
+		}
+
 		CComVariant fname(_saveFile);
 		_xmlDom->save(fname);
 	}
@@ -389,16 +998,60 @@ void ManagedAssembly::ZeroInit()
 {
 	_module =  NULL;
 	_file = _map = NULL;
-	_dispenser = NULL;
-	_import = NULL;
 	_reportFlags = 0;
 	_badInstrTable = NULL;
 	_xmlInited = false;
+	_inMember = false;
+	_reportTruncated = false;
+	_collecting = false;
+	_saveFile = NULL;
+	_fileSize = 0;
+	_attached = false;
+	_maxTurnCost = 0;
+	_maxTurnAllocations = 0;
+	_checkFlags = CHECK_FLAGS_NONE;
+	_costExceeded = false;
+	_allocationsExceeded = false;
+	_strongNameStatus = STRONG_NAME_NOT_CHECKED;
+	_hasContentHash = false;
+	_maxTableRows = DEFAULT_MAX_TABLE_ROWS;
+	_maxHeapSize = DEFAULT_MAX_HEAP_SIZE;
+	_maxILBytes = DEFAULT_MAX_IL_BYTES;
+	_maxMethodSize = DEFAULT_MAX_METHOD_SIZE;
+	_maxSwitchTargets = DEFAULT_MAX_SWITCH_TARGETS;
+	_limitExceeded = RESOURCE_LIMIT_NONE;
+	_timeLimit = 0;
+	_cancel = NULL;
+	_stopTime.QuadPart = 0;
+	_requested.QuadPart = 0;
+	_polls = 0;
+	_stopVerdict = ASMCHECK_VERDICT_NONE;
+	_verdict = ASMCHECK_VERDICT_NONE;
+	_allowlistFile = NULL;
+	_summaryFile = NULL;
+	_listingFile = NULL;
+	_indexFile = NULL;
+	_indexImage.file = INVALID_HANDLE_VALUE;
+	_indexImage.map = NULL;
+	_indexImage.view = NULL;
+	_indexImage.size = 0;
+	_similarCount = 0;
+	BZERO(_similarAssembly, sizeof(_similarAssembly));
+	_contextsSeen = 0;
+	_methodContexts = 0;
+	_currentOffset = DIAG_NO_OFFSET;
+	BZERO(_visitorCount, sizeof(_visitorCount));
+	_currentType = TypeName();
+	_currentMember = "";
 }
 
 void ManagedAssembly::Dispose()
 {
-	if ( NULL != _module )
+	if ( _attached )
+    {
+		_module = NULL;
+	}
+	else if ( NULL != _module )
     {
 		UnmapViewOfFile(_module);
 		_module = NULL;
@@ -414,147 +1067,375 @@ void ManagedAssembly::Dispose()
 		_file = NULL;
 	}
 
-	if ( NULL != _import )
-    {
-		_import->Release();
-		_import = NULL;
-	}
+}
+
+bool ManagedAssembly::LoadFile(LPCWSTR name)
+{
+	MappedImage image;
+	bool success = MapImage(name, &image);
+
+	_file = (image.file != INVALID_HANDLE_VALUE) ? image.file : NULL;
+	_map = image.map;
+	_module = (HMODULE)image.view;
+	_fileSize = image.size;
+
+	return success;
+}
+
+// Validates an image some other code mapped, such as the batch loader,
+// instead of opening name.  The caller keeps ownership of the mapping.
+void ManagedAssembly::AttachImage(const MappedImage& image)
+{
+	_module = (HMODULE)image.view;
+	_fileSize = image.size;
+	_attached = true;
+}
 
+// The time limit counts from when the slot was asked for, and a
+// validation stopped while it waited for the slot doesn't start.
+void ManagedAssembly::AfterWait(const SchedulerSlot& slot)
+{
+	_requested = slot.GetRequested();
+	if ( _stopVerdict == ASMCHECK_VERDICT_NONE )
+		_stopVerdict = slot.GetStopVerdict();
+}
 
-	if ( NULL != _dispenser )
+// The types organisms must not use.
+// These are unauthorized because they can be used by a malicious
+// (or poorly written) organism to deadlock, starve resources,
+// or otherwise mess with the state of the Terrarium game.
+// We just check against direct calls to banned types
+// and classes derived from banned types
+static const char* bannedTypes[] = {
+        "System.Threading.Thread",
+        "System.Threading.ThreadPool",
+        "System.Activator",
+        "System.Threading.Timer",
+        "System.Threading.Mutex",
+        "System.Threading.Monitor",
+        "System.AppDomain",
+        "System.Threading.WaitHandle",
+        "System.GC",
+        "System.IntPtr",
+        "System.LocalDataStoreSlot",
+        "System.Security.SecurityManager",
+        "System.Windows.Forms.MessageBox",
+        "System.Reflection.Assembly",
+        "System.Runtime.Remoting.CallContext",
+        "System.Security.Principal",
+        "System.Drawing.Graphics",
+        "System.Drawing.Bitmap",
+        "System.Drawing.Image",
+        "System.Reflection.Binder",
+        "System.Reflection.MemberInfo",
+        "System.Reflection.MethodInfo",
+        "System.Reflection.FieldInfo",
+        "System.Security.Cryptography.SymmetricAlgorithm",
+        "System.Security.Cryptography.AsymmetricAlgorithm",
+        "System.Console",
+        "System.Diagnostics.Process",
+        "System.Diagnostics.Debug",
+        "System.Diagnostics.Debugger",
+        "System.Diagnostics.Trace",
+        "System.Diagnostics.StackTrace",
+        "System.Diagnostics.StackFrame",
+        "System.Diagnostics.ProcessThread",
+        "System.Diagnostics.ProcessModule",
+        "System.Diagnostics.TraceListener",
+        "System.Diagnostics.TraceListenerCollection",
+        "JScript 0",
+        "System.IO.Path",
+
+};
+
+// classes organisms derive from, which must be public to be loaded
+static const char* organismBaseTypes[] = {
+	"Animal",
+	"Plant"
+};
+
+// Puts the names checked against into the process-wide table, flagged
+// with what they are, so no validation has to set them up again.
+static bool InternKnownNames()
+{
+	bool interned = true;
+
+	for (int i = 0; i < ArraySize(bannedTypes); i++)
     {
-		_dispenser->Release();
-		_dispenser = NULL;
+		if ( NAME_ID_NONE == g_names.Intern(bannedTypes[i], NAME_FLAG_BANNED) )
+			interned = false;
 	}
 
-	if ( NULL != _badInstrTable )
+	for (int i = 0; i < ArraySize(organismBaseTypes); i++)
     {
-		delete [] _badInstrTable;
-		_badInstrTable = NULL;
+		if ( NAME_ID_NONE == g_names.Intern(organismBaseTypes[i], NAME_FLAG_ORGANISM_BASE) )
+			interned = false;
 	}
 
+	return interned;
 }
 
-bool ManagedAssembly::LoadFile(LPCWSTR name)
+// the opcodes organisms must not use
+static const OPCODE badInstructions[] = {
+	CEE_STSFLD
+};
+
+// error contexts a summary holds enough to decide again; the others are
+// carried over from the validation that wrote it
+#define SUMMARY_POLICY_CONTEXTS \
+	((1 << InvalidCall) | (1 << InvalidField) | (1 << InvalidBaseClass) | \
+	 (1 << PinvokeMethod) | (1 << HasSecurityMethod) | (1 << RequiresSecObjectMethod) | \
+	 (1 << ClassConstructor) | (1 << StaticField) | (1 << BadInstruction) | (1 << MemberNotAllowed))
+
+// SUMMARY_OPCODE_BITS index of an opcode given by its encoding
+static USHORT OpcodeBit(USHORT encoding)
 {
-	bool success = false;
+	if ( encoding < 0x100 )
+		return encoding;
+	if ( (encoding & 0xFF00) == 0xFE00 )
+		return (USHORT)(0x100 + (encoding & 0xFF));
+	return SUMMARY_OPCODE_BITS;
+}
 
-	if ( !IsWin9x() )
+// The same checks the validator makes, on the summary alone: the banned
+// types against every type the organism defines or references, the
+// banned opcodes, the banned attributes and, with CHECK_FLAGS_ALLOWLIST,
+// every member it references in another assembly.
+BOOL EvaluateSummaryInternal(const ReferenceSummaryView& summary, const ASMCHECK_POLICY* policy, ULONG* violations)
+{
+	const SummaryHeader* header = summary.GetHeader();
+	TypeNameSet banned;     // the policy's own, on top of the built-in ones
+	ULONG found = 0;
+
+	bool useAllowlist = false;
+	LPCWSTR allowlistFile = NULL;
+	if ( NULL != policy )
     {
-		_file = CreateFileW(name, GENERIC_READ, FILE_SHARE_READ,
-							0, OPEN_EXISTING, 0, 0);
-		_ASSERTE(_file != INVALID_HANDLE_VALUE);
-		if (_file != INVALID_HANDLE_VALUE)
+		if ( ASMCHECK_HAS_FIELD(policy, ASMCHECK_POLICY, bannedTypeCount) && NULL != policy->bannedTypes )
         {
-			_map = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
-			_ASSERTE(_map != NULL);
-			if (_map != NULL)
+			for (ULONG i = 0; i < policy->bannedTypeCount; i++)
             {
-				_module = (HMODULE) MapViewOfFile(_map, FILE_MAP_READ, 0, 0, 0);
-				_ASSERTE(_module != NULL);
-				success = (_module != NULL);
+				if ( !banned.Insert(policy->bannedTypes[i]) )
+                {
+					ASMTRACE(L"asmcheck: Too many banned types in policy (%u)\n", policy->bannedTypeCount);
+					return FALSE;
+				}
 			}
 		}
+
+		if ( ASMCHECK_HAS_FIELD(policy, ASMCHECK_POLICY, allowlistFile) )
+        {
+			useAllowlist = (policy->checkFlags & CHECK_FLAGS_ALLOWLIST) != 0;
+			allowlistFile = policy->allowlistFile;
+		}
 	}
-    else
+
+	// what the summary can't decide again stands
+	DWORD carried = header->contexts & ~SUMMARY_POLICY_CONTEXTS;
+	for (int ctx = 0; ctx < METRIC_MAX_CONTEXTS; ctx++)
     {
-		size_t len = wcslen(name);
-		LPSTR ansiName = new char[ len + 1 ];
-		wcstombs(ansiName, name, len);
-		ansiName[len] = '\0';
+		if ( carried & (1 << ctx) )
+			found++;
+	}
 
-		_file = CreateFileA(ansiName, GENERIC_READ, FILE_SHARE_READ,
-							0, OPEN_EXISTING, 0, 0);
-		_ASSERTE(_file != INVALID_HANDLE_VALUE);
+	static const DWORD bannedFeatures[] = {
+		SUMMARY_FEATURE_PINVOKE,
+		SUMMARY_FEATURE_HAS_SECURITY,
+		SUMMARY_FEATURE_REQUIRE_SEC_OBJECT,
+		SUMMARY_FEATURE_CLASS_CONSTRUCTOR,
+		SUMMARY_FEATURE_STATIC_FIELD
+	};
+	for (int i = 0; i < ArraySize(bannedFeatures); i++)
+    {
+		if ( header->features & bannedFeatures[i] )
+			found++;
+	}
+
+	const SummaryType* types = summary.GetTypes();
+	for (DWORD t = 0; t < header->typeCount; t++)
+    {
+		TypeName name(summary.GetString(types[t].nameSpace), summary.GetString(types[t].name));
+		if ( !name.IsEmpty() && ((g_names.GetFlags(name) & NAME_FLAG_BANNED) || banned.Contains(name)) )
+			found++;
+	}
 
-		if ( _file != INVALID_HANDLE_VALUE )
+	for (int i = 0; i < ArraySize(badInstructions); i++)
+    {
+		if ( summary.UsesOpcode(OpcodeEncoding(badInstructions[i])) )
+			found++;
+	}
+	if ( NULL != policy && ASMCHECK_HAS_FIELD(policy, ASMCHECK_POLICY, bannedOpcodeCount) && NULL != policy->bannedOpcodes )
+    {
+		for (ULONG i = 0; i < policy->bannedOpcodeCount; i++)
         {
-			_map = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
-			_ASSERTE(_map != NULL);
+			if ( summary.UsesOpcode(OpcodeBit(policy->bannedOpcodes[i])) )
+				found++;
+		}
+	}
+
+	if ( useAllowlist )
+    {
+		MappedImage image;
+		Allowlist allowlist;
 
-			if ( _map != NULL )
+		// an allowlist that can't be read fails the organism, as it
+		// does in the validator
+		if ( NULL == allowlistFile || !MapImage(allowlistFile, &image) )
+			found++;
+		else
+        {
+			if ( allowlist.Attach(image.view, image.size) )
             {
-				_module = (HMODULE) MapViewOfFile(_map, FILE_MAP_READ, 0, 0, 0);
-				_ASSERTE(_module != NULL);
-				success = (_module != NULL);
+				const SummaryMember* members = summary.GetMembers();
+				for (DWORD m = 0; m < header->memberCount; m++)
+                {
+					if ( members[m].key == 0 || !allowlist.Contains(members[m].key) )
+						found++;
+				}
 			}
-		}
+            else
+				found++;
 
-		if ( NULL != ansiName )
-			delete [] ansiName;
+			UnmapImage(&image);
+		}
 	}
 
-	return success;
+	if ( NULL != violations )
+		*violations = found;
+
+	return found == 0;
 }
 
 void ManagedAssembly::CreateBadInstructionTable()
 {
 	if ( NULL == _badInstrTable )
-		_badInstrTable = new unsigned int[ CEE_COUNT ];
+		_badInstrTable = (unsigned int*)_budget.Allocate(sizeof(unsigned int) * CEE_COUNT);
 
 	BZERO(_badInstrTable, sizeof(unsigned int) * CEE_COUNT);
-	_badInstrTable[CEE_STSFLD] = 1;
+	for (int i = 0; i < ArraySize(badInstructions); i++)
+		_badInstrTable[badInstructions[i]] = 1;
 }
 
-// Insert the list of types organisms must not use into a list
-// These are unauthorized because they can be used by a malicious
-// (or poorly written) organism to deadlock, starve resources,
-// or otherwise mess with the state of the Terrarium game.
-// We just check against direct calls to banned types
-// and classes derived from banned types
+// The types organisms must not use are interned for the whole process
+// when the DLL is loaded; all that is left is to tell if that worked.
 bool ManagedAssembly::ResolveUnauthorizedTypes()
 {
-	int errors = 0;
-
-    WCHAR* bannedTypes[] = {
-        L"System.Threading.Thread",
-        L"System.Threading.ThreadPool",
-        L"System.Activator",
-        L"System.Threading.Timer",
-        L"System.Threading.Mutex",
-        L"System.Threading.Monitor",
-        L"System.AppDomain",
-        L"System.Threading.WaitHandle",
-        L"System.GC",
-        L"System.IntPtr",
-        L"System.LocalDataStoreSlot",
-        L"System.Security.SecurityManager",
-        L"System.Windows.Forms.MessageBox",
-        L"System.Reflection.Assembly",
-        L"System.Runtime.Remoting.CallContext",
-        L"System.Security.Principal",
-        L"System.Drawing.Graphics",
-        L"System.Drawing.Bitmap",
-        L"System.Drawing.Image",
-        L"System.Reflection.Binder",
-        L"System.Reflection.MemberInfo",
-        L"System.Reflection.MethodInfo",
-        L"System.Reflection.FieldInfo",
-        L"System.Security.Cryptography.SymmetricAlgorithm",
-        L"System.Security.Cryptography.AsymmetricAlgorithm",
-        L"System.Console",
-        L"System.Diagnostics.Process",
-        L"System.Diagnostics.Debug",
-        L"System.Diagnostics.Debugger",
-        L"System.Diagnostics.Trace",
-        L"System.Diagnostics.StackTrace",
-        L"System.Diagnostics.StackFrame",
-        L"System.Diagnostics.ProcessThread",
-        L"System.Diagnostics.ProcessModule",
-        L"System.Diagnostics.TraceListener",
-        L"System.Diagnostics.TraceListenerCollection",
-        L"JScript 0",
-        L"System.IO.Path",
-
-    };
-
-
-	for (int j = 0; j < ArraySize(bannedTypes); j++ )
-    {
-		_bannedTypes.insert(bannedTypes[j]);
-	}
-
-	return(0 == errors);
+	return g_knownNames;
+}
+
+// In allowlist mode every member referenced in another assembly has to
+// be on the approved list, on top of the banned types.  Each MemberRef
+// row is keyed once and looked up with one probe.  A list that can't be
+// read fails the assembly.
+void ManagedAssembly::CheckAllowlist()
+{
+	MappedImage image;
+	Allowlist allowlist;
+
+	if ( NULL == _allowlistFile || !MapImage(_allowlistFile, &image) )
+    {
+		ASMTRACE(L"asmcheck: Can't open allowlist: %s\n", NULL != _allowlistFile ? _allowlistFile : L"");
+		ReportError(MemberNotAllowed, "", TypeName());
+		_errors.FoundError();
+		return;
+	}
+
+	if ( !allowlist.Attach(image.view, image.size) )
+    {
+		ASMTRACE(L"asmcheck: Bad allowlist: %s\n", _allowlistFile);
+		ReportError(MemberNotAllowed, "", TypeName());
+		_errors.FoundError();
+		UnmapImage(&image);
+		return;
+	}
+
+	ULONG count = _tables.GetRowCount(TblMemberRef);
+	for (ULONG rid = 1; rid <= count && !Stopped(); rid++)
+    {
+		mdToken parent, owner;
+		LPCSTR memberName = "";
+		PCCOR_SIGNATURE sig = NULL;
+		ULONG sigSize = 0;
+		ULONGLONG key;
+
+		HRESULT hr = _tables.GetMemberRefProps(TokenFromRid(rid, mdtMemberRef), &parent, &memberName, &sig, &sigSize);
+		if ( SUCCEEDED(hr) )
+			hr = GetMemberOwner(_tables, parent, &owner);
+
+		// members of the organism's own types and methods need no
+		// approval, nor do the accessors the runtime provides on arrays;
+		// that leaves the functions of other modules
+		if ( hr == S_FALSE && TypeFromToken(parent) != mdtModuleRef )
+			continue;
+		if ( hr == S_OK && TypeFromToken(owner) == mdtTypeDef )
+			continue;
+
+		if ( hr == S_OK )
+			hr = KeyMember(_tables, owner, memberName, sig, sigSize, &key);
+
+		if ( hr != S_OK || !allowlist.Contains(key) )
+        {
+			TypeName className;
+			if ( hr == S_OK )
+				GetTypeName(owner, &className);
+
+			ReportError(MemberNotAllowed, memberName, className);
+			_errors.FoundError();
+		}
+	}
+
+	UnmapImage(&image);
+}
+
+// Stamp of the rules a method body's result depends on; an index kept
+// under other rules is started over.  Changes to the checks themselves
+// bump INDEX_VERSION.
+static DWORD IndexPolicy()
+{
+	MemberKey key;
+
+	for (int i = 0; i < ArraySize(bannedTypes); i++)
+		key.AddString(bannedTypes[i]);
+	for (int i = 0; i < ArraySize(badInstructions); i++)
+		key.AddData(badInstructions[i]);
+
+	return (DWORD)key.Get();
+}
+
+// A missing or stale index is no error: every body is checked, and the
+// index is started over when the new bodies are merged.
+void ManagedAssembly::OpenIndex()
+{
+	if ( NULL == _indexFile || NULL != _indexImage.view )
+		return;
+
+	if ( MapImage(_indexFile, &_indexImage) && !_index.Attach(_indexImage.view, _indexImage.size, IndexPolicy()) )
+		ASMTRACE(L"asmcheck: Ignoring index: %s\n", _indexFile);
+}
+
+void ManagedAssembly::CloseIndex(bool passed)
+{
+	if ( NULL == _indexFile )
+		return;
+
+	// the closest known assembly is looked up while the names are mapped
+	if ( _index.IsAttached() )
+    {
+		WCHAR name[ASMCHECK_NAME_SIZE];
+		IndexAssemblyName(_currentAssembly, name);
+
+		DWORD closest = _fingerprints.GetClosest(_index.FindAssembly(name), &_similarCount);
+		if ( closest < _index.GetAssemblyCount() )
+			wcsncpy(_similarAssembly, _index.GetAssemblyName(closest), ASMCHECK_NAME_SIZE - 1);
+		else
+			_similarCount = 0;
+	}
+
+	_index = FingerprintIndex();
+	UnmapImage(&_indexImage);
+
+	if ( !_fingerprints.Merge(_indexFile, IndexPolicy(), _currentAssembly, passed) )
+		ASMTRACE(L"asmcheck: Can't update index: %s\n", _indexFile);
 }
 
 #define CHECK_HEADER(p, Struct)  {                                                      \
@@ -590,8 +1471,21 @@ bool ManagedAssembly::Validate(LPCWSTR name)
 	_currentAssembly = name;
 	bool success = false;
 	HRESULT hr;
+	LARGE_INTEGER start;
 
-	if ( LoadFile(name) )
+	QueryPerformanceCounter(&start);
+
+	if ( 0 != _timeLimit )
+    {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		LONGLONG from = (0 != _requested.QuadPart) ? _requested.QuadPart : start.QuadPart;
+		_stopTime.QuadPart = from + (LONGLONG)_timeLimit * frequency.QuadPart / 1000;
+	}
+
+	DISPATCH_VISITORS(AssemblyEvent, BeginAssembly(name));
+
+	if ( _attached ? NULL != _module : LoadFile(name) )
     {
 		// First validate that the native OS headers haven't been modified to
         // prevent any viruses that could have been inserted there
@@ -600,227 +1494,422 @@ bool ManagedAssembly::Validate(LPCWSTR name)
         {
 			_headers = RtlpImageNtHeader(_module);
 
-			hr = CoCreateInstance(CLSID_CorMetaDataDispenser, NULL,
-								  CLSCTX_INPROC_SERVER,
-								  IID_IMetaDataDispenser,
-								  (void **) &_dispenser);
-			_ASSERTE(SUCCEEDED(hr));
+			// everything is read straight from the mapped tables; there
+			// is no metadata scope to open, so nothing here touches COM
+			hr = _tables.Init((const BYTE*)_module, _fileSize, _headers);
+			_stackVerifier.SetTables(&_tables);
 
-			if (SUCCEEDED(hr)) {
-				LPCWSTR szScope = name;
-				hr = _dispenser->OpenScope(szScope, 0, IID_IMetaDataImport, (IUnknown**)&_import);
+			// oversized organisms are turned away on the table
+			// header, before anything walks them
+			bool withinLimits = SUCCEEDED(hr) && CheckResourceLimits();
 
-                // Now walk through and make sure the animal isn't using types that are
-                // banned.
-				if (SUCCEEDED(hr))
-                {
-					ResolveUnauthorizedTypes();
+			// a validation cancelled while it waited for its turn
+			// doesn't start
+			if ( withinLimits && Stopped() )
+				withinLimits = false;
 
-					// start with globals, then walk types
-					ProcessType(mdTokenNil);
+            // Now walk through and make sure the animal isn't using types that are
+            // banned.
+			if ( withinLimits )
+            {
+				IngestImage();
 
-					HCORENUM typeDefEnum = NULL;
-					enumMgr eMgr(_import, &typeDefEnum);
+				ResolveUnauthorizedTypes();
 
-					mdTypeDef typeDefs[ENUM_BUFFER_SIZE];
-					ULONG count, totalCount = 1;
-					HRESULT hr;
+				if ( _checkFlags & CHECK_FLAGS_ALLOWLIST )
+					CheckAllowlist();
 
-					while (SUCCEEDED(hr = _import->EnumTypeDefs( &typeDefEnum, typeDefs,
-                                                                 ArraySize(typeDefs), &count)) && count > 0)
-                    {
-						for (ULONG i = 0; i < count; i++, totalCount++)
-                        {
-							ProcessType(typeDefs[i]);
-						}
-					}
-				}
-                else
+				OpenIndex();
+
+				// start with globals, then walk types; the first TypeDef
+				// is <Module>, which holds the globals
+				ProcessType(mdTokenNil);
+
+				ULONG typeCount = _tables.GetRowCount(TblTypeDef);
+				for (ULONG rid = 2; rid <= typeCount && !Stopped(); rid++)
                 {
-					_errors.FoundError(); // make sure it fails...
-					ASMTRACE(L"asmcheck: Can't open scope: %s\n", name);
+					ProcessType(TokenFromRid(rid, mdtTypeDef));
 				}
+
+				// the estimate of part of the handlers proves nothing
+				if ( !Stopped() )
+					CheckTurnCost();
+			}
+            else if ( FAILED(hr) )
+            {
+				_errors.FoundError(); // make sure it fails...
+				ASMTRACE(L"asmcheck: Can't read metadata: %s\n", name);
 			}
 
-			success = _errors.GetErrorCount() == 0;
+			success = _errors.GetErrorCount() == 0 && _stopVerdict == ASMCHECK_VERDICT_NONE;
 		}
 	}
 
+	if ( _stopVerdict != ASMCHECK_VERDICT_NONE )
+    {
+		_verdict = _stopVerdict;
+		ASMTRACE2(L"asmcheck: Stopped (verdict %u): %s\n", _verdict, name);
+	}
+	else
+		_verdict = success ? ASMCHECK_VERDICT_PASSED : ASMCHECK_VERDICT_FAILED;
+
+	FlushDiagnostics();
+	DISPATCH_VISITORS(AssemblyEvent, EndAssembly(_errors.GetErrorCount()));
+
+	if ( NULL != _listingFile && _listing.Failed() )
+		ASMTRACE(L"asmcheck: Can't write listing: %s\n", _listingFile);
+
+	// written while the tables are still mapped; a summary of part of
+	// the assembly would pass what the rest of it breaks
+	if ( NULL != _summaryFile && _stopVerdict == ASMCHECK_VERDICT_NONE &&
+		 !_summary.Write(_summaryFile, _fileSize, _contextsSeen) )
+		ASMTRACE(L"asmcheck: Can't write summary: %s\n", _summaryFile);
+
+	CloseIndex(success);
+
+	LARGE_INTEGER end, frequency;
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&frequency);
+	g_metrics.RecordValidation(_verdict, (ULONGLONG)(end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart,
+							   _fileSize, _contextsSeen);
+
 	ASMTRACE2(L"asmcheck: %d errors found in %s\n", _errors.GetErrorCount(), name);
+	ASMTRACE2(L"asmcheck: peak memory %u of %u bytes\n", (ULONG)_budget.GetPeak(), (ULONG)_budget.GetLimit());
 	return success;
 }
 
 void ManagedAssembly::ProcessType(mdTypeDef tok) {
+	FlushDiagnostics();
+
+	// the report node for this type is created with its first error
+	if ( _currTypeNode.p != NULL )
+    {
+		_currTypeNode.Release();
+	}
+	_currentType = TypeName();
+
 	if ( tok != mdTokenNil )
     {
-		GetTypeName(tok, _currentType, ArraySize(_currentType));
+		GetTypeName(tok, &_currentType);
 
-		if ( _xmlInited )
+		TypeCheckTree(tok, InvalidBaseClass, "Type Definition");
+	}
+
+	DispatchBeginType(tok);
+	ValidateMemberTypes(tok);
+	DISPATCH_VISITORS(TypeEvent, EndType(tok));
+}
+
+// Flags the organism if its event handlers are estimated to cost more per
+// turn, or to allocate more per turn, than allowed.  Each error is filed
+// under the handler that contributes most and only fails validation with
+// CHECK_FLAGS_REJECT_COSTLY or CHECK_FLAGS_REJECT_ALLOCATING.
+void ManagedAssembly::CheckTurnCost()
+{
+	if ( 0 != _maxTurnCost )
+    {
+		ULONGLONG cost = _costEstimator.GetTurnCost();
+		ASMTRACE2(L"asmcheck: estimated turn cost %u, limit %u\n",
+				  (ULONG)min(cost, (ULONGLONG)MAXULONG), _maxTurnCost);
+
+		if ( cost > _maxTurnCost )
         {
-			CComBSTR rootNode = L"type";
-			CComVariant elemNode(NODE_ELEMENT);
-			CComPtr<IXMLDOMNode> rootDomElem;
+			_costExceeded = true;
+			if ( _checkFlags & CHECK_FLAGS_REJECT_COSTLY )
+				_errors.FoundError();
 
-			_xmlDom->createNode(elemNode, rootNode, NULL, &rootDomElem);
+			ReportHandler(_costEstimator.GetCostliestHandler(), ExcessiveCost);
+		}
+	}
 
-			if ( _currTypeNode.p != NULL )
-            {
-				_currTypeNode.Release();
-			}
-			_rootDomNode->appendChild(rootDomElem, &_currTypeNode);
+	if ( 0 != _maxTurnAllocations )
+    {
+		ULONGLONG allocs = _costEstimator.GetTurnAllocations();
+		ASMTRACE2(L"asmcheck: estimated turn allocations %u, limit %u\n",
+				  (ULONG)min(allocs, (ULONGLONG)MAXULONG), _maxTurnAllocations);
+
+		if ( allocs > _maxTurnAllocations )
+        {
+			_allocationsExceeded = true;
+			if ( _checkFlags & CHECK_FLAGS_REJECT_ALLOCATING )
+				_errors.FoundError();
+
+			ReportHandler(_costEstimator.GetMostAllocatingHandler(), ExcessiveAllocation);
+		}
+	}
+}
+
+// files an error about the whole organism under one of its handlers
+void ManagedAssembly::ReportHandler(mdMethodDef handler, ErrorContext ctx)
+{
+	mdTypeDef owner = mdTypeDefNil;
+
+	FlushDiagnostics();
+
+	if ( _currTypeNode.p != NULL )
+		_currTypeNode.Release();
+	if ( _currMemberNode.p != NULL )
+		_currMemberNode.Release();
+
+	_currentType = TypeName();
+	if ( SUCCEEDED(_tables.GetMemberParent(handler, &owner)) )
+		GetTypeName(owner, &_currentType);
+	_tables.GetMemberName(handler, &_currentMember);
+
+	_inMember = true;
+	ReportError(ctx, _currentMember, TypeName());
+	FlushDiagnostics();
+	_inMember = false;
+}
+
+// Checks the organism against the size ceilings using only the table
+// header and the method headers, so an oversized assembly is rejected
+// before it is decoded.  Switch tables are checked as they are decoded.
+bool ManagedAssembly::CheckResourceLimits()
+{
+	for (int table = 0; table < TblCount; table++)
+    {
+		if ( _tables.GetRowCount((MetaDataTable)table) > _maxTableRows )
+        {
+			LimitExceeded(RESOURCE_LIMIT_TABLE_ROWS, "metadata table rows");
+			return false;
+		}
+	}
+
+	if ( _tables.GetStringsSize() > _maxHeapSize )
+		LimitExceeded(RESOURCE_LIMIT_HEAP_SIZE, "#Strings heap");
+	else if ( _tables.GetBlobSize() > _maxHeapSize )
+		LimitExceeded(RESOURCE_LIMIT_HEAP_SIZE, "#Blob heap");
+	else if ( _tables.GetGuidSize() > _maxHeapSize )
+		LimitExceeded(RESOURCE_LIMIT_HEAP_SIZE, "#GUID heap");
+	else if ( _tables.GetUserStringsSize() > _maxHeapSize )
+		LimitExceeded(RESOURCE_LIMIT_HEAP_SIZE, "#US heap");
+
+	if ( _limitExceeded != RESOURCE_LIMIT_NONE )
+		return false;
+
+	// one header read per method, bounded by the row limit above
+	ULONGLONG ilBytes = 0;
+	ULONG methods = _tables.GetRowCount(TblMethodDef);
+
+	for (ULONG rid = 1; rid <= methods; rid++)
+    {
+		ULONG codeSize = 0;
+		if ( FAILED(_tables.GetMethodCodeSize(_headers, rid, &codeSize)) )
+			continue;
+
+		if ( codeSize > _maxMethodSize )
+        {
+			_tables.GetMemberName(TokenFromRid(rid, mdtMethodDef), &_currentMember);
+			LimitExceeded(RESOURCE_LIMIT_METHOD_SIZE, _currentMember);
+			return false;
+		}
+
+		ilBytes += codeSize;
+	}
+
+	if ( ilBytes > _maxILBytes )
+    {
+		LimitExceeded(RESOURCE_LIMIT_IL_BYTES, "method bodies");
+		return false;
+	}
 
-			CComQIPtr<IXMLDOMElement> childTypeElement;
-			childTypeElement = _currTypeNode;
-			_currReportNode = _currTypeNode;
-			childTypeElement->setAttribute(CComBSTR(L"name"), CComVariant(_currentType));
+	return true;
+}
+
+// True once the validation is to give up: its cancel flag was set, it
+// ran past its time limit, or it needed more memory than its budget.
+// Polled between types, members and basic blocks; the flags are read on
+// every poll, the clock on every STOP_POLL_INTERVAL-th.  Once stopped it
+// stays stopped.
+bool ManagedAssembly::Stopped()
+{
+	if ( _stopVerdict != ASMCHECK_VERDICT_NONE )
+		return true;
+
+	if ( NULL != _cancel && 0 != *_cancel )
+		_stopVerdict = ASMCHECK_VERDICT_CANCELLED;
+	else if ( _budget.Overcommitted() )
+    {
+		// an organism that big fails, like one over any other ceiling
+		LimitExceeded(RESOURCE_LIMIT_MEMORY, "memory budget");
+		_stopVerdict = ASMCHECK_VERDICT_FAILED;
+	}
+	else if ( 0 != _stopTime.QuadPart && (++_polls & (STOP_POLL_INTERVAL - 1)) == 0 )
+    {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		if ( now.QuadPart >= _stopTime.QuadPart )
+			_stopVerdict = ASMCHECK_VERDICT_TIMED_OUT;
+	}
+
+	return _stopVerdict != ASMCHECK_VERDICT_NONE;
+}
+
+// Fails the assembly for going over a ceiling; only the first one is
+// recorded in the stats.
+void ManagedAssembly::LimitExceeded(DWORD limit, LPCSTR what)
+{
+	ASMTRACE2(L"asmcheck: resource limit %u exceeded by %S\n", limit, what);
+
+	if ( _limitExceeded == RESOURCE_LIMIT_NONE )
+		_limitExceeded = limit;
+
+	_errors.FoundError();
+	ReportError(ResourceLimitExceeded, what, TypeName());
+}
+
+// Walks the mapped image once in file order, feeding the content hash
+// and the strong name hash from the same pages.  The file is opened for
+// sequential access, so this walk is what pulls it in through read-ahead
+// and the metadata and IL checks that follow find it resident.  Anything
+// but a valid strong name fails the assembly.
+void ManagedAssembly::IngestImage()
+{
+	bool wantContent = (_checkFlags & CHECK_FLAGS_CONTENT_HASH) != 0;
+	bool wantStrongName = (_checkFlags & CHECK_FLAGS_STRONG_NAME) != 0;
+	const BYTE* base = (const BYTE*)_module;
+	StrongNameKey key;
+	bool hashing = false;
+
+	if ( wantStrongName )
+    {
+		_strongNameStatus = ReadStrongNameKey(_headers, _tables, &key);
+
+		if ( _strongNameStatus == STRONG_NAME_VALID )
+        {
+			hashing = _strongNameHash.Begin(base, _fileSize, _headers, key);
+			if ( !hashing )
+				_strongNameStatus = STRONG_NAME_INVALID;
+		}
+	}
+
+	if ( wantContent || hashing )
+    {
+		Sha256 content;
+
+		for (ULONG offset = 0; offset < _fileSize; offset += INGEST_CHUNK_SIZE)
+        {
+			ULONG length = min((ULONG)INGEST_CHUNK_SIZE, _fileSize - offset);
+
+			if ( wantContent )
+				content.Update(base + offset, length);
+			if ( hashing )
+				_strongNameHash.Feed(offset, length);
+		}
+
+		if ( wantContent )
+        {
+			content.Final(_contentHash);
+			_hasContentHash = true;
+		}
+
+		if ( hashing )
+        {
+			BYTE digest[SN_MAX_DIGEST_SIZE];
+			ULONG digestSize = 0;
+
+			_strongNameStatus = _strongNameHash.Final(digest, &digestSize) ?
+								CheckStrongNameSignature(key, digest, digestSize) :
+								STRONG_NAME_INVALID;
+		}
+	}
+
+	if ( !wantStrongName )
+		return;
+
+	ASMTRACE2(L"asmcheck: strong name status %u for %s\n", _strongNameStatus, _currentAssembly);
+
+	if ( _strongNameStatus == STRONG_NAME_VALID )
+		return;
+
+	_errors.FoundError();
+	ReportError(InvalidStrongName, "", TypeName());
+}
+
+// Strong name check alone, for ValidateStrongName.  Only the headers
+// and the metadata tables are looked at, no IL is decoded.
+DWORD ManagedAssembly::VerifyStrongName(LPCWSTR name)
+{
+	_strongNameStatus = STRONG_NAME_INVALID;
+
+	if ( LoadFile(name) )
+    {
+		_base = (PVOID)_module;
+		if ( CheckDosHeader() )
+        {
+			_headers = RtlpImageNtHeader(_module);
 
+			if ( NULL != _headers &&
+				 SUCCEEDED(_tables.Init((const BYTE*)_module, _fileSize, _headers)) )
+				_strongNameStatus = VerifyStrongNameImage((const BYTE*)_module, _fileSize, _headers, _tables);
 		}
-
-		TypeCheckTree(tok, InvalidBaseClass, L"Type Definition");
-		DisplayTypeDefProps(tok);
 	}
 
-	ValidateMemberTypes(tok);
+	return _strongNameStatus;
 }
 
-HRESULT ManagedAssembly::GetTypeName(mdTypeDef inTypeDef, WCHAR* buffer, int len)
+void ManagedAssembly::DispatchBeginType(mdTypeDef tok)
 {
-	_ASSERTE(SUCCEEDED(_import->IsValidToken(inTypeDef)));
-	HRESULT hr = S_FALSE;
-
-#ifdef META_TOKEN_NAME_CACHE
-	metaNameMap::iterator it = _metaNameMap.find(inTypeDef);
-	if ( it != _metaNameMap.end()) {
-		wcscpy(buffer, ((*it).second).c_str());
-		return NO_ERROR;
-	}
-#endif
+	if ( 0 == _visitorCount[TypeEvent] )
+		return;
 
-	if ( !RidFromToken(inTypeDef) )
-		return E_FAIL;
+	DWORD flags = 0;
+	mdToken baseTok = mdTokenNil;
 
-	switch (TypeFromToken(inTypeDef))
+	if ( tok != mdTokenNil )
     {
-		case mdtMemberRef:
-			hr = GetMemberRefName(inTypeDef, buffer, len);
-			break;
+		GetTypeDefFlags(tok, &flags);
+		GetTypeDefBase(tok, baseTok);
+	}
 
-		case mdtTypeRef:
-			hr = GetTypeRefName(inTypeDef, buffer, len);
-			break;
+	DISPATCH_VISITORS(TypeEvent, BeginType(tok, _currentType, flags, baseTok));
+}
 
-		case mdtTypeDef:
-			hr = GetTypeDefName(inTypeDef, buffer, len);
-			break;
+// TypeDef and TypeRef names, or the member name of a MemberRef, as views
+// into the mapped image.  Other tokens succeed with an empty name.
+HRESULT ManagedAssembly::GetTypeName(mdToken tok, TypeName* name)
+{
+	HRESULT hr = _tables.GetTypeName(tok, name);
 
-		default:
-		case mdtTypeSpec:
-		case mdtAssembly:
-		case mdtAssemblyRef:
-		case mdtModuleRef:
 #ifdef _EMIT_DIAGNOSTICS
-			wprintf(L"Just blew something off in GetTypeName\n");
-#endif
-			break;
-	}
-
-#ifdef META_TOKEN_NAME_CACHE
-	if (SUCCEEDED(hr) && buffer[0]) {
-		_metaNameMap[inTypeDef] = wideString(buffer);
-	}
+	if ( hr == S_FALSE )
+		wprintf(L"Just blew something off in GetTypeName\n");
 #endif
 
 	return hr;
 }
 
+// outTypeDef is mdTokenNil for a type without a base class
 HRESULT ManagedAssembly::GetTypeDefBase(mdTypeDef inTypeDef, mdTypeDef& outTypeDef)
 {
-	mdTypeDef baseClass = mdTypeDefNil;
+	mdToken baseClass = mdTokenNil;
 	HRESULT hr = E_FAIL;
 
 	if ( TypeFromToken(inTypeDef) == mdtTypeDef )
     {
-		hr = _import->GetTypeDefProps(
-									 inTypeDef, NULL, 0, NULL, NULL, &baseClass);
-		_ASSERTE(SUCCEEDED(hr));
+		hr = _tables.GetTypeDefProps(inTypeDef, NULL, &baseClass);
 	}
 
 	if (SUCCEEDED(hr))
     {
-		outTypeDef = baseClass;
+		outTypeDef = IsNilToken(baseClass) ? mdTokenNil : baseClass;
 	}
 
 	return hr;
 }
 
-HRESULT ManagedAssembly::GetMemberRefName(mdTypeDef inTypeDef, WCHAR* buffer, int len )
-{
-	ULONG memCount = 0;
-
-	HRESULT hr = _import->GetMemberRefProps(
-										   inTypeDef,					  // [IN] given memberref
-										   NULL,				   // [OUT] Put classref or classdef here.
-										   buffer,				 // [OUT] buffer to fill for member's name
-										   len,				 // [IN] the count of char of szMember
-										   &memCount,			  // [OUT] actual count of char in member name
-										   NULL,		// [OUT] point to meta data blob value
-										   NULL);			// [OUT] actual size of signature blob
-
-	_ASSERTE(SUCCEEDED(hr));
-	return hr;
-}
-
-HRESULT ManagedAssembly::GetTypeDefName(mdTypeDef inTypeDef, WCHAR* buffer, int len)
-{
-	HRESULT hr = _import->GetTypeDefProps(
-										 // [IN] The import scope.
-										 inTypeDef,					 // [IN] TypeDef token for inquiry.
-										 buffer,			 // [OUT] Put name here.
-										 len,				  // [IN] size of name buffer in wide chars.
-										 NULL,					 // [OUT] put size of name (wide chars) here.
-										 NULL,					 // [OUT] Put flags here.
-										 NULL);						 // [OUT] Put base class TypeDef/TypeRef here.
-
-	_ASSERTE(SUCCEEDED(hr));
-	return hr;
-}
-
 HRESULT ManagedAssembly::GetTypeDefFlags(mdTypeDef inTypeDef, DWORD* flags)
 {
-	HRESULT hr = _import->GetTypeDefProps(
-										 // [IN] The import scope.
-										 inTypeDef,					 // [IN] TypeDef token for inquiry.
-										 NULL,			 // [OUT] Put name here.
-										 0,				  // [IN] size of name buffer in wide chars.
-										 NULL,					 // [OUT] put size of name (wide chars) here.
-										 flags,					 // [OUT] Put flags here.
-										 NULL);						 // [OUT] Put base class TypeDef/TypeRef here.
-
-	_ASSERTE(SUCCEEDED(hr));
-	return hr;
-}
-
-HRESULT ManagedAssembly::GetTypeRefName(mdTypeDef inTypeDef, WCHAR* buffer, int len)
-{
-	HRESULT hr = E_FAIL;
-
-	hr = _import->GetTypeRefProps(
-								 inTypeDef,					 // [IN] TypeDef token for inquiry.
-								 NULL,
-								 buffer,			 // [OUT] Put name here.
-								 len,				  // [IN] size of name buffer in wide chars.
-								 NULL);						 // [OUT] Put base class TypeDef/TypeRef here.
-
-	_ASSERTE(SUCCEEDED(hr));
-	return hr;
+	return _tables.GetTypeDefProps(inTypeDef, flags, NULL);
 }
 
-void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, WCHAR* container)
+void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, LPCSTR container)
 {
 	_typeCheckFailed = true;
-	DECLARE_STR_BUFFER(className);
+	TypeName className;
 
-	if ( SUCCEEDED(GetTypeName(tok, className, ArraySize(className))))
+	if ( SUCCEEDED(GetTypeName(tok, &className)))
     {
 		TypeCheck(className, ctx, container);
 
@@ -829,27 +1918,34 @@ void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, WCHAR* contai
 		// try to see if it's in the cache of known tokens and results
 		// if we don't find it, do the work
 		metaTokenMap::iterator it = _tokenCache.find(tok);
+		g_metrics.RecordCache(TokenCache, it != _tokenCache.end());
 		if ( it == _tokenCache.end() ) {
 #endif
 
 			// check base class types...
+			// a hostile image can make the chain loop, so it is walked at
+			// most once per TypeDef
 			mdTypeDef parentTok;
 			mdTypeDef currTok = tok;
-			while (SUCCEEDED(GetTypeDefBase(currTok, parentTok)))
+			ULONG depth = 0;
+			while ( depth++ < _tables.GetRowCount(TblTypeDef) &&
+					SUCCEEDED(GetTypeDefBase(currTok, parentTok)) )
             {
-				if ( parentTok != mdTokenNil )
+				if ( parentTok == mdTokenNil )
+					break;
+				else
                 {
-					if (SUCCEEDED(GetTypeName(parentTok, className, ArraySize(className))))
+					if (SUCCEEDED(GetTypeName(parentTok, &className)))
                     {
-                        if ( className != NULL && *className != L'\0' )
+                        if ( !className.IsEmpty() )
                         {
-                            if ( !wcscmp(className, L"Animal") || !wcscmp(className, L"Plant") )
+                            if ( g_names.GetFlags(className) & NAME_FLAG_ORGANISM_BASE )
                             {
                                 DWORD flags = 0;
                                 GetTypeDefFlags(tok, &flags);
                                 if ( !IsTdPublic(flags) )
                                 {
-                                    ReportError(InternalClass, _ErrorFormatStr, _currentType);
+                                    ReportError(InternalClass, container, className);
                                     _errors.FoundError();
                                 }
                             }
@@ -865,8 +1961,10 @@ void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, WCHAR* contai
 
 
 #ifdef META_TOKEN_CACHE
-			// cache it
-			_tokenCache[tok] = _typeCheckFailed;
+			// cache it, unless the budget is spent
+			if ( _budget.CanAfford(TREE_NODE_COST(sizeof(metaTokenMap::value_type))) ) {
+				_tokenCache[tok] = _typeCheckFailed;
+			}
 		}
 		// it was in the cache, check the result
 		else
@@ -875,7 +1973,7 @@ void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, WCHAR* contai
 			if ( !result )
             {
 				_errors.FoundError();
-				ReportError(ctx, _ErrorFormatStr, _currentType, container, className);
+				ReportError(ctx, container, className);
 			}
 		}
 #endif
@@ -883,31 +1981,21 @@ void ManagedAssembly::TypeCheckTree(mdToken tok, ErrorContext ctx, WCHAR* contai
 	}
 }
 
-void ManagedAssembly::TypeCheck(LPCWSTR className, ErrorContext ctx, WCHAR* container)
+void ManagedAssembly::TypeCheck(const TypeName& className, ErrorContext ctx, LPCSTR container)
 {
-	if ( NULL != className && *className!= L'\0' ) {
-		typeDefSet::iterator it = _bannedTypes.find(className);
-		if ( it != _bannedTypes.end() )
+	if ( !className.IsEmpty() ) {
+		if ( g_names.GetFlags(className) & NAME_FLAG_BANNED )
         {
 			_typeCheckFailed = true;
 			_errors.FoundError();
-			ReportError(ctx, _ErrorFormatStr, _currentType, container, className);
+			ReportError(ctx, container, className);
 #ifdef _DEBUG
-			ASMTRACE(L"Invalid type found: %s\n", className);
+			ASMTRACE2(L"Invalid type found: %S.%S\n", className.nameSpace, className.name);
 #endif
 		}
 	}
 }
 
-void ManagedAssembly::DisplayTypeDefProps(mdTypeDef inTypeDef)
-{
-	HRESULT hr;
-	DECLARE_STR_BUFFER(buffer);
-	int bufLen = sizeof(buffer) / sizeof(WCHAR);
-	hr = GetTypeDefName(inTypeDef, buffer, bufLen);
-}
-
-
 bool ManagedAssembly::IsEmptyMethod(PBYTE pCode, DWORD dwCodeSize)
 {
 	bool isEmpty = false;
@@ -925,117 +2013,116 @@ bool ManagedAssembly::IsEmptyMethod(PBYTE pCode, DWORD dwCodeSize)
 }
 
 
+// Checks a method body unless the index knows it to be clean.  A known
+// body is still walked if an analyzer wants its instructions, or if it
+// has a larger switch than this validation allows.  Its stack is always
+// checked, since that hangs on the signature, MaxStack and EH clauses
+// around the body too, which the fingerprint doesn't cover.
+void ManagedAssembly::CheckMethodBody(PBYTE pCode, DWORD dwCodeSize, DWORD codeRVA)
+{
+	IndexDigest fingerprint;
+	DWORD switchTargets;
+
+	if ( NULL == _indexFile || !_fingerprinter.Fingerprint(pCode, dwCodeSize, &fingerprint, &switchTargets) )
+    {
+		CheckMethodCode(pCode, dwCodeSize, codeRVA);
+		return;
+	}
+
+	const IndexSlot* known = _index.Find(fingerprint);
+	g_metrics.RecordCache(MethodIndexCache, NULL != known);
+	if ( NULL != known )
+    {
+		_fingerprints.AddKnown(*known);
+		if ( known->contexts == 0 && switchTargets <= _maxSwitchTargets && _visitorCount[InstructionEvent] == 0 )
+        {
+			VerifyStack(pCode, dwCodeSize);
+			return;
+		}
+	}
+
+	_methodContexts = 0;
+	int errors = _errors.GetErrorCount();
+	CheckMethodCode(pCode, dwCodeSize, codeRVA);
+
+	// the rest of a body that was cut short is unknown
+	if ( _stopVerdict != ASMCHECK_VERDICT_NONE )
+		return;
+
+	// a body over the switch limit failed on this validation's
+	// options rather than on its own
+	if ( NULL == known && switchTargets <= _maxSwitchTargets )
+    {
+		DWORD contexts = _methodContexts;
+		if ( contexts == 0 && _errors.GetErrorCount() != errors )
+			contexts = INDEX_UNVERIFIED;
+		_fingerprints.AddNew(fingerprint, contexts);
+	}
+}
+
 void ManagedAssembly::CheckMethodCode(PBYTE pCode, DWORD dwCodeSize, DWORD	/* codeRVA */)
 {
 	unsigned int instrPtr = 0;
+	ILInstruction decoded;
 
 	while (instrPtr < dwCodeSize)
     {
 		DWORD   Len;
+		DWORD   operandSize;
 		OPCODE  instr;
 
-#ifdef _EMIT_DIAGNOSTICS
-#endif
-		DECLARE_STR_BUFFER(instrBuff);
-		DECLARE_STR_BUFFER(buffer);
-		int bufLen = ArraySize(buffer);
-		size_t cnt, maxCnt;
-		const WCHAR wideNull = L'\0';
-
-		instr = DecodeOpcode(&pCode[instrPtr], &Len);
-
-#ifdef _EMIT_INSTRUCTIONS
-#define OUTPUT_INSTR(v)
-#define OUTPUT_REF(r)
-
-#else
-#define OUTPUT_INSTR(v)
-#define OUTPUT_REF(r)
-#endif
+		_currentOffset = instrPtr;
 
-		instrBuff[0] = wideNull;
-		maxCnt = strlen(OpcodeInfo[instr].pszName);
-		cnt = ArraySize(instrBuff);
-		maxCnt = min(cnt, maxCnt);
-		cnt = mbstowcs(instrBuff, OpcodeInfo[instr].pszName, maxCnt );
-		if ( cnt == maxCnt )
-			instrBuff[ cnt - 1] = wideNull;
+		// every operand is bounded by the body before anything reads it
+		if ( !DecodeInstruction(&pCode[instrPtr], dwCodeSize - instrPtr, &instr, &Len, &operandSize) )
+        {
+			_errors.FoundError();
+			ReportError(MalformedMethodBody, _currentMember, TypeName());
+			return;
+		}
+		DWORD next = instrPtr + Len + operandSize;
+
+		decoded.offset = instrPtr;
+		decoded.opcode = instr;
+		decoded.format = (instr < CEE_COUNT) ? OpcodeInfo[instr].Type : InlineNone;
+		decoded.operand = &pCode[instrPtr + Len];
+		decoded.token = mdTokenNil;
+		decoded.target = 0;
+		decoded.numTargets = 0;
+		decoded.classToken = mdTokenNil;
+		decoded.className = TypeName();
+		decoded.memberName = NULL;
 
 		if ( IsBadInstr(instr) )
         {
 			_errors.FoundError();
-			ReportError(BadInstruction, _ErrorFormatStr, _currentType, _currentMember, instrBuff);
+			ReportError(BadInstruction, _currentMember, TypeName((instr < CEE_COUNT) ? OpcodeInfo[instr].pszName : "unknown"));
 		}
 
-		instrPtr += Len;
-		switch (OpcodeInfo[instr].Type) {
+		// only branches and tokens need more than the raw operand
+		switch (decoded.format) {
 			default:
 				break;
 
-			case InlineNone:
-				OUTPUT_INSTR(L"InlineNone");
-				break;
-
-			case ShortInlineI:
-			case ShortInlineVar:
-				OUTPUT_INSTR(L"ShortInline");
-				instrPtr++;
-				break;
-
-			case InlineVar:
-				OUTPUT_INSTR(L"InlineVar");
-				instrPtr += 2;
-				break;
-
-			case InlineI:
-			case InlineRVA:
-				OUTPUT_INSTR(L"InlineRVA");
-				instrPtr += 4;
-				break;
-
-			case InlineI8:
-				OUTPUT_INSTR(L"InlineI8");
-				instrPtr += 8;
-				break;
-
-			case ShortInlineR:
-				OUTPUT_INSTR(L"ShortInlineR");
-				instrPtr += 4;
-				break;
-
-			case InlineR:
-				OUTPUT_INSTR(L"InlineR");
-				instrPtr += 8;
-				break;
-
 			case ShortInlineBrTarget:
-				OUTPUT_INSTR(L"ShortInlineBrTarget");
-				instrPtr++;
+				decoded.target = (DWORD)((LONG)next + (signed char)decoded.operand[0]);
 				break;
 
 			case InlineBrTarget:
-				OUTPUT_INSTR(L"InlineBrTarget");
-				instrPtr+=4;
+				decoded.target = (DWORD)((LONG)next + (LONG)GET_UNALIGNED_DWORD(decoded.operand));
 				break;
 
 			case InlineSwitch: {
-					OUTPUT_INSTR(L"InlineSwitch");
-					DWORD numCases = pCode[instrPtr] + (pCode[instrPtr+1] << 8) +
-									 (pCode[instrPtr+2] << 16) + (pCode[instrPtr+3] << 24);
-					instrPtr+=4;
-					for ( unsigned i = 0; i < numCases; i++ ) {
-						instrPtr += 4;
+					DWORD numCases = GET_UNALIGNED_DWORD(decoded.operand);
+					if ( numCases > _maxSwitchTargets )
+                    {
+						LimitExceeded(RESOURCE_LIMIT_SWITCH_TARGETS, _currentMember);
+						return;
 					}
+					decoded.numTargets = numCases;
 				}
 				break;
 
-			case InlinePhi: {
-					DWORD cases = pCode[instrPtr];
-					OUTPUT_INSTR(L"InlinePhi");
-					instrPtr += 2 * cases + 1;
-					break;
-				}
-
 			case InlineString:
 			case InlineField:
 			case InlineType:
@@ -1044,89 +2131,67 @@ void ManagedAssembly::CheckMethodCode(PBYTE pCode, DWORD dwCodeSize, DWORD	/* co
 				{
 					DWORD tk;
 					DWORD tkType;
-					tk = pCode[instrPtr] + (pCode[instrPtr+1] << 8) +
-						 (pCode[instrPtr+2] << 16) + (pCode[instrPtr+3] << 24);
+					tk = GET_UNALIGNED_DWORD(decoded.operand);
 					tkType = TypeFromToken(tk);
-					OUTPUT_INSTR(L"InlineSwitch");
-
-					if (OpcodeInfo[instr].Type== InlineTok) {
+					decoded.token = tk;
 
+					// ldtoken only loads a handle, nothing is called or read
+					if (OpcodeInfo[instr].Type != InlineTok) {
 						switch (tkType) {
-							case mdtMemberRef:
-								break;
-
-							case mdtFieldDef:
-								break;
-
-							case mdtMethodDef:
-								break;
-						}
-					} else {
-						switch (tkType) {
-							case mdtTypeDef:
-							case mdtTypeRef:
-							case mdtTypeSpec: {
-								}
-								break;
-
 							case mdtMemberRef:
 								{
 									mdToken classTok = mdTokenNil;
-									HRESULT hr = _import->GetMemberRefProps(
-																		   tk,			  // [IN] TypeDef token for inquiry.
-																		   &classTok,		 // [OUT] Put classref or classdef here.
-																		   buffer,
-																		   bufLen,
-																		   NULL,
-																		   NULL,
-																		   NULL);
+									LPCSTR memberName = NULL;
+									HRESULT hr = _tables.GetMemberRefProps(tk, &classTok, &memberName, NULL, NULL);
 
 									_ASSERTE(SUCCEEDED(hr));
 									if ( SUCCEEDED(hr)) {
 
-										hr = GetTypeName(classTok, instrBuff, sizeof(instrBuff)/sizeof(WCHAR));
+										hr = GetTypeName(classTok, &decoded.className);
 										_ASSERTE(SUCCEEDED(hr));
-										OUTPUT_REF(instrBuff);
-										OUTPUT_REF(L"::");
-										OUTPUT_REF(buffer);
-										TypeCheckTree(classTok, InvalidCall, buffer);
-									}
-								}
-								break;
+										TypeCheckTree(classTok, InvalidCall, memberName);
 
-							case mdtString: {
+										decoded.classToken = classTok;
+										decoded.memberName = memberName;
+									}
 								}
 								break;
 
-
 							case mdtFieldDef: {
 									mdTypeDef classTok = mdTokenNil;
-									HRESULT hr = _import->GetFieldProps(tk, &classTok, buffer, bufLen,
-																		NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-									hr = GetTypeName(classTok, instrBuff, sizeof(instrBuff)/sizeof(WCHAR));
+									LPCSTR memberName = NULL;
+									HRESULT hr = _tables.GetMemberParent(tk, &classTok);
+									if (SUCCEEDED(hr))
+										hr = _tables.GetMemberName(tk, &memberName);
 									_ASSERTE(SUCCEEDED(hr));
-									OUTPUT_REF(instrBuff);
-									OUTPUT_REF(L" ");
-									OUTPUT_REF(buffer);
-									TypeCheckTree(classTok, InvalidField, buffer);
+
+									if (SUCCEEDED(hr)) {
+										GetTypeName(classTok, &decoded.className);
+										TypeCheckTree(classTok, InvalidField, memberName);
+
+										decoded.classToken = classTok;
+										decoded.memberName = memberName;
+									}
 								}
 
 								break;
 
 							case mdtMethodDef:{
 									mdTypeDef classTok = mdTokenNil;
+									LPCSTR memberName = NULL;
 									// do method code here
-									HRESULT hr = _import->GetMemberProps(tk, &classTok, buffer, bufLen,
-																		 NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+									HRESULT hr = _tables.GetMemberParent(tk, &classTok);
+									if (SUCCEEDED(hr))
+										hr = _tables.GetMemberName(tk, &memberName);
 									_ASSERTE(SUCCEEDED(hr));
 
 									if (SUCCEEDED(hr)) {
-										hr = GetTypeName(classTok, instrBuff, sizeof(instrBuff)/sizeof(WCHAR));
+										hr = GetTypeName(classTok, &decoded.className);
 										if (SUCCEEDED(hr)) {
-											OUTPUT_REF(instrBuff);
-											OUTPUT_REF(L"::");
-											OUTPUT_REF(buffer);
-											TypeCheckTree(classTok, InvalidCall, buffer);
+											TypeCheckTree(classTok, InvalidCall, memberName);
+
+											decoded.classToken = classTok;
+											decoded.memberName = memberName;
 										}
 									}
 								}
@@ -1136,34 +2201,112 @@ void ManagedAssembly::CheckMethodCode(PBYTE pCode, DWORD dwCodeSize, DWORD	/* co
 						}
 					}
 
-
-					instrPtr+=4;
 					break;
 				}
 
 			case InlineSig:
-				OUTPUT_INSTR(L"InlineSig");
-				instrPtr+=4;
+				decoded.token = GET_UNALIGNED_DWORD(decoded.operand);
 				break;
 		}
+		instrPtr = next;
 
-#ifdef _EMIT_DIAGNOSTICS
-#endif
+		// hand the decoded instruction to the analyzers
+		decoded.length = instrPtr - decoded.offset;
+		DISPATCH_VISITORS(InstructionEvent, VisitInstruction(decoded));
+		_stackVerifier.Visit(decoded);
+
+		// a body is given up at the end of a basic block
+		if ( GetFlowKind(instr, decoded.format) != FlowNext && Stopped() )
+			return;
+	}
+
+	CheckStackBalance();
+}
+
+// The stack pass alone, over a body the index knows to be clean; only
+// what the verifier reads is decoded.
+void ManagedAssembly::VerifyStack(PBYTE pCode, DWORD dwCodeSize)
+{
+	unsigned int instrPtr = 0;
+	ILInstruction decoded;
+
+	decoded.classToken = mdTokenNil;
+	decoded.className = TypeName();
+	decoded.memberName = NULL;
 
+	while (instrPtr < dwCodeSize)
+    {
+		DWORD   Len;
+		DWORD   operandSize;
+		OPCODE  instr;
+
+		// left to End, which passes a body that wasn't decoded to its end
+		if ( !DecodeInstruction(&pCode[instrPtr], dwCodeSize - instrPtr, &instr, &Len, &operandSize) )
+			break;
+		DWORD next = instrPtr + Len + operandSize;
+
+		decoded.offset = instrPtr;
+		decoded.opcode = instr;
+		decoded.format = (instr < CEE_COUNT) ? OpcodeInfo[instr].Type : InlineNone;
+		decoded.operand = &pCode[instrPtr + Len];
+		decoded.length = next - instrPtr;
+		decoded.token = mdTokenNil;
+		decoded.target = 0;
+		decoded.numTargets = 0;
+
+		switch ( decoded.format )
+        {
+			case ShortInlineBrTarget:
+				decoded.target = (DWORD)((LONG)next + (signed char)decoded.operand[0]);
+				break;
+
+			case InlineBrTarget:
+				decoded.target = (DWORD)((LONG)next + (LONG)GET_UNALIGNED_DWORD(decoded.operand));
+				break;
+
+			case InlineSwitch:
+				decoded.numTargets = GET_UNALIGNED_DWORD(decoded.operand);
+				break;
+
+			case InlineMethod:
+			case InlineSig:
+				decoded.token = GET_UNALIGNED_DWORD(decoded.operand);
+				break;
+		}
+
+		_stackVerifier.Visit(decoded);
+		instrPtr = next;
+
+		if ( GetFlowKind(instr, decoded.format) != FlowNext && Stopped() )
+			return;
+	}
+
+	CheckStackBalance();
+}
+
+// a body the JIT would throw out on every peer
+void ManagedAssembly::CheckStackBalance()
+{
+	DWORD stackOffset;
+	if ( !_stackVerifier.End(&stackOffset) )
+    {
+		_currentOffset = stackOffset;
+		_errors.FoundError();
+		ReportError(InvalidStack, _currentMember, TypeName());
 	}
 }
 
-void ManagedAssembly::CheckFieldAttrs(DWORD dwAttrs, WCHAR* buffer)
+void ManagedAssembly::CheckFieldAttrs(DWORD dwAttrs, LPCSTR name)
 {
 	// constants/literals are OK, other static fields aren't
 	if (IsFdStatic(dwAttrs) && !IsFdLiteral(dwAttrs) ) {
-		ReportError(StaticField, _ErrorFormatStr, _currentType, buffer, buffer);
+		ReportError(StaticField, name, TypeName(name));
 		_errors.FoundError();
 	}
 }
 
 
-void ManagedAssembly::CheckFieldType(mdTypeDef	/* classType */, WCHAR* fieldName, PCCOR_SIGNATURE pCorSig, ULONG /* sigSize */) {
+void ManagedAssembly::CheckFieldType(mdTypeDef	/* classType */, LPCSTR fieldName, PCCOR_SIGNATURE pCorSig, ULONG /* sigSize */) {
 	mdToken sigTok;
 
 	if ( SigHasClassType(pCorSig, &sigTok) ) {
@@ -1172,23 +2315,23 @@ void ManagedAssembly::CheckFieldType(mdTypeDef	/* classType */, WCHAR* fieldName
 }
 
 // Don't allow pinvokes, methods with security attributes or static constructors
-void ManagedAssembly::CheckMethodAttrs(DWORD dwAttrs, WCHAR* buffer, bool isEmpty) {
+void ManagedAssembly::CheckMethodAttrs(DWORD dwAttrs, LPCSTR name, bool isEmpty) {
 	if (IsMdPinvokeImpl(dwAttrs)) {
-		ReportError(PinvokeMethod, _ErrorFormatStr, _currentType, buffer, buffer);
+		ReportError(PinvokeMethod, name, TypeName(name));
 		_errors.FoundError();
 	}
 
 	if (IsMdHasSecurity(dwAttrs)) {
-		ReportError(HasSecurityMethod, _ErrorFormatStr, _currentType, buffer, buffer);
+		ReportError(HasSecurityMethod, name, TypeName(name));
 		_errors.FoundError();
 	}
 	if (IsMdRequireSecObject(dwAttrs)) {
-		ReportError(RequiresSecObjectMethod, _ErrorFormatStr, _currentType, buffer, buffer);
+		ReportError(RequiresSecObjectMethod, name, TypeName(name));
 		_errors.FoundError();
 	}
 
-	if (IsMdClassConstructorW(dwAttrs, buffer) && !isEmpty) {
-		ReportError(ClassConstructor, _ErrorFormatStr, _currentType, buffer, buffer);
+	if (IsMdClassConstructorA(dwAttrs, name) && !isEmpty) {
+		ReportError(ClassConstructor, name, TypeName(name));
 		_errors.FoundError();
 	}
 }
@@ -1226,6 +2369,7 @@ void ManagedAssembly::SigToString(PCCOR_SIGNATURE sig, ULONG /* sigSize */, WCHA
 	int typ;
 	WCHAR* str;
 	mdToken  tk;
+	TypeName typeName;
 	DECLARE_STR_BUFFER(className);
 
 	// we're intentionally not using this variable...
@@ -1284,11 +2428,12 @@ void ManagedAssembly::SigToString(PCCOR_SIGNATURE sig, ULONG /* sigSize */, WCHA
 			case ELEMENT_TYPE_VALUETYPE    :
 			case ELEMENT_TYPE_CLASS         :
 				sig += CorSigUncompressToken(sig, &tk);
-				hr = GetTypeName(tk, className, ArraySize(className));
+				hr = GetTypeName(tk, &typeName);
 				_ASSERTE(SUCCEEDED(hr));
 
 				if (SUCCEEDED(hr) )
                 {
+					WidenTypeName(typeName, className, ArraySize(className));
 					wcscat(buffer, className);
 				}
 				break;
@@ -1305,11 +2450,7 @@ void ManagedAssembly::SigToString(PCCOR_SIGNATURE sig, ULONG /* sigSize */, WCHA
 void ManagedAssembly::ValidateMemberTypes(mdToken tkType)
 {
 	HRESULT hr;
-	HCORENUM memEnum = NULL;
-	ULONG count = 0;
-	mdMemberRef memRefs[ENUM_BUFFER_SIZE];
-	mdTypeDef classType;
-	DWORD bufLen = ArraySize(_currentMember);
+	ULONG first, end;
 	DWORD implFlags = 0;
 	DWORD dwAttrs = 0;
 	mdMemberRef currRef;
@@ -1321,56 +2462,79 @@ void ManagedAssembly::ValidateMemberTypes(mdToken tkType)
 	DWORD dwCodeSize;
 	PBYTE pbCode;
 
-	enumMgr eMgr(_import, &memEnum);
+	// globals are the members of <Module>, the first TypeDef
+	mdTypeDef typeDef = (tkType == mdTokenNil) ? TokenFromRid(1, mdtTypeDef) : tkType;
 
-	while (SUCCEEDED(hr = _import->EnumMembers(&memEnum, tkType,
-											   memRefs, ArraySize(memRefs), &count)) && count > 0 )
+	// methods, then fields
+	static const MetaDataTable memberLists[] = { TblMethodDef, TblField };
+
+	for (size_t list = 0; list < ArraySize(memberLists); list++)
     {
-		for (ULONG i = 0; i < count; i++ )
+		if ( FAILED(_tables.GetMemberList(typeDef, memberLists[list], &first, &end)) )
+        {
+			_errors.FoundError();
+			continue;
+		}
+
+		for (ULONG i = first; i < end && !Stopped(); i++ )
         {
-			currRef = memRefs[i];
-			hr = _import->GetMemberProps(currRef, &classType, _currentMember,
-										 bufLen, NULL, &dwAttrs, &pCorSig, &sigSize, &codeRVA, &implFlags, NULL, NULL, NULL);
+			// what the last member reported goes out under its name
+			FlushDiagnostics();
+
+			currRef = _tables.GetListMember(memberLists[list], i);
+			if ( TypeFromToken(currRef) == mdtFieldDef )
+				hr = _tables.GetFieldProps(currRef, &dwAttrs, &pCorSig, &sigSize);
+			else
+				hr = _tables.GetMethodProps(currRef, &dwAttrs, &implFlags, &pCorSig, &sigSize, &codeRVA);
+			if ( SUCCEEDED(hr) )
+				hr = _tables.GetMemberName(currRef, &_currentMember);
+
+			// the report node for this member is created with its first error
+			if ( _currMemberNode.p != NULL ) {
+				_currMemberNode.Release();
+			}
 
 			if ( SUCCEEDED(hr) )
             {
-				if ( _xmlInited )
-                {
-					OutputDebugString(L"Processing Member\n");
-					CComBSTR rootNode = L"member";
-					CComVariant elemNode(NODE_ELEMENT);
-					CComPtr<IXMLDOMNode> rootDomElem;
-
-					_xmlDom->createNode(elemNode, rootNode, NULL, &rootDomElem);
-					if ( _currMemberNode.p != NULL ) {
-						_currMemberNode.Release();
-					}
-					_currTypeNode->appendChild(rootDomElem, &_currMemberNode);
-
-					CComQIPtr<IXMLDOMElement> childMemberElement;
-					childMemberElement = _currMemberNode;
-					_currReportNode = _currMemberNode;
-					childMemberElement->setAttribute(CComBSTR(L"name"), CComVariant(_currentMember));
-				}
+				_inMember = true;
 
 				switch ( TypeFromToken(currRef))
                 {
 					case mdtFieldDef:
 						CheckFieldAttrs(dwAttrs, _currentMember);
 						CheckFieldType(currRef, _currentMember, pCorSig, sigSize);
+						DISPATCH_VISITORS(FieldEvent, VisitField(currRef, _currentMember, dwAttrs, pCorSig, sigSize));
 						break;
 
-					case mdtProperty:
 					case mdtMethodDef:
                         {
 							bool isEmpty = false;
-							pSectionHeader = (PIMAGE_SECTION_HEADER) RtlImageRvaToVa(_headers, _module, codeRVA, NULL);
+							ILMethod method;
+							method.token = currRef;
+							method.name = _currentMember;
+							method.attrs = dwAttrs;
+							method.implFlags = implFlags;
+							method.sig = pCorSig;
+							method.sigSize = sigSize;
+							method.code = NULL;
+							method.codeSize = 0;
+							method.header = NULL;
+
+							// the whole body is checked to be in the file before
+							// the decoder reads its sizes and EH sections
+							pSectionHeader = (0 != codeRVA) ? (PIMAGE_SECTION_HEADER)_tables.GetMethodBody(_headers, codeRVA) : NULL;
+							if ( 0 != codeRVA && NULL == pSectionHeader )
+                            {
+								_errors.FoundError();
+								ReportError(MalformedMethodBody, _currentMember, TypeName());
+							}
+
 							if ( NULL != pSectionHeader)
                             {
 								pimHeader = (COR_ILMETHOD*) (pSectionHeader);
 								if(( ((size_t)pimHeader) & 3) != 0)
                                 {
-                                    ReportError(MisalignedMethodHeader, _ErrorFormatStr, _currentType);
+                                    ReportError(MisalignedMethodHeader, _currentMember, TypeName());
 									break;
 								}
 
@@ -1378,27 +2542,43 @@ void ManagedAssembly::ValidateMemberTypes(mdToken tkType)
 
 								dwCodeSize = (DWORD)imdHeader.CodeSize;
 								pbCode = (PUCHAR)imdHeader.Code;
-								CheckMethodCode(pbCode, dwCodeSize, codeRVA);
+
+								method.code = pbCode;
+								method.codeSize = dwCodeSize;
+								method.header = &imdHeader;
+								DISPATCH_VISITORS(MethodEvent, BeginMethod(method));
+
+								_stackVerifier.Begin(&imdHeader, pCorSig, sigSize);
+								CheckMethodBody(pbCode, dwCodeSize, codeRVA);
+								_currentOffset = DIAG_NO_OFFSET;
 								isEmpty = IsEmptyMethod(pbCode, dwCodeSize);
+
+								DISPATCH_VISITORS(MethodEvent, EndMethod(method));
+							}
+                            else
+                            {
+								DISPATCH_VISITORS(MethodEvent, BeginMethod(method));
+								DISPATCH_VISITORS(MethodEvent, EndMethod(method));
 							}
 
 							CheckMethodAttrs(dwAttrs, _currentMember, isEmpty);
 						}
 						break;
 
-					case mdtEvent:
-						break;
 				}
+
+				_inMember = false;
 			}
             else
             {
-				// handle GetMemberProps failure
+				// a member row that can't be read
+				_currentMember = "";
 				_errors.FoundError();
 			}
 		}
 	}
 
-
+	FlushDiagnostics();
 }
 
 void ManagedAssembly::Unload()
@@ -1463,36 +2643,224 @@ PIMAGE_SECTION_HEADER ManagedAssembly::RtlImageRvaToSection(PIMAGE_NT_HEADERS Nt
 	return NULL;
 }
 
-void ManagedAssembly::ReportError(ErrorContext ctx, LPCWSTR formatStr, ...)
+// true if diag is the violation described by the other arguments
+static bool SameDiagnostic(const Diagnostic& diag, ErrorContext ctx, bool inMember,
+						   LPCSTR container, const TypeName& detail)
+{
+	return diag.ctx == ctx && diag.inMember == inMember &&
+		   0 == strcmp(diag.container, container) &&
+		   0 == strcmp(diag.detail.nameSpace, detail.nameSpace) &&
+		   0 == strcmp(diag.detail.name, detail.name);
+}
+
+// Names stay UTF-8 views until they are reported; this is the only
+// place they are widened.
+void ManagedAssembly::ReportError(ErrorContext ctx, LPCSTR container, const TypeName& detail)
 {
-	ASMTRACE4(L"asmcheck: [Error] %s in %s.%s (%s)\n",
+	g_metrics.RecordError(ctx);
+	_contextsSeen |= 1 << ctx;
+	_methodContexts |= 1 << ctx;
+
+	ASMTRACE4(L"asmcheck: [Error] %s in %S::%S (%s)\n",
 			  AssemblyErrorInfo::GetErrorString(ctx),
-			  _currentType, _currentMember, _currentAssembly);
+			  _currentType.name, _currentMember, _currentAssembly);
+
+	if ( NULL != _listingFile )
+		_listing.AddViolation(_currentOffset, AssemblyErrorInfo::GetErrorId(ctx), container, detail);
+
+	if ( !Reporting() && !UsingXml() && !Collecting() )
+		return;
+
+	if ( NULL == container )
+		container = "";
+
+	// the same violation at another call site only adds to its count
+	MemberKey key;
+	key.AddData(ctx);
+	key.AddData(_inMember);
+	key.AddString(container);
+	key.AddString(detail.nameSpace);
+	key.AddString(detail.name);
+
+	Diagnostic* diag = NULL;
+	std::pair<diagnosticMap::iterator, diagnosticMap::iterator> range = _diagnosticIndex.equal_range(key.Get());
+	for (diagnosticMap::iterator it = range.first; it != range.second; ++it)
+    {
+		if ( SameDiagnostic(_diagnostics[it->second], ctx, _inMember, container, detail) )
+        {
+			diag = &_diagnostics[it->second];
+			break;
+		}
+	}
+
+	if ( NULL == diag )
+    {
+		Diagnostic added;
+		added.ctx = ctx;
+		added.inMember = _inMember;
+		added.container = container;
+		added.detail = detail;
+		added.count = 0;
+		added.offsetCount = 0;
+
+		_diagnosticIndex.insert(diagnosticMap::value_type(key.Get(), _diagnostics.size()));
+		_diagnostics.push_back(added);
+		diag = &_diagnostics.back();
+	}
+
+	diag->count++;
+	if ( _currentOffset != DIAG_NO_OFFSET && diag->offsetCount < DIAG_MAX_OFFSETS )
+		diag->offsets[diag->offsetCount++] = _currentOffset;
+}
+
+// Writes out the diagnostics gathered since the last flush, one line or
+// error node each.  Called whenever the type or member being checked
+// changes, so they all belong to the current type, and to the current
+// member if they were reported inside one.  The report grows with the
+// number of distinct violations, not with the size of the code.
+void ManagedAssembly::FlushDiagnostics()
+{
+	if ( _diagnostics.empty() )
+		return;
+
+	DECLARE_STR_BUFFER(typeName);
+	DECLARE_STR_BUFFER(memberName);
+	WidenTypeName(_currentType, typeName, ArraySize(typeName));
+	WidenName(_currentMember, memberName, ArraySize(memberName));
+
+	bool inMember = _inMember;
+	for (size_t d = 0; d < _diagnostics.size(); d++)
+    {
+		const Diagnostic& diag = _diagnostics[d];
+		LPCWSTR errorString = AssemblyErrorInfo::GetErrorString(diag.ctx);
+
+		// "IL_0010 IL_0024 ...", up to eight digits each
+		WCHAR offsets[DIAG_MAX_OFFSETS * 12 + 1];
+		int length = 0;
+		offsets[0] = L'\0';
+		for (ULONG i = 0; i < diag.offsetCount; i++)
+        {
+			int written = _snwprintf(offsets + length, ArraySize(offsets) - length, (i > 0) ? L" IL_%04x" : L"IL_%04x", diag.offsets[i]);
+			if ( written < 0 )
+            {
+				// truncated and not terminated; keep the offsets that fit
+				offsets[length] = L'\0';
+				break;
+			}
+			length += written;
+		}
+
+		DECLARE_STR_BUFFER(containerName);
+		DECLARE_STR_BUFFER(detailName);
+		if ( Reporting() || Collecting() )
+        {
+			WidenName(diag.container, containerName, ArraySize(containerName));
+			WidenTypeName(diag.detail, detailName, ArraySize(detailName));
+		}
+
+		if ( Reporting() )
+        {
+			wprintf(L"*%s: ", errorString);
+			wprintf(_ErrorFormatStr, typeName, containerName, detailName);
+			if ( diag.count > 1 )
+				wprintf(L" x%lu", diag.count);
+			if ( diag.offsetCount > 0 )
+				wprintf(L" at %s", offsets);
+			wprintf(L"\n");
+		}
+
+		if ( Collecting() )
+        {
+			LPCWSTR member = diag.inMember ? memberName : NULL;
+			SIZE_T cost = ResultBuilder::GetCost(typeName, member, containerName, detailName);
+			if ( _budget.CanAfford(cost) )
+            {
+				_budget.Charge(cost);
+				_result.Add(diag.ctx, AssemblyErrorInfo::GetErrorId(diag.ctx), errorString,
+							typeName, member, containerName, detailName,
+							diag.count, diag.offsets, diag.offsetCount);
+			}
+            else
+				_reportTruncated = true;
+		}
+
+		_inMember = diag.inMember;
+		if ( UsingXml() && EnsureReportNode(typeName, memberName) )
+        {
+			CComPtr<IXMLDOMNode> errorNode;
+			if ( AppendReportNode(_currReportNode, L"error", errorString, &errorNode) )
+            {
+				CComQIPtr<IXMLDOMElement> element(errorNode);
+				element->setAttribute(CComBSTR(L"count"), CComVariant((long)diag.count));
+				if ( diag.offsetCount > 0 )
+					element->setAttribute(CComBSTR(L"offsets"), CComVariant(offsets));
+			}
+		}
+	}
+	_inMember = inMember;
+
+	_diagnostics.clear();
+	_diagnosticIndex.clear();
+}
+
+// Type and member nodes are only added to the report once they have
+// an error to hold, so the DOM grows with the number of errors instead
+// of the number of members in the assembly.
+bool ManagedAssembly::EnsureReportNode(LPCWSTR typeName, LPCWSTR memberName)
+{
+	if ( _currTypeNode.p == NULL && !_currentType.IsEmpty() )
+    {
+		if ( !AppendReportNode(_rootDomNode, L"type", typeName, &_currTypeNode) )
+			return false;
+	}
 
-	if ( Reporting() )
+	IXMLDOMNode* typeNode = (_currTypeNode.p != NULL) ? _currTypeNode.p : _rootDomNode.p;
+
+	if ( _inMember )
+    {
+		if ( _currMemberNode.p == NULL )
+        {
+			if ( !AppendReportNode(typeNode, L"member", memberName, &_currMemberNode) )
+				return false;
+		}
+		_currReportNode = _currMemberNode;
+	}
+    else
     {
-		va_list marker;
-		va_start(marker, formatStr);
-		wprintf(L"*%s: ", AssemblyErrorInfo::GetErrorString(ctx));
-		vwprintf(formatStr, marker);
-		va_end(marker);
+		_currReportNode = typeNode;
 	}
 
-	if ( UsingXml() )
+	return true;
+}
+
+bool ManagedAssembly::AppendReportNode(IXMLDOMNode* parent, LPCWSTR nodeName, LPCWSTR name, IXMLDOMNode** node)
+{
+	SIZE_T cost = DOM_NODE_COST + ((NULL != name) ? wcslen(name) * sizeof(WCHAR) : 0);
+	if ( !_budget.CanAfford(cost) )
     {
-		CComBSTR rootNode = L"error";
-		CComVariant elemNode(NODE_ELEMENT);
-		CComPtr<IXMLDOMNode> rootDomElem;
+		_reportTruncated = true;
+		return false;
+	}
 
-		_xmlDom->createNode(elemNode, rootNode, NULL, &rootDomElem);
+	CComBSTR elemName = nodeName;
+	CComVariant elemNode(NODE_ELEMENT);
+	CComPtr<IXMLDOMNode> domElem;
 
-		CComPtr<IXMLDOMNode> errorNode;
-		_currReportNode->appendChild(rootDomElem, &errorNode);
+	HRESULT hr = _xmlDom->createNode(elemNode, elemName, NULL, &domElem);
+	if ( SUCCEEDED(hr) )
+		hr = parent->appendChild(domElem, node);
+	if ( FAILED(hr) )
+		return false;
 
-		CComQIPtr<IXMLDOMElement> childElement;
-		childElement = errorNode;
-		childElement->setAttribute(CComBSTR(L"name"), CComVariant(AssemblyErrorInfo::GetErrorString(ctx)));
+	_budget.Charge(cost);
+
+	if ( NULL != name )
+    {
+		CComQIPtr<IXMLDOMElement> element(*node);
+		element->setAttribute(CComBSTR(L"name"), CComVariant(name));
 	}
+
+	return true;
 }
 
 
@@ -1517,10 +2885,49 @@ errorContexts[] = {
 	L"Exception handlers aren't allowed and you have one",
 	L"You have IL instructions that aren't allowed",
 	L"Your assembly is not a managed assembly",
-    L"Class derived from Animal or Plant must be marked public"
-	L"Your assembly has a misaligned method header within it"
+    L"Class derived from Animal or Plant must be marked public",
+	L"Your assembly has a misaligned method header within it",
+	L"Your organism is estimated to take too long per turn",
+	L"Your assembly's strong name signature is missing or invalid",
+	L"Your assembly is larger than organisms are allowed to be",
+	L"You use a member that isn't on the list of approved members",
+	L"Your assembly has a method body that runs past its end",
+	L"Your organism is estimated to allocate too much memory per turn",
+	L"Your assembly has a method whose evaluation stack doesn't balance"
+};
+
+// label values for the metrics, in ErrorContext order
+static LPCSTR
+errorContextIds[] = {
+	"UnknownContext",
+	"InvalidCall",
+	"InvalidField",
+	"InvalidBaseClass",
+	"StaticMethod",
+	"PinvokeMethod",
+	"HasSecurityMethod",
+	"RequiresSecObjectMethod",
+	"ClassConstructor",
+	"StaticField",
+	"ExceptionHandlers",
+	"BadInstruction",
+	"UnmanagedAssembly",
+	"InternalClass",
+	"MisalignedMethodHeader",
+	"ExcessiveCost",
+	"InvalidStrongName",
+	"ResourceLimitExceeded",
+	"MemberNotAllowed",
+	"MalformedMethodBody",
+	"ExcessiveAllocation",
+	"InvalidStack"
 };
 
+void AssemblyErrorInfo::WriteMetrics(std::string& out)
+{
+	g_metrics.Write(out, errorContextIds, ArraySize(errorContextIds));
+}
+
 const WCHAR* AssemblyErrorInfo::GetErrorString(ErrorContext ctx)
 {
 	int _ctx = (int)ctx;
@@ -1531,6 +2938,16 @@ const WCHAR* AssemblyErrorInfo::GetErrorString(ErrorContext ctx)
 	return errorContexts[0];
 }
 
+LPCSTR AssemblyErrorInfo::GetErrorId(ErrorContext ctx)
+{
+	int _ctx = (int)ctx;
+	if ( _ctx < ArraySize(errorContextIds))
+    {
+		return errorContextIds[_ctx];
+	}
+	return errorContextIds[0];
+}
+
 
 #ifdef _DEBUG
 void OutputDebugStringFmt( LPCWSTR lpszFormat, ... ) {
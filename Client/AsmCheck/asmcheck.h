@@ -16,6 +16,22 @@
 #include <hash_map>
 #include <xhash>
 
+#include "asmcheckapi.h"
+#include "asmalloc.h"
+#include "asmvisitor.h"
+#include "asmsign.h"
+#include "asmload.h"
+#include "asmmetrics.h"
+#include "asmpolicy.h"
+#include "asmsummary.h"
+#include "asmindex.h"
+#include "asmsched.h"
+#include "asmnames.h"
+#include "asmpipe.h"
+#include "ilstack.h"
+#include "asmlisting.h"
+#include "asmresult.h"
+
 #define BZERO(buff, size) ZeroMemory(buff, size)
 
 unsigned long StringHash ( const wchar_t *name )
@@ -53,9 +69,51 @@ public:
 
 };
 
-typedef std::set<wideString> typeDefSet;
-typedef std::map<mdToken, bool> metaTokenMap;
-typedef std::map<mdToken, wideString> metaNameMap;
+typedef std::map<mdToken, bool, std::less<mdToken>,
+				 TrackedAllocator<std::pair<const mdToken, bool> > > metaTokenMap;
+
+// Open addressed set of dotted type names.  Lookups take a TypeName
+// view, so the full name is never assembled; entries are not copied.
+#define TYPE_NAME_SET_SIZE 128
+
+class TypeNameSet {
+private:
+	LPCSTR _names[TYPE_NAME_SET_SIZE];
+	int _count;
+
+public:
+	TypeNameSet() {
+		BZERO(_names, sizeof(_names));
+		_count = 0;
+	}
+
+	bool Insert(LPCSTR fullName) {
+		unsigned long i = StringHashA(fullName) & (TYPE_NAME_SET_SIZE - 1);
+		while ( NULL != _names[i] ) {
+			if ( !strcmp(_names[i], fullName) )
+				return true;
+			i = (i + 1) & (TYPE_NAME_SET_SIZE - 1);
+		}
+
+		// keep the table at most half full
+		if ( _count >= TYPE_NAME_SET_SIZE / 2 )
+			return false;
+
+		_names[i] = fullName;
+		_count++;
+		return true;
+	}
+
+	bool Contains(const TypeName& name) const {
+		unsigned long i = name.Hash() & (TYPE_NAME_SET_SIZE - 1);
+		while ( NULL != _names[i] ) {
+			if ( name.Equals(_names[i]) )
+				return true;
+			i = (i + 1) & (TYPE_NAME_SET_SIZE - 1);
+		}
+		return false;
+	}
+};
 
 #ifdef DEBUG
 // tracing, debugging helpers
@@ -79,48 +137,23 @@ void OutputDebugStringFmt( LPCWSTR lpszFormat, ... );
 // to cache the results of invalid type lookups
 #define META_TOKEN_CACHE
 
-// enable use of token to name caching at the app layer
-#define META_TOKEN_NAME_CACHE
-
-#define REPORT_FLAGS_NONE    0x00000000
-#define REPORT_FLAGS_CONSOLE 0x00000001
-#define REPORT_FLAGS_XML     0x00000002
-
 #define DECLARE_STR_BUFFER(nm) WCHAR nm[STRING_BUFFER_LEN]
 
 // forward defs
 BOOL CheckAssemblyInternal(LPCWSTR asmName, unsigned int flags);
 BOOL CheckAssemblyInternal(LPCWSTR asmName, LPCWSTR xmlFile, unsigned int flags);
-
-// helper class to prevent against enum handle leaks
-class enumMgr {
-private:
-	IMetaDataImport* _mdImport;
-	HCORENUM* _corEnum;
-
-public:
-	enumMgr(IMetaDataImport* metaDataDisp, HCORENUM* corEnum) {
-		_mdImport = metaDataDisp;
-		_corEnum = corEnum;
-	}
-
-	~enumMgr() {
-		if ( NULL != _corEnum && *_corEnum ) {
-			_mdImport->CloseEnum(*_corEnum);
-			*_corEnum = NULL;
-		}
-	}
-};
+BOOL CheckAssemblyInternal(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats);
+BOOL CheckAssemblyInternal(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats, PriorityClass defaultPriority, ASMCHECK_RESULT* checkResult = NULL);
+BOOL EvaluateSummaryInternal(const ReferenceSummaryView& summary, const ASMCHECK_POLICY* policy, ULONG* violations);
 
 
 // uncomment to emit IL dumps for testing
 //#define _EMIT_DIAGNOSTICS
 
-//#define _EMIT_INSTRUCTIONS
-
 #define ArraySize(s) (sizeof(s) / sizeof(s[0]))
-#define ENUM_BUFFER_SIZE 10
 #define STRING_BUFFER_LEN 1024
+#define INGEST_CHUNK_SIZE (64 * 1024)   // bytes hashed per step of the ingest walk
+#define STOP_POLL_INTERVAL 64           // calls to Stopped per look at the clock, a power of two
 #define	NEW_TRY_BLOCK	0x80000000
 #define PUT_INTO_CODE	0x40000000
 #define ERR_OUT_OF_CODE	0x20000000
@@ -141,9 +174,39 @@ enum ErrorContext {
 	BadInstruction,
 	UnmanagedAssembly,
     InternalClass,
-	MisalignedMethodHeader
+	MisalignedMethodHeader,
+	ExcessiveCost,
+	InvalidStrongName,
+	ResourceLimitExceeded,
+	MemberNotAllowed,
+	MalformedMethodBody,
+	ExcessiveAllocation,
+	InvalidStack
 };
 
+#define DIAG_MAX_OFFSETS    ASMCHECK_MAX_OFFSETS    // IL offsets kept per diagnostic
+#define DIAG_NO_OFFSET      0xFFFFFFFF  // reported outside a method body
+
+// One distinct violation in the current member, or in the current type
+// outside its members, with the number of times it was reported and the
+// first places in the IL it was reported at.  The names are views into
+// the mapped image or static strings.
+struct Diagnostic {
+	ErrorContext ctx;
+	bool inMember;
+	LPCSTR container;
+	TypeName detail;
+	ULONG count;
+	ULONG offsetCount;
+	DWORD offsets[DIAG_MAX_OFFSETS];
+};
+
+typedef std::vector<Diagnostic, TrackedAllocator<Diagnostic> > diagnosticList;
+// a hash of the distinct fields to the diagnostics that have it; two
+// violations can share a hash, so the fields are compared on a hit
+typedef std::multimap<ULONGLONG, size_t, std::less<ULONGLONG>,
+				 TrackedAllocator<std::pair<const ULONGLONG, size_t> > > diagnosticMap;
+
 class AssemblyErrorInfo {
 private:
 	int _errorCount;
@@ -151,6 +214,8 @@ private:
 public:
 
 	static const WCHAR* GetErrorString(ErrorContext ctx);
+	static LPCSTR GetErrorId(ErrorContext ctx);
+	static void WriteMetrics(std::string& out);
 
 	AssemblyErrorInfo();
 	void FoundError() {
@@ -162,18 +227,31 @@ public:
 };
 
 
-class ManagedAssembly {
+// the caches and analyzers take their memory from the owning assembly's
+// budget, in member order
+#define INIT_ASSEMBLY_CACHES \
+	_costEstimator(&_budget), \
+	_summary(&_budget), \
+	_fingerprinter(&_budget), \
+	_fingerprints(&_budget), \
+	_tokenCache(metaTokenMap::key_compare(), metaTokenMap::allocator_type(&_budget)), \
+	_diagnostics(diagnosticList::allocator_type(&_budget)), \
+	_diagnosticIndex(diagnosticMap::key_compare(), diagnosticMap::allocator_type(&_budget))
+
+class ManagedAssembly : public ILFlowPoll {
 private:
 	HMODULE _module;
 	HANDLE  _file;
 	HANDLE  _map;
-	IMetaDataDispenserEx* _dispenser;
-	IMetaDataImport *_import;
-	typeDefSet _bannedTypes;
+	MetaDataTables _tables;
 
 	unsigned int _reportFlags;
 	unsigned int* _badInstrTable;
 
+	// transient state below is carved from this budget's arena,
+	// so it has to be constructed before the caches and freed after
+	MemoryBudget _budget;
+
 
 
 	////////////////////////////////////
@@ -185,63 +263,155 @@ private:
 	CComPtr<IXMLDOMNode> _currTypeNode;
 	CComPtr<IXMLDOMNode> _currMemberNode;
 	CComPtr<IXMLDOMNode> _currReportNode;
+	bool _inMember;
+	bool _reportTruncated;
 
 	inline bool UsingXml() {
 		return (_reportFlags & REPORT_FLAGS_XML) && _xmlInited;
 	}
+
+	bool EnsureReportNode(LPCWSTR typeName, LPCWSTR memberName);
+	bool AppendReportNode(IXMLDOMNode* parent, LPCWSTR nodeName, LPCWSTR name, IXMLDOMNode** node);
 	////////////////////////////////////
 
 	inline bool Reporting() {
 		return _reportFlags & REPORT_FLAGS_CONSOLE;
 	}
 
+	// the report kept in memory for CheckAssemblyWithResult
+	ResultBuilder _result;
+	bool _collecting;
+
+	inline bool Collecting() {
+		return _collecting;
+	}
+
 	AssemblyErrorInfo _errors;
 
+	// per-turn cost and allocation estimates, registered as a visitor
+	// when maxTurnCost or maxTurnAllocations is set
+	CostEstimator _costEstimator;
+	ULONG _maxTurnCost;
+	ULONG _maxTurnAllocations;
+	DWORD _checkFlags;
+	bool _costExceeded;
+	bool _allocationsExceeded;
+
+	// ceilings on the organism's size, from ASMCHECK_OPTIONS
+	ULONG _maxTableRows;
+	ULONG _maxHeapSize;
+	ULONG _maxILBytes;
+	ULONG _maxMethodSize;
+	ULONG _maxSwitchTargets;
+	DWORD _limitExceeded;
+
+	// cooperative stop, from ASMCHECK_OPTIONS.timeLimit and cancel
+	ULONG _timeLimit;
+	const volatile LONG* _cancel;
+	LARGE_INTEGER _stopTime;    // performance counter, 0 for no limit
+	LARGE_INTEGER _requested;   // when the slot was asked for, 0 if there was none
+	ULONG _polls;
+	DWORD _stopVerdict;         // ASMCHECK_VERDICT_TIMED_OUT, _CANCELLED or _FAILED once stopped
+	DWORD _verdict;
+
+	// approved members, with CHECK_FLAGS_ALLOWLIST
+	LPCWSTR _allowlistFile;
+
+	// written after validation when _summaryFile is set
+	ReferenceSummary _summary;
+	LPCWSTR _summaryFile;
+
+	// written during validation when _listingFile is set
+	ListingWriter _listing;
+	LPCWSTR _listingFile;
+
+	// method bodies already known to be clean are not checked again
+	LPCWSTR _indexFile;
+	MappedImage _indexImage;
+	FingerprintIndex _index;
+	MethodFingerprinter _fingerprinter;
+	FingerprintLog _fingerprints;
+	ULONG _similarCount;
+	WCHAR _similarAssembly[ASMCHECK_NAME_SIZE];
+
+	// one bit per ErrorContext reported, for the metrics
+	DWORD _contextsSeen;
+	DWORD _methodContexts;  // reported by the method body being checked
+
+	// filled by IngestImage: STRONG_NAME_* with CHECK_FLAGS_STRONG_NAME,
+	// the SHA-256 of the file with CHECK_FLAGS_CONTENT_HASH
+	DWORD _strongNameStatus;
+	StrongNameHash _strongNameHash;
+	BYTE _contentHash[SHA256_DIGEST_SIZE];
+	bool _hasContentHash;
+
+	// analyzers fed from the same decode pass, per event
+	AssemblyVisitor* _visitors[VisitorEventCount][MAX_VISITORS];
+	int _visitorCount[VisitorEventCount];
+
 	// pointer to arg passed to Validate: do not delete
 	LPCWSTR _currentAssembly;
 	LPCWSTR _saveFile;
-	WCHAR _currentType[STRING_BUFFER_LEN];
-	WCHAR _currentMember[STRING_BUFFER_LEN];
+	// views into the #Strings heap of the mapped assembly
+	TypeName _currentType;
+	LPCSTR _currentMember;
 	metaTokenMap _tokenCache;
 	bool _typeCheckFailed;
 
+	// reports of the current type or member, written out by
+	// FlushDiagnostics when it changes; one per distinct violation
+	diagnosticList _diagnostics;
+	diagnosticMap _diagnosticIndex;
+	DWORD _currentOffset;       // of the instruction being checked, DIAG_NO_OFFSET outside code
 
-#ifdef META_TOKEN_NAME_CACHE
-	metaNameMap _metaNameMap;
-#endif
+	// fed the same instructions as the policy checks
+	StackVerifier _stackVerifier;
 
 	static const WCHAR* _ErrorFormatStr;
 
 	PVOID _base;
+	DWORD _fileSize;
+	bool _attached;          // _module belongs to the caller
 	PIMAGE_NT_HEADERS _headers;
-	void DisplayTypeDefProps(mdTypeDef inTypeDef);
 	void CheckMethodCode(PBYTE pbCode, DWORD dwCodeSize, DWORD codeRVA);
+	void CheckMethodBody(PBYTE pbCode, DWORD dwCodeSize, DWORD codeRVA);
+	void VerifyStack(PBYTE pbCode, DWORD dwCodeSize);
+	void CheckStackBalance();
+	void OpenIndex();
+	void CloseIndex(bool passed);
+	void DispatchBeginType(mdTypeDef tok);
 	void ProcessType(mdToken tok);
 	void Unload();
 	void ZeroInit();
 	void FinalInitialize();
+	void ApplyOptions(const ASMCHECK_OPTIONS* options);
+	void CheckTurnCost();
+	void ReportHandler(mdMethodDef handler, ErrorContext ctx);
+	void IngestImage();
+	bool CheckResourceLimits();
+	void LimitExceeded(DWORD limit, LPCSTR what);
+	bool Stopped();
 	void Dispose();
 	bool LoadFile(LPCWSTR name);
 	void* RtlImageRvaToVa(PIMAGE_NT_HEADERS NtHeaders, void* Base, ULONG Rva, PIMAGE_SECTION_HEADER *LastRvaSection);
-	HRESULT GetTypeDefName(mdTypeDef, WCHAR* buffer, int len);
 	HRESULT GetTypeDefFlags(mdTypeDef inTypeDef, DWORD* flags);
-	HRESULT GetTypeRefName(mdTypeDef inTypeDef, WCHAR* buffer, int len);
-	HRESULT GetTypeName(mdTypeDef inTypeDef, WCHAR* buffer, int len);
-	HRESULT GetMemberRefName(mdTypeDef inTypeDef, WCHAR* buffer, int len );
+	HRESULT GetTypeName(mdToken tok, TypeName* name);
 	bool ResolveUnauthorizedTypes();
-	void TypeCheck(LPCWSTR className, ErrorContext ctx = UnknownContext, WCHAR* container = NULL);
-	void TypeCheckTree(mdToken tok, ErrorContext ctx = UnknownContext, WCHAR* container = NULL);
+	void CheckAllowlist();
+	void TypeCheck(const TypeName& className, ErrorContext ctx = UnknownContext, LPCSTR container = "");
+	void TypeCheckTree(mdToken tok, ErrorContext ctx = UnknownContext, LPCSTR container = "");
 	bool CheckDosHeader();
 	void ValidateMemberTypes(mdToken tkType);
-	void CheckMethodAttrs(DWORD dwAttrs, WCHAR* buffer, bool isEmpty);
-	void CheckFieldAttrs(DWORD dwAttrs, WCHAR* buffer);
-	void CheckFieldType(mdTypeDef classType, WCHAR* buffer, PCCOR_SIGNATURE pCorSig, ULONG sigSize);
+	void CheckMethodAttrs(DWORD dwAttrs, LPCSTR name, bool isEmpty);
+	void CheckFieldAttrs(DWORD dwAttrs, LPCSTR name);
+	void CheckFieldType(mdTypeDef classType, LPCSTR name, PCCOR_SIGNATURE pCorSig, ULONG sigSize);
 	HRESULT GetTypeDefBase(mdTypeDef inTypeDef, mdTypeDef& outTypeDef);
 	void SigToString(PCCOR_SIGNATURE sig, ULONG sigSize, WCHAR* buff, int maxLen);
 	bool SigHasClassType(PCCOR_SIGNATURE sig, mdToken* tok = NULL, bool stripCallConv = true);
 	bool IsEmptyMethod(PBYTE pCode, DWORD dwCodeSize);
 
-	void ReportError(ErrorContext ctx, LPCWSTR formatStr, ...);
+	void ReportError(ErrorContext ctx, LPCSTR container, const TypeName& detail);
+	void FlushDiagnostics();
 	void CreateBadInstructionTable();
 
 	PIMAGE_SECTION_HEADER RtlImageRvaToSection(PIMAGE_NT_HEADERS NtHeaders, PVOID Base, ULONG Rva);
@@ -249,11 +419,26 @@ public:
 	ManagedAssembly();
 	ManagedAssembly(unsigned int reportFlags);
 	ManagedAssembly(unsigned int reportFlags, LPCWSTR xmlFile);
+	ManagedAssembly(const ASMCHECK_OPTIONS* options);
 	~ManagedAssembly();
 
+	void AttachImage(const MappedImage& image);
+	void AfterWait(const SchedulerSlot& slot);
 	bool Validate(LPCWSTR name);
+	DWORD VerifyStrongName(LPCWSTR name);
+	void GetStats(ASMCHECK_STATS* stats);
+	bool AddVisitor(AssemblyVisitor* visitor);
+
+	// keeps the diagnostics for GetResult; set before Validate
+	void CollectResult() { _collecting = true; }
+	void GetResult(ASMCHECK_RESULT* result);
 };
 
+// call a method on every visitor registered for an event
+#define DISPATCH_VISITORS(ev, call) \
+	for (int _v = 0; _v < _visitorCount[ev]; _v++) \
+		_visitors[ev][_v]->call
+
 __inline
 PIMAGE_NT_HEADERS
 NTAPI RtlpImageNtHeader (IN PVOID Base) {
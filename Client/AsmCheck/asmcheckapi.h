@@ -0,0 +1,215 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmcheckapi.h : exported entry points of asmcheck.dll and the option and
+// statistics blocks passed across them.  Both blocks start with a cbSize
+// field so that fields can be appended without breaking older callers.
+//
+// Every entry point may be called from any number of threads at once.
+// Validations run on the calling thread, as many at a time as there are
+// processors; the rest wait their turn, interactive ones ahead of bulk
+// ones.  Each call validates with state of its own; the only state shared
+// between calls is the process metrics, which are updated with
+// interlocked operations, and any fingerprintIndex file, which is only
+// ever replaced whole.  Metadata is read straight from the mapped
+// file, so validation needs no COM; REPORT_FLAGS_XML builds its report
+// with MSXML and needs COM initialized on the calling thread.
+// CheckAssemblyWithResult hands the same report back in memory and
+// needs neither COM nor a file.
+//
+
+#pragma once
+
+#ifdef ASMCHECK_EXPORTS
+#define ASMCHECK_API extern "C" __declspec(dllexport)
+#else
+#define ASMCHECK_API extern "C" __declspec(dllimport)
+#endif
+
+#define REPORT_FLAGS_NONE    0x00000000
+#define REPORT_FLAGS_CONSOLE 0x00000001
+#define REPORT_FLAGS_XML     0x00000002
+
+#define CHECK_FLAGS_NONE            0x00000000
+#define CHECK_FLAGS_REJECT_COSTLY   0x00000001  // fail instead of flag over maxTurnCost
+#define CHECK_FLAGS_STRONG_NAME     0x00000002  // verify the strong name signature too
+#define CHECK_FLAGS_CONTENT_HASH    0x00000004  // SHA-256 of the file into contentHash
+#define CHECK_FLAGS_ALLOWLIST       0x00000008  // only members on allowlistFile may be referenced
+#define CHECK_FLAGS_REJECT_ALLOCATING 0x00000010  // fail instead of flag over maxTurnAllocations
+
+// ASMCHECK_OPTIONS.priority
+#define ASMCHECK_PRIORITY_DEFAULT       0   // interactive, bulk for CheckAssemblyBatch
+#define ASMCHECK_PRIORITY_INTERACTIVE   1   // someone is waiting on the verdict
+#define ASMCHECK_PRIORITY_BULK          2   // revalidation and scans
+
+// ASMCHECK_STATS.strongNameStatus
+#define STRONG_NAME_NOT_CHECKED     0
+#define STRONG_NAME_VALID           1
+#define STRONG_NAME_UNSIGNED        2   // no public key or no signature
+#define STRONG_NAME_INVALID         3   // signature doesn't match the image
+#define STRONG_NAME_UNSUPPORTED     4   // key or hash algorithm not handled
+
+// ASMCHECK_STATS.verdict; a validation that is stopped fails, the
+// verdict tells it from one that found errors
+#define ASMCHECK_VERDICT_NONE       0   // not validated
+#define ASMCHECK_VERDICT_PASSED     1
+#define ASMCHECK_VERDICT_FAILED     2
+#define ASMCHECK_VERDICT_TIMED_OUT  3   // ran past timeLimit
+#define ASMCHECK_VERDICT_CANCELLED  4   // *cancel was set
+#define ASMCHECK_VERDICT_COUNT      5
+
+// default per-validation budget for transient state (caches, report
+// nodes); past it caches are skipped, and a validation that still needs
+// more fails with RESOURCE_LIMIT_MEMORY
+#define DEFAULT_MEMORY_BUDGET (8 * 1024 * 1024)
+
+// default ceilings on the size of an organism, checked before the
+// assembly is walked; organisms are small, so these are generous
+#define DEFAULT_MAX_TABLE_ROWS      0x10000
+#define DEFAULT_MAX_HEAP_SIZE       (4 * 1024 * 1024)
+#define DEFAULT_MAX_IL_BYTES        (4 * 1024 * 1024)
+#define DEFAULT_MAX_METHOD_SIZE     (128 * 1024)
+#define DEFAULT_MAX_SWITCH_TARGETS  1024
+
+// ASMCHECK_STATS.limitExceeded
+#define RESOURCE_LIMIT_NONE             0
+#define RESOURCE_LIMIT_TABLE_ROWS       1
+#define RESOURCE_LIMIT_HEAP_SIZE        2
+#define RESOURCE_LIMIT_IL_BYTES         3
+#define RESOURCE_LIMIT_METHOD_SIZE      4
+#define RESOURCE_LIMIT_SWITCH_TARGETS   5
+#define RESOURCE_LIMIT_MEMORY           6
+
+#define ASMCHECK_HASH_SIZE 32
+#define ASMCHECK_NAME_SIZE 64
+#define ASMCHECK_MAX_OFFSETS 4      // IL offsets kept per diagnostic
+
+// true if a versioned block is large enough to carry the given field
+#define ASMCHECK_HAS_FIELD(p, type, field) \
+	((p)->cbSize >= FIELD_OFFSET(type, field) + sizeof(((type*)0)->field))
+
+typedef struct _ASMCHECK_OPTIONS {
+	ULONG cbSize;               // sizeof(ASMCHECK_OPTIONS)
+	unsigned int reportFlags;   // REPORT_FLAGS_*
+	LPCWSTR xmlFile;            // report file used with REPORT_FLAGS_XML
+	SIZE_T memoryBudget;        // bytes, 0 selects DEFAULT_MEMORY_BUDGET
+	ULONG maxTurnCost;          // estimated per-turn cost limit, 0 skips the estimate
+	DWORD checkFlags;           // CHECK_FLAGS_*
+	ULONG prefetchDepth;        // files CheckAssemblyBatch maps ahead, 0 selects the default;
+	                            // also the queue between its validation and retirement
+	// ceilings, 0 selects the DEFAULT_MAX_* value
+	ULONG maxTableRows;         // rows in any one metadata table
+	ULONG maxHeapSize;          // bytes in any one metadata heap
+	ULONG maxILBytes;           // IL bytes over all method bodies
+	ULONG maxMethodSize;        // IL bytes in one method body
+	ULONG maxSwitchTargets;     // targets of one switch instruction
+	LPCWSTR allowlistFile;      // written by BuildAllowlist, used with CHECK_FLAGS_ALLOWLIST
+	LPCWSTR summaryFile;        // reference summary for EvaluateSummary, NULL writes none
+	LPCWSTR fingerprintIndex;   // method body index consulted and added to, NULL keeps none
+	DWORD priority;             // ASMCHECK_PRIORITY_*
+	ULONG deadline;             // milliseconds the verdict is wanted in, 0 for none; for a
+	                            // batch, per assembly from its turn; orders waiting
+	                            // validations, timeLimit is what stops one
+	// checked between types, members and basic blocks; the stats of a
+	// validation that is stopped cover what it got through
+	ULONG timeLimit;            // milliseconds of validation before it gives up, 0 for none
+	const volatile LONG* cancel;    // set to nonzero from any thread to stop, NULL for none
+	ULONG maxTurnAllocations;   // estimated heap allocations per turn limit, 0 skips the estimate
+	// threads of the CheckAssemblyBatch stages, 0 for one; validations
+	// running at once still get no more than the scheduler's bulk slots;
+	// a batch rejects xmlFile, summaryFile and listingFile, which would
+	// be shared by all its assemblies
+	ULONG loadThreads;          // mapping and faulting in files
+	ULONG validateThreads;
+	// method IL with operands by name and each violation where it was
+	// found, for looking into a rejection; NULL writes none
+	LPCWSTR listingFile;
+} ASMCHECK_OPTIONS;
+
+typedef struct _ASMCHECK_STATS {
+	ULONG cbSize;               // sizeof(ASMCHECK_STATS)
+	SIZE_T peakMemory;          // high-water mark of tracked bytes
+	BOOL budgetExceeded;        // caches or report were cut short by the budget
+	ULONG typeCount;
+	ULONG fieldCount;
+	ULONG methodCount;
+	ULONG instructionCount;
+	ULONG ilBytes;
+	ULONG memberRefCount;       // call sites and field accesses resolved by name
+	ULONG estimatedTurnCost;    // only computed when maxTurnCost is set
+	ULONG loopCount;
+	BOOL costExceeded;
+	DWORD strongNameStatus;     // STRONG_NAME_*, with CHECK_FLAGS_STRONG_NAME
+	BYTE contentHash[ASMCHECK_HASH_SIZE];  // SHA-256, with CHECK_FLAGS_CONTENT_HASH
+	DWORD limitExceeded;        // RESOURCE_LIMIT_* of the first ceiling hit
+	// with fingerprintIndex
+	ULONG indexedMethodCount;   // method bodies found in the index
+	ULONG similarMethodCount;   // of those, first seen in similarAssembly
+	WCHAR similarAssembly[ASMCHECK_NAME_SIZE];  // known assembly it shares most bodies with, empty if none
+	DWORD verdict;              // ASMCHECK_VERDICT_*
+	// with maxTurnAllocations; allocation sites weighted by loop nesting
+	// and summed over the event handlers and what they call
+	ULONG estimatedTurnAllocations;
+	BOOL allocationsExceeded;
+} ASMCHECK_STATS;
+
+// One distinct violation, as the XML report has it in an error node.
+// The strings stay valid until FreeCheckResult.
+typedef struct _ASMCHECK_DIAGNOSTIC {
+	DWORD errorContext;         // which check it broke
+	LPCSTR id;                  // errorContext by name, "InvalidCall"
+	LPCWSTR message;            // as the XML report words it
+	LPCWSTR typeName;           // type it was found in, empty outside any type
+	LPCWSTR memberName;         // member it was found in, NULL for the type as a whole
+	LPCWSTR container;          // what was referenced, as the console report has it
+	LPCWSTR detail;
+	ULONG count;                // times it was reported
+	ULONG offsetCount;
+	DWORD offsets[ASMCHECK_MAX_OFFSETS];   // first IL offsets it was reported at
+} ASMCHECK_DIAGNOSTIC;
+
+// The outcome of CheckAssemblyWithResult.  The caller sets the two sizes;
+// the diagnostics are laid out cbDiagnostic apart, which is just an
+// array for a caller built with this header.
+typedef struct _ASMCHECK_RESULT {
+	ULONG cbSize;               // sizeof(ASMCHECK_RESULT)
+	ULONG cbDiagnostic;         // sizeof(ASMCHECK_DIAGNOSTIC), 0 only counts them
+	DWORD verdict;              // ASMCHECK_VERDICT_*
+	BOOL truncated;             // the memory budget ran out before every diagnostic was kept
+	ULONG diagnosticCount;
+	ASMCHECK_DIAGNOSTIC* diagnostics;   // one allocation, freed by FreeCheckResult
+} ASMCHECK_RESULT;
+
+// A policy applied to a reference summary.  The built-in banned types,
+// opcodes and attributes always apply; these add to them.
+typedef struct _ASMCHECK_POLICY {
+	ULONG cbSize;               // sizeof(ASMCHECK_POLICY)
+	DWORD checkFlags;           // CHECK_FLAGS_ALLOWLIST is the one that applies
+	LPCWSTR allowlistFile;
+	LPCSTR const* bannedTypes;  // dotted full names
+	ULONG bannedTypeCount;
+	const USHORT* bannedOpcodes;    // encodings, 0xFExx for two byte opcodes
+	ULONG bannedOpcodeCount;
+} ASMCHECK_POLICY;
+
+// an assembly whose members BuildAllowlist approves
+typedef struct _ASMCHECK_ALLOWLIST_SOURCE {
+	LPCWSTR asmName;
+	LPCSTR const* types;        // dotted full names, NULL for every public type
+	ULONG typeCount;
+} ASMCHECK_ALLOWLIST_SOURCE;
+
+ASMCHECK_API BOOL ValidateStrongName(LPCWSTR asmName);
+ASMCHECK_API BOOL ValidateStrongNameEx(LPCWSTR asmName, BOOLEAN fForce);
+ASMCHECK_API BOOL CheckAssembly(LPCWSTR asmName);
+ASMCHECK_API BOOL CheckAssemblyEx(LPCWSTR asmName, unsigned int flags);
+ASMCHECK_API BOOL CheckAssemblyWithReporting(LPCWSTR asmName, LPCWSTR xmlFile);
+ASMCHECK_API BOOL CheckAssemblyWithOptions(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats);
+ASMCHECK_API BOOL CheckAssemblyWithResult(LPCWSTR asmName, const ASMCHECK_OPTIONS* options, ASMCHECK_STATS* stats, ASMCHECK_RESULT* result);
+ASMCHECK_API void FreeCheckResult(ASMCHECK_RESULT* result);
+ASMCHECK_API BOOL CheckAssemblyBatch(LPCWSTR* asmNames, ULONG count, const ASMCHECK_OPTIONS* options, BOOL* results, ASMCHECK_STATS* stats);
+ASMCHECK_API BOOL DumpMetrics(LPCWSTR file);
+ASMCHECK_API BOOL GetMetricsText(LPSTR buffer, ULONG size, ULONG* needed);
+ASMCHECK_API BOOL BuildAllowlist(const ASMCHECK_ALLOWLIST_SOURCE* sources, ULONG count, LPCWSTR allowlistFile);
+ASMCHECK_API BOOL EvaluateSummary(LPCWSTR summaryFile, const ASMCHECK_POLICY* policy, ULONG* violations);
@@ -0,0 +1,506 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmindex.cpp : method body fingerprints and the index of known bodies
+//
+
+#include "stdafx.h"
+#include <corerror.h>
+#include <string>
+#include "asmcheckapi.h"
+#include "asmload.h"
+#include "mdtables.h"
+#include "ilopcode.h"
+#include "asmalloc.h"
+#include "asmpolicy.h"
+#include "asmsign.h"
+#include "asmindex.h"
+
+// fewest slots an index is written with
+#define MIN_INDEX_CAPACITY      1024
+
+// a SHA-256 fed a field at a time, the way MemberKey is
+class DigestKey {
+private:
+	Sha256 _sha;
+
+public:
+	void AddByte(BYTE b) { _sha.Update(&b, 1); }
+	void AddBytes(const BYTE* p, DWORD size) { _sha.Update(p, size); }
+
+	void AddData(ULONG value) {
+		BYTE bytes[4];
+		for (int i = 0; i < 4; i++, value >>= 8)
+			bytes[i] = (BYTE)value;
+		_sha.Update(bytes, sizeof(bytes));
+	}
+
+	void AddKey(ULONGLONG key) {
+		AddData((ULONG)key);
+		AddData((ULONG)(key >> 32));
+	}
+
+	void AddDigest(const IndexDigest& digest) {
+		AddKey(digest.low);
+		AddKey(digest.high);
+	}
+
+	// the terminator goes in too, so "ab" "c" and "a" "bc" differ
+	void AddString(LPCSTR s) { _sha.Update((const BYTE*)s, strlen(s) + 1); }
+
+	IndexDigest Get() {
+		BYTE digest[SHA256_DIGEST_SIZE];
+		_sha.Final(digest);
+
+		IndexDigest result;
+		result.low = 0;
+		result.high = 0;
+		for (int i = 7; i >= 0; i--)
+        {
+			result.low = (result.low << 8) | digest[i];
+			result.high = (result.high << 8) | digest[8 + i];
+		}
+
+		// all zero marks an empty slot
+		if ( result.IsEmpty() )
+			result.low = 1;
+		return result;
+	}
+};
+
+////////////////////////////////////
+// MethodFingerprinter
+
+MethodFingerprinter::MethodFingerprinter(MemoryBudget* budget) :
+	_tokenKeys(tokenKeyMap::key_compare(), tokenKeyMap::allocator_type(budget))
+{
+	_tables = NULL;
+}
+
+// The names TypeCheckTree looks at, in the order it looks at them: the
+// type, then its base classes as long as they are defined here.  The
+// visibility goes in as well, an internal class may not extend Animal
+// or Plant.
+void MethodFingerprinter::KeyTypeTree(mdToken tok, DigestKey& key)
+{
+	DWORD flags = 0;
+	if ( TypeFromToken(tok) == mdtTypeDef && SUCCEEDED(_tables->GetTypeDefProps(tok, &flags, NULL)) )
+		key.AddByte(IsTdPublic(flags) ? 'P' : 'I');
+
+	// a hostile image can make the chain loop
+	mdToken curr = tok;
+	ULONG typeCount = _tables->GetRowCount(TblTypeDef);
+	for (ULONG depth = 0; depth <= typeCount; depth++)
+    {
+		TypeName name;
+		if ( FAILED(_tables->GetTypeName(curr, &name)) )
+        {
+			key.AddByte('?');
+			break;
+		}
+
+		key.AddString(name.nameSpace);
+		key.AddString(name.name);
+
+		mdToken base = mdTokenNil;
+		if ( TypeFromToken(curr) != mdtTypeDef || FAILED(_tables->GetTypeDefProps(curr, NULL, &base)) ||
+			 IsNilToken(base) )
+			break;
+
+		curr = base;
+	}
+
+	key.AddByte('.');
+}
+
+// Tokens are keyed by what they name, so the key doesn't depend on the
+// layout of the tables.  A token that can't be resolved goes in as is;
+// the checks skip those too.  The names go into the digest themselves,
+// not their 64 bit member keys, which an uploader could collide.
+const IndexDigest& MethodFingerprinter::KeyToken(mdToken tok)
+{
+	tokenKeyMap::iterator it = _tokenKeys.find(tok);
+	if ( it != _tokenKeys.end() )
+		return it->second;
+
+	DigestKey key;
+	mdToken parent = mdTokenNil, owner;
+	LPCSTR name = NULL;
+	PCCOR_SIGNATURE sig = NULL;
+	ULONG sigSize = 0;
+	DWORD attrs, implFlags, rva;
+	HRESULT hr = E_FAIL;
+
+	key.AddData(TypeFromToken(tok));
+	switch ( TypeFromToken(tok) )
+    {
+		case mdtTypeDef:
+		case mdtTypeRef:
+		case mdtTypeSpec:
+			KeyTypeTree(tok, key);
+			return _tokenKeys[tok] = key.Get();
+
+		case mdtMemberRef:
+			hr = _tables->GetMemberRefProps(tok, &parent, &name, &sig, &sigSize);
+			break;
+
+		case mdtMethodDef:
+			hr = _tables->GetMemberParent(tok, &parent);
+			if ( SUCCEEDED(hr) )
+				hr = _tables->GetMemberName(tok, &name);
+			if ( SUCCEEDED(hr) )
+				hr = _tables->GetMethodProps(tok, &attrs, &implFlags, &sig, &sigSize, &rva);
+			break;
+
+		case mdtFieldDef:
+			hr = _tables->GetMemberParent(tok, &parent);
+			if ( SUCCEEDED(hr) )
+				hr = _tables->GetMemberName(tok, &name);
+			if ( SUCCEEDED(hr) )
+				hr = _tables->GetFieldProps(tok, &attrs, &sig, &sigSize);
+			break;
+	}
+
+	if ( FAILED(hr) )
+    {
+		key.AddByte('#');
+		key.AddData(tok);
+		return _tokenKeys[tok] = key.Get();
+	}
+
+	key.AddString(name);
+	KeyTypeTree(parent, key);
+
+	// the member itself, where it can be keyed
+	ULONGLONG memberKey;
+	if ( GetMemberOwner(*_tables, parent, &owner) == S_OK &&
+		 SUCCEEDED(KeyMember(*_tables, owner, name, sig, sigSize, &memberKey)) )
+		key.AddKey(memberKey);
+
+	return _tokenKeys[tok] = key.Get();
+}
+
+// Decodes the body the way CheckMethodCode does.
+bool MethodFingerprinter::Fingerprint(const BYTE* code, DWORD codeSize, IndexDigest* hash, DWORD* maxSwitchTargets)
+{
+	DigestKey key;
+	DWORD pos = 0;
+
+	ZeroMemory(hash, sizeof(*hash));
+	*maxSwitchTargets = 0;
+
+	if ( NULL == _tables || NULL == code )
+		return false;
+
+	key.AddData(codeSize);
+	while ( pos < codeSize )
+    {
+		OPCODE opcode;
+		DWORD len, size;
+
+		if ( !DecodeInstruction(code + pos, codeSize - pos, &opcode, &len, &size) )
+			return false;
+
+		key.AddBytes(code + pos, len);
+		pos += len;
+
+		bool isToken = false;
+		switch ( (opcode < CEE_COUNT) ? OpcodeInfo[opcode].Type : InlineNone )
+        {
+			default:
+				break;
+
+			case InlineSwitch:
+                {
+					DWORD numCases = GET_UNALIGNED_DWORD(code + pos);
+					if ( numCases > *maxSwitchTargets )
+						*maxSwitchTargets = numCases;
+				}
+				break;
+
+			case InlineString:
+			case InlineSig:
+			case InlineField:
+			case InlineType:
+			case InlineTok:
+			case InlineMethod:
+				isToken = true;
+				break;
+		}
+
+		if ( isToken )
+        {
+			mdToken tok = GET_UNALIGNED_DWORD(code + pos);
+
+			// literals and call site signatures don't change the verdict
+			if ( TypeFromToken(tok) == mdtString || TypeFromToken(tok) == mdtSignature )
+				key.AddData(TypeFromToken(tok));
+			else
+				key.AddDigest(KeyToken(tok));
+		}
+        else
+			key.AddBytes(code + pos, size);
+
+		pos += size;
+	}
+
+	*hash = key.Get();
+	return true;
+}
+
+////////////////////////////////////
+// FingerprintIndex
+
+FingerprintIndex::FingerprintIndex()
+{
+	_header = NULL;
+	_slots = NULL;
+	_names = NULL;
+	_mask = 0;
+}
+
+bool FingerprintIndex::Attach(const BYTE* data, DWORD size, DWORD policy)
+{
+	const IndexHeader* header = (const IndexHeader*)data;
+
+	_header = NULL;
+	_slots = NULL;
+	_names = NULL;
+	_mask = 0;
+
+	if ( NULL == data || size < sizeof(IndexHeader) ||
+		 header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || header->policy != policy )
+		return false;
+
+	DWORD capacity = header->capacity;
+	if ( capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+		 capacity > (size - sizeof(IndexHeader)) / sizeof(IndexSlot) ||
+		 header->count > capacity / 2 )
+		return false;
+
+	DWORD nameBytes = size - sizeof(IndexHeader) - capacity * sizeof(IndexSlot);
+	if ( header->assemblyCount > MAX_INDEX_ASSEMBLIES ||
+		 nameBytes != header->assemblyCount * ASMCHECK_NAME_SIZE * sizeof(WCHAR) )
+		return false;
+
+	const IndexSlot* slots = (const IndexSlot*)(header + 1);
+	const WCHAR* names = (const WCHAR*)(slots + capacity);
+
+	// every name is terminated, so they can be handed out as they are
+	for (DWORD a = 0; a < header->assemblyCount; a++)
+    {
+		if ( names[(SIZE_T)a * ASMCHECK_NAME_SIZE + ASMCHECK_NAME_SIZE - 1] != L'\0' )
+			return false;
+	}
+
+	_header = header;
+	_slots = slots;
+	_names = names;
+	_mask = capacity - 1;
+	return true;
+}
+
+const IndexSlot* FingerprintIndex::Find(const IndexDigest& hash) const
+{
+	if ( NULL == _slots || hash.IsEmpty() )
+		return NULL;
+
+	// bounded by the capacity in case the file lied about its count
+	for (ULONG probe = 0, i = (ULONG)hash.low & _mask; probe <= _mask; probe++, i = (i + 1) & _mask)
+    {
+		if ( _slots[i].hash == hash )
+			return &_slots[i];
+		if ( _slots[i].hash.IsEmpty() )
+			return NULL;
+	}
+
+	return NULL;
+}
+
+DWORD FingerprintIndex::FindAssembly(LPCWSTR name) const
+{
+	for (DWORD a = 0; a < GetAssemblyCount(); a++)
+    {
+		if ( !_wcsicmp(GetAssemblyName(a), name) )
+			return a;
+	}
+
+	return INDEX_NO_ASSEMBLY;
+}
+
+////////////////////////////////////
+// FingerprintLog
+
+FingerprintLog::FingerprintLog(MemoryBudget* budget) :
+	_matches(matchMap::key_compare(), matchMap::allocator_type(budget)),
+	_newBodies(slotList::allocator_type(budget))
+{
+	_knownCount = 0;
+}
+
+void FingerprintLog::AddKnown(const IndexSlot& slot)
+{
+	_knownCount++;
+	_matches[slot.assembly]++;
+}
+
+void FingerprintLog::AddNew(const IndexDigest& hash, DWORD contexts)
+{
+	IndexSlot slot;
+	slot.hash = hash;
+	slot.contexts = contexts;
+	slot.assembly = INDEX_NO_ASSEMBLY;
+	_newBodies.push_back(slot);
+}
+
+DWORD FingerprintLog::GetClosest(DWORD self, ULONG* matches) const
+{
+	DWORD closest = INDEX_NO_ASSEMBLY;
+	*matches = 0;
+
+	for (matchMap::const_iterator it = _matches.begin(); it != _matches.end(); it++)
+    {
+		if ( it->first != self && it->second > *matches )
+        {
+			closest = it->first;
+			*matches = it->second;
+		}
+	}
+
+	return closest;
+}
+
+static void InsertSlot(std::vector<IndexSlot>& slots, const IndexSlot& slot)
+{
+	ULONG mask = (ULONG)slots.size() - 1;
+	ULONG i = (ULONG)slot.hash.low & mask;
+
+	while ( !slots[i].hash.IsEmpty() && slots[i].hash != slot.hash )
+		i = (i + 1) & mask;
+
+	// the body's first assembly and result stand
+	if ( slots[i].hash.IsEmpty() )
+		slots[i] = slot;
+}
+
+bool FingerprintLog::Merge(LPCWSTR file, DWORD policy, LPCWSTR asmName, bool passed)
+{
+	std::vector<IndexSlot> bodies;
+
+	if ( _newBodies.empty() )
+		return true;
+	std::vector<WCHAR> names;
+	DWORD assemblyCount = 0;
+
+	// what is there now, unless it's missing, unreadable or stale
+	MappedImage image;
+	if ( MapImage(file, &image) )
+    {
+		FingerprintIndex index;
+		if ( index.Attach(image.view, image.size, policy) )
+        {
+			const IndexSlot* slots = (const IndexSlot*)(image.view + sizeof(IndexHeader));
+			DWORD capacity = ((const IndexHeader*)image.view)->capacity;
+
+			bodies.reserve(((const IndexHeader*)image.view)->count + _newBodies.size());
+			for (DWORD i = 0; i < capacity; i++)
+            {
+				if ( !slots[i].hash.IsEmpty() )
+					bodies.push_back(slots[i]);
+			}
+
+			assemblyCount = index.GetAssemblyCount();
+			names.assign(index.GetAssemblyName(0), index.GetAssemblyName(assemblyCount));
+		}
+		UnmapImage(&image);
+	}
+
+	WCHAR name[ASMCHECK_NAME_SIZE];
+	IndexAssemblyName(asmName, name);
+
+	DWORD assembly = INDEX_NO_ASSEMBLY;
+	for (DWORD a = 0; a < assemblyCount; a++)
+    {
+		if ( !_wcsicmp(&names[(SIZE_T)a * ASMCHECK_NAME_SIZE], name) )
+			assembly = a;
+	}
+	if ( assembly == INDEX_NO_ASSEMBLY )
+    {
+		if ( assemblyCount >= MAX_INDEX_ASSEMBLIES )
+			return false;
+		assembly = assemblyCount++;
+		names.insert(names.end(), name, name + ASMCHECK_NAME_SIZE);
+	}
+
+	for (size_t b = 0; b < _newBodies.size() && bodies.size() < MAX_INDEX_BODIES; b++)
+    {
+		bodies.push_back(_newBodies[b]);
+		bodies.back().assembly = assembly;
+		if ( !passed && bodies.back().contexts == 0 )
+			bodies.back().contexts = INDEX_UNVERIFIED;
+	}
+
+	DWORD capacity = MIN_INDEX_CAPACITY;
+	while ( capacity < 2 * bodies.size() )
+		capacity *= 2;
+
+	IndexSlot empty;
+	ZeroMemory(&empty, sizeof(empty));
+	std::vector<IndexSlot> slots(capacity, empty);
+
+	DWORD count = 0;
+	for (size_t b = 0; b < bodies.size(); b++)
+		InsertSlot(slots, bodies[b]);
+	for (DWORD i = 0; i < capacity; i++)
+    {
+		if ( !slots[i].hash.IsEmpty() )
+			count++;
+	}
+
+	IndexHeader header;
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.policy = policy;
+	header.capacity = capacity;
+	header.count = count;
+	header.assemblyCount = assemblyCount;
+
+	// written aside and renamed over the index, so a reader never maps a
+	// partial one; a second writer can't open the file aside and gives up
+	std::wstring tempFile = file;
+	tempFile += L".tmp";
+
+	HANDLE handle = CreateFileW(tempFile.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( handle == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD written = 0;
+	DWORD slotBytes = capacity * sizeof(IndexSlot);
+	DWORD nameBytes = (DWORD)(names.size() * sizeof(WCHAR));
+	bool result = WriteFile(handle, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+				  WriteFile(handle, &slots[0], slotBytes, &written, NULL) && written == slotBytes &&
+				  WriteFile(handle, &names[0], nameBytes, &written, NULL) && written == nameBytes;
+	CloseHandle(handle);
+
+	if ( result )
+		result = MoveFileExW(tempFile.c_str(), file, MOVEFILE_REPLACE_EXISTING) != FALSE;
+
+	if ( !result )
+		DeleteFileW(tempFile.c_str());
+
+	return result;
+}
+
+void IndexAssemblyName(LPCWSTR path, WCHAR* name)
+{
+	LPCWSTR fileName = path;
+	for (LPCWSTR p = path; *p != L'\0'; p++)
+    {
+		if ( *p == L'\\' || *p == L'/' || *p == L':' )
+			fileName = p + 1;
+	}
+
+	ZeroMemory(name, ASMCHECK_NAME_SIZE * sizeof(WCHAR));
+	wcsncpy(name, fileName, ASMCHECK_NAME_SIZE - 1);
+}
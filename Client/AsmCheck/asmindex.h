@@ -0,0 +1,151 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmindex.h : the method body index.  Every method body is reduced to a
+// fingerprint of its normalized IL, with tokens replaced by the names
+// they resolve to, so the same body gets the same fingerprint in any
+// assembly.  The index maps fingerprints to the errors the body was
+// found to have, and remembers the assembly each body was first seen in,
+// so a fork of a known organism only has its changed methods checked and
+// can be traced back to the organism it was taken from.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <map>
+#include <vector>
+
+#define INDEX_MAGIC             0x49464341  // "ACFI"
+#define INDEX_VERSION           3
+
+// the most bodies and assemblies an index is grown to; beyond that new
+// bodies are still checked, just not remembered
+#define MAX_INDEX_BODIES        0x1000000
+#define MAX_INDEX_ASSEMBLIES    0x10000
+
+#define INDEX_NO_ASSEMBLY       0xFFFFFFFF
+
+// IndexSlot.contexts of a body that reported nothing in an assembly that
+// failed.  The type check reports a type once per assembly, so the
+// error may have been reported against another body; it is checked in
+// full the next time it is seen.
+#define INDEX_UNVERIFIED        0x80000000
+
+// The first 128 bits of a SHA-256.  A body found in the index skips the
+// policy checks, and the uploader picks every name and immediate that is
+// hashed, so fingerprints have to be a digest no body can be made to
+// collide with.  All zero is an empty slot, so it is never a digest.
+struct IndexDigest {
+	ULONGLONG low;
+	ULONGLONG high;
+
+	bool IsEmpty() const { return 0 == low && 0 == high; }
+	bool operator==(const IndexDigest& other) const { return low == other.low && high == other.high; }
+	bool operator!=(const IndexDigest& other) const { return !(*this == other); }
+};
+
+// Layout of an index file: the header, capacity slots, then one name of
+// ASMCHECK_NAME_SIZE characters per assembly.  Slots are placed by
+// linear probing from hash.low & (capacity - 1).
+struct IndexHeader {
+	DWORD magic;            // INDEX_MAGIC
+	DWORD version;          // INDEX_VERSION
+	DWORD policy;           // stamp of the rules the results were found under
+	DWORD capacity;         // slots, a power of two
+	DWORD count;            // slots in use, at most half of capacity
+	DWORD assemblyCount;
+};
+
+struct IndexSlot {
+	IndexDigest hash;
+	DWORD contexts;         // one bit per ErrorContext the body reported, 0 if clean
+	DWORD assembly;         // the body was first seen in
+};
+
+class DigestKey;
+
+// Fingerprints method bodies of one assembly.  The IL is hashed as is
+// except for token operands, which go in as the digest of the names they
+// resolve to; string literals go in as a placeholder.  A member is keyed by its
+// KeyMember key and by its type along with the type's base classes and
+// visibility, which is all the body checks look at, so bodies with the
+// same fingerprint get the same verdict.
+class MethodFingerprinter {
+private:
+	typedef std::map<mdToken, IndexDigest, std::less<mdToken>,
+					 TrackedAllocator<std::pair<const mdToken, IndexDigest> > > tokenKeyMap;
+
+	MetaDataTables* _tables;
+	tokenKeyMap _tokenKeys;
+
+	const IndexDigest& KeyToken(mdToken tok);
+	void KeyTypeTree(mdToken tok, DigestKey& key);
+
+public:
+	MethodFingerprinter(MemoryBudget* budget = NULL);
+
+	void SetTables(MetaDataTables* tables) { _tables = tables; }
+
+	// false if the body runs off its end; maxSwitchTargets receives the
+	// largest switch in it, which the fingerprint doesn't cover
+	bool Fingerprint(const BYTE* code, DWORD codeSize, IndexDigest* hash, DWORD* maxSwitchTargets);
+};
+
+// an index file mapped by the caller; nothing is copied
+class FingerprintIndex {
+private:
+	const IndexHeader* _header;
+	const IndexSlot* _slots;
+	const WCHAR* _names;
+	ULONG _mask;
+
+public:
+	FingerprintIndex();
+
+	// false if data isn't a well formed index kept under policy
+	bool Attach(const BYTE* data, DWORD size, DWORD policy);
+	bool IsAttached() const { return NULL != _header; }
+
+	const IndexSlot* Find(const IndexDigest& hash) const;
+	DWORD GetAssemblyCount() const { return NULL != _header ? _header->assemblyCount : 0; }
+	LPCWSTR GetAssemblyName(DWORD assembly) const { return _names + (SIZE_T)assembly * ASMCHECK_NAME_SIZE; }
+	DWORD FindAssembly(LPCWSTR name) const;
+};
+
+// What one validation learned from and for the index: the known bodies
+// it met, counted by the assembly they were first seen in, and the new
+// bodies with their results.
+class FingerprintLog {
+private:
+	typedef std::map<DWORD, ULONG, std::less<DWORD>,
+					 TrackedAllocator<std::pair<const DWORD, ULONG> > > matchMap;
+	typedef std::vector<IndexSlot, TrackedAllocator<IndexSlot> > slotList;
+
+	matchMap _matches;
+	slotList _newBodies;
+	ULONG _knownCount;
+
+public:
+	FingerprintLog(MemoryBudget* budget = NULL);
+
+	void AddKnown(const IndexSlot& slot);
+	void AddNew(const IndexDigest& hash, DWORD contexts);
+
+	ULONG GetKnownCount() const { return _knownCount; }
+
+	// the assembly, other than self, the most known bodies were first
+	// seen in; INDEX_NO_ASSEMBLY if none
+	DWORD GetClosest(DWORD self, ULONG* matches) const;
+
+	// Adds the new bodies to the index file under the name of the
+	// assembly.  The file is rewritten and renamed into place; an index
+	// kept under another policy is started over.  Fails without harm if
+	// another validation is reading or writing the index at the time;
+	// the bodies are added the next time they are seen.
+	bool Merge(LPCWSTR file, DWORD policy, LPCWSTR asmName, bool passed);
+};
+
+// the file name of a path, as assemblies are named in the index
+void IndexAssemblyName(LPCWSTR path, WCHAR* name);
@@ -0,0 +1,461 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmlisting.cpp : buffered IL listing writer
+//
+
+#include "stdafx.h"
+#include <corerror.h>
+#include "asmcheckapi.h"
+#include "asmlisting.h"
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+ListingWriter::ListingWriter()
+{
+	_tables = NULL;
+	_path = NULL;
+	_file = INVALID_HANDLE_VALUE;
+	_used = 0;
+	_failed = false;
+	_inBody = false;
+	_written = 0;
+	_labelDigits = 4;
+}
+
+ListingWriter::~ListingWriter()
+{
+	if ( _file != INVALID_HANDLE_VALUE )
+		CloseHandle(_file);
+}
+
+DWORD ListingWriter::GetEvents()
+{
+	return VISITOR_EVENT_MASK(AssemblyEvent) | VISITOR_EVENT_MASK(TypeEvent) | VISITOR_EVENT_MASK(FieldEvent) |
+		   VISITOR_EVENT_MASK(MethodEvent) | VISITOR_EVENT_MASK(InstructionEvent);
+}
+
+void ListingWriter::Flush()
+{
+	DWORD written;
+
+	if ( _used > 0 && !_failed && _file != INVALID_HANDLE_VALUE )
+    {
+		if ( !WriteFile(_file, &_buffer[0], _used, &written, NULL) || written != _used )
+			_failed = true;
+	}
+
+	_used = 0;
+}
+
+void ListingWriter::AppendSpilling(LPCSTR s, size_t length)
+{
+	while ( length > 0 )
+    {
+		if ( _used == LISTING_BUFFER_SIZE )
+			Flush();
+
+		size_t chunk = min(length, (size_t)(LISTING_BUFFER_SIZE - _used));
+		memcpy(&_buffer[_used], s, chunk);
+		_used += (DWORD)chunk;
+		s += chunk;
+		length -= chunk;
+	}
+}
+
+void ListingWriter::AppendChar(char c)
+{
+	if ( _used == LISTING_BUFFER_SIZE )
+		Flush();
+
+	_buffer[_used++] = c;
+}
+
+void ListingWriter::AppendHex(DWORD value, int digits)
+{
+	char text[8];
+
+	for (int i = digits - 1; i >= 0; i--, value >>= 4)
+		text[i] = hexDigits[value & 0xF];
+
+	Append(text, digits);
+}
+
+// IL_ and an offset, as wide as the method's largest; a branch out of
+// the body may need more
+void ListingWriter::AppendLabel(DWORD offset)
+{
+	Append("IL_");
+	AppendHex(offset, (offset > 0xFFFF) ? 8 : _labelDigits);
+}
+
+void ListingWriter::AppendDecimal(LONGLONG value)
+{
+	char text[24];
+	int i = sizeof(text);
+	ULONGLONG magnitude = (value < 0) ? (ULONGLONG)-value : (ULONGLONG)value;
+
+	do
+    {
+		text[--i] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	}
+	while ( magnitude != 0 );
+
+	if ( value < 0 )
+		text[--i] = '-';
+
+	Append(text + i, sizeof(text) - i);
+}
+
+void ListingWriter::AppendTypeName(const TypeName& name)
+{
+	if ( *name.nameSpace )
+    {
+		Append(name.nameSpace);
+		AppendChar('.');
+	}
+
+	Append(name.name);
+}
+
+// a type or member by name, or by token if it has none to show
+void ListingWriter::AppendToken(mdToken tok)
+{
+	TypeName typeName;
+	LPCSTR memberName = NULL;
+	mdToken parent = mdTokenNil;
+
+	switch ( TypeFromToken(tok) )
+    {
+		case mdtTypeDef:
+		case mdtTypeRef:
+			if ( SUCCEEDED(_tables->GetTypeName(tok, &typeName)) && !typeName.IsEmpty() )
+            {
+				AppendTypeName(typeName);
+				return;
+			}
+			break;
+
+		case mdtMethodDef:
+		case mdtFieldDef:
+			if ( SUCCEEDED(_tables->GetMemberName(tok, &memberName)) )
+				_tables->GetMemberParent(tok, &parent);
+			break;
+
+		case mdtMemberRef:
+			_tables->GetMemberRefProps(tok, &parent, &memberName, NULL, NULL);
+			break;
+	}
+
+	if ( NULL == memberName )
+    {
+		Append("0x");
+		AppendHex(tok, 8);
+		return;
+	}
+
+	// the parent of a generic instance member is a TypeSpec, shown by token
+	if ( !IsNilToken(parent) )
+    {
+		if ( TypeFromToken(parent) == mdtTypeSpec || FAILED(_tables->GetTypeName(parent, &typeName)) || typeName.IsEmpty() )
+        {
+			Append("0x");
+			AppendHex(parent, 8);
+		}
+        else
+			AppendTypeName(typeName);
+
+		Append("::");
+	}
+
+	Append(memberName);
+}
+
+void ListingWriter::AppendOperand(const ILInstruction& instr)
+{
+	const BYTE* operand = instr.operand;
+	char text[32];
+
+	switch ( instr.format )
+    {
+		case InlineNone:
+			break;
+
+		case ShortInlineVar:
+			AppendDecimal(operand[0]);
+			break;
+
+		case ShortInlineI:
+			AppendDecimal((signed char)operand[0]);
+			break;
+
+		case InlineVar:
+			AppendDecimal(operand[0] | (operand[1] << 8));
+			break;
+
+		case InlineI:
+			AppendDecimal((LONG)GET_UNALIGNED_DWORD(operand));
+			break;
+
+		case InlineI8:
+			Append("0x");
+			AppendHex(GET_UNALIGNED_DWORD(operand + 4), 8);
+			AppendHex(GET_UNALIGNED_DWORD(operand), 8);
+			break;
+
+		case ShortInlineR:
+        {
+			float value;
+			memcpy(&value, operand, sizeof(value));
+			_snprintf(text, sizeof(text) - 1, "%.9g", (double)value);
+			text[sizeof(text) - 1] = '\0';
+			Append(text);
+			break;
+		}
+
+		case InlineR:
+        {
+			double value;
+			memcpy(&value, operand, sizeof(value));
+			_snprintf(text, sizeof(text) - 1, "%.17g", value);
+			text[sizeof(text) - 1] = '\0';
+			Append(text);
+			break;
+		}
+
+		case ShortInlineBrTarget:
+		case InlineBrTarget:
+			AppendLabel(instr.target);
+			break;
+
+		case InlineSwitch:
+			AppendChar('(');
+			for (DWORD n = 0; n < instr.numTargets; n++)
+            {
+				if ( n > 0 )
+					Append(", ");
+				AppendLabel(SwitchTarget(instr, n));
+			}
+			AppendChar(')');
+			break;
+
+		case InlineMethod:
+		case InlineField:
+			// the policy checks resolved the references to other assemblies
+			if ( NULL != instr.memberName )
+            {
+				AppendTypeName(instr.className);
+				Append("::");
+				Append(instr.memberName);
+			}
+            else
+				AppendToken(instr.token);
+			break;
+
+		case InlineType:
+		case InlineTok:
+			AppendToken(GET_UNALIGNED_DWORD(operand));
+			break;
+
+		default:
+			// strings, signatures and RVAs by token
+			Append("0x");
+			AppendHex(GET_UNALIGNED_DWORD(operand), 8);
+			break;
+	}
+}
+
+void ListingWriter::WriteViolation(const Violation& violation)
+{
+	Append(_inBody ? "    // error " : "// error ");
+	Append(violation.id);
+
+	if ( *violation.container )
+    {
+		Append(" in ");
+		Append(violation.container);
+	}
+
+	if ( violation.offset != LISTING_NO_OFFSET )
+    {
+		Append(" at ");
+		AppendLabel(violation.offset);
+	}
+
+	if ( !violation.detail.IsEmpty() )
+    {
+		Append(": ");
+		AppendTypeName(violation.detail);
+	}
+
+	AppendChar('\n');
+}
+
+void ListingWriter::AddViolation(DWORD offset, LPCSTR id, LPCSTR container, const TypeName& detail)
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	Violation violation;
+	violation.offset = offset;
+	violation.id = id;
+	violation.container = (NULL != container) ? container : "";
+	violation.detail = detail;
+
+	// goes under its instruction, once that is written
+	if ( _inBody && offset != LISTING_NO_OFFSET && offset >= _written )
+		_pending.push_back(violation);
+	else
+		WriteViolation(violation);
+}
+
+void ListingWriter::BeginAssembly(LPCWSTR path)
+{
+	char name[MAX_PATH * 3];
+
+	_used = 0;
+	_failed = false;
+	_inBody = false;
+	_pending.clear();
+
+	if ( NULL == _path )
+		return;
+
+	_file = CreateFileW(_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if ( _file == INVALID_HANDLE_VALUE )
+    {
+		_failed = true;
+		return;
+	}
+
+	_buffer.resize(LISTING_BUFFER_SIZE);
+
+	Append("// asmcheck listing of ");
+	if ( 0 == WideCharToMultiByte(CP_UTF8, 0, path, -1, name, sizeof(name), NULL, NULL) )
+		name[0] = '\0';
+	Append(name);
+	AppendChar('\n');
+}
+
+void ListingWriter::EndAssembly(int errorCount)
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	if ( 0 == errorCount )
+		Append("// passed\n");
+	else
+    {
+		Append("// failed, ");
+		AppendDecimal(errorCount);
+		Append(" errors\n");
+	}
+
+	Flush();
+	CloseHandle(_file);
+	_file = INVALID_HANDLE_VALUE;
+
+	std::vector<char>().swap(_buffer);
+}
+
+void ListingWriter::BeginType(mdTypeDef /* tok */, const TypeName& name, DWORD /* flags */, mdToken /* baseTok */)
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	Append("\n.class ");
+	if ( name.IsEmpty() )
+		Append("<Module>");
+	else
+		AppendTypeName(name);
+	AppendChar('\n');
+}
+
+void ListingWriter::VisitField(mdFieldDef /* tok */, LPCSTR name, DWORD /* attrs */, PCCOR_SIGNATURE /* sig */, ULONG /* sigSize */)
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	Append("  .field ");
+	Append(name);
+	AppendChar('\n');
+}
+
+void ListingWriter::BeginMethod(const ILMethod& method)
+{
+	if ( _file == INVALID_HANDLE_VALUE )
+		return;
+
+	Append("  .method ");
+	Append(method.name);
+
+	if ( NULL == method.code || NULL == method.header )
+    {
+		Append("  // no body\n");
+		return;
+	}
+
+	Append("  // ");
+	AppendDecimal(method.codeSize);
+	Append(" bytes, maxstack ");
+	AppendDecimal(method.header->MaxStack);
+	AppendChar('\n');
+
+	_inBody = true;
+	_written = 0;
+	_labelDigits = (method.codeSize > 0xFFFF) ? 8 : 4;
+}
+
+void ListingWriter::EndMethod(const ILMethod& /* method */)
+{
+	if ( _file == INVALID_HANDLE_VALUE || !_inBody )
+		return;
+
+	// found at an instruction the walk never got to, or after it
+	for (size_t i = 0; i < _pending.size(); i++)
+		WriteViolation(_pending[i]);
+
+	_pending.clear();
+	_inBody = false;
+}
+
+void ListingWriter::VisitInstruction(const ILInstruction& instr)
+{
+	if ( _file == INVALID_HANDLE_VALUE || !_inBody )
+		return;
+
+	Append("    ");
+	AppendLabel(instr.offset);
+	Append(": ");
+
+	LPCSTR name = (instr.opcode < CEE_COUNT) ? OpcodeInfo[instr.opcode].pszName : "unknown";
+	size_t length = strlen(name);
+	Append(name, length);
+
+	if ( instr.format != InlineNone )
+    {
+		do
+			AppendChar(' ');
+		while ( ++length < LISTING_OPCODE_WIDTH );
+
+		AppendOperand(instr);
+	}
+
+	AppendChar('\n');
+	_written = instr.offset + instr.length;
+
+	if ( _pending.empty() )
+		return;
+
+	size_t kept = 0;
+	for (size_t i = 0; i < _pending.size(); i++)
+    {
+		if ( _pending[i].offset < _written )
+			WriteViolation(_pending[i]);
+		else
+			_pending[kept++] = _pending[i];
+	}
+	_pending.resize(kept);
+}
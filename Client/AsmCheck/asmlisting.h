@@ -0,0 +1,90 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmlisting.h : IL listing of a validated assembly, for moderators
+// looking into why an organism was turned away.  Every method body is
+// written out with its operands resolved to names, and every violation
+// the validator reports is written where it was found.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+
+#include "asmvisitor.h"
+
+#define LISTING_BUFFER_SIZE (256 * 1024)    // bytes gathered per WriteFile
+#define LISTING_NO_OFFSET   0xFFFFFFFF      // a violation outside any method body
+#define LISTING_OPCODE_WIDTH 11             // opcode column, as ildasm lays it out
+
+// Written from the decode pass as a visitor, through one large buffer;
+// formatting is done by hand rather than through the CRT so a listing
+// costs little more than the validation itself.  The file is created
+// by BeginAssembly and closed by EndAssembly.
+class ListingWriter : public AssemblyVisitor {
+private:
+	// a violation at an instruction not written yet
+	struct Violation {
+		DWORD offset;
+		LPCSTR id;
+		LPCSTR container;
+		TypeName detail;
+	};
+
+	MetaDataTables* _tables;
+	LPCWSTR _path;
+	HANDLE _file;
+	std::vector<char> _buffer;
+	DWORD _used;
+	bool _failed;               // a write failed, the rest is dropped
+	bool _inBody;
+	DWORD _written;             // end of the last instruction written
+	int _labelDigits;           // hex digits in an IL_ label, 8 for a body over 64KB
+	std::vector<Violation> _pending;
+
+	void Flush();
+	void AppendSpilling(LPCSTR s, size_t length);
+	void Append(LPCSTR s, size_t length) {
+		// nearly every piece fits in what is left of the buffer
+		if ( length <= LISTING_BUFFER_SIZE - _used )
+        {
+			memcpy(&_buffer[_used], s, length);
+			_used += (DWORD)length;
+		}
+		else
+			AppendSpilling(s, length);
+	}
+	void Append(LPCSTR s) { Append(s, strlen(s)); }
+	void AppendChar(char c);
+	void AppendHex(DWORD value, int digits);
+	void AppendLabel(DWORD offset);
+	void AppendDecimal(LONGLONG value);
+	void AppendTypeName(const TypeName& name);
+	void AppendToken(mdToken tok);
+	void AppendOperand(const ILInstruction& instr);
+	void WriteViolation(const Violation& violation);
+
+public:
+	ListingWriter();
+	~ListingWriter();
+
+	void SetTables(MetaDataTables* tables) { _tables = tables; }
+	void SetFile(LPCWSTR path) { _path = path; }
+	bool Failed() { return _failed; }
+
+	// id names the ErrorContext; offset is where in the current method
+	// body it was found, LISTING_NO_OFFSET for a violation of a type or
+	// member as a whole
+	void AddViolation(DWORD offset, LPCSTR id, LPCSTR container, const TypeName& detail);
+
+	virtual DWORD GetEvents();
+	virtual void BeginAssembly(LPCWSTR path);
+	virtual void EndAssembly(int errorCount);
+	virtual void BeginType(mdTypeDef tok, const TypeName& name, DWORD flags, mdToken baseTok);
+	virtual void VisitField(mdFieldDef tok, LPCSTR name, DWORD attrs, PCCOR_SIGNATURE sig, ULONG sigSize);
+	virtual void BeginMethod(const ILMethod& method);
+	virtual void EndMethod(const ILMethod& method);
+	virtual void VisitInstruction(const ILInstruction& instr);
+};
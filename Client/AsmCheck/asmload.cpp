@@ -0,0 +1,95 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmload.cpp : mapping assemblies and faulting them in
+//
+
+#include "stdafx.h"
+#include "asmload.h"
+
+bool MapImage(LPCWSTR name, MappedImage* image)
+{
+	image->file = INVALID_HANDLE_VALUE;
+	image->map = NULL;
+	image->view = NULL;
+	image->size = 0;
+
+	// the validator reads the file front to back once, so ask for
+	// aggressive read-ahead instead of the default random access
+	if ( !IsWin9x() )
+    {
+		image->file = CreateFileW(name, GENERIC_READ, FILE_SHARE_READ,
+								  0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	}
+    else
+    {
+		size_t len = wcslen(name);
+		LPSTR ansiName = new char[ len + 1 ];
+		wcstombs(ansiName, name, len);
+		ansiName[len] = '\0';
+
+		image->file = CreateFileA(ansiName, GENERIC_READ, FILE_SHARE_READ,
+								  0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+
+		delete [] ansiName;
+	}
+
+	if ( image->file == INVALID_HANDLE_VALUE )
+		return false;
+
+	image->map = CreateFileMappingA(image->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if ( image->map != NULL )
+    {
+		image->view = (const BYTE*)MapViewOfFile(image->map, FILE_MAP_READ, 0, 0, 0);
+		image->size = GetFileSize(image->file, NULL);
+	}
+
+	if ( NULL == image->view )
+    {
+		UnmapImage(image);
+		return false;
+	}
+
+	return true;
+}
+
+void UnmapImage(MappedImage* image)
+{
+	if ( NULL != image->view )
+    {
+		UnmapViewOfFile(image->view);
+		image->view = NULL;
+	}
+	if ( NULL != image->map )
+    {
+		CloseHandle(image->map);
+		image->map = NULL;
+	}
+	if ( image->file != INVALID_HANDLE_VALUE )
+    {
+		CloseHandle(image->file);
+		image->file = INVALID_HANDLE_VALUE;
+	}
+	image->size = 0;
+}
+
+bool PrefaultImage(const MappedImage& image)
+{
+	volatile BYTE sink = 0;
+	bool success = true;
+
+	__try
+    {
+		for (DWORD offset = 0; offset < image.size; offset += PREFETCH_STRIDE)
+			sink ^= image.view[offset];
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+    {
+		// a read error on the file; the validator will hit it again
+		// and fail the assembly
+		success = false;
+	}
+
+	return success;
+}
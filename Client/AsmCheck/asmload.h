@@ -0,0 +1,38 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmload.h : opening and mapping assemblies, and paging them in ahead
+// of the validator.
+//
+
+#pragma once
+#pragma unmanaged
+
+// files of a batch mapped ahead of the validator when the caller
+// doesn't say
+#define DEFAULT_PREFETCH_DEPTH  4
+#define MAX_PREFETCH_DEPTH      32
+
+// distance between the bytes touched to fault an image in
+#define PREFETCH_STRIDE         4096
+
+// defined in asmcheck.cpp
+bool IsWin9x();
+
+// a read-only view of a whole file
+struct MappedImage {
+	HANDLE file;
+	HANDLE map;
+	const BYTE* view;       // NULL if the file couldn't be mapped
+	DWORD size;
+};
+
+// Opens name for sequential reading and maps all of it.  On failure
+// nothing is left open and image->view is NULL.
+bool MapImage(LPCWSTR name, MappedImage* image);
+void UnmapImage(MappedImage* image);
+
+// Touches the image front to back so read-ahead brings it in as one
+// sequential read.  Returns false if paging it in failed.
+bool PrefaultImage(const MappedImage& image);
@@ -0,0 +1,290 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmmetrics.cpp : process lifetime counters and the Prometheus writer
+//
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <intrin.h>
+#include "asmcheckapi.h"
+#include "asmmetrics.h"
+
+// the intrinsic works on every target, unlike the kernel32 export
+#pragma intrinsic(_InterlockedCompareExchange64)
+
+ValidatorMetrics g_metrics;
+
+void InterlockedAdd64(volatile LONGLONG* target, LONGLONG value)
+{
+	LONGLONG current, previous = *target;
+
+	do
+    {
+		current = previous;
+		previous = _InterlockedCompareExchange64(target, current + value, current);
+	} while ( previous != current );
+}
+
+// Reads a 64 bit counter in one piece on 32 bit platforms
+static LONGLONG ReadCounter64(volatile LONGLONG* target)
+{
+	return _InterlockedCompareExchange64(target, 0, 0);
+}
+
+static void Append(std::string& out, LPCSTR format, ...)
+{
+	char line[256];
+	va_list args;
+
+	va_start(args, format);
+	int len = _vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+
+	if ( len < 0 )
+		len = sizeof(line) - 1;
+	line[len] = '\0';
+	out += line;
+}
+
+////////////////////////////////////
+// Histogram
+
+int Histogram::BucketOf(ULONGLONG value)
+{
+	// values below HISTOGRAM_SUB_BUCKETS get a bucket each
+	if ( value < HISTOGRAM_SUB_BUCKETS )
+		return (int)value;
+
+	int bits = 0;
+	for (ULONGLONG v = value; v > 1; v >>= 1)
+		bits++;
+
+	if ( bits > HISTOGRAM_MAX_BITS )
+		return HISTOGRAM_BUCKETS - 1;
+
+	// the HISTOGRAM_SUB_BITS bits below the top one pick the step
+	int step = (int)(value >> (bits - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return (bits - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + step;
+}
+
+// largest value that falls into bucket
+ULONGLONG Histogram::UpperBound(int bucket)
+{
+	if ( bucket < HISTOGRAM_SUB_BUCKETS )
+		return (ULONGLONG)bucket;
+
+	int bits = bucket / HISTOGRAM_SUB_BUCKETS - 1 + HISTOGRAM_SUB_BITS;
+	int step = bucket % HISTOGRAM_SUB_BUCKETS;
+	ULONGLONG width = (ULONGLONG)1 << (bits - HISTOGRAM_SUB_BITS);
+
+	return ((ULONGLONG)1 << bits) + (step + 1) * width - 1;
+}
+
+void Histogram::Record(ULONGLONG value)
+{
+	InterlockedIncrement(&_buckets[BucketOf(value)]);
+	InterlockedAdd64(&_sum, (LONGLONG)value);
+}
+
+// Writes cumulative buckets up to the highest one in use, so the
+// series stays small for the values actually seen.  The counters are
+// read one at a time, so a scrape racing a validation can be off by
+// that validation.
+void Histogram::Write(std::string& out, LPCSTR name, double scale)
+{
+	Append(out, "# TYPE %s histogram\n", name);
+	WriteSeries(out, name, NULL, scale);
+}
+
+void Histogram::WriteSeries(std::string& out, LPCSTR name, LPCSTR labels, double scale)
+{
+	int last = -1;
+	for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+		if ( _buckets[b] != 0 )
+			last = b;
+	}
+
+	// labels of _sum and _count, and the ones le is added to
+	std::string series, bucketLabels;
+	if ( NULL != labels )
+    {
+		series = std::string("{") + labels + "}";
+		bucketLabels = std::string(labels) + ",";
+	}
+
+	// the count is taken from the buckets so the series stays consistent
+	ULONG cumulative = 0;
+	for (int b = 0; b <= last; b++)
+    {
+		cumulative += (ULONG)_buckets[b];
+		Append(out, "%s_bucket{%sle=\"%.9g\"} %lu\n", name, bucketLabels.c_str(), (double)UpperBound(b) / scale, cumulative);
+	}
+
+	Append(out, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, bucketLabels.c_str(), cumulative);
+	Append(out, "%s_sum%s %.9g\n", name, series.c_str(), (double)ReadCounter64(&_sum) / scale);
+	Append(out, "%s_count%s %lu\n", name, series.c_str(), cumulative);
+}
+
+////////////////////////////////////
+// ValidatorMetrics
+
+// contexts is a mask of the error contexts the assembly was flagged for
+void ValidatorMetrics::RecordValidation(DWORD verdict, ULONGLONG micros, ULONG bytes, DWORD contexts)
+{
+	if ( verdict < ASMCHECK_VERDICT_COUNT )
+		InterlockedIncrement(&_verdicts[verdict]);
+	InterlockedAdd64(&_bytesScanned, bytes);
+
+	for (int ctx = 0; ctx < METRIC_MAX_CONTEXTS; ctx++)
+    {
+		if ( contexts & (1 << ctx) )
+			InterlockedIncrement(&_flaggedBy[ctx]);
+	}
+
+	_latency.Record(micros);
+	_fileSize.Record(bytes);
+}
+
+void ValidatorMetrics::RecordError(int context)
+{
+	if ( context >= 0 && context < METRIC_MAX_CONTEXTS )
+		InterlockedIncrement(&_errorsBy[context]);
+}
+
+void ValidatorMetrics::RecordCache(MetricCache cache, bool hit)
+{
+	InterlockedIncrement(hit ? &_cacheHits[cache] : &_cacheMisses[cache]);
+}
+
+void ValidatorMetrics::RecordWait(int priority, ULONGLONG micros)
+{
+	if ( priority >= 0 && priority < METRIC_PRIORITY_CLASSES )
+		_waitTime[priority].Record(micros);
+}
+
+void ValidatorMetrics::RecordRequest(int priority, ULONGLONG micros)
+{
+	if ( priority >= 0 && priority < METRIC_PRIORITY_CLASSES )
+		_requestTime[priority].Record(micros);
+}
+
+// one assembly through one stage of a batch pipeline
+void ValidatorMetrics::RecordStage(int stage, ULONGLONG micros)
+{
+	if ( stage >= 0 && stage < METRIC_PIPELINE_STAGES )
+    {
+		InterlockedAdd64(&_stageBusy[stage], (LONGLONG)micros);
+		InterlockedIncrement(&_stageItems[stage]);
+	}
+}
+
+// gauges, summed over the batches running at once
+void ValidatorMetrics::AddStageThreads(int stage, LONG delta)
+{
+	if ( stage >= 0 && stage < METRIC_PIPELINE_STAGES )
+		InterlockedExchangeAdd(&_stageThreads[stage], delta);
+}
+
+void ValidatorMetrics::AddQueueDepth(int stage, LONG delta)
+{
+	if ( stage >= 0 && stage < METRIC_PIPELINE_STAGES )
+		InterlockedExchangeAdd(&_queueDepth[stage], delta);
+}
+
+void ValidatorMetrics::Write(std::string& out, const LPCSTR* contextNames, int contextCount)
+{
+	static const LPCSTR verdictNames[ASMCHECK_VERDICT_COUNT] = {
+		NULL,
+		"pass",
+		"fail",
+		"timed_out",
+		"cancelled"
+	};
+	static const LPCSTR cacheNames[MetricCacheCount] = {
+		"token",
+		"method_index"
+	};
+
+	if ( contextCount > METRIC_MAX_CONTEXTS )
+		contextCount = METRIC_MAX_CONTEXTS;
+
+	Append(out, "# HELP asmcheck_validations_total Assemblies validated, by verdict.\n");
+	Append(out, "# TYPE asmcheck_validations_total counter\n");
+	for (int v = ASMCHECK_VERDICT_PASSED; v < ASMCHECK_VERDICT_COUNT; v++)
+		Append(out, "asmcheck_validations_total{verdict=\"%s\"} %lu\n", verdictNames[v], (ULONG)_verdicts[v]);
+
+	Append(out, "# HELP asmcheck_flagged_total Assemblies flagged at least once for an error context.\n");
+	Append(out, "# TYPE asmcheck_flagged_total counter\n");
+	for (int ctx = 0; ctx < contextCount; ctx++)
+		Append(out, "asmcheck_flagged_total{context=\"%s\"} %lu\n", contextNames[ctx], (ULONG)_flaggedBy[ctx]);
+
+	Append(out, "# HELP asmcheck_errors_total Errors reported, by error context.\n");
+	Append(out, "# TYPE asmcheck_errors_total counter\n");
+	for (int ctx = 0; ctx < contextCount; ctx++)
+		Append(out, "asmcheck_errors_total{context=\"%s\"} %lu\n", contextNames[ctx], (ULONG)_errorsBy[ctx]);
+
+	Append(out, "# HELP asmcheck_cache_lookups_total Cache lookups, by cache and result.\n");
+	Append(out, "# TYPE asmcheck_cache_lookups_total counter\n");
+	for (int c = 0; c < MetricCacheCount; c++)
+    {
+		Append(out, "asmcheck_cache_lookups_total{cache=\"%s\",result=\"hit\"} %lu\n", cacheNames[c], (ULONG)_cacheHits[c]);
+		Append(out, "asmcheck_cache_lookups_total{cache=\"%s\",result=\"miss\"} %lu\n", cacheNames[c], (ULONG)_cacheMisses[c]);
+	}
+
+	Append(out, "# HELP asmcheck_scanned_bytes_total Bytes of assembly images validated.\n");
+	Append(out, "# TYPE asmcheck_scanned_bytes_total counter\n");
+	Append(out, "asmcheck_scanned_bytes_total %I64u\n", (ULONGLONG)ReadCounter64(&_bytesScanned));
+
+	Append(out, "# HELP asmcheck_validation_seconds Time spent validating one assembly.\n");
+	_latency.Write(out, "asmcheck_validation_seconds", 1000000.0);
+
+	static const LPCSTR priorityLabels[METRIC_PRIORITY_CLASSES] = {
+		"priority=\"interactive\"",
+		"priority=\"bulk\""
+	};
+
+	Append(out, "# HELP asmcheck_queue_wait_seconds Time a validation waited for a scheduler slot, by priority.\n");
+	Append(out, "# TYPE asmcheck_queue_wait_seconds histogram\n");
+	for (int p = 0; p < METRIC_PRIORITY_CLASSES; p++)
+		_waitTime[p].WriteSeries(out, "asmcheck_queue_wait_seconds", priorityLabels[p], 1000000.0);
+
+	Append(out, "# HELP asmcheck_request_seconds Time from asking for a validation to its verdict, by priority.\n");
+	Append(out, "# TYPE asmcheck_request_seconds histogram\n");
+	for (int p = 0; p < METRIC_PRIORITY_CLASSES; p++)
+		_requestTime[p].WriteSeries(out, "asmcheck_request_seconds", priorityLabels[p], 1000000.0);
+
+	Append(out, "# HELP asmcheck_assembly_bytes Size of the assemblies validated.\n");
+	_fileSize.Write(out, "asmcheck_assembly_bytes", 1.0);
+
+	// a stage's busy time over its threads is how much of them it uses
+	static const LPCSTR stageNames[METRIC_PIPELINE_STAGES] = {
+		"load",
+		"validate",
+		"retire"
+	};
+
+	Append(out, "# HELP asmcheck_stage_busy_seconds_total Time batch pipeline threads spent working, by stage.\n");
+	Append(out, "# TYPE asmcheck_stage_busy_seconds_total counter\n");
+	for (int s = 0; s < METRIC_PIPELINE_STAGES; s++)
+		Append(out, "asmcheck_stage_busy_seconds_total{stage=\"%s\"} %.6f\n", stageNames[s], (double)ReadCounter64(&_stageBusy[s]) / 1000000.0);
+
+	Append(out, "# HELP asmcheck_stage_assemblies_total Assemblies through a batch pipeline stage, by stage.\n");
+	Append(out, "# TYPE asmcheck_stage_assemblies_total counter\n");
+	for (int s = 0; s < METRIC_PIPELINE_STAGES; s++)
+		Append(out, "asmcheck_stage_assemblies_total{stage=\"%s\"} %lu\n", stageNames[s], (ULONG)_stageItems[s]);
+
+	Append(out, "# HELP asmcheck_stage_threads Batch pipeline threads running, by stage.\n");
+	Append(out, "# TYPE asmcheck_stage_threads gauge\n");
+	for (int s = 0; s < METRIC_PIPELINE_STAGES; s++)
+		Append(out, "asmcheck_stage_threads{stage=\"%s\"} %ld\n", stageNames[s], (LONG)_stageThreads[s]);
+
+	// the first stage reads the batch itself, nothing queues for it
+	Append(out, "# HELP asmcheck_stage_queue_depth Assemblies waiting for a batch pipeline stage, by stage.\n");
+	Append(out, "# TYPE asmcheck_stage_queue_depth gauge\n");
+	for (int s = 1; s < METRIC_PIPELINE_STAGES; s++)
+		Append(out, "asmcheck_stage_queue_depth{stage=\"%s\"} %ld\n", stageNames[s], (LONG)_queueDepth[s]);
+}
@@ -0,0 +1,101 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmmetrics.h : counters and histograms kept for the life of the process
+// and written out in the Prometheus text exposition format.  Everything
+// is updated with interlocked operations, so recording never blocks a
+// validation running on another thread.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <string>
+
+// error contexts that can be counted; ErrorContext has fewer
+#define METRIC_MAX_CONTEXTS 32
+
+// scheduler priority classes, see PriorityClass
+#define METRIC_PRIORITY_CLASSES 2
+
+// batch pipeline stages, see PipelineStage
+#define METRIC_PIPELINE_STAGES 3
+
+// Log-linear buckets: every power of two is split into
+// HISTOGRAM_SUB_BUCKETS steps, which keeps the relative error of a
+// bucket bound under 1 / HISTOGRAM_SUB_BUCKETS at any magnitude.
+#define HISTOGRAM_SUB_BITS      2
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS      40
+#define HISTOGRAM_BUCKETS       ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+class Histogram {
+private:
+	volatile LONG _buckets[HISTOGRAM_BUCKETS];
+	volatile LONGLONG _sum;
+
+public:
+	static int BucketOf(ULONGLONG value);
+	static ULONGLONG UpperBound(int bucket);
+
+	void Record(ULONGLONG value);
+
+	// scale divides the bounds and the sum, e.g. 1000000 for
+	// microseconds written out as seconds
+	void Write(std::string& out, LPCSTR name, double scale);
+
+	// one labeled series of a family whose TYPE line is written by the
+	// caller; labels are "name=\"value\"" pairs
+	void WriteSeries(std::string& out, LPCSTR name, LPCSTR labels, double scale);
+};
+
+enum MetricCache {
+	TokenCache = 0,         // base class checks by TypeDef token
+	MethodIndexCache,       // method bodies by fingerprint
+	MetricCacheCount
+};
+
+// Lives in zero-initialized static storage; there is no constructor
+// so it is usable from DllMain onwards.
+class ValidatorMetrics {
+private:
+	volatile LONG _verdicts[ASMCHECK_VERDICT_COUNT];
+	volatile LONG _flaggedBy[METRIC_MAX_CONTEXTS];
+	volatile LONG _errorsBy[METRIC_MAX_CONTEXTS];
+	volatile LONG _cacheHits[MetricCacheCount];
+	volatile LONG _cacheMisses[MetricCacheCount];
+	volatile LONGLONG _bytesScanned;
+
+	Histogram _latency;         // microseconds
+	Histogram _fileSize;        // bytes
+
+	// by priority class, microseconds
+	Histogram _waitTime[METRIC_PRIORITY_CLASSES];       // for a scheduler slot
+	Histogram _requestTime[METRIC_PRIORITY_CLASSES];    // waiting and validating
+
+	// by batch pipeline stage
+	volatile LONGLONG _stageBusy[METRIC_PIPELINE_STAGES];   // microseconds
+	volatile LONG _stageItems[METRIC_PIPELINE_STAGES];
+	volatile LONG _stageThreads[METRIC_PIPELINE_STAGES];    // running now
+	volatile LONG _queueDepth[METRIC_PIPELINE_STAGES];      // waiting in front of it now
+
+public:
+	// verdict is one of ASMCHECK_VERDICT_*
+	void RecordValidation(DWORD verdict, ULONGLONG micros, ULONG bytes, DWORD contexts);
+	void RecordError(int context);
+	void RecordCache(MetricCache cache, bool hit);
+	void RecordWait(int priority, ULONGLONG micros);
+	void RecordRequest(int priority, ULONGLONG micros);
+	void RecordStage(int stage, ULONGLONG micros);
+	void AddStageThreads(int stage, LONG delta);
+	void AddQueueDepth(int stage, LONG delta);
+
+	// contextNames holds a label value for every error context
+	void Write(std::string& out, const LPCSTR* contextNames, int contextCount);
+};
+
+extern ValidatorMetrics g_metrics;
+
+// 64 bit add for counters that outgrow a LONG
+void InterlockedAdd64(volatile LONGLONG* target, LONGLONG value);
@@ -0,0 +1,145 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmnames.cpp : the lock-free intern table for type names
+//
+
+#include "stdafx.h"
+#include <string.h>
+#include "asmcheckapi.h"
+#include "asmnames.h"
+
+NameTable g_names;
+
+// Carves a copy of fullName from the pool.  Space is never given back;
+// what a losing insert copied is reused for its next try.
+LPCSTR NameTable::CopyName(LPCSTR fullName)
+{
+	LONG length = (LONG)strlen(fullName) + 1;
+
+	// checked first so a full pool can't be pushed past LONG range
+	if ( _poolUsed > NAME_POOL_SIZE || length > NAME_POOL_SIZE )
+		return NULL;
+
+	LONG offset = InterlockedExchangeAdd(&_poolUsed, length);
+	if ( offset > NAME_POOL_SIZE - length )
+		return NULL;
+
+	memcpy(&_pool[offset], fullName, length);
+	return &_pool[offset];
+}
+
+// A slot whose name matched is being filled in by another thread; that
+// takes a few instructions unless the thread was preempted.
+ULONG NameTable::WaitForId(Slot& slot)
+{
+	LONG id;
+
+	while ( (id = slot.id) == NAME_ID_NONE )
+		SwitchToThread();
+
+	return (id == NAME_ID_DEAD) ? NAME_ID_NONE : (ULONG)id;
+}
+
+void NameTable::AddFlags(ULONG id, DWORD flags)
+{
+	LONG current, previous = _flags[id];
+
+	do
+    {
+		current = previous;
+		previous = InterlockedCompareExchange(&_flags[id], current | (LONG)flags, current);
+	} while ( previous != current );
+}
+
+ULONG NameTable::Intern(LPCSTR fullName, DWORD flags)
+{
+	unsigned long hash = StringHashA(fullName);
+	LPCSTR copy = NULL;
+	ULONG i = hash & (NAME_TABLE_SIZE - 1);
+
+	for (ULONG probes = 0; probes < NAME_TABLE_SIZE; probes++, i = (i + 1) & (NAME_TABLE_SIZE - 1))
+    {
+		Slot& slot = _slots[i];
+		LPCSTR name = slot.name;
+
+		if ( NULL == name )
+        {
+			if ( _ids >= NAME_TABLE_MAX_IDS )
+				return NAME_ID_NONE;
+
+			if ( NULL == copy && NULL == (copy = CopyName(fullName)) )
+				return NAME_ID_NONE;
+
+			name = (LPCSTR)InterlockedCompareExchangePointer((PVOID volatile*)&slot.name, (PVOID)copy, NULL);
+			if ( NULL == name )
+            {
+				// the slot is ours; its id is published last, which is
+				// what makes it visible to Find
+				LONG id = InterlockedIncrement(&_ids);
+				if ( id > NAME_TABLE_MAX_IDS )
+                {
+					InterlockedExchange(&slot.id, NAME_ID_DEAD);
+					return NAME_ID_NONE;
+				}
+
+				slot.hash = hash;
+				_flags[id] = (LONG)flags;
+				InterlockedExchange(&slot.id, id);
+				return (ULONG)id;
+			}
+		}
+
+		// a finished slot can be told apart by its hash
+		LONG id = slot.id;
+		if ( id != NAME_ID_NONE && slot.hash != hash )
+			continue;
+
+		if ( 0 == strcmp(name, fullName) )
+        {
+			ULONG found = WaitForId(slot);
+			if ( found != NAME_ID_NONE && flags != 0 )
+				AddFlags(found, flags);
+			return found;
+		}
+	}
+
+	return NAME_ID_NONE;
+}
+
+ULONG NameTable::Find(const TypeName& name) const
+{
+	unsigned long hash = name.Hash();
+	ULONG i = hash & (NAME_TABLE_SIZE - 1);
+
+	for (ULONG probes = 0; probes < NAME_TABLE_SIZE; probes++, i = (i + 1) & (NAME_TABLE_SIZE - 1))
+    {
+		const Slot& slot = _slots[i];
+		if ( NULL == slot.name )
+			break;
+
+		// the id is read first; once it is set, hash and name are too
+		LONG id = slot.id;
+		if ( id > NAME_ID_NONE && slot.hash == hash && name.Equals(slot.name) )
+			return (ULONG)id;
+	}
+
+	return NAME_ID_NONE;
+}
+
+DWORD NameTable::GetFlags(ULONG id) const
+{
+	if ( id == NAME_ID_NONE || id > NAME_TABLE_MAX_IDS )
+		return 0;
+
+	return (DWORD)_flags[id];
+}
+
+ULONG NameTable::GetCount() const
+{
+	LONG ids = _ids;
+
+	// inserts that lost to a full table still counted themselves
+	return (ULONG)((ids > NAME_TABLE_MAX_IDS) ? NAME_TABLE_MAX_IDS : ids);
+}
@@ -0,0 +1,65 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmnames.h : the process-wide table of interned type names.  The names
+// the validator checks organisms against are hashed and copied into it
+// once per process, not once per assembly, and every validation looks
+// them up in the same table.  Each name gets a small id that stays the
+// same for the life of the process, and NAME_FLAG_* bits saying what
+// the validator knows about it.
+//
+// The table only grows.  Lookups take no lock; an insert claims a slot
+// with one compare and exchange.  It is bounded, and Intern returns
+// NAME_ID_NONE once it is full, which callers treat as an unknown name.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include "mdtables.h"
+
+#define NAME_TABLE_SIZE     4096                    // slots, a power of two
+#define NAME_TABLE_MAX_IDS  (NAME_TABLE_SIZE / 2)   // kept at most half full
+#define NAME_POOL_SIZE      (128 * 1024)            // bytes of name text
+
+#define NAME_ID_NONE        0
+#define NAME_ID_DEAD        (-1)    // slot claimed after the table filled up
+
+#define NAME_FLAG_BANNED        0x00000001  // organisms may not use it or derive from it
+#define NAME_FLAG_ORGANISM_BASE 0x00000002  // classes derived from it must be public
+
+// Lives in static storage; zero filled, it is an empty table.
+class NameTable {
+private:
+	struct Slot {
+		LPCSTR volatile name;   // dotted full name in the pool, NULL while free
+		unsigned long hash;     // StringHashA of name, valid once id is set
+		volatile LONG id;       // NAME_ID_NONE until the insert has finished
+	};
+
+	Slot _slots[NAME_TABLE_SIZE];
+	volatile LONG _flags[NAME_TABLE_MAX_IDS + 1];   // by id
+	volatile LONG _ids;
+	volatile LONG _poolUsed;
+	char _pool[NAME_POOL_SIZE];
+
+	LPCSTR CopyName(LPCSTR fullName);
+	ULONG WaitForId(Slot& slot);
+	void AddFlags(ULONG id, DWORD flags);
+
+public:
+	// The id of a dotted full name, inserting it if it is new, with flags
+	// added to what is known about it.
+	ULONG Intern(LPCSTR fullName, DWORD flags = 0);
+
+	// The id of a name, NAME_ID_NONE if it was never interned.  Never
+	// waits; a name still being inserted by another thread isn't found.
+	ULONG Find(const TypeName& name) const;
+
+	DWORD GetFlags(ULONG id) const;
+	DWORD GetFlags(const TypeName& name) const { return GetFlags(Find(name)); }
+	ULONG GetCount() const;
+};
+
+extern NameTable g_names;
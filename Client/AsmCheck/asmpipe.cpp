@@ -0,0 +1,254 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmpipe.cpp : the batch pipeline and the queues between its stages
+//
+
+#include "stdafx.h"
+#include <process.h>
+#include "asmcheckapi.h"
+#include "asmmetrics.h"
+#include "asmpipe.h"
+
+static ULONGLONG ElapsedMicros(const LARGE_INTEGER& start)
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (ULONGLONG)(now.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+////////////////////////////////////
+// WorkQueue
+
+WorkQueue::WorkQueue()
+{
+	_capacity = 0;
+	_head = 0;
+	_tail = 0;
+	_items = NULL;
+	_spaces = NULL;
+	_metric = 0;
+}
+
+WorkQueue::~WorkQueue()
+{
+	Destroy();
+}
+
+bool WorkQueue::Create(ULONG capacity, int feeds)
+{
+	_capacity = 1;
+	while ( _capacity < capacity && _capacity < MAX_PREFETCH_DEPTH )
+		_capacity <<= 1;
+
+	_head = 0;
+	_tail = 0;
+	_metric = feeds;
+
+	// a cell is free for position p when its sequence is p, and
+	// filled when it is p + 1
+	for (ULONG i = 0; i < _capacity; i++)
+		_cells[i].sequence = (LONG)i;
+
+	_items = CreateSemaphoreW(NULL, 0, _capacity, NULL);
+	_spaces = CreateSemaphoreW(NULL, _capacity, _capacity, NULL);
+
+	if ( NULL == _items || NULL == _spaces )
+    {
+		Destroy();
+		return false;
+	}
+
+	return true;
+}
+
+void WorkQueue::Destroy()
+{
+	if ( NULL != _items )
+    {
+		CloseHandle(_items);
+		_items = NULL;
+	}
+	if ( NULL != _spaces )
+    {
+		CloseHandle(_spaces);
+		_spaces = NULL;
+	}
+}
+
+void WorkQueue::Push(ULONG value)
+{
+	WaitForSingleObject(_spaces, INFINITE);
+
+	LONG position = InterlockedIncrement(&_tail) - 1;
+	Cell& cell = _cells[(ULONG)position & (_capacity - 1)];
+
+	// the consumer of the lap before may not be done reading it
+	while ( cell.sequence != position )
+		SwitchToThread();
+
+	cell.value = value;
+	InterlockedExchange(&cell.sequence, position + 1);
+
+	g_metrics.AddQueueDepth(_metric, 1);
+	ReleaseSemaphore(_items, 1, NULL);
+}
+
+ULONG WorkQueue::Pop()
+{
+	WaitForSingleObject(_items, INFINITE);
+
+	LONG position = InterlockedIncrement(&_head) - 1;
+	Cell& cell = _cells[(ULONG)position & (_capacity - 1)];
+
+	// the count may have come from a producer of a later cell
+	while ( cell.sequence != position + 1 )
+		SwitchToThread();
+
+	ULONG value = cell.value;
+	InterlockedExchange(&cell.sequence, position + (LONG)_capacity);
+
+	g_metrics.AddQueueDepth(_metric, -1);
+	ReleaseSemaphore(_spaces, 1, NULL);
+	return value;
+}
+
+////////////////////////////////////
+// BatchPipeline
+
+static const ULONG defaultThreads[PipelineStageCount] = {
+	DEFAULT_LOAD_THREADS,
+	DEFAULT_VALIDATE_THREADS,
+	1                           // retiring is only bookkeeping
+};
+
+BatchPipeline::BatchPipeline()
+{
+	for (int s = 0; s < PipelineStageCount; s++)
+    {
+		_stages[s].pipeline = this;
+		_stages[s].number = s;
+		_stages[s].proc = NULL;
+		_stages[s].threads = defaultThreads[s];
+		_stages[s].taken = 0;
+	}
+
+	_count = 0;
+	_context = NULL;
+	_abort = 0;
+}
+
+void BatchPipeline::SetStage(PipelineStage stage, StageProc proc, ULONG threads)
+{
+	if ( threads == 0 )
+		threads = defaultThreads[stage];
+	if ( threads > MAX_STAGE_THREADS )
+		threads = MAX_STAGE_THREADS;
+
+	_stages[stage].proc = proc;
+	_stages[stage].threads = threads;
+}
+
+unsigned int __stdcall BatchPipeline::ThreadProc(void* context)
+{
+	Stage* stage = (Stage*)context;
+	stage->pipeline->RunStage(*stage);
+	return 0;
+}
+
+// Every assembly goes through a stage exactly once: a thread claims one
+// before taking it, and leaves once all of them are claimed.  The first
+// stage takes the batch in order, the others whatever the stage before
+// finished with.
+void BatchPipeline::RunStage(Stage& stage)
+{
+	if ( _abort )
+		return;
+
+	g_metrics.AddStageThreads(stage.number, 1);
+
+	for (;;)
+    {
+		LONG taken = InterlockedIncrement(&stage.taken);
+		if ( (ULONG)taken > _count )
+			break;
+
+		ULONG index = (stage.number == 0) ? (ULONG)taken - 1 : _queues[stage.number - 1].Pop();
+
+		LARGE_INTEGER start;
+		QueryPerformanceCounter(&start);
+		stage.proc(_context, index);
+		g_metrics.RecordStage(stage.number, ElapsedMicros(start));
+
+		if ( stage.number + 1 < PipelineStageCount )
+			_queues[stage.number].Push(index);
+	}
+
+	g_metrics.AddStageThreads(stage.number, -1);
+}
+
+bool BatchPipeline::Run(ULONG count, ULONG depth, void* context)
+{
+	HANDLE threads[PipelineStageCount * MAX_STAGE_THREADS];
+	ULONG started = 0;
+	bool complete = true;
+
+	if ( depth == 0 )
+		depth = DEFAULT_PREFETCH_DEPTH;
+
+	_count = count;
+	_context = context;
+	_abort = 0;
+
+	for (int s = 0; s < PipelineStageCount; s++)
+    {
+		if ( NULL == _stages[s].proc )
+			return false;
+		_stages[s].taken = 0;
+	}
+
+	for (int q = 0; q < PipelineStageCount - 1; q++)
+    {
+		if ( !_queues[q].Create(depth, q + 1) )
+			return false;
+	}
+
+	// started suspended, so a stage left without a thread calls the
+	// whole run off before anything is taken
+	for (int s = 0; s < PipelineStageCount; s++)
+    {
+		ULONG stageThreads = 0;
+		for (ULONG t = 0; t < _stages[s].threads; t++)
+        {
+			HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, &_stages[s], CREATE_SUSPENDED, NULL);
+			if ( NULL != thread )
+            {
+				threads[started++] = thread;
+				stageThreads++;
+			}
+		}
+
+		if ( 0 == stageThreads )
+			complete = false;
+	}
+
+	if ( !complete )
+		InterlockedExchange(&_abort, 1);
+
+	for (ULONG t = 0; t < started; t++)
+		ResumeThread(threads[t]);
+
+	// more threads than WaitForMultipleObjects takes at once
+	for (ULONG t = 0; t < started; t++)
+    {
+		WaitForSingleObject(threads[t], INFINITE);
+		CloseHandle(threads[t]);
+	}
+
+	for (int q = 0; q < PipelineStageCount - 1; q++)
+		_queues[q].Destroy();
+
+	return complete;
+}
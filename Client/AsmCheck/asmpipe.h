@@ -0,0 +1,95 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmpipe.h : the staged pipeline CheckAssemblyBatch runs a batch
+// through.  Each stage has its own threads and hands the position of an
+// assembly in the batch to the next stage through a bounded queue, so a
+// stage that falls behind holds up the ones before it instead of letting
+// mapped files pile up.  The stages are loading (mapping and faulting in
+// the file), validating and retiring (unmapping, gathering the verdict).
+//
+
+#pragma once
+#pragma unmanaged
+
+#include "asmload.h"
+
+enum PipelineStage {
+	LoadStage = 0,
+	ValidateStage,
+	RetireStage,
+	PipelineStageCount
+};
+
+// threads a stage gets when the caller doesn't say
+#define DEFAULT_LOAD_THREADS        1
+#define DEFAULT_VALIDATE_THREADS    1
+#define MAX_STAGE_THREADS           32
+
+// Bounded queue of batch positions for any number of producers and
+// consumers.  Slots are claimed with an interlocked increment and handed
+// over through a sequence number per cell, so neither side takes a lock;
+// the two semaphores only put a thread to sleep while the queue is full
+// or empty.
+class WorkQueue {
+private:
+	struct Cell {
+		volatile LONG sequence;
+		ULONG value;
+	};
+
+	Cell _cells[MAX_PREFETCH_DEPTH];
+	ULONG _capacity;            // a power of two
+	volatile LONG _head;        // next cell to take from
+	volatile LONG _tail;        // next cell to put into
+	HANDLE _items;              // counts cells filled
+	HANDLE _spaces;             // counts cells free
+	int _metric;                // the stage it feeds, for the depth gauge
+
+public:
+	WorkQueue();
+	~WorkQueue();
+
+	bool Create(ULONG capacity, int feeds);
+	void Destroy();
+
+	// block while the queue is full or empty
+	void Push(ULONG value);
+	ULONG Pop();
+};
+
+// one call per assembly of the batch, on one of the stage's threads
+typedef void (*StageProc)(void* context, ULONG index);
+
+class BatchPipeline {
+private:
+	struct Stage {
+		BatchPipeline* pipeline;
+		int number;
+		StageProc proc;
+		ULONG threads;
+		volatile LONG taken;    // assemblies claimed by its threads
+	};
+
+	Stage _stages[PipelineStageCount];
+	WorkQueue _queues[PipelineStageCount - 1];   // in front of every stage but the first
+	ULONG _count;
+	void* _context;
+	volatile LONG _abort;
+
+	static unsigned int __stdcall ThreadProc(void* context);
+	void RunStage(Stage& stage);
+
+public:
+	BatchPipeline();
+
+	// threads of 0 selects the default for the stage, depth of 0 the
+	// default prefetch depth
+	void SetStage(PipelineStage stage, StageProc proc, ULONG threads);
+
+	// Runs every assembly of the batch through every stage and returns
+	// once the last one is retired.  False, with nothing run, if the
+	// threads couldn't be started.
+	bool Run(ULONG count, ULONG depth, void* context);
+};
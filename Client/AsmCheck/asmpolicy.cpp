@@ -0,0 +1,535 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmpolicy.cpp : member keys and the allowlist table
+//
+
+#include "stdafx.h"
+#include <algorithm>
+#include <corerror.h>
+#include "mdtables.h"
+#include "asmpolicy.h"
+
+// fewest slots an allowlist is written with
+#define MIN_ALLOWLIST_CAPACITY  16
+
+// Reads a signature blob without running off its end.
+class SigReader {
+private:
+	PCCOR_SIGNATURE _pos;
+	PCCOR_SIGNATURE _end;
+
+public:
+	SigReader(PCCOR_SIGNATURE sig, ULONG size) : _pos(sig), _end(sig + size) {}
+
+	bool PeekByte(BYTE* b) {
+		if ( _pos >= _end )
+			return false;
+		*b = *_pos;
+		return true;
+	}
+
+	bool ReadByte(BYTE* b) {
+		if ( !PeekByte(b) )
+			return false;
+		_pos++;
+		return true;
+	}
+
+	// ECMA-335 II.23.2 compressed unsigned integer
+	bool ReadData(ULONG* value) {
+		BYTE b0, b1, b2, b3;
+
+		if ( !ReadByte(&b0) )
+			return false;
+
+		if ( (b0 & 0x80) == 0 )
+        {
+			*value = b0;
+			return true;
+		}
+
+		if ( !ReadByte(&b1) )
+			return false;
+
+		if ( (b0 & 0xC0) == 0x80 )
+        {
+			*value = ((ULONG)(b0 & 0x3F) << 8) | b1;
+			return true;
+		}
+
+		if ( (b0 & 0xE0) != 0xC0 || !ReadByte(&b2) || !ReadByte(&b3) )
+			return false;
+
+		*value = ((ULONG)(b0 & 0x1F) << 24) | ((ULONG)b1 << 16) | ((ULONG)b2 << 8) | b3;
+		return true;
+	}
+
+	// a TypeDefOrRefEncoded token
+	bool ReadToken(mdToken* tok) {
+		static const ULONG tokenTypes[] = { mdtTypeDef, mdtTypeRef, mdtTypeSpec };
+		ULONG value;
+
+		if ( !ReadData(&value) || (value & 3) == 3 )
+			return false;
+
+		*tok = TokenFromRid(value >> 2, tokenTypes[value & 3]);
+		return true;
+	}
+};
+
+static bool KeyType(MetaDataTables& tables, SigReader& reader, MemberKey& key, int depth);
+
+// Type names go in after the types they are nested in, TypeSpecs as
+// their keyed signature.
+static bool KeyTypeName(MetaDataTables& tables, mdToken tok, MemberKey& key, int depth)
+{
+	if ( depth > MAX_SIGNATURE_DEPTH )
+		return false;
+
+	if ( TypeFromToken(tok) == mdtTypeSpec )
+    {
+		PCCOR_SIGNATURE sig;
+		ULONG sigSize;
+
+		if ( FAILED(tables.GetTypeSpec(tok, &sig, &sigSize)) )
+			return false;
+
+		SigReader reader(sig, sigSize);
+		return KeyType(tables, reader, key, depth + 1);
+	}
+
+	mdToken enclosing;
+	HRESULT hr = tables.GetEnclosingType(tok, &enclosing);
+	if ( FAILED(hr) )
+		return false;
+
+	if ( hr == S_OK )
+    {
+		if ( !KeyTypeName(tables, enclosing, key, depth + 1) )
+			return false;
+		key.AddByte('/');
+	}
+
+	TypeName name;
+	if ( FAILED(tables.GetTypeName(tok, &name)) )
+		return false;
+
+	key.AddString(name.nameSpace);
+	key.AddString(name.name);
+	return true;
+}
+
+// calling convention, generic arity, parameter count, return type and
+// parameters (ECMA-335 II.23.2.1 - II.23.2.3)
+static bool KeyMethodSig(MetaDataTables& tables, SigReader& reader, MemberKey& key, int depth)
+{
+	BYTE callConv, b;
+	ULONG count;
+
+	if ( depth > MAX_SIGNATURE_DEPTH || !reader.ReadByte(&callConv) )
+		return false;
+	key.AddByte(callConv);
+
+	if ( callConv & IMAGE_CEE_CS_CALLCONV_GENERIC )
+    {
+		if ( !reader.ReadData(&count) )
+			return false;
+		key.AddData(count);
+	}
+
+	if ( !reader.ReadData(&count) )
+		return false;
+	key.AddData(count);
+
+	// the return type, then the parameters
+	for (ULONG i = 0; i <= count; i++)
+    {
+		// the optional vararg parameters follow a sentinel
+		if ( reader.PeekByte(&b) && b == ELEMENT_TYPE_SENTINEL )
+        {
+			reader.ReadByte(&b);
+			key.AddByte(b);
+		}
+
+		if ( !KeyType(tables, reader, key, depth + 1) )
+			return false;
+	}
+
+	return true;
+}
+
+static bool KeyType(MetaDataTables& tables, SigReader& reader, MemberKey& key, int depth)
+{
+	BYTE elem;
+	mdToken tok;
+	ULONG count, value;
+
+	if ( depth > MAX_SIGNATURE_DEPTH )
+		return false;
+
+	for (;;)
+    {
+		if ( !reader.ReadByte(&elem) )
+			return false;
+		key.AddByte(elem);
+
+		switch ( elem )
+        {
+			case ELEMENT_TYPE_VOID:
+			case ELEMENT_TYPE_BOOLEAN:
+			case ELEMENT_TYPE_CHAR:
+			case ELEMENT_TYPE_I1:
+			case ELEMENT_TYPE_U1:
+			case ELEMENT_TYPE_I2:
+			case ELEMENT_TYPE_U2:
+			case ELEMENT_TYPE_I4:
+			case ELEMENT_TYPE_U4:
+			case ELEMENT_TYPE_I8:
+			case ELEMENT_TYPE_U8:
+			case ELEMENT_TYPE_R4:
+			case ELEMENT_TYPE_R8:
+			case ELEMENT_TYPE_STRING:
+			case ELEMENT_TYPE_TYPEDBYREF:
+			case ELEMENT_TYPE_I:
+			case ELEMENT_TYPE_U:
+			case ELEMENT_TYPE_OBJECT:
+				return true;
+
+			// prefixes of the type that follows
+			case ELEMENT_TYPE_PTR:
+			case ELEMENT_TYPE_BYREF:
+			case ELEMENT_TYPE_SZARRAY:
+			case ELEMENT_TYPE_PINNED:
+				break;
+
+			case ELEMENT_TYPE_CMOD_REQD:
+			case ELEMENT_TYPE_CMOD_OPT:
+				if ( !reader.ReadToken(&tok) || !KeyTypeName(tables, tok, key, depth + 1) )
+					return false;
+				break;
+
+			case ELEMENT_TYPE_VALUETYPE:
+			case ELEMENT_TYPE_CLASS:
+				return reader.ReadToken(&tok) && KeyTypeName(tables, tok, key, depth + 1);
+
+			case ELEMENT_TYPE_VAR:
+			case ELEMENT_TYPE_MVAR:
+				if ( !reader.ReadData(&value) )
+					return false;
+				key.AddData(value);
+				return true;
+
+			case ELEMENT_TYPE_ARRAY:
+				// element type, rank, sizes and lower bounds
+				if ( !KeyType(tables, reader, key, depth + 1) || !reader.ReadData(&value) )
+					return false;
+				key.AddData(value);
+				for (int list = 0; list < 2; list++)
+                {
+					if ( !reader.ReadData(&count) )
+						return false;
+					key.AddData(count);
+					for (ULONG i = 0; i < count; i++)
+                    {
+						if ( !reader.ReadData(&value) )
+							return false;
+						key.AddData(value);
+					}
+				}
+				return true;
+
+			case ELEMENT_TYPE_GENERICINST:
+				if ( !reader.ReadByte(&elem) ||
+					 (elem != ELEMENT_TYPE_CLASS && elem != ELEMENT_TYPE_VALUETYPE) )
+					return false;
+				key.AddByte(elem);
+				if ( !reader.ReadToken(&tok) || !KeyTypeName(tables, tok, key, depth + 1) ||
+					 !reader.ReadData(&count) )
+					return false;
+				key.AddData(count);
+				for (ULONG i = 0; i < count; i++)
+                {
+					if ( !KeyType(tables, reader, key, depth + 1) )
+						return false;
+				}
+				return true;
+
+			case ELEMENT_TYPE_FNPTR:
+				return KeyMethodSig(tables, reader, key, depth + 1);
+
+			default:
+				return false;
+		}
+	}
+}
+
+HRESULT KeyMember(MetaDataTables& tables, mdToken typeTok, LPCSTR name,
+				  PCCOR_SIGNATURE sig, ULONG sigSize, ULONGLONG* key)
+{
+	MemberKey memberKey;
+	SigReader reader(sig, sigSize);
+	BYTE callConv;
+
+	if ( TypeFromToken(typeTok) != mdtTypeDef && TypeFromToken(typeTok) != mdtTypeRef )
+		return E_INVALIDARG;
+
+	if ( !KeyTypeName(tables, typeTok, memberKey, 0) || !reader.PeekByte(&callConv) )
+		return CLDB_E_FILE_CORRUPT;
+
+	memberKey.AddString(name);
+
+	bool keyed;
+	if ( (callConv & IMAGE_CEE_CS_CALLCONV_MASK) == IMAGE_CEE_CS_CALLCONV_FIELD )
+    {
+		reader.ReadByte(&callConv);
+		memberKey.AddByte(callConv);
+		keyed = KeyType(tables, reader, memberKey, 0);
+	}
+    else
+		keyed = KeyMethodSig(tables, reader, memberKey, 0);
+
+	if ( !keyed )
+		return CLDB_E_FILE_CORRUPT;
+
+	*key = memberKey.Get();
+	return S_OK;
+}
+
+HRESULT GetMemberOwner(MetaDataTables& tables, mdToken parent, mdToken* owner)
+{
+	*owner = mdTokenNil;
+
+	switch ( TypeFromToken(parent) )
+    {
+		case mdtTypeDef:
+		case mdtTypeRef:
+			*owner = parent;
+			return S_OK;
+
+		case mdtTypeSpec:
+            {
+				PCCOR_SIGNATURE sig;
+				ULONG sigSize;
+				BYTE elem, kind;
+
+				HRESULT hr = tables.GetTypeSpec(parent, &sig, &sigSize);
+				if ( FAILED(hr) )
+					return hr;
+
+				// members of List<int> are the members of List`1
+				SigReader reader(sig, sigSize);
+				if ( !reader.ReadByte(&elem) || elem != ELEMENT_TYPE_GENERICINST )
+					return S_FALSE;
+
+				if ( !reader.ReadByte(&kind) || !reader.ReadToken(owner) ||
+					 TypeFromToken(*owner) == mdtTypeSpec )
+					return CLDB_E_FILE_CORRUPT;
+
+				return S_OK;
+			}
+	}
+
+	return S_FALSE;
+}
+
+////////////////////////////////////
+// Allowlist
+
+Allowlist::Allowlist()
+{
+	_slots = NULL;
+	_mask = 0;
+}
+
+bool Allowlist::Attach(const BYTE* data, DWORD size)
+{
+	const AllowlistHeader* header = (const AllowlistHeader*)data;
+
+	_slots = NULL;
+	_mask = 0;
+
+	if ( NULL == data || size < sizeof(AllowlistHeader) ||
+		 header->magic != ALLOWLIST_MAGIC || header->version != ALLOWLIST_VERSION )
+		return false;
+
+	// a power of two that exactly fills the rest of the file, with a
+	// free slot left to end every probe
+	DWORD capacity = header->capacity;
+	if ( capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+		 capacity != (size - sizeof(AllowlistHeader)) / sizeof(ULONGLONG) ||
+		 (size - sizeof(AllowlistHeader)) % sizeof(ULONGLONG) != 0 ||
+		 header->count >= capacity )
+		return false;
+
+	_slots = (const ULONGLONG*)(header + 1);
+	_mask = capacity - 1;
+	return true;
+}
+
+bool Allowlist::Contains(ULONGLONG key) const
+{
+	if ( NULL == _slots )
+		return false;
+
+	// bounded by the capacity in case the file lied about its count
+	for (ULONG probe = 0, i = (ULONG)key & _mask; probe <= _mask; probe++, i = (i + 1) & _mask)
+    {
+		if ( _slots[i] == key )
+			return true;
+		if ( _slots[i] == 0 )
+			return false;
+	}
+
+	return false;
+}
+
+////////////////////////////////////
+// AllowlistBuilder
+
+// a type is taken if it is, or is nested in, one of the listed types
+bool AllowlistBuilder::IsTaken(MetaDataTables& tables, mdTypeDef tok, LPCSTR const* types, ULONG typeCount)
+{
+	if ( NULL == types )
+		return true;
+
+	mdToken outer = tok, enclosing;
+	for (int depth = 0; tables.GetEnclosingType(outer, &enclosing) == S_OK; depth++)
+    {
+		if ( depth > MAX_SIGNATURE_DEPTH )
+			return false;
+		outer = enclosing;
+	}
+
+	TypeName name;
+	if ( FAILED(tables.GetTypeName(outer, &name)) )
+		return false;
+
+	for (ULONG i = 0; i < typeCount; i++)
+    {
+		if ( name.Equals(types[i]) )
+			return true;
+	}
+
+	return false;
+}
+
+HRESULT AllowlistBuilder::AddAssembly(MetaDataTables& tables, LPCSTR const* types, ULONG typeCount)
+{
+	static const MetaDataTable memberLists[] = { TblMethodDef, TblField };
+	ULONG typeRows = tables.GetRowCount(TblTypeDef);
+
+	for (ULONG rid = 1; rid <= typeRows; rid++)
+    {
+		mdTypeDef typeTok = TokenFromRid(rid, mdtTypeDef);
+		DWORD typeFlags;
+
+		HRESULT hr = tables.GetTypeDefProps(typeTok, &typeFlags, NULL);
+		if ( FAILED(hr) )
+			return hr;
+
+		// visible from an organism: public, or nested where a derived
+		// class can see it
+		switch ( typeFlags & tdVisibilityMask )
+        {
+			case tdPublic:
+			case tdNestedPublic:
+			case tdNestedFamily:
+			case tdNestedFamORAssem:
+				break;
+			default:
+				continue;
+		}
+
+		if ( !IsTaken(tables, typeTok, types, typeCount) )
+			continue;
+
+		for (size_t list = 0; list < sizeof(memberLists) / sizeof(memberLists[0]); list++)
+        {
+			ULONG first, end;
+
+			hr = tables.GetMemberList(typeTok, memberLists[list], &first, &end);
+			if ( FAILED(hr) )
+				return hr;
+
+			for (ULONG i = first; i < end; i++)
+            {
+				mdToken memberTok = tables.GetListMember(memberLists[list], i);
+				DWORD attrs, implFlags, rva;
+				PCCOR_SIGNATURE sig;
+				ULONG sigSize;
+				LPCSTR name;
+				ULONGLONG key;
+
+				if ( memberLists[list] == TblMethodDef )
+					hr = tables.GetMethodProps(memberTok, &attrs, &implFlags, &sig, &sigSize, &rva);
+				else
+					hr = tables.GetFieldProps(memberTok, &attrs, &sig, &sigSize);
+				if ( SUCCEEDED(hr) )
+					hr = tables.GetMemberName(memberTok, &name);
+				if ( FAILED(hr) )
+					return hr;
+
+				// method and field access share their values
+				switch ( attrs & mdMemberAccessMask )
+                {
+					case mdPublic:
+					case mdFamily:
+					case mdFamORAssem:
+						break;
+					default:
+						continue;
+				}
+
+				hr = KeyMember(tables, typeTok, name, sig, sigSize, &key);
+				if ( FAILED(hr) )
+					return hr;
+
+				_keys.push_back(key);
+			}
+		}
+	}
+
+	return S_OK;
+}
+
+// Sizes the table for a load factor of at most one half and writes it.
+bool AllowlistBuilder::Write(LPCWSTR file)
+{
+	std::sort(_keys.begin(), _keys.end());
+	_keys.erase(std::unique(_keys.begin(), _keys.end()), _keys.end());
+
+	DWORD capacity = MIN_ALLOWLIST_CAPACITY;
+	while ( capacity < 2 * _keys.size() )
+		capacity *= 2;
+
+	std::vector<ULONGLONG> slots(capacity, 0);
+	for (size_t k = 0; k < _keys.size(); k++)
+    {
+		ULONG i = (ULONG)_keys[k] & (capacity - 1);
+		while ( slots[i] != 0 )
+			i = (i + 1) & (capacity - 1);
+		slots[i] = _keys[k];
+	}
+
+	AllowlistHeader header;
+	header.magic = ALLOWLIST_MAGIC;
+	header.version = ALLOWLIST_VERSION;
+	header.capacity = capacity;
+	header.count = (DWORD)_keys.size();
+
+	HANDLE handle = CreateFileW(file, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( handle == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD written = 0, slotBytes = capacity * sizeof(ULONGLONG);
+	bool result = WriteFile(handle, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+				  WriteFile(handle, &slots[0], slotBytes, &written, NULL) && written == slotBytes;
+	CloseHandle(handle);
+
+	if ( !result )
+		DeleteFileW(file);
+
+	return result;
+}
@@ -0,0 +1,116 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmpolicy.h : the allowlist policy.  Every member an organism references
+// in another assembly has to match an approved (type, member, signature)
+// triple.  Triples are reduced to 64 bit keys, and the approved keys are
+// kept in an open-addressing table that is built offline and mapped as is,
+// so checking a reference is one hash probe.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+
+#define ALLOWLIST_MAGIC         0x4C414341  // "ACAL"
+#define ALLOWLIST_VERSION       1
+
+// FNV-1a, 64 bit; member keys are made with it
+#define FNV64_OFFSET    (((ULONGLONG)0xCBF29CE4 << 32) | 0x84222325)
+#define FNV64_PRIME     (((ULONGLONG)0x00000100 << 32) | 0x000001B3)
+
+// deepest nesting of types within a signature, or of nested classes,
+// that is keyed; anything deeper is treated as corrupt
+#define MAX_SIGNATURE_DEPTH     32
+
+// Layout of an allowlist file: the header, then capacity slots holding
+// a key each, 0 for an empty slot.  Keys are placed by linear probing
+// from key & (capacity - 1).
+struct AllowlistHeader {
+	DWORD magic;            // ALLOWLIST_MAGIC
+	DWORD version;          // ALLOWLIST_VERSION
+	DWORD capacity;         // slots, a power of two
+	DWORD count;            // slots in use, less than capacity
+};
+
+// an FNV-1a hash fed a field at a time
+class MemberKey {
+private:
+	ULONGLONG _hash;
+
+public:
+	MemberKey() : _hash(FNV64_OFFSET) {}
+
+	void AddByte(BYTE b) {
+		_hash = (_hash ^ b) * FNV64_PRIME;
+	}
+
+	void AddData(ULONG value) {
+		for (int i = 0; i < 4; i++, value >>= 8)
+			AddByte((BYTE)value);
+	}
+
+	void AddKey(ULONGLONG key) {
+		AddData((ULONG)key);
+		AddData((ULONG)(key >> 32));
+	}
+
+	// the terminator goes in too, so "ab" "c" and "a" "bc" differ
+	void AddString(LPCSTR s) {
+		do
+			AddByte((BYTE)*s);
+		while ( *s++ != '\0' );
+	}
+
+	// 0 marks an empty slot, so it is never a key
+	ULONGLONG Get() {
+		return _hash != 0 ? _hash : 1;
+	}
+};
+
+// Keys a member by the full name of its type (enclosing types included),
+// its name and its signature.  Type tokens in the signature are replaced
+// by type names, so a member gets the same key from its defining
+// assembly as from any assembly that references it.  typeTok is a
+// TypeDef or TypeRef.
+HRESULT KeyMember(MetaDataTables& tables, mdToken typeTok, LPCSTR name,
+				  PCCOR_SIGNATURE sig, ULONG sigSize, ULONGLONG* key);
+
+// The type whose members a MemberRef parent names: the parent itself
+// for a TypeDef or TypeRef, the generic type for an instantiation.
+// S_FALSE for parents that have no allowlisted members (arrays, module
+// references, methods).
+HRESULT GetMemberOwner(MetaDataTables& tables, mdToken parent, mdToken* owner);
+
+// an allowlist file mapped by the caller; nothing is copied
+class Allowlist {
+private:
+	const ULONGLONG* _slots;
+	ULONG _mask;
+
+public:
+	Allowlist();
+
+	// false if data isn't a well formed allowlist
+	bool Attach(const BYTE* data, DWORD size);
+	bool Contains(ULONGLONG key) const;
+};
+
+// Collects the keys of the approved surface and writes the table.
+class AllowlistBuilder {
+private:
+	std::vector<ULONGLONG> _keys;
+
+	bool IsTaken(MetaDataTables& tables, mdTypeDef tok, LPCSTR const* types, ULONG typeCount);
+
+public:
+	// Adds the public and protected members of the visible types of an
+	// assembly.  If types isn't NULL only the listed types, given as
+	// dotted full names, and the types nested in them are added.
+	HRESULT AddAssembly(MetaDataTables& tables, LPCSTR const* types, ULONG typeCount);
+
+	ULONG GetKeyCount() { return (ULONG)_keys.size(); }
+	bool Write(LPCWSTR file);
+};
@@ -0,0 +1,122 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmresult.cpp : in-memory validation result
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmresult.h"
+
+#define NO_STRING ((size_t)-1)
+
+size_t ResultBuilder::AddString(LPCWSTR s)
+{
+	if ( NULL == s )
+		return NO_STRING;
+
+	size_t offset = _strings.size();
+	_strings.insert(_strings.end(), s, s + wcslen(s) + 1);
+	return offset;
+}
+
+SIZE_T ResultBuilder::GetCost(LPCWSTR typeName, LPCWSTR memberName, LPCWSTR container, LPCWSTR detail)
+{
+	SIZE_T chars = wcslen(typeName) + wcslen(container) + wcslen(detail) + 3;
+	if ( NULL != memberName )
+		chars += wcslen(memberName) + 1;
+
+	return sizeof(ASMCHECK_DIAGNOSTIC) + chars * sizeof(WCHAR);
+}
+
+void ResultBuilder::Add(DWORD errorContext, LPCSTR id, LPCWSTR message,
+						LPCWSTR typeName, LPCWSTR memberName, LPCWSTR container, LPCWSTR detail,
+						ULONG count, const DWORD* offsets, ULONG offsetCount)
+{
+	Entry entry;
+	entry.errorContext = errorContext;
+	entry.id = id;
+	entry.message = message;
+	entry.typeName = AddString(typeName);
+	entry.memberName = AddString(memberName);
+	entry.container = AddString(container);
+	entry.detail = AddString(detail);
+	entry.count = count;
+	entry.offsetCount = min(offsetCount, (ULONG)ASMCHECK_MAX_OFFSETS);
+	ZeroMemory(entry.offsets, sizeof(entry.offsets));
+	CopyMemory(entry.offsets, offsets, entry.offsetCount * sizeof(DWORD));
+
+	_entries.push_back(entry);
+}
+
+void ResultBuilder::Detach(ASMCHECK_RESULT* result)
+{
+	if ( !ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, diagnostics) )
+    {
+		_entries.clear();
+		_strings.clear();
+		return;
+	}
+
+	result->diagnosticCount = (ULONG)_entries.size();
+
+	SIZE_T stride = result->cbDiagnostic;
+	if ( 0 == stride || _entries.empty() )
+    {
+		_entries.clear();
+		_strings.clear();
+		return;
+	}
+
+	// the strings go after the diagnostics, WCHAR aligned whatever the stride
+	SIZE_T stringsAt = (_entries.size() * stride + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	SIZE_T size = stringsAt + _strings.size() * sizeof(WCHAR);
+
+	BYTE* block = new BYTE[size];
+
+	ZeroMemory(block, stringsAt);
+	WCHAR* strings = (WCHAR*)(block + stringsAt);
+	if ( !_strings.empty() )
+		CopyMemory(strings, &_strings[0], _strings.size() * sizeof(WCHAR));
+
+	for (size_t i = 0; i < _entries.size(); i++)
+    {
+		const Entry& entry = _entries[i];
+		ASMCHECK_DIAGNOSTIC diag;
+
+		diag.errorContext = entry.errorContext;
+		diag.id = entry.id;
+		diag.message = entry.message;
+		diag.typeName = strings + entry.typeName;
+		diag.memberName = (entry.memberName != NO_STRING) ? strings + entry.memberName : NULL;
+		diag.container = strings + entry.container;
+		diag.detail = strings + entry.detail;
+		diag.count = entry.count;
+		diag.offsetCount = entry.offsetCount;
+		CopyMemory(diag.offsets, entry.offsets, sizeof(diag.offsets));
+
+		// an older caller gets the fields it knows of
+		CopyMemory(block + i * stride, &diag, min(stride, sizeof(diag)));
+	}
+
+	result->diagnostics = (ASMCHECK_DIAGNOSTIC*)block;
+
+	_entries.clear();
+	_strings.clear();
+}
+
+void ClearCheckResult(ASMCHECK_RESULT* result)
+{
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, verdict) )
+		result->verdict = ASMCHECK_VERDICT_NONE;
+
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, truncated) )
+		result->truncated = FALSE;
+
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, diagnosticCount) )
+		result->diagnosticCount = 0;
+
+	if ( ASMCHECK_HAS_FIELD(result, ASMCHECK_RESULT, diagnostics) )
+		result->diagnostics = NULL;
+}
@@ -0,0 +1,52 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmresult.h : the diagnostics of one validation gathered for
+// CheckAssemblyWithResult, handed to the caller as one allocation.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+
+// Names are copied in as they are flushed, while the image they point
+// into is still mapped; Detach packs them behind the diagnostics.
+class ResultBuilder {
+private:
+	// an ASMCHECK_DIAGNOSTIC with its strings as offsets into _strings
+	struct Entry {
+		DWORD errorContext;
+		LPCSTR id;
+		LPCWSTR message;
+		size_t typeName;
+		size_t memberName;
+		size_t container;
+		size_t detail;
+		ULONG count;
+		ULONG offsetCount;
+		DWORD offsets[ASMCHECK_MAX_OFFSETS];
+	};
+
+	std::vector<Entry> _entries;
+	std::vector<WCHAR> _strings;
+
+	size_t AddString(LPCWSTR s);
+
+public:
+	// bytes Add takes for a diagnostic with these names, for the budget
+	static SIZE_T GetCost(LPCWSTR typeName, LPCWSTR memberName, LPCWSTR container, LPCWSTR detail);
+
+	// id and message are static; memberName is NULL outside a member
+	void Add(DWORD errorContext, LPCSTR id, LPCWSTR message,
+			 LPCWSTR typeName, LPCWSTR memberName, LPCWSTR container, LPCWSTR detail,
+			 ULONG count, const DWORD* offsets, ULONG offsetCount);
+
+	// fills in the diagnostics of result, laid out cbDiagnostic apart,
+	// and forgets them
+	void Detach(ASMCHECK_RESULT* result);
+};
+
+// empties a result before it is filled in, or after it is freed
+void ClearCheckResult(ASMCHECK_RESULT* result);
@@ -0,0 +1,274 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsched.cpp : the two class admission scheduler
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmmetrics.h"
+#include "asmsched.h"
+
+#define NO_DEADLINE (~(ULONGLONG)0)
+
+ValidationScheduler g_scheduler;
+
+static ULONGLONG ElapsedMicros(const LARGE_INTEGER& start)
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (ULONGLONG)(now.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+// milliseconds on a clock that doesn't wrap like GetTickCount
+static ULONGLONG NowMillis()
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (ULONGLONG)now.QuadPart / ((ULONGLONG)frequency.QuadPart / 1000);
+}
+
+////////////////////////////////////
+// ValidationScheduler
+
+// one slot per processor; bulk work may use all but one of them
+void ValidationScheduler::Initialize()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	_slots = max((LONG)info.dwNumberOfProcessors, SCHEDULER_MIN_SLOTS);
+	for (int p = 0; p < PriorityClassCount; p++)
+    {
+		_running[p] = 0;
+		_waiting[p] = NULL;
+	}
+
+	_users = 0;
+	InitializeCriticalSection(&_lock);
+	InterlockedExchange(&_inited, 1);
+}
+
+void ValidationScheduler::Shutdown(bool terminating)
+{
+	if ( 0 == InterlockedExchange(&_inited, 0) || terminating )
+		return;
+
+	// nobody is admitted from here on; the waiters go on without a slot
+	EnterCriticalSection(&_lock);
+	for (int p = 0; p < PriorityClassCount; p++)
+    {
+		while ( NULL != _waiting[p] )
+        {
+			Waiter* waiter = _waiting[p];
+			HANDLE event = waiter->event;
+			_waiting[p] = waiter->next;
+			waiter->admitted = false;
+			SetEvent(event);
+		}
+	}
+	LeaveCriticalSection(&_lock);
+
+	ULONGLONG giveUp = NowMillis() + SCHEDULER_DRAIN_TIMEOUT;
+	while ( 0 != _users || 0 != _running[InteractivePriority] || 0 != _running[BulkPriority] )
+    {
+		if ( NowMillis() >= giveUp )
+			return;
+		Sleep(1);
+	}
+
+	DeleteCriticalSection(&_lock);
+}
+
+// called with _lock held
+bool ValidationScheduler::CanAdmit(PriorityClass priority)
+{
+	if ( _running[InteractivePriority] + _running[BulkPriority] >= _slots )
+		return false;
+
+	// the last slot is kept for interactive work
+	return priority == InteractivePriority || _running[BulkPriority] < _slots - 1;
+}
+
+// Hands free slots to the waiters in order, called with _lock held.  A
+// waiter is unlinked before its event is set; once set it may return
+// and take the Waiter with it.
+void ValidationScheduler::AdmitWaiters()
+{
+	for (;;)
+    {
+		PriorityClass priority;
+		if ( NULL != _waiting[InteractivePriority] && CanAdmit(InteractivePriority) )
+			priority = InteractivePriority;
+		else if ( NULL != _waiting[BulkPriority] && CanAdmit(BulkPriority) )
+			priority = BulkPriority;
+		else
+			break;
+
+		Waiter* waiter = _waiting[priority];
+		HANDLE event = waiter->event;
+		_waiting[priority] = waiter->next;
+		waiter->admitted = true;
+		_running[priority]++;
+		SetEvent(event);
+	}
+}
+
+// takes a waiter off its queue, called with _lock held; false if it
+// had already been admitted or sent on
+bool ValidationScheduler::Unlink(Waiter* waiter, PriorityClass priority)
+{
+	for (Waiter** link = &_waiting[priority]; NULL != *link; link = &(*link)->next)
+    {
+		if ( *link == waiter )
+        {
+			*link = waiter->next;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+Admission ValidationScheduler::Enter(PriorityClass priority, ULONG deadline, const volatile LONG* cancel, ULONG timeLimit)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	ULONGLONG stopAt = (timeLimit != 0) ? NowMillis() + timeLimit : NO_DEADLINE;
+	Admission admission = Admitted;
+
+	// counted before _inited is looked at, so Shutdown either sees this
+	// thread or this thread sees Shutdown
+	InterlockedIncrement(&_users);
+	if ( 0 == _inited )
+    {
+		InterlockedDecrement(&_users);
+		return Unscheduled;
+	}
+
+	Waiter waiter;
+	waiter.deadline = (deadline != 0) ? NowMillis() + deadline : NO_DEADLINE;
+	waiter.event = NULL;
+	waiter.admitted = true;
+	waiter.next = NULL;
+
+	EnterCriticalSection(&_lock);
+
+	// Shutdown came in between, and has already sent the waiters on
+	if ( 0 == _inited )
+    {
+		LeaveCriticalSection(&_lock);
+		InterlockedDecrement(&_users);
+		return Unscheduled;
+	}
+
+	// straight in if nobody of this class, or for bulk work nobody at
+	// all, is waiting and there is a slot
+	bool queued = NULL != _waiting[priority] ||
+				  (priority == BulkPriority && NULL != _waiting[InteractivePriority]) ||
+				  !CanAdmit(priority);
+	if ( queued )
+		waiter.event = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+	if ( !queued || NULL == waiter.event )
+    {
+		// without an event to wait on it runs over the limit rather
+		// than fail the validation
+		_running[priority]++;
+		LeaveCriticalSection(&_lock);
+	}
+    else
+    {
+		Waiter** link = &_waiting[priority];
+		while ( NULL != *link && (*link)->deadline <= waiter.deadline )
+			link = &(*link)->next;
+		waiter.next = *link;
+		*link = &waiter;
+		LeaveCriticalSection(&_lock);
+
+		while ( WaitForSingleObject(waiter.event, SCHEDULER_POLL_INTERVAL) != WAIT_OBJECT_0 )
+        {
+			Admission stop;
+			if ( NULL != cancel && 0 != *cancel )
+				stop = WaitCancelled;
+			else if ( NowMillis() >= stopAt )
+				stop = WaitTimedOut;
+			else
+				continue;
+
+			EnterCriticalSection(&_lock);
+			bool unlinked = Unlink(&waiter, priority);
+			LeaveCriticalSection(&_lock);
+
+			// otherwise a slot or Shutdown got to it first, and its
+			// event is set
+			if ( unlinked )
+				admission = stop;
+			else
+				WaitForSingleObject(waiter.event, INFINITE);
+			break;
+		}
+
+		CloseHandle(waiter.event);
+	}
+
+	InterlockedDecrement(&_users);
+	g_metrics.RecordWait(priority, ElapsedMicros(start));
+
+	if ( admission == Admitted && !waiter.admitted )
+		admission = Unscheduled;
+	return admission;
+}
+
+void ValidationScheduler::Leave(PriorityClass priority)
+{
+	InterlockedIncrement(&_users);
+
+	// after Shutdown there is nobody left to admit, and the count is
+	// only kept for Shutdown to wait on
+	if ( 0 == _inited )
+		InterlockedDecrement(&_running[priority]);
+    else
+    {
+		EnterCriticalSection(&_lock);
+		_running[priority]--;
+		AdmitWaiters();
+		LeaveCriticalSection(&_lock);
+	}
+
+	InterlockedDecrement(&_users);
+}
+
+////////////////////////////////////
+// SchedulerSlot
+
+SchedulerSlot::SchedulerSlot(PriorityClass priority, ULONG deadline, const volatile LONG* cancel, ULONG timeLimit)
+{
+	_priority = priority;
+	QueryPerformanceCounter(&_requested);
+	_admission = g_scheduler.Enter(priority, deadline, cancel, timeLimit);
+}
+
+SchedulerSlot::~SchedulerSlot()
+{
+	if ( _admission == Admitted )
+		g_scheduler.Leave(_priority);
+	g_metrics.RecordRequest(_priority, ElapsedMicros(_requested));
+}
+
+DWORD SchedulerSlot::GetStopVerdict() const
+{
+	switch ( _admission )
+    {
+		case WaitCancelled:
+			return ASMCHECK_VERDICT_CANCELLED;
+		case WaitTimedOut:
+			return ASMCHECK_VERDICT_TIMED_OUT;
+	}
+
+	return ASMCHECK_VERDICT_NONE;
+}
@@ -0,0 +1,102 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsched.h : admission of validations to the processors.  Validations
+// run on the threads that ask for them; the scheduler only decides how
+// many run at once and which goes next.  Interactive validations are
+// admitted before bulk ones, and bulk validations never take the last
+// slot, so a player's creature is never queued behind a catalog scan.
+// A batch asks for a slot per assembly, which is where it gives way.
+//
+
+#pragma once
+#pragma unmanaged
+
+// at least one slot for bulk work and one kept for interactive work
+#define SCHEDULER_MIN_SLOTS     2
+
+// longest Shutdown waits for validations still in the scheduler before
+// it gives up and leaves the lock behind rather than delete it under them
+#define SCHEDULER_DRAIN_TIMEOUT 5000    // milliseconds
+
+// how often a waiting validation looks at its cancel flag and time limit
+#define SCHEDULER_POLL_INTERVAL 50      // milliseconds
+
+enum PriorityClass {
+	InteractivePriority = 0,
+	BulkPriority,
+	PriorityClassCount
+};
+
+// how Enter let a validation go
+enum Admission {
+	Admitted,           // with a slot, which Leave hands back
+	Unscheduled,        // without one, the scheduler isn't running
+	WaitCancelled,      // its cancel flag was set while it waited
+	WaitTimedOut        // its time limit ran out while it waited
+};
+
+// Lives in static storage; Initialize and Shutdown are called from
+// DllMain.  Before Initialize and after Shutdown every validation runs at
+// once, without a slot.  Shutdown sends the waiting validations on
+// without slots too, and waits for every thread in Enter or Leave, and
+// every validation holding a slot, to be done before it deletes the lock.
+class ValidationScheduler {
+private:
+	// lives on the stack of the waiting thread
+	struct Waiter {
+		ULONGLONG deadline;     // milliseconds, NO_DEADLINE for none
+		HANDLE event;
+		bool admitted;          // given a slot, rather than sent on by Shutdown
+		Waiter* next;
+	};
+
+	CRITICAL_SECTION _lock;
+	volatile LONG _inited;
+	volatile LONG _users;       // threads in Enter or Leave
+	LONG _slots;
+	volatile LONG _running[PriorityClassCount];
+	Waiter* _waiting[PriorityClassCount];   // by deadline, then by arrival
+
+	bool CanAdmit(PriorityClass priority);
+	void AdmitWaiters();
+	bool Unlink(Waiter* waiter, PriorityClass priority);
+
+public:
+	void Initialize();
+
+	// terminating is set when the process is exiting, with every other
+	// thread already gone; there is nobody to wait for then
+	void Shutdown(bool terminating);
+
+	// Blocks until the validation may run, or is to give up.  deadline
+	// is in milliseconds from now, 0 for none; within a class the
+	// earliest deadline goes first.  cancel and timeLimit are the
+	// validation's own, polled while it waits.  Leave is called only
+	// for Admitted.
+	Admission Enter(PriorityClass priority, ULONG deadline, const volatile LONG* cancel, ULONG timeLimit);
+	void Leave(PriorityClass priority);
+};
+
+extern ValidationScheduler g_scheduler;
+
+// Holds a slot for the validation of one assembly and records how long
+// the caller waited for the verdict.
+class SchedulerSlot {
+private:
+	PriorityClass _priority;
+	Admission _admission;
+	LARGE_INTEGER _requested;
+
+public:
+	SchedulerSlot(PriorityClass priority, ULONG deadline, const volatile LONG* cancel, ULONG timeLimit);
+	~SchedulerSlot();
+
+	// when the slot was asked for, which a time limit counts from
+	const LARGE_INTEGER& GetRequested() const { return _requested; }
+
+	// ASMCHECK_VERDICT_CANCELLED or _TIMED_OUT if the validation was
+	// stopped while it waited, otherwise ASMCHECK_VERDICT_NONE
+	DWORD GetStopVerdict() const;
+};
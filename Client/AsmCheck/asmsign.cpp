@@ -0,0 +1,752 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsign.cpp : SHA-1, SHA-256, RSA signature check and the strong name
+// image hash
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmsign.h"
+
+#define SN_U2(p) ((DWORD)(p)[0] | ((DWORD)(p)[1] << 8))
+#define SN_U4(p) ((DWORD)(p)[0] | ((DWORD)(p)[1] << 8) | ((DWORD)(p)[2] << 16) | ((DWORD)(p)[3] << 24))
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+////////////////////////////////////
+// SHA-1 (FIPS 180-2)
+
+void Sha1::Init()
+{
+	_state[0] = 0x67452301;
+	_state[1] = 0xEFCDAB89;
+	_state[2] = 0x98BADCFE;
+	_state[3] = 0x10325476;
+	_state[4] = 0xC3D2E1F0;
+	_length = 0;
+	_used = 0;
+}
+
+void Sha1::Transform(const BYTE* block)
+{
+	DWORD w[80];
+	DWORD a, b, c, d, e, f, k, temp;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((DWORD)block[i * 4] << 24) | ((DWORD)block[i * 4 + 1] << 16) |
+			   ((DWORD)block[i * 4 + 2] << 8) | (DWORD)block[i * 4 + 3];
+	for (i = 16; i < 80; i++)
+		w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = _state[0];
+	b = _state[1];
+	c = _state[2];
+	d = _state[3];
+	e = _state[4];
+
+	for (i = 0; i < 80; i++)
+    {
+		if ( i < 20 )
+        {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+        else if ( i < 40 )
+        {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+        else if ( i < 60 )
+        {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+        else
+        {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		temp = ROTL32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROTL32(b, 30);
+		b = a;
+		a = temp;
+	}
+
+	_state[0] += a;
+	_state[1] += b;
+	_state[2] += c;
+	_state[3] += d;
+	_state[4] += e;
+}
+
+void Sha1::Update(const BYTE* data, SIZE_T size)
+{
+	_length += size;
+
+	if ( _used > 0 )
+    {
+		SIZE_T take = min(size, (SIZE_T)(64 - _used));
+		CopyMemory(_block + _used, data, take);
+		_used += (DWORD)take;
+		data += take;
+		size -= take;
+
+		if ( _used < 64 )
+			return;
+
+		Transform(_block);
+		_used = 0;
+	}
+
+	while ( size >= 64 )
+    {
+		Transform(data);
+		data += 64;
+		size -= 64;
+	}
+
+	if ( size > 0 )
+    {
+		CopyMemory(_block, data, size);
+		_used = (DWORD)size;
+	}
+}
+
+void Sha1::Final(BYTE digest[SHA1_DIGEST_SIZE])
+{
+	ULONGLONG bits = _length * 8;
+	BYTE pad[72];
+	DWORD padSize = (_used < 56) ? 56 - _used : 120 - _used;
+
+	ZeroMemory(pad, sizeof(pad));
+	pad[0] = 0x80;
+	for (int i = 0; i < 8; i++)
+		pad[padSize + i] = (BYTE)(bits >> (56 - 8 * i));
+
+	Update(pad, padSize + 8);
+
+	for (int i = 0; i < 5; i++)
+    {
+		digest[i * 4] = (BYTE)(_state[i] >> 24);
+		digest[i * 4 + 1] = (BYTE)(_state[i] >> 16);
+		digest[i * 4 + 2] = (BYTE)(_state[i] >> 8);
+		digest[i * 4 + 3] = (BYTE)_state[i];
+	}
+
+	Init();
+}
+
+////////////////////////////////////
+// SHA-256 (FIPS 180-2)
+
+static const DWORD sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void Sha256::Init()
+{
+	_state[0] = 0x6a09e667;
+	_state[1] = 0xbb67ae85;
+	_state[2] = 0x3c6ef372;
+	_state[3] = 0xa54ff53a;
+	_state[4] = 0x510e527f;
+	_state[5] = 0x9b05688c;
+	_state[6] = 0x1f83d9ab;
+	_state[7] = 0x5be0cd19;
+	_length = 0;
+	_used = 0;
+}
+
+void Sha256::Transform(const BYTE* block)
+{
+	DWORD w[64];
+	DWORD s[8];
+	DWORD t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((DWORD)block[i * 4] << 24) | ((DWORD)block[i * 4 + 1] << 16) |
+			   ((DWORD)block[i * 4 + 2] << 8) | (DWORD)block[i * 4 + 3];
+	for (i = 16; i < 64; i++)
+    {
+		DWORD s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		DWORD s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	for (i = 0; i < 8; i++)
+		s[i] = _state[i];
+
+	for (i = 0; i < 64; i++)
+    {
+		t1 = s[7] + (ROTR32(s[4], 6) ^ ROTR32(s[4], 11) ^ ROTR32(s[4], 25)) +
+			 ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+		t2 = (ROTR32(s[0], 2) ^ ROTR32(s[0], 13) ^ ROTR32(s[0], 22)) +
+			 ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		_state[i] += s[i];
+}
+
+void Sha256::Update(const BYTE* data, SIZE_T size)
+{
+	_length += size;
+
+	if ( _used > 0 )
+    {
+		SIZE_T take = min(size, (SIZE_T)(64 - _used));
+		CopyMemory(_block + _used, data, take);
+		_used += (DWORD)take;
+		data += take;
+		size -= take;
+
+		if ( _used < 64 )
+			return;
+
+		Transform(_block);
+		_used = 0;
+	}
+
+	while ( size >= 64 )
+    {
+		Transform(data);
+		data += 64;
+		size -= 64;
+	}
+
+	if ( size > 0 )
+    {
+		CopyMemory(_block, data, size);
+		_used = (DWORD)size;
+	}
+}
+
+void Sha256::Final(BYTE digest[SHA256_DIGEST_SIZE])
+{
+	ULONGLONG bits = _length * 8;
+	BYTE pad[72];
+	DWORD padSize = (_used < 56) ? 56 - _used : 120 - _used;
+
+	ZeroMemory(pad, sizeof(pad));
+	pad[0] = 0x80;
+	for (int i = 0; i < 8; i++)
+		pad[padSize + i] = (BYTE)(bits >> (56 - 8 * i));
+
+	Update(pad, padSize + 8);
+
+	for (int i = 0; i < 8; i++)
+    {
+		digest[i * 4] = (BYTE)(_state[i] >> 24);
+		digest[i * 4 + 1] = (BYTE)(_state[i] >> 16);
+		digest[i * 4 + 2] = (BYTE)(_state[i] >> 8);
+		digest[i * 4 + 3] = (BYTE)_state[i];
+	}
+
+	Init();
+}
+
+////////////////////////////////////
+// RSA public key operation with Montgomery multiplication over 32 bit limbs
+
+#define RSA_MAX_LIMBS (RSA_MAX_BITS / 32)
+
+static int BigCompare(const DWORD* a, const DWORD* b, int n)
+{
+	for (int i = n - 1; i >= 0; i--)
+    {
+		if ( a[i] != b[i] )
+			return (a[i] > b[i]) ? 1 : -1;
+	}
+	return 0;
+}
+
+static void BigSub(DWORD* a, const DWORD* b, int n)
+{
+	DWORD borrow = 0;
+	for (int i = 0; i < n; i++)
+    {
+		ULONGLONG d = (ULONGLONG)a[i] - b[i] - borrow;
+		a[i] = (DWORD)d;
+		borrow = (DWORD)(d >> 32) & 1;
+	}
+}
+
+// r = a * b / 2^(32n) mod m
+static void MontMul(DWORD* r, const DWORD* a, const DWORD* b, const DWORD* m, DWORD m0inv, int n)
+{
+	DWORD t[RSA_MAX_LIMBS + 2];
+	ZeroMemory(t, (n + 2) * sizeof(DWORD));
+
+	for (int i = 0; i < n; i++)
+    {
+		ULONGLONG s;
+		DWORD carry = 0;
+		int j;
+
+		for (j = 0; j < n; j++)
+        {
+			s = (ULONGLONG)a[j] * b[i] + t[j] + carry;
+			t[j] = (DWORD)s;
+			carry = (DWORD)(s >> 32);
+		}
+		s = (ULONGLONG)t[n] + carry;
+		t[n] = (DWORD)s;
+		t[n + 1] = (DWORD)(s >> 32);
+
+		DWORD q = t[0] * m0inv;
+		s = (ULONGLONG)q * m[0] + t[0];
+		carry = (DWORD)(s >> 32);
+		for (j = 1; j < n; j++)
+        {
+			s = (ULONGLONG)q * m[j] + t[j] + carry;
+			t[j - 1] = (DWORD)s;
+			carry = (DWORD)(s >> 32);
+		}
+		s = (ULONGLONG)t[n] + carry;
+		t[n - 1] = (DWORD)s;
+		t[n] = t[n + 1] + (DWORD)(s >> 32);
+	}
+
+	if ( t[n] != 0 || BigCompare(t, m, n) >= 0 )
+		BigSub(t, m, n);
+
+	CopyMemory(r, t, n * sizeof(DWORD));
+}
+
+// result = base^exponent mod m, m odd
+static void ModExp(DWORD* result, const DWORD* base, DWORD exponent, const DWORD* m, int n)
+{
+	DWORD r2[RSA_MAX_LIMBS];
+	DWORD one[RSA_MAX_LIMBS];
+	DWORD x[RSA_MAX_LIMBS];
+	DWORD acc[RSA_MAX_LIMBS];
+
+	// -m^-1 mod 2^32 by Newton iteration
+	DWORD inv = m[0];
+	for (int i = 0; i < 4; i++)
+		inv *= 2 - m[0] * inv;
+	DWORD m0inv = 0 - inv;
+
+	// 2^(64n) mod m by doubling
+	ZeroMemory(r2, n * sizeof(DWORD));
+	r2[0] = 1;
+	for (int bit = 0; bit < 64 * n; bit++)
+    {
+		DWORD carry = 0;
+		for (int i = 0; i < n; i++)
+        {
+			DWORD next = r2[i] >> 31;
+			r2[i] = (r2[i] << 1) | carry;
+			carry = next;
+		}
+		if ( carry || BigCompare(r2, m, n) >= 0 )
+			BigSub(r2, m, n);
+	}
+
+	ZeroMemory(one, n * sizeof(DWORD));
+	one[0] = 1;
+
+	MontMul(x, base, r2, m, m0inv, n);
+	MontMul(acc, r2, one, m, m0inv, n);
+
+	int top = 31;
+	while ( top > 0 && !((exponent >> top) & 1) )
+		top--;
+
+	for (int bit = top; bit >= 0; bit--)
+    {
+		MontMul(acc, acc, acc, m, m0inv, n);
+		if ( (exponent >> bit) & 1 )
+			MontMul(acc, acc, x, m, m0inv, n);
+	}
+
+	MontMul(result, acc, one, m, m0inv, n);
+}
+
+static void LoadLimbs(DWORD* limbs, int n, const BYTE* bytes, ULONG size)
+{
+	ZeroMemory(limbs, n * sizeof(DWORD));
+	for (ULONG i = 0; i < size; i++)
+		limbs[i / 4] |= (DWORD)bytes[i] << (8 * (i % 4));
+}
+
+bool RsaVerifyPkcs1(const BYTE* modulus, ULONG modulusSize, DWORD exponent,
+					const BYTE* signature, ULONG signatureSize,
+					const BYTE* digestInfo, ULONG digestInfoSize,
+					const BYTE* digest, ULONG digestSize)
+{
+	DWORD m[RSA_MAX_LIMBS];
+	DWORD s[RSA_MAX_LIMBS];
+	DWORD em[RSA_MAX_LIMBS];
+
+	// the modulus length without high zero bytes is the block size
+	while ( modulusSize > 0 && modulus[modulusSize - 1] == 0 )
+		modulusSize--;
+
+	if ( modulusSize == 0 || modulusSize > RSA_MAX_BITS / 8 || !(modulus[0] & 1) ||
+		 signatureSize > modulusSize || exponent == 0 )
+		return false;
+
+	// 00 01 FF*8 00 at the least
+	if ( digestInfoSize + digestSize + 11 > modulusSize )
+		return false;
+
+	int n = (int)((modulusSize + 3) / 4);
+	LoadLimbs(m, n, modulus, modulusSize);
+	LoadLimbs(s, n, signature, signatureSize);
+
+	if ( BigCompare(s, m, n) >= 0 )
+		return false;
+
+	ModExp(em, s, exponent, m, n);
+
+	// compare big endian: 00 01 FF..FF 00 digestInfo digest
+	ULONG padEnd = modulusSize - digestInfoSize - digestSize - 1;
+	for (ULONG i = 0; i < modulusSize; i++)
+    {
+		ULONG le = modulusSize - 1 - i;
+		BYTE actual = (BYTE)(em[le / 4] >> (8 * (le % 4)));
+		BYTE expected;
+
+		if ( i == 0 )
+			expected = 0x00;
+		else if ( i == 1 )
+			expected = 0x01;
+		else if ( i < padEnd )
+			expected = 0xFF;
+		else if ( i == padEnd )
+			expected = 0x00;
+		else if ( i < padEnd + 1 + digestInfoSize )
+			expected = digestInfo[i - padEnd - 1];
+		else
+			expected = digest[i - padEnd - 1 - digestInfoSize];
+
+		if ( actual != expected )
+			return false;
+	}
+
+	return true;
+}
+
+////////////////////////////////////
+// strong name image hash
+
+// CryptoAPI identifiers found in the public key blob
+#define SN_CALG_SHA1        0x00008004
+#define SN_CALG_SHA_256     0x0000800C
+#define SN_CALG_RSA_SIGN    0x00002400
+#define SN_CALG_RSA_KEYX    0x0000A400
+#define SN_PUBLICKEYBLOB    0x06
+#define SN_RSA1_MAGIC       0x31415352  // "RSA1"
+
+// PublicKeyBlob: SigAlgID, HashAlgID, cbPublicKey, then a CryptoAPI
+// PUBLICKEYBLOB: BLOBHEADER, RSAPUBKEY, modulus
+#define SN_KEY_HEADER       12
+#define SN_BLOB_HEADER      20
+
+// offsets in the optional header of the fields the hash skips
+#define SN_CHECKSUM_OFFSET          64
+#define SN_SECURITY_DIR_OFFSET32    128
+#define SN_SECURITY_DIR_OFFSET64    144
+
+static const BYTE sha1DigestInfo[] = {
+	0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14
+};
+
+static const BYTE sha256DigestInfo[] = {
+	0x30, 0x31, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01,
+	0x05, 0x00, 0x04, 0x20
+};
+
+DWORD ReadStrongNameKey(PIMAGE_NT_HEADERS headers, MetaDataTables& tables, StrongNameKey* key)
+{
+	const BYTE* publicKey = NULL;
+	ULONG keySize = 0;
+
+	ZeroMemory(key, sizeof(StrongNameKey));
+
+	const IMAGE_COR20_HEADER* corHeader = tables.GetCorHeader();
+	if ( NULL == corHeader || !tables.GetAssemblyPublicKey(&publicKey, &keySize) ||
+		 corHeader->StrongNameSignature.Size == 0 )
+		return STRONG_NAME_UNSIGNED;
+
+	// this also turns away the 16 byte ECMA placeholder key
+	if ( keySize < SN_KEY_HEADER + SN_BLOB_HEADER )
+		return STRONG_NAME_UNSUPPORTED;
+
+	DWORD hashAlg = SN_U4(publicKey + 4);
+	ULONG blobSize = SN_U4(publicKey + 8);
+	const BYTE* blob = publicKey + SN_KEY_HEADER;
+
+	if ( blobSize > keySize - SN_KEY_HEADER || blobSize < SN_BLOB_HEADER )
+		return STRONG_NAME_UNSUPPORTED;
+
+	DWORD keyAlg = SN_U4(blob + 4);
+	if ( blob[0] != SN_PUBLICKEYBLOB ||
+		 (keyAlg != SN_CALG_RSA_SIGN && keyAlg != SN_CALG_RSA_KEYX) ||
+		 SN_U4(blob + 8) != SN_RSA1_MAGIC )
+		return STRONG_NAME_UNSUPPORTED;
+
+	ULONG bitLen = SN_U4(blob + 12);
+	ULONG modulusSize = bitLen / 8;
+
+	if ( bitLen == 0 || bitLen % 8 != 0 || modulusSize > blobSize - SN_BLOB_HEADER ||
+		 bitLen > RSA_MAX_BITS )
+		return STRONG_NAME_UNSUPPORTED;
+
+	if ( hashAlg != SN_CALG_SHA1 && hashAlg != SN_CALG_SHA_256 )
+		return STRONG_NAME_UNSUPPORTED;
+
+	ULONG signatureSize = corHeader->StrongNameSignature.Size;
+	const BYTE* signature = tables.RvaToPointer(headers, corHeader->StrongNameSignature.VirtualAddress,
+												signatureSize);
+	if ( NULL == signature || signatureSize != modulusSize )
+		return STRONG_NAME_INVALID;
+
+	key->modulus = blob + SN_BLOB_HEADER;
+	key->modulusSize = modulusSize;
+	key->exponent = SN_U4(blob + 16);
+	key->hashAlg = hashAlg;
+	key->signature = signature;
+	key->signatureSize = signatureSize;
+
+	return STRONG_NAME_VALID;
+}
+
+DWORD CheckStrongNameSignature(const StrongNameKey& key, const BYTE* digest, ULONG digestSize)
+{
+	const BYTE* digestInfo = sha1DigestInfo;
+	ULONG digestInfoSize = sizeof(sha1DigestInfo);
+
+	if ( key.hashAlg == SN_CALG_SHA_256 )
+    {
+		digestInfo = sha256DigestInfo;
+		digestInfoSize = sizeof(sha256DigestInfo);
+	}
+
+	if ( !RsaVerifyPkcs1(key.modulus, key.modulusSize, key.exponent,
+						 key.signature, key.signatureSize,
+						 digestInfo, digestInfoSize, digest, digestSize) )
+		return STRONG_NAME_INVALID;
+
+	return STRONG_NAME_VALID;
+}
+
+////////////////////////////////////
+// strong name image hash
+
+StrongNameHash::StrongNameHash()
+{
+	_base = NULL;
+	_size = 0;
+	_hashAlg = 0;
+	_valid = false;
+	_ordered = false;
+	_next = 0;
+	_position = 0;
+}
+
+void StrongNameHash::AddSpan(ULONG start, ULONG length, const BYTE* data)
+{
+	if ( length == 0 )
+		return;
+
+	if ( !_spans.empty() && start < _spans.back().start + _spans.back().length )
+		_ordered = false;
+
+	HashSpan span;
+	span.start = start;
+	span.length = length;
+	span.data = data;
+	_spans.push_back(span);
+}
+
+// Lays out what the strong name tools hash: the DOS header and stub, the
+// PE headers with the checksum and security directory zeroed, the section
+// table, then the raw data of every section except the signature itself.
+bool StrongNameHash::Begin(const BYTE* base, ULONG size, PIMAGE_NT_HEADERS headers,
+						   const StrongNameKey& key)
+{
+	_base = base;
+	_size = size;
+	_hashAlg = key.hashAlg;
+	_valid = false;
+	_ordered = true;
+	_next = 0;
+	_position = 0;
+	_spans.clear();
+	_sha1.Init();
+	_sha256.Init();
+
+	ULONG peOffset = (ULONG)((const BYTE*)headers - base);
+	ULONG optionalSize = headers->FileHeader.SizeOfOptionalHeader;
+	ULONG peSize = FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) + optionalSize;
+	ULONG numSections = headers->FileHeader.NumberOfSections;
+	ULONG sectionOffset = peOffset + peSize;
+
+	if ( peSize > sizeof(_patch) || sectionOffset > size ||
+		 numSections * sizeof(IMAGE_SECTION_HEADER) > size - sectionOffset )
+		return false;
+
+	ULONG optional = FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader);
+	ULONG securityDir = (headers->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) ?
+						SN_SECURITY_DIR_OFFSET64 : SN_SECURITY_DIR_OFFSET32;
+	if ( optional + securityDir + 8 > peSize )
+		return false;
+
+	CopyMemory(_patch, base + peOffset, peSize);
+	ZeroMemory(_patch + optional + SN_CHECKSUM_OFFSET, 4);
+	ZeroMemory(_patch + optional + securityDir, 8);
+
+	AddSpan(0, peOffset, NULL);
+	AddSpan(peOffset, peSize, _patch);
+	AddSpan(sectionOffset, numSections * sizeof(IMAGE_SECTION_HEADER), NULL);
+
+	ULONG sigStart = (ULONG)(key.signature - base);
+	ULONG sigEnd = sigStart + key.signatureSize;
+	const IMAGE_SECTION_HEADER* section = (const IMAGE_SECTION_HEADER*)(base + sectionOffset);
+
+	for (ULONG i = 0; i < numSections; i++, section++)
+    {
+		ULONG start = section->PointerToRawData;
+		ULONG length = section->SizeOfRawData;
+
+		if ( start > size || length > size - start )
+			return false;
+
+		if ( sigStart >= start && sigStart < start + length )
+        {
+			if ( sigEnd > start + length )
+				return false;
+			AddSpan(start, sigStart - start, NULL);
+			AddSpan(sigEnd, start + length - sigEnd, NULL);
+		}
+        else
+        {
+			AddSpan(start, length, NULL);
+		}
+	}
+
+	_valid = true;
+	return true;
+}
+
+void StrongNameHash::HashBytes(const BYTE* data, ULONG length)
+{
+	if ( _hashAlg == SN_CALG_SHA_256 )
+		_sha256.Update(data, length);
+	else
+		_sha1.Update(data, length);
+}
+
+// Hashes whatever part of [offset, offset + length) the spans cover.
+// Regions have to come in ascending order; if the sections aren't laid
+// out in file order the spans are hashed from the view in Final instead.
+void StrongNameHash::Feed(ULONG offset, ULONG length)
+{
+	if ( !_valid || !_ordered )
+		return;
+
+	ULONG end = offset + length;
+	_ASSERTE(offset >= _position);
+	_position = end;
+
+	while ( _next < _spans.size() )
+    {
+		const HashSpan& span = _spans[_next];
+		ULONG spanEnd = span.start + span.length;
+
+		if ( span.start >= end )
+			break;
+
+		ULONG from = max(span.start, offset);
+		ULONG to = min(spanEnd, end);
+		if ( from < to )
+        {
+			const BYTE* data = (NULL != span.data) ? span.data + (from - span.start) : _base + from;
+			HashBytes(data, to - from);
+		}
+
+		if ( spanEnd > end )
+			break;
+		_next++;
+	}
+}
+
+bool StrongNameHash::Final(BYTE* digest, ULONG* digestSize)
+{
+	if ( !_valid )
+		return false;
+
+	if ( !_ordered )
+    {
+		for (_next = 0; _next < _spans.size(); _next++)
+        {
+			const HashSpan& span = _spans[_next];
+			HashBytes((NULL != span.data) ? span.data : _base + span.start, span.length);
+		}
+	}
+	else if ( _next < _spans.size() )
+    {
+		// the caller stopped short of the end of the image
+		return false;
+	}
+
+	if ( _hashAlg == SN_CALG_SHA_256 )
+    {
+		_sha256.Final(digest);
+		*digestSize = SHA256_DIGEST_SIZE;
+	}
+    else
+    {
+		_sha1.Final(digest);
+		*digestSize = SHA1_DIGEST_SIZE;
+	}
+
+	_valid = false;
+	return true;
+}
+
+DWORD VerifyStrongNameImage(const BYTE* base, ULONG size,
+							PIMAGE_NT_HEADERS headers, MetaDataTables& tables)
+{
+	StrongNameKey key;
+	DWORD status = ReadStrongNameKey(headers, tables, &key);
+	if ( status != STRONG_NAME_VALID )
+		return status;
+
+	StrongNameHash hash;
+	BYTE digest[SN_MAX_DIGEST_SIZE];
+	ULONG digestSize = 0;
+
+	if ( !hash.Begin(base, size, headers, key) )
+		return STRONG_NAME_INVALID;
+	hash.Feed(0, size);
+	if ( !hash.Final(digest, &digestSize) )
+		return STRONG_NAME_INVALID;
+
+	return CheckStrongNameSignature(key, digest, digestSize);
+}
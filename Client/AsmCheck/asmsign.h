@@ -0,0 +1,127 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsign.h : strong name signature verification over a mapped image.
+// Hashes the image the way the strong name tools do and checks the RSA
+// signature against the public key in the Assembly table, without going
+// through the runtime's strong name API.  The image hash can be fed in
+// file order so it shares a single walk with the content hash.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+#include "mdtables.h"
+
+#define SHA1_DIGEST_SIZE 20
+
+class Sha1 {
+private:
+	DWORD _state[5];
+	ULONGLONG _length;
+	BYTE _block[64];
+	DWORD _used;
+
+	void Transform(const BYTE* block);
+
+public:
+	Sha1() { Init(); }
+
+	void Init();
+	void Update(const BYTE* data, SIZE_T size);
+	void Final(BYTE digest[SHA1_DIGEST_SIZE]);
+};
+
+#define SHA256_DIGEST_SIZE 32
+
+class Sha256 {
+private:
+	DWORD _state[8];
+	ULONGLONG _length;
+	BYTE _block[64];
+	DWORD _used;
+
+	void Transform(const BYTE* block);
+
+public:
+	Sha256() { Init(); }
+
+	void Init();
+	void Update(const BYTE* data, SIZE_T size);
+	void Final(BYTE digest[SHA256_DIGEST_SIZE]);
+};
+
+// largest digest a strong name signature is checked against
+#define SN_MAX_DIGEST_SIZE SHA256_DIGEST_SIZE
+
+// largest RSA modulus accepted, in bits
+#define RSA_MAX_BITS 16384
+
+// true if signature^exponent mod modulus is a PKCS#1 v1.5 signature block
+// over digest.  Numbers are little endian, as CryptoAPI stores them.
+bool RsaVerifyPkcs1(const BYTE* modulus, ULONG modulusSize, DWORD exponent,
+					const BYTE* signature, ULONG signatureSize,
+					const BYTE* digestInfo, ULONG digestInfoSize,
+					const BYTE* digest, ULONG digestSize);
+
+// The signing key and signature of an assembly, pointing into the view
+struct StrongNameKey {
+	const BYTE* modulus;        // little endian
+	ULONG modulusSize;
+	DWORD exponent;
+	DWORD hashAlg;              // CALG_SHA1 or CALG_SHA_256
+	const BYTE* signature;
+	ULONG signatureSize;
+};
+
+// Fills in key and returns STRONG_NAME_VALID if the assembly carries a
+// signature this code can check, otherwise the status to report.
+DWORD ReadStrongNameKey(PIMAGE_NT_HEADERS headers, MetaDataTables& tables, StrongNameKey* key);
+
+// STRONG_NAME_VALID if the signature matches the digest of the image
+DWORD CheckStrongNameSignature(const StrongNameKey& key, const BYTE* digest, ULONG digestSize);
+
+// Digest of the signed parts of an image, fed as the file is walked
+class StrongNameHash {
+private:
+	struct HashSpan {
+		ULONG start;
+		ULONG length;
+		const BYTE* data;       // patched copy, NULL to hash the view
+	};
+
+	const BYTE* _base;
+	ULONG _size;
+	DWORD _hashAlg;
+	bool _valid;
+	bool _ordered;              // spans ascend through the file
+	SIZE_T _next;
+	ULONG _position;
+	std::vector<HashSpan> _spans;
+	BYTE _patch[1024];          // PE headers with the skipped fields zeroed
+	Sha1 _sha1;
+	Sha256 _sha256;
+
+	void AddSpan(ULONG start, ULONG length, const BYTE* data);
+	void HashBytes(const BYTE* data, ULONG length);
+
+public:
+	StrongNameHash();
+
+	bool Begin(const BYTE* base, ULONG size, PIMAGE_NT_HEADERS headers, const StrongNameKey& key);
+
+	// [offset, offset + length) of the view has been read; regions
+	// must be passed in ascending order and cover the whole image
+	void Feed(ULONG offset, ULONG length);
+
+	// digest must hold SN_MAX_DIGEST_SIZE bytes
+	bool Final(BYTE* digest, ULONG* digestSize);
+};
+
+// Checks the strong name signature of a mapped image and returns one of
+// the STRONG_NAME_* values.  tables must already be initialized on the
+// same view.
+DWORD VerifyStrongNameImage(const BYTE* base, ULONG size,
+							PIMAGE_NT_HEADERS headers, MetaDataTables& tables);
@@ -0,0 +1,304 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsummary.cpp : collecting, writing and reading reference summaries
+//
+
+#include "stdafx.h"
+#include <corerror.h>
+#include "asmcheckapi.h"
+#include "asmsummary.h"
+#include "asmpolicy.h"
+
+USHORT OpcodeEncoding(OPCODE opcode)
+{
+	if ( opcode >= CEE_COUNT )
+		return SUMMARY_OPCODE_BITS;
+
+	switch ( OpcodeInfo[opcode].Len )
+    {
+		case 1:
+			return OpcodeInfo[opcode].Std2;
+		case 2:
+			return (USHORT)(0x100 + OpcodeInfo[opcode].Std2);
+	}
+
+	// macros and placeholders never show up in the stream
+	return SUMMARY_OPCODE_BITS;
+}
+
+////////////////////////////////////
+// ReferenceSummary
+
+ReferenceSummary::ReferenceSummary(MemoryBudget* budget) :
+	_types(typeUseMap::key_compare(), typeUseMap::allocator_type(budget)),
+	_memberCallSites(callSiteMap::key_compare(), callSiteMap::allocator_type(budget))
+{
+	_tables = NULL;
+	_features = 0;
+	ZeroMemory(_opcodes, sizeof(_opcodes));
+}
+
+DWORD ReferenceSummary::GetEvents()
+{
+	return VISITOR_EVENT_MASK(TypeEvent) | VISITOR_EVENT_MASK(FieldEvent) |
+		   VISITOR_EVENT_MASK(MethodEvent) | VISITOR_EVENT_MASK(InstructionEvent);
+}
+
+// Types are recorded by the token that names them; members of a
+// generic instantiation count against the generic type.
+void ReferenceSummary::AddType(mdToken tok, DWORD use, DWORD callSites)
+{
+	mdToken owner;
+
+	if ( NULL == _tables || GetMemberOwner(*_tables, tok, &owner) != S_OK )
+		return;
+
+	TypeUse& entry = _types[owner];
+	entry.uses |= use;
+	entry.callSites += callSites;
+}
+
+void ReferenceSummary::BeginType(mdTypeDef tok, const TypeName& /* name */, DWORD /* flags */, mdToken baseTok)
+{
+	if ( tok == mdTokenNil )
+		return;
+
+	AddType(tok, SUMMARY_USE_DEFINED, 0);
+	if ( baseTok != mdTokenNil )
+		AddType(baseTok, SUMMARY_USE_BASE, 0);
+}
+
+void ReferenceSummary::VisitField(mdFieldDef /* tok */, LPCSTR /* name */, DWORD attrs, PCCOR_SIGNATURE sig, ULONG sigSize)
+{
+	if ( IsFdStatic(attrs) && !IsFdLiteral(attrs) )
+		_features |= SUMMARY_FEATURE_STATIC_FIELD;
+
+	// the same type the validator checks: the field's own type when it
+	// is a class or value type
+	if ( sigSize >= 3 && (sig[1] == ELEMENT_TYPE_CLASS || sig[1] == ELEMENT_TYPE_VALUETYPE) )
+    {
+		mdToken tok;
+		ULONG len = CorSigUncompressToken(sig + 2, &tok);
+		if ( 2 + len <= sigSize )
+			AddType(tok, SUMMARY_USE_FIELD_TYPE, 0);
+	}
+}
+
+void ReferenceSummary::BeginMethod(const ILMethod& method)
+{
+	if ( IsMdPinvokeImpl(method.attrs) )
+		_features |= SUMMARY_FEATURE_PINVOKE;
+	if ( IsMdHasSecurity(method.attrs) )
+		_features |= SUMMARY_FEATURE_HAS_SECURITY;
+	if ( IsMdRequireSecObject(method.attrs) )
+		_features |= SUMMARY_FEATURE_REQUIRE_SEC_OBJECT;
+
+	// an empty class constructor is a lone ret
+	if ( IsMdClassConstructorA(method.attrs, method.name) )
+    {
+		DWORD len = 0;
+		if ( NULL == method.code || method.codeSize != 1 || DecodeOpcode(method.code, &len) != CEE_RET )
+			_features |= SUMMARY_FEATURE_CLASS_CONSTRUCTOR;
+	}
+
+	if ( NULL != method.header && NULL != method.header->EH )
+		_features |= SUMMARY_FEATURE_EXCEPTION_HANDLERS;
+}
+
+void ReferenceSummary::VisitInstruction(const ILInstruction& instr)
+{
+	USHORT encoding = OpcodeEncoding(instr.opcode);
+	if ( encoding < SUMMARY_OPCODE_BITS )
+		_opcodes[encoding / 32] |= 1 << (encoding % 32);
+
+	// the references the policy resolved and checked
+	if ( NULL == instr.memberName )
+		return;
+
+	AddType(instr.classToken, (instr.format == InlineField) ? SUMMARY_USE_FIELD : SUMMARY_USE_CALL, 1);
+
+	if ( TypeFromToken(instr.token) == mdtMemberRef )
+		_memberCallSites[RidFromToken(instr.token)]++;
+}
+
+DWORD ReferenceSummary::AddString(std::string& strings, stringMap& offsets, LPCSTR s)
+{
+	stringMap::iterator it = offsets.find(s);
+	if ( it != offsets.end() )
+		return it->second;
+
+	DWORD offset = (DWORD)strings.size();
+	strings.append(s, strlen(s) + 1);
+	offsets[s] = offset;
+	return offset;
+}
+
+// Every MemberRef that leaves the organism is written, including those
+// only used outside of method bodies, so an allowlist can be applied
+// to the summary the same way it is applied to the assembly.
+bool ReferenceSummary::Write(LPCWSTR file, DWORD fileSize, DWORD contexts)
+{
+	if ( NULL == _tables || !_tables->IsInited() )
+		return false;
+
+	std::vector<SummaryMember> members;
+	std::vector<mdToken> memberTypes;
+	std::string strings;
+	stringMap offsets;
+
+	AddString(strings, offsets, "");
+
+	ULONG memberRefs = _tables->GetRowCount(TblMemberRef);
+	for (ULONG rid = 1; rid <= memberRefs; rid++)
+    {
+		mdToken parent, owner;
+		LPCSTR name = "";
+		PCCOR_SIGNATURE sig = NULL;
+		ULONG sigSize = 0;
+
+		HRESULT hr = _tables->GetMemberRefProps(TokenFromRid(rid, mdtMemberRef), &parent, &name, &sig, &sigSize);
+		if ( SUCCEEDED(hr) )
+			hr = GetMemberOwner(*_tables, parent, &owner);
+		if ( hr != S_OK || TypeFromToken(owner) == mdtTypeDef )
+			continue;
+
+		bool isField = sigSize > 0 && (sig[0] & IMAGE_CEE_CS_CALLCONV_MASK) == IMAGE_CEE_CS_CALLCONV_FIELD;
+		AddType(owner, isField ? SUMMARY_USE_FIELD : SUMMARY_USE_CALL, 0);
+
+		SummaryMember member;
+		ZeroMemory(&member, sizeof(member));
+		if ( FAILED(KeyMember(*_tables, owner, name, sig, sigSize, &member.key)) )
+			member.key = 0;
+		member.name = AddString(strings, offsets, name);
+
+		callSiteMap::iterator sites = _memberCallSites.find(rid);
+		if ( sites != _memberCallSites.end() )
+			member.callSites = sites->second;
+
+		members.push_back(member);
+		memberTypes.push_back(owner);
+	}
+
+	std::vector<SummaryType> types;
+	std::map<mdToken, DWORD> typeIndex;
+	for (typeUseMap::iterator it = _types.begin(); it != _types.end(); it++)
+    {
+		TypeName typeName;
+		_tables->GetTypeName(it->first, &typeName);
+
+		SummaryType type;
+		type.nameSpace = AddString(strings, offsets, typeName.nameSpace);
+		type.name = AddString(strings, offsets, typeName.name);
+		type.uses = it->second.uses;
+		type.callSites = it->second.callSites;
+
+		typeIndex[it->first] = (DWORD)types.size();
+		types.push_back(type);
+	}
+
+	for (size_t m = 0; m < members.size(); m++)
+		members[m].type = typeIndex[memberTypes[m]];
+
+	SummaryHeader header;
+	ZeroMemory(&header, sizeof(header));
+	header.magic = SUMMARY_MAGIC;
+	header.version = SUMMARY_VERSION;
+	header.fileSize = fileSize;
+	header.contexts = contexts;
+	header.features = _features;
+	header.memberCount = (DWORD)members.size();
+	header.memberOffset = sizeof(SummaryHeader);
+	header.typeCount = (DWORD)types.size();
+	header.typeOffset = header.memberOffset + header.memberCount * sizeof(SummaryMember);
+	header.stringsSize = (DWORD)strings.size();
+	header.stringsOffset = header.typeOffset + header.typeCount * sizeof(SummaryType);
+	CopyMemory(header.opcodes, _opcodes, sizeof(header.opcodes));
+
+	// laid out in memory first so the file is written in one go
+	std::vector<BYTE> image(header.stringsOffset + header.stringsSize);
+	CopyMemory(&image[0], &header, sizeof(header));
+	if ( !members.empty() )
+		CopyMemory(&image[header.memberOffset], &members[0], header.memberCount * sizeof(SummaryMember));
+	if ( !types.empty() )
+		CopyMemory(&image[header.typeOffset], &types[0], header.typeCount * sizeof(SummaryType));
+	CopyMemory(&image[header.stringsOffset], strings.data(), header.stringsSize);
+
+	HANDLE handle = CreateFileW(file, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( handle == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD written = 0;
+	bool result = WriteFile(handle, &image[0], (DWORD)image.size(), &written, NULL) &&
+				  written == (DWORD)image.size();
+	CloseHandle(handle);
+
+	if ( !result )
+		DeleteFileW(file);
+
+	return result;
+}
+
+////////////////////////////////////
+// ReferenceSummaryView
+
+ReferenceSummaryView::ReferenceSummaryView()
+{
+	_data = NULL;
+	_header = NULL;
+}
+
+// The sections have to lie in the file in order and the strings have to
+// end in a terminator, so every name offset below stringsSize is safe
+// to read.  Name offsets are checked here once instead of on every read.
+bool ReferenceSummaryView::Attach(const BYTE* data, DWORD size)
+{
+	const SummaryHeader* header = (const SummaryHeader*)data;
+
+	_data = NULL;
+	_header = NULL;
+
+	if ( NULL == data || size < sizeof(SummaryHeader) ||
+		 header->magic != SUMMARY_MAGIC || header->version != SUMMARY_VERSION )
+		return false;
+
+	if ( header->memberOffset != sizeof(SummaryHeader) ||
+		 header->memberCount > (size - header->memberOffset) / sizeof(SummaryMember) )
+		return false;
+
+	if ( header->typeOffset != header->memberOffset + header->memberCount * sizeof(SummaryMember) ||
+		 header->typeCount > (size - header->typeOffset) / sizeof(SummaryType) )
+		return false;
+
+	if ( header->stringsOffset != header->typeOffset + header->typeCount * sizeof(SummaryType) ||
+		 header->stringsSize == 0 || header->stringsSize > size - header->stringsOffset ||
+		 data[header->stringsOffset + header->stringsSize - 1] != '\0' )
+		return false;
+
+	const SummaryMember* members = (const SummaryMember*)(data + header->memberOffset);
+	for (DWORD m = 0; m < header->memberCount; m++)
+    {
+		if ( members[m].type >= header->typeCount || members[m].name >= header->stringsSize )
+			return false;
+	}
+
+	const SummaryType* types = (const SummaryType*)(data + header->typeOffset);
+	for (DWORD t = 0; t < header->typeCount; t++)
+    {
+		if ( types[t].nameSpace >= header->stringsSize || types[t].name >= header->stringsSize )
+			return false;
+	}
+
+	_data = data;
+	_header = header;
+	return true;
+}
+
+bool ReferenceSummaryView::UsesOpcode(USHORT encoding) const
+{
+	if ( NULL == _header || encoding >= SUMMARY_OPCODE_BITS )
+		return false;
+
+	return (_header->opcodes[encoding / 32] & (1 << (encoding % 32))) != 0;
+}
@@ -0,0 +1,140 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmsummary.h : reference summaries.  A summary is what the policy checks
+// look at, taken from one validation: the types and members an organism
+// references, its base and field types, the opcodes it uses and the
+// attributes that are banned outright.  It is written as one flat file
+// that can be mapped and read in place, so a changed policy can be
+// applied to stored organisms without decoding them again.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "asmvisitor.h"
+
+#define SUMMARY_MAGIC           0x4D534341  // "ACSM"
+#define SUMMARY_VERSION         1
+
+// one bit per opcode: one byte opcodes by value, two byte opcodes
+// (0xFE xx) at 0x100 + xx
+#define SUMMARY_OPCODE_BITS     0x200
+#define SUMMARY_OPCODE_WORDS    (SUMMARY_OPCODE_BITS / 32)
+
+// SummaryHeader.features
+#define SUMMARY_FEATURE_PINVOKE             0x00000001
+#define SUMMARY_FEATURE_HAS_SECURITY        0x00000002
+#define SUMMARY_FEATURE_REQUIRE_SEC_OBJECT  0x00000004
+#define SUMMARY_FEATURE_CLASS_CONSTRUCTOR   0x00000008  // one that does more than return
+#define SUMMARY_FEATURE_STATIC_FIELD        0x00000010  // other than a literal
+#define SUMMARY_FEATURE_EXCEPTION_HANDLERS  0x00000020
+
+// SummaryType.uses
+#define SUMMARY_USE_DEFINED     0x00000001  // a type of the organism
+#define SUMMARY_USE_BASE        0x00000002  // extended by a type of the organism
+#define SUMMARY_USE_CALL        0x00000004  // declares a method the organism references
+#define SUMMARY_USE_FIELD       0x00000008  // declares a field the organism references
+#define SUMMARY_USE_FIELD_TYPE  0x00000010  // type of a field of the organism
+
+// The file is the header, the members, the types and the strings, in
+// that order.  Names are offsets into the strings, which are UTF-8 and
+// NUL terminated.
+struct SummaryHeader {
+	DWORD magic;            // SUMMARY_MAGIC
+	DWORD version;          // SUMMARY_VERSION
+	DWORD fileSize;         // of the assembly summarized
+	DWORD contexts;         // one bit per ErrorContext the validation reported
+	DWORD features;         // SUMMARY_FEATURE_*
+	DWORD memberCount;
+	DWORD memberOffset;
+	DWORD typeCount;
+	DWORD typeOffset;
+	DWORD stringsSize;
+	DWORD stringsOffset;
+	DWORD reserved;
+	DWORD opcodes[SUMMARY_OPCODE_WORDS];
+};
+
+// a member of another assembly, one per MemberRef row
+struct SummaryMember {
+	ULONGLONG key;          // KeyMember, 0 if the reference couldn't be keyed
+	DWORD type;             // index of the declaring type
+	DWORD name;
+	DWORD callSites;        // instructions referencing it
+	DWORD reserved;
+};
+
+struct SummaryType {
+	DWORD nameSpace;
+	DWORD name;
+	DWORD uses;             // SUMMARY_USE_*
+	DWORD callSites;        // instructions referencing its members
+};
+
+// Collects the summary from the decode pass.  The tables must be those
+// of the assembly being validated, and Write must be called while they
+// are still mapped.
+class ReferenceSummary : public AssemblyVisitor {
+private:
+	struct TypeUse {
+		DWORD uses;
+		DWORD callSites;
+	};
+
+	typedef std::map<mdToken, TypeUse, std::less<mdToken>,
+					 TrackedAllocator<std::pair<const mdToken, TypeUse> > > typeUseMap;
+	typedef std::map<ULONG, DWORD, std::less<ULONG>,
+					 TrackedAllocator<std::pair<const ULONG, DWORD> > > callSiteMap;
+	typedef std::map<std::string, DWORD> stringMap;
+
+	MetaDataTables* _tables;
+	typeUseMap _types;
+	callSiteMap _memberCallSites;   // by MemberRef rid
+	DWORD _features;
+	DWORD _opcodes[SUMMARY_OPCODE_WORDS];
+
+	void AddType(mdToken tok, DWORD use, DWORD callSites);
+	DWORD AddString(std::string& strings, stringMap& offsets, LPCSTR s);
+
+public:
+	ReferenceSummary(MemoryBudget* budget = NULL);
+
+	void SetTables(MetaDataTables* tables) { _tables = tables; }
+
+	virtual DWORD GetEvents();
+	virtual void BeginType(mdTypeDef tok, const TypeName& name, DWORD flags, mdToken baseTok);
+	virtual void VisitField(mdFieldDef tok, LPCSTR name, DWORD attrs, PCCOR_SIGNATURE sig, ULONG sigSize);
+	virtual void BeginMethod(const ILMethod& method);
+	virtual void VisitInstruction(const ILInstruction& instr);
+
+	bool Write(LPCWSTR file, DWORD fileSize, DWORD contexts);
+};
+
+// a summary file mapped by the caller; nothing is copied
+class ReferenceSummaryView {
+private:
+	const BYTE* _data;
+	const SummaryHeader* _header;
+
+public:
+	ReferenceSummaryView();
+
+	// false if data isn't a well formed summary
+	bool Attach(const BYTE* data, DWORD size);
+
+	const SummaryHeader* GetHeader() const { return _header; }
+	const SummaryMember* GetMembers() const { return (const SummaryMember*)(_data + _header->memberOffset); }
+	const SummaryType* GetTypes() const { return (const SummaryType*)(_data + _header->typeOffset); }
+	LPCSTR GetString(DWORD offset) const { return (LPCSTR)(_data + _header->stringsOffset + offset); }
+
+	bool UsesOpcode(USHORT encoding) const;
+};
+
+// SUMMARY_OPCODE_BITS index of an opcode
+USHORT OpcodeEncoding(OPCODE opcode);
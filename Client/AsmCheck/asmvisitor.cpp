@@ -0,0 +1,421 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmvisitor.cpp : analyzers that run on the decoded assembly stream
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmvisitor.h"
+
+AssemblyStatistics::AssemblyStatistics()
+{
+	_types = _fields = _methods = 0;
+	_instructions = _ilBytes = _memberRefs = 0;
+}
+
+DWORD AssemblyStatistics::GetEvents()
+{
+	return VISITOR_EVENT_MASK(TypeEvent) | VISITOR_EVENT_MASK(FieldEvent) |
+		   VISITOR_EVENT_MASK(MethodEvent) | VISITOR_EVENT_MASK(InstructionEvent);
+}
+
+void AssemblyStatistics::BeginType(mdTypeDef tok, const TypeName& /* name */, DWORD /* flags */, mdToken /* baseTok */)
+{
+	if ( tok != mdTokenNil )
+		_types++;
+}
+
+void AssemblyStatistics::VisitField(mdFieldDef /* tok */, LPCSTR /* name */, DWORD /* attrs */,
+									PCCOR_SIGNATURE /* sig */, ULONG /* sigSize */)
+{
+	_fields++;
+}
+
+void AssemblyStatistics::BeginMethod(const ILMethod& method)
+{
+	_methods++;
+	_ilBytes += method.codeSize;
+}
+
+void AssemblyStatistics::VisitInstruction(const ILInstruction& instr)
+{
+	_instructions++;
+	if ( NULL != instr.memberName )
+		_memberRefs++;
+}
+
+void AssemblyStatistics::GetStats(ASMCHECK_STATS* stats)
+{
+	if ( NULL == stats )
+		return;
+
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, typeCount) )
+		stats->typeCount = _types;
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, fieldCount) )
+		stats->fieldCount = _fields;
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, methodCount) )
+		stats->methodCount = _methods;
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, instructionCount) )
+		stats->instructionCount = _instructions;
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, ilBytes) )
+		stats->ilBytes = _ilBytes;
+	if ( ASMCHECK_HAS_FIELD(stats, ASMCHECK_STATS, memberRefCount) )
+		stats->memberRefCount = _memberRefs;
+}
+
+
+// saturating arithmetic, a runaway estimate just stays at the top
+static ULONGLONG CostAdd(ULONGLONG a, ULONGLONG b)
+{
+	return (a + b < a) ? (ULONGLONG)-1 : a + b;
+}
+
+static ULONGLONG CostMul(ULONGLONG a, ULONGLONG b)
+{
+	if ( a != 0 && b > ((ULONGLONG)-1) / a )
+		return (ULONGLONG)-1;
+	return a * b;
+}
+
+ULONG InstructionCost(OPCODE opcode)
+{
+	switch (opcode)
+    {
+		case CEE_CALL:
+		case CEE_CALLVIRT:
+		case CEE_CALLI:
+		case CEE_JMP:
+			return 10;
+
+		case CEE_NEWOBJ:
+			return 25;
+
+		case CEE_NEWARR:
+			return 20;
+
+		case CEE_BOX:
+			return 8;
+
+		case CEE_UNBOX:
+		case CEE_UNBOX_ANY:
+		case CEE_CASTCLASS:
+		case CEE_ISINST:
+		case CEE_DIV:
+		case CEE_DIV_UN:
+		case CEE_REM:
+		case CEE_REM_UN:
+			return 4;
+
+		case CEE_LDSTR:
+		case CEE_LDELEMA:
+		case CEE_LDELEM:
+		case CEE_LDELEM_REF:
+		case CEE_STELEM:
+		case CEE_STELEM_REF:
+			return 2;
+
+		case CEE_THROW:
+		case CEE_RETHROW:
+			return 100;
+
+		case CEE_LOCALLOC:
+		case CEE_CPBLK:
+		case CEE_INITBLK:
+			return 50;
+	}
+
+	return 1;
+}
+
+// Counts newobj and newarr, box, and the String.Concat calls the compilers
+// emit for string +.  A newobj of a value type doesn't allocate, but telling
+// it apart takes a lookup per site, and organisms rarely construct structs
+// in their handlers.
+ULONG AllocationCount(const ILInstruction& instr)
+{
+	switch (instr.opcode)
+    {
+		case CEE_NEWOBJ:
+		case CEE_NEWARR:
+		case CEE_BOX:
+			return 1;
+
+		case CEE_CALL:
+			if ( NULL != instr.memberName && 0 == strcmp(instr.memberName, "Concat") &&
+				 instr.className.Equals("System.String") )
+				return 1;
+			break;
+	}
+
+	return 0;
+}
+
+// trips through a block nested depth loops deep
+static ULONGLONG LoopWeight(DWORD depth)
+{
+	ULONGLONG weight = 1;
+
+	depth = min(depth, (DWORD)COST_MAX_LOOP_DEPTH);
+	for (DWORD d = 0; d < depth; d++)
+		weight *= COST_LOOP_ITERATIONS;
+
+	return weight;
+}
+
+CostEstimator::CostEstimator(MemoryBudget* budget) :
+	_methods(methodCostMap::key_compare(), methodCostMap::allocator_type(budget)),
+	_handlers(handlerSet::key_compare(), handlerSet::allocator_type(budget))
+{
+	_poll = NULL;
+	_loops = 0;
+	_summed = false;
+	_turnCost = 0;
+	_turnAllocs = 0;
+	_costliest = mdTokenNil;
+	_mostAllocating = mdTokenNil;
+}
+
+DWORD CostEstimator::GetEvents()
+{
+	return VISITOR_EVENT_MASK(MethodEvent) | VISITOR_EVENT_MASK(InstructionEvent);
+}
+
+void CostEstimator::BeginMethod(const ILMethod& method)
+{
+	_graph.Begin(method.codeSize);
+	_callInstrs.clear();
+	_callees.clear();
+	_allocInstrs.clear();
+	_allocCounts.clear();
+}
+
+void CostEstimator::VisitInstruction(const ILInstruction& instr)
+{
+	DWORD index = _graph.GetInstrCount();
+	_graph.Add(instr);
+
+	ULONG allocs = AllocationCount(instr);
+	if ( allocs != 0 )
+    {
+		_allocInstrs.push_back(index);
+		_allocCounts.push_back(allocs);
+	}
+
+	if ( TypeFromToken(instr.token) != mdtMethodDef )
+		return;
+
+	switch (instr.opcode)
+    {
+		case CEE_CALL:
+		case CEE_CALLVIRT:
+		case CEE_NEWOBJ:
+		case CEE_JMP:
+			_callInstrs.push_back(index);
+			_callees.push_back(instr.token);
+			break;
+
+		// a method bound to a delegate, i.e. an event handler
+		case CEE_LDFTN:
+		case CEE_LDVIRTFTN:
+			_handlers.insert(instr.token);
+			break;
+	}
+}
+
+// Loop nesting of a block as the weights see it.  When the graph gave up
+// finding loops, every reachable block is taken to be as deep as the
+// estimate goes, so a method too tangled to analyze can't look cheap.
+DWORD CostEstimator::LoopDepth(const ILBasicBlock& block)
+{
+	if ( _graph.LoopsTruncated() && block.reachable )
+		return COST_MAX_LOOP_DEPTH;
+
+	return min(block.loopDepth, (DWORD)COST_MAX_LOOP_DEPTH);
+}
+
+void CostEstimator::EndMethod(const ILMethod& method)
+{
+	MethodCost& cost = _methods[method.token];
+	cost.local = 0;
+	cost.total = 0;
+	cost.localAllocs = 0;
+	cost.totalAllocs = 0;
+	cost.state = 0;
+	cost.calls.clear();
+
+	if ( NULL == method.code )
+		return;
+
+	_graph.Build(_poll);
+	_loops += _graph.GetLoopCount();
+
+	for (DWORD b = 0; b < _graph.GetBlockCount(); b++)
+    {
+		const ILBasicBlock& block = _graph.GetBlock(b);
+		ULONGLONG blockCost = 0;
+
+		for (DWORD i = 0; i < block.numInstrs; i++)
+			blockCost += InstructionCost(_graph.GetInstr(block.firstInstr + i).opcode);
+
+		DWORD depth = LoopDepth(block);
+		for (DWORD d = 0; d < depth; d++)
+			blockCost = CostMul(blockCost, COST_LOOP_ITERATIONS);
+
+		cost.local = CostAdd(cost.local, blockCost);
+	}
+
+	for (size_t c = 0; c < _callInstrs.size(); c++)
+    {
+		const ILBasicBlock& block = _graph.GetBlock(_graph.GetInstr(_callInstrs[c]).block);
+		CallSite site;
+		site.callee = _callees[c];
+		site.weight = LoopWeight(LoopDepth(block));
+
+		cost.calls.push_back(site);
+	}
+
+	// an allocation in unreachable code never happens
+	for (size_t a = 0; a < _allocInstrs.size(); a++)
+    {
+		const ILBasicBlock& block = _graph.GetBlock(_graph.GetInstr(_allocInstrs[a]).block);
+		if ( block.reachable )
+			cost.localAllocs = CostAdd(cost.localAllocs, _allocCounts[a] * LoopWeight(LoopDepth(block)));
+	}
+}
+
+// Local cost plus the weighted cost of every callee, and the same for
+// allocations.  Walks the call graph with an explicit stack; a call back
+// into a method still being summed is recursion and is charged as a loop
+// over the callee's own body.
+ULONGLONG CostEstimator::TotalCost(mdMethodDef tok, ULONGLONG* allocs)
+{
+	*allocs = 0;
+
+	methodCostMap::iterator it = _methods.find(tok);
+	if ( it == _methods.end() )
+		return 0;
+
+	MethodCost& root = (*it).second;
+	if ( root.state == 2 )
+    {
+		*allocs = root.totalAllocs;
+		return root.total;
+	}
+
+	std::vector<CostFrame> stack;
+	CostFrame frame;
+	frame.method = &root;
+	frame.next = 0;
+	frame.weight = 1;
+	root.state = 1;
+	root.total = root.local;
+	root.totalAllocs = root.localAllocs;
+	stack.push_back(frame);
+
+	while ( !stack.empty() )
+    {
+		CostFrame& top = stack.back();
+		MethodCost* method = top.method;
+
+		if ( top.next < method->calls.size() )
+        {
+			const CallSite& site = method->calls[top.next++];
+
+			it = _methods.find(site.callee);
+			if ( it == _methods.end() )
+				continue;
+
+			MethodCost& callee = (*it).second;
+			if ( callee.state == 2 )
+            {
+				method->total = CostAdd(method->total, CostMul(site.weight, callee.total));
+				method->totalAllocs = CostAdd(method->totalAllocs, CostMul(site.weight, callee.totalAllocs));
+			}
+            else if ( callee.state == 1 )
+            {
+				method->total = CostAdd(method->total,
+										CostMul(site.weight, CostMul(callee.local, COST_RECURSION_FACTOR)));
+				method->totalAllocs = CostAdd(method->totalAllocs,
+											  CostMul(site.weight, CostMul(callee.localAllocs, COST_RECURSION_FACTOR)));
+			}
+            else
+            {
+				callee.state = 1;
+				callee.total = callee.local;
+				callee.totalAllocs = callee.localAllocs;
+				frame.method = &callee;
+				frame.next = 0;
+				frame.weight = site.weight;
+				stack.push_back(frame);
+			}
+		}
+        else
+        {
+			ULONGLONG weight = top.weight;
+			method->state = 2;
+			stack.pop_back();
+
+			if ( !stack.empty() )
+            {
+				MethodCost* caller = stack.back().method;
+				caller->total = CostAdd(caller->total, CostMul(weight, method->total));
+				caller->totalAllocs = CostAdd(caller->totalAllocs, CostMul(weight, method->totalAllocs));
+			}
+		}
+	}
+
+	*allocs = root.totalAllocs;
+	return root.total;
+}
+
+ULONGLONG CostEstimator::GetTurnCost()
+{
+	if ( _summed )
+		return _turnCost;
+
+	ULONGLONG costliest = 0, mostAllocs = 0;
+
+	// every handler is taken to run once a turn
+	for (handlerSet::iterator it = _handlers.begin(); it != _handlers.end(); it++)
+    {
+		ULONGLONG allocs;
+		ULONGLONG cost = TotalCost(*it, &allocs);
+		_turnCost = CostAdd(_turnCost, cost);
+		_turnAllocs = CostAdd(_turnAllocs, allocs);
+
+		if ( cost > costliest || _costliest == mdTokenNil )
+        {
+			costliest = cost;
+			_costliest = *it;
+		}
+
+		if ( allocs > mostAllocs || _mostAllocating == mdTokenNil )
+        {
+			mostAllocs = allocs;
+			_mostAllocating = *it;
+		}
+	}
+
+	_summed = true;
+	return _turnCost;
+}
+
+mdMethodDef CostEstimator::GetCostliestHandler()
+{
+	GetTurnCost();
+	return _costliest;
+}
+
+ULONGLONG CostEstimator::GetTurnAllocations()
+{
+	GetTurnCost();
+	return _turnAllocs;
+}
+
+mdMethodDef CostEstimator::GetMostAllocatingHandler()
+{
+	GetTurnCost();
+	return _mostAllocating;
+}
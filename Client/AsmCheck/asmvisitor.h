@@ -0,0 +1,198 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmvisitor.h : callbacks over the decoded types, members and IL of an
+// assembly.  ManagedAssembly decodes the assembly once, runs its own policy
+// checks and hands the same stream to every registered visitor.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "ilopcode.h"
+#include "mdtables.h"
+#include "ilflow.h"
+#include "asmalloc.h"
+
+// One decoded IL instruction.  Names are only resolved for
+// method and field references, the same ones the policy checks,
+// and point into the #Strings heap of the mapped assembly.
+struct ILInstruction {
+	DWORD offset;           // offset of the opcode within the method body
+	DWORD length;           // opcode plus inline operand
+	OPCODE opcode;
+	BYTE format;            // OpcodeInfo[opcode].Type
+	const BYTE* operand;    // first operand byte
+	mdToken token;          // token operand, mdTokenNil if there is none
+	DWORD target;           // (Short)InlineBrTarget destination offset
+	DWORD numTargets;       // InlineSwitch case count
+	mdToken classToken;     // parent of a resolved method or field reference
+	TypeName className;     // empty unless classToken was resolved
+	LPCSTR memberName;      // NULL unless the reference was resolved
+};
+
+// destination of the n'th case of an InlineSwitch instruction
+inline DWORD SwitchTarget(const ILInstruction& instr, DWORD n)
+{
+	const BYTE* pcrel = instr.operand + 4 + 4 * n;
+	return (DWORD)((LONG)(instr.offset + instr.length) + (LONG)GET_UNALIGNED_DWORD(pcrel));
+}
+
+// A method as seen by the visitors.  code is NULL for methods without a body.
+struct ILMethod {
+	mdMethodDef token;
+	LPCSTR name;
+	DWORD attrs;
+	DWORD implFlags;
+	PCCOR_SIGNATURE sig;
+	ULONG sigSize;
+	const BYTE* code;
+	DWORD codeSize;
+	const COR_ILMETHOD_DECODER* header;
+};
+
+enum VisitorEvent {
+	AssemblyEvent = 0,
+	TypeEvent,
+	FieldEvent,
+	MethodEvent,
+	InstructionEvent,
+	VisitorEventCount
+};
+
+#define VISITOR_EVENT_MASK(ev) (1 << (ev))
+#define MAX_VISITORS 16
+
+// Base class for analyzers.  GetEvents tells the dispatcher which of the
+// callbacks below are wanted, so a visitor only pays for what it uses.
+class AssemblyVisitor {
+public:
+	virtual ~AssemblyVisitor() {}
+
+	virtual DWORD GetEvents() = 0;
+
+	// AssemblyEvent
+	virtual void BeginAssembly(LPCWSTR /* path */) {}
+	virtual void EndAssembly(int /* errorCount */) {}
+
+	// TypeEvent; mdTokenNil is the pseudo type holding global members
+	virtual void BeginType(mdTypeDef /* tok */, const TypeName& /* name */, DWORD /* flags */, mdToken /* baseTok */) {}
+	virtual void EndType(mdTypeDef /* tok */) {}
+
+	// FieldEvent
+	virtual void VisitField(mdFieldDef /* tok */, LPCSTR /* name */, DWORD /* attrs */,
+							PCCOR_SIGNATURE /* sig */, ULONG /* sigSize */) {}
+
+	// MethodEvent
+	virtual void BeginMethod(const ILMethod& /* method */) {}
+	virtual void EndMethod(const ILMethod& /* method */) {}
+
+	// InstructionEvent
+	virtual void VisitInstruction(const ILInstruction& /* instr */) {}
+};
+
+// Counts what the decode pass has seen; backs the ASMCHECK_STATS totals.
+class AssemblyStatistics : public AssemblyVisitor {
+private:
+	ULONG _types;
+	ULONG _fields;
+	ULONG _methods;
+	ULONG _instructions;
+	ULONG _ilBytes;
+	ULONG _memberRefs;
+
+public:
+	AssemblyStatistics();
+
+	virtual DWORD GetEvents();
+	virtual void BeginType(mdTypeDef tok, const TypeName& name, DWORD flags, mdToken baseTok);
+	virtual void VisitField(mdFieldDef tok, LPCSTR name, DWORD attrs, PCCOR_SIGNATURE sig, ULONG sigSize);
+	virtual void BeginMethod(const ILMethod& method);
+	virtual void VisitInstruction(const ILInstruction& instr);
+
+	void GetStats(ASMCHECK_STATS* stats);
+};
+
+// cost model knobs
+#define COST_LOOP_ITERATIONS   16   // assumed trips through a loop body
+#define COST_MAX_LOOP_DEPTH    4    // deeper nesting is not multiplied further
+#define COST_RECURSION_FACTOR  COST_LOOP_ITERATIONS
+
+// relative cost of executing one instruction once
+ULONG InstructionCost(OPCODE opcode);
+
+// heap allocations made by executing one instruction once
+ULONG AllocationCount(const ILInstruction& instr);
+
+// Static estimate of what an organism costs per turn.  Each method gets a
+// local cost from its basic blocks weighted by loop nesting; calls into the
+// assembly add the callee's cost at the weight of the call site.  The turn
+// cost is the sum over the methods the organism binds to delegates, which
+// is how its event handlers get hooked up.  Allocation sites are weighted
+// and summed the same way, for the garbage a turn leaves behind.
+class CostEstimator : public AssemblyVisitor {
+private:
+	struct CallSite {
+		mdMethodDef callee;
+		ULONGLONG weight;
+	};
+
+	struct MethodCost {
+		ULONGLONG local;
+		ULONGLONG total;
+		ULONGLONG localAllocs;
+		ULONGLONG totalAllocs;
+		DWORD state;            // 0 not summed, 1 being summed, 2 done
+		std::vector<CallSite> calls;
+	};
+
+	typedef std::map<mdMethodDef, MethodCost, std::less<mdMethodDef>,
+					 TrackedAllocator<std::pair<const mdMethodDef, MethodCost> > > methodCostMap;
+	typedef std::set<mdMethodDef, std::less<mdMethodDef>, TrackedAllocator<mdMethodDef> > handlerSet;
+
+	struct CostFrame {
+		MethodCost* method;
+		size_t next;
+		ULONGLONG weight;       // of the call site in the caller
+	};
+
+	ILFlowGraph _graph;
+	ILFlowPoll* _poll;
+	std::vector<DWORD> _callInstrs;     // internal call sites of the current method
+	std::vector<mdMethodDef> _callees;
+	std::vector<DWORD> _allocInstrs;    // allocation sites of the current method
+	std::vector<ULONG> _allocCounts;
+	methodCostMap _methods;
+	handlerSet _handlers;
+	ULONG _loops;
+	bool _summed;
+	ULONGLONG _turnCost;
+	ULONGLONG _turnAllocs;
+	mdMethodDef _costliest;
+	mdMethodDef _mostAllocating;
+
+	ULONGLONG TotalCost(mdMethodDef tok, ULONGLONG* allocs);
+	DWORD LoopDepth(const ILBasicBlock& block);
+
+public:
+	CostEstimator(MemoryBudget* budget = NULL);
+
+	// asked while finding loops whether the validation is to give up
+	void SetPoll(ILFlowPoll* poll) { _poll = poll; }
+
+	virtual DWORD GetEvents();
+	virtual void BeginMethod(const ILMethod& method);
+	virtual void EndMethod(const ILMethod& method);
+	virtual void VisitInstruction(const ILInstruction& instr);
+
+	ULONGLONG GetTurnCost();
+	mdMethodDef GetCostliestHandler();
+	ULONGLONG GetTurnAllocations();
+	mdMethodDef GetMostAllocatingHandler();
+	ULONG GetLoopCount() { return _loops; }
+};
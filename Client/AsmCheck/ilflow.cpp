@@ -0,0 +1,351 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// ilflow.cpp : basic blocks and natural loops of a method body
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmvisitor.h"
+#include "ilflow.h"
+
+ILFlowKind GetFlowKind(OPCODE opcode, BYTE format)
+{
+	switch (opcode)
+    {
+		case CEE_BR:
+		case CEE_BR_S:
+		case CEE_LEAVE:
+		case CEE_LEAVE_S:
+			return FlowBranch;
+
+		case CEE_RET:
+		case CEE_THROW:
+		case CEE_RETHROW:
+		case CEE_ENDFINALLY:
+		case CEE_ENDFILTER:
+		case CEE_JMP:
+			return FlowReturn;
+	}
+
+	if ( format == InlineBrTarget || format == ShortInlineBrTarget || format == InlineSwitch )
+		return FlowCondBranch;
+
+	return FlowNext;
+}
+
+#define NO_BLOCK ((DWORD)-1)
+
+ILFlowGraph::ILFlowGraph()
+{
+	_codeSize = 0;
+	_loopCount = 0;
+	_loopsTruncated = false;
+}
+
+void ILFlowGraph::Begin(DWORD codeSize)
+{
+	_codeSize = codeSize;
+	_loopCount = 0;
+	_loopsTruncated = false;
+	_instrs.clear();
+	_targets.clear();
+	_blocks.clear();
+	_succs.clear();
+}
+
+void ILFlowGraph::Add(const ILInstruction& instr)
+{
+	ILFlowInstr fi;
+	fi.offset = instr.offset;
+	fi.length = instr.length;
+	fi.opcode = instr.opcode;
+	fi.flow = (BYTE)GetFlowKind(instr.opcode, instr.format);
+	fi.firstTarget = (DWORD)_targets.size();
+	fi.numTargets = 0;
+	fi.block = 0;
+
+	// a truncated operand has no usable targets
+	bool complete = instr.length > 0 && instr.length <= _codeSize &&
+					instr.offset <= _codeSize - instr.length &&
+					instr.numTargets <= _codeSize / 4;
+
+	if ( fi.flow == FlowBranch || fi.flow == FlowCondBranch )
+    {
+		if ( instr.format == InlineSwitch )
+        {
+			if ( complete )
+            {
+				for (DWORD n = 0; n < instr.numTargets; n++)
+					_targets.push_back(SwitchTarget(instr, n));
+				fi.numTargets = instr.numTargets;
+			}
+		}
+        else if ( complete )
+        {
+			_targets.push_back(instr.target);
+			fi.numTargets = 1;
+		}
+	}
+
+	_instrs.push_back(fi);
+}
+
+// index of the instruction starting at offset, -1 if there is none
+int ILFlowGraph::FindInstr(DWORD offset)
+{
+	int lo = 0, hi = (int)_instrs.size() - 1;
+
+	while ( lo <= hi )
+    {
+		int mid = lo + (hi - lo) / 2;
+		if ( _instrs[mid].offset == offset )
+			return mid;
+		if ( _instrs[mid].offset < offset )
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+void ILFlowGraph::Build(ILFlowPoll* poll)
+{
+	DWORD count = (DWORD)_instrs.size();
+	DWORD i, n;
+
+	if ( count == 0 )
+		return;
+
+	// leaders: the entry, every branch target and whatever follows a branch
+	_scratch.assign(count, 0);
+	_scratch[0] = 1;
+	for (i = 0; i < count; i++)
+    {
+		const ILFlowInstr& fi = _instrs[i];
+
+		for (n = 0; n < fi.numTargets; n++)
+        {
+			int t = FindInstr(_targets[fi.firstTarget + n]);
+			if ( t >= 0 )
+				_scratch[t] = 1;
+		}
+
+		if ( fi.flow != FlowNext && i + 1 < count )
+			_scratch[i + 1] = 1;
+	}
+
+	for (i = 0; i < count; i++)
+    {
+		if ( _scratch[i] )
+        {
+			ILBasicBlock block;
+			block.firstInstr = i;
+			block.numInstrs = 0;
+			block.firstSucc = 0;
+			block.numSuccs = 0;
+			block.loopDepth = 0;
+			block.reachable = false;
+			_blocks.push_back(block);
+		}
+		_instrs[i].block = (DWORD)_blocks.size() - 1;
+		_blocks.back().numInstrs++;
+	}
+
+	DWORD numBlocks = (DWORD)_blocks.size();
+
+	for (DWORD b = 0; b < numBlocks; b++)
+    {
+		ILBasicBlock& block = _blocks[b];
+		const ILFlowInstr& last = _instrs[block.firstInstr + block.numInstrs - 1];
+
+		block.firstSucc = (DWORD)_succs.size();
+
+		for (n = 0; n < last.numTargets; n++)
+        {
+			int t = FindInstr(_targets[last.firstTarget + n]);
+			if ( t >= 0 )
+				_succs.push_back(_instrs[t].block);
+		}
+
+		if ( (last.flow == FlowNext || last.flow == FlowCondBranch) && b + 1 < numBlocks )
+			_succs.push_back(b + 1);
+
+		block.numSuccs = (DWORD)_succs.size() - block.firstSucc;
+	}
+
+	// depth first walk from the entry; an edge back to a block
+	// still on the stack closes a loop
+	std::vector<DWORD>& state = _scratch;
+	state.assign(numBlocks, 0);
+	_stack.clear();
+	_backEdges.clear();
+
+	_stack.push_back(0);
+	_stack.push_back(0);
+	state[0] = 1;
+	_blocks[0].reachable = true;
+
+	while ( !_stack.empty() )
+    {
+		DWORD next = _stack.back();
+		DWORD b = _stack[_stack.size() - 2];
+		ILBasicBlock& block = _blocks[b];
+
+		if ( next < block.numSuccs )
+        {
+			_stack.back()++;
+			DWORD s = _succs[block.firstSucc + next];
+
+			if ( state[s] == 0 )
+            {
+				state[s] = 1;
+				_blocks[s].reachable = true;
+				_stack.push_back(s);
+				_stack.push_back(0);
+			}
+            else if ( state[s] == 1 )
+            {
+				_backEdges.push_back(s);
+				_backEdges.push_back(b);
+			}
+		}
+        else
+        {
+			state[b] = 2;
+			_stack.pop_back();
+			_stack.pop_back();
+		}
+	}
+
+	if ( _backEdges.empty() )
+		return;
+
+	// predecessor lists of the reachable blocks
+	_predStart.assign(numBlocks + 1, 0);
+	for (DWORD b = 0; b < numBlocks; b++)
+    {
+		if ( !_blocks[b].reachable )
+			continue;
+		for (n = 0; n < _blocks[b].numSuccs; n++)
+			_predStart[_succs[_blocks[b].firstSucc + n] + 1]++;
+	}
+	for (DWORD b = 0; b < numBlocks; b++)
+		_predStart[b + 1] += _predStart[b];
+
+	_preds.assign(_predStart[numBlocks], 0);
+	std::vector<DWORD>& fill = _scratch;
+	fill.assign(_predStart.begin(), _predStart.end() - 1);
+	for (DWORD b = 0; b < numBlocks; b++)
+    {
+		if ( !_blocks[b].reachable )
+			continue;
+		for (n = 0; n < _blocks[b].numSuccs; n++)
+			_preds[fill[_succs[_blocks[b].firstSucc + n]]++] = b;
+	}
+
+	// tails of the back edges, grouped by header
+	_tailStart.assign(numBlocks + 1, 0);
+	for (i = 0; i < _backEdges.size(); i += 2)
+		_tailStart[_backEdges[i] + 1]++;
+	for (DWORD b = 0; b < numBlocks; b++)
+		_tailStart[b + 1] += _tailStart[b];
+
+	_tails.assign(_backEdges.size() / 2, 0);
+	fill.assign(_tailStart.begin(), _tailStart.end() - 1);
+	for (i = 0; i < _backEdges.size(); i += 2)
+		_tails[fill[_backEdges[i]]++] = _backEdges[i + 1];
+
+	// One natural loop per header, holding the bodies of all its back
+	// edges: the blocks that reach a tail without going through the
+	// header.  A walk from a tail that gets to the entry instead found
+	// an edge into an irreducible region, whose header doesn't dominate
+	// the tail; it closes no natural loop and its marks are taken back.
+	DWORD work = 0;
+	_stamp.assign(numBlocks, NO_BLOCK);
+	for (DWORD header = 0; header < numBlocks; header++)
+    {
+		if ( _tailStart[header] == _tailStart[header + 1] )
+			continue;
+
+		if ( work > FLOW_MAX_LOOP_WORK || (NULL != poll && poll->Stopped()) )
+        {
+			_loopsTruncated = true;
+			break;
+		}
+
+		bool closed = false;
+		_stamp[header] = header;
+		_body.clear();
+
+		for (DWORD t = _tailStart[header]; t < _tailStart[header + 1]; t++)
+        {
+			DWORD tail = _tails[t];
+
+			if ( work > FLOW_MAX_LOOP_WORK )
+            {
+				_loopsTruncated = true;
+				break;
+			}
+
+			// a self loop, or a tail already in the body of another
+			if ( _stamp[tail] == header )
+            {
+				closed = true;
+				continue;
+			}
+
+			size_t walked = _body.size();
+			bool dominated = (tail != 0);
+			_stamp[tail] = header;
+			_body.push_back(tail);
+			_stack.clear();
+			_stack.push_back(tail);
+
+			while ( dominated && !_stack.empty() )
+            {
+				DWORD b = _stack.back();
+				_stack.pop_back();
+				work += _predStart[b + 1] - _predStart[b] + 1;
+
+				for (DWORD p = _predStart[b]; p < _predStart[b + 1]; p++)
+                {
+					DWORD pred = _preds[p];
+					if ( _stamp[pred] == header )
+						continue;
+
+					if ( pred == 0 )
+                    {
+						dominated = false;
+						break;
+					}
+
+					_stamp[pred] = header;
+					_body.push_back(pred);
+					_stack.push_back(pred);
+				}
+			}
+
+			if ( dominated )
+				closed = true;
+            else
+            {
+				for (size_t k = walked; k < _body.size(); k++)
+					_stamp[_body[k]] = NO_BLOCK;
+				_body.resize(walked);
+			}
+		}
+
+		if ( _loopsTruncated )
+			break;
+		if ( !closed )
+			continue;
+
+		_loopCount++;
+		_blocks[header].loopDepth++;
+		for (size_t k = 0; k < _body.size(); k++)
+			_blocks[_body[k]].loopDepth++;
+	}
+}
@@ -0,0 +1,99 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// ilflow.h : control flow graph of one method body, built from the
+// instructions handed out by the decode pass.  Used by the analyzers
+// that need to know which code can run more than once.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+#include "ilopcode.h"
+
+struct ILInstruction;
+
+// how control leaves an instruction
+enum ILFlowKind {
+	FlowNext = 0,       // falls through
+	FlowBranch,         // br, leave: goes to its target only
+	FlowCondBranch,     // conditional branch or switch: targets and fall through
+	FlowReturn          // ret, throw, rethrow, endfinally, endfilter, jmp
+};
+
+struct ILFlowInstr {
+	DWORD offset;
+	DWORD length;
+	OPCODE opcode;
+	BYTE flow;              // ILFlowKind
+	DWORD firstTarget;      // index into the graph's target list
+	DWORD numTargets;
+	DWORD block;            // filled in by Build
+};
+
+struct ILBasicBlock {
+	DWORD firstInstr;
+	DWORD numInstrs;
+	DWORD firstSucc;        // index into the graph's successor list
+	DWORD numSuccs;
+	DWORD loopDepth;        // number of natural loops containing the block
+	bool reachable;
+};
+
+ILFlowKind GetFlowKind(OPCODE opcode, BYTE format);
+
+// most predecessor visits Build spends finding natural loops in one
+// method; past it the loops are left as they are and LoopsTruncated says so
+#define FLOW_MAX_LOOP_WORK  (4 * 1024 * 1024)
+
+// asked between loops whether the validation is to give up
+class ILFlowPoll {
+public:
+	virtual bool Stopped() = 0;
+};
+
+class ILFlowGraph {
+private:
+	DWORD _codeSize;
+	std::vector<ILFlowInstr> _instrs;
+	std::vector<DWORD> _targets;
+	std::vector<ILBasicBlock> _blocks;
+	std::vector<DWORD> _succs;
+	DWORD _loopCount;
+	bool _loopsTruncated;
+
+	// scratch space for Build, kept to avoid reallocating per method
+	std::vector<DWORD> _scratch;
+	std::vector<DWORD> _stack;
+	std::vector<DWORD> _backEdges;      // (header, tail) pairs
+	std::vector<DWORD> _tails;          // back edge tails grouped by header
+	std::vector<DWORD> _tailStart;
+	std::vector<DWORD> _preds;
+	std::vector<DWORD> _predStart;
+	std::vector<DWORD> _stamp;
+	std::vector<DWORD> _body;           // of the loop being marked
+
+	int FindInstr(DWORD offset);
+
+public:
+	ILFlowGraph();
+
+	// starts a new method, keeping the storage of the previous one
+	void Begin(DWORD codeSize);
+	void Add(const ILInstruction& instr);
+	// poll, if not NULL, is asked between loops whether to give up
+	void Build(ILFlowPoll* poll = NULL);
+
+	DWORD GetInstrCount() { return (DWORD)_instrs.size(); }
+	const ILFlowInstr& GetInstr(DWORD i) { return _instrs[i]; }
+	DWORD GetBlockCount() { return (DWORD)_blocks.size(); }
+	const ILBasicBlock& GetBlock(DWORD i) { return _blocks[i]; }
+	DWORD GetSuccessor(const ILBasicBlock& block, DWORD n) { return _succs[block.firstSucc + n]; }
+	DWORD GetLoopCount() { return _loopCount; }
+
+	// the loops were too much work to find, or the walk was stopped;
+	// loopDepth understates how often blocks run
+	bool LoopsTruncated() { return _loopsTruncated; }
+};
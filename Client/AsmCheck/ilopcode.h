@@ -0,0 +1,71 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// ilopcode.h : IL opcode enumeration and opcode table shared by the
+// validator and the analyzers that walk the decoded instruction stream
+//
+
+#pragma once
+#pragma unmanaged
+
+#undef OPDEF
+
+typedef enum opcode_t {
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
+#include "opcode.def"
+#undef OPDEF
+	CEE_COUNT,			/* number of instructions and macros pre-defined */
+} OPCODE;
+
+typedef enum opcode_format_t {
+	InlineNone      = 0,  // no inline args
+	InlineVar       = 1,  // local variable       (U2 (U1 if Short on))
+	InlineI         = 2,  // an signed integer    (I4 (I1 if Short on))
+	InlineR         = 3,  // a real number        (R8 (R4 if Short on))
+	InlineBrTarget  = 4,  // branch target        (I4 (I1 if Short on))
+	InlineI8        = 5,
+	InlineMethod    = 6,   // method token (U4)
+	InlineField     = 7,   // field token  (U4)
+	InlineType      = 8,   // type token   (U4)
+	InlineString    = 9,   // string TOKEN (U4)
+	InlineSig       = 10,  // signature tok (U4)
+	InlineRVA       = 11,  // ldptr token  (U4)
+	InlineTok       = 12,  // a metadata token of unknown type (U4)
+	InlineSwitch    = 13,  // count (U4), pcrel1 (U4) .... pcrelN (U4)
+	InlinePhi       = 14,  // count (U1), var1 (U2) ... varN (U2)
+	ShortInline     = 16,					      // if this bit is set, the format is the 'short' format
+	PrimaryMask     = (ShortInline-1),			  // mask these off to get primary enumeration above
+	ShortInlineVar  = (ShortInline + InlineVar),
+	ShortInlineI    = (ShortInline + InlineI),
+	ShortInlineR    = (ShortInline + InlineR),
+	ShortInlineBrTarget = (ShortInline + InlineBrTarget),
+} OPCODE_FORMAT;
+
+
+
+typedef struct {
+	char *  pszName;
+	USHORT   Ref; // reference codes
+	BYTE    Type; // Inline0 etc.
+	BYTE    Len;  // std mapping
+	BYTE    Std1;
+	BYTE    Std2;
+	BYTE    Pop;  // stack slots taken, OPCODE_VAR_STACK if the operand says
+	BYTE    Push; // stack slots left
+} opcodeinfo_t;
+
+#define OPCODE_VAR_STACK 0x40
+
+extern opcodeinfo_t OpcodeInfo[];
+
+OPCODE DecodeOpcode(const BYTE *pCode, DWORD *pdwLen);
+
+// Decodes the instruction at code, with left bytes of the method body
+// from there on.  length is the size of its opcode, operandSize that of
+// the operand after it.  False if either runs off the end of the body.
+bool DecodeInstruction(const BYTE* code, DWORD left, OPCODE* opcode, DWORD* length, DWORD* operandSize);
+
+// read a little endian 32 bit operand
+#define GET_UNALIGNED_DWORD(p) \
+	((DWORD)(p)[0] + ((DWORD)(p)[1] << 8) + ((DWORD)(p)[2] << 16) + ((DWORD)(p)[3] << 24))
@@ -0,0 +1,364 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// ilstack.cpp : single pass evaluation stack check of a method body
+//
+
+#include "stdafx.h"
+#include "asmcheckapi.h"
+#include "asmvisitor.h"
+#include "ilstack.h"
+
+#define STACK_UNKNOWN   0xFFFFFFFF      // _depth after br, ret, throw...
+#define STACK_UNSEEN    0xFFFFFFFF      // _depths slot nothing has reached
+#define STACK_START     0x80000000      // _depths slot of a decoded instruction
+#define STACK_DEPTH(s)  ((s) & ~STACK_START)
+
+// compressed unsigned integer (ECMA-335 II.23.2), bounded by end
+static bool ReadSigData(PCCOR_SIGNATURE& p, PCCOR_SIGNATURE end, ULONG* value)
+{
+	if ( p >= end )
+		return false;
+
+	if ( (p[0] & 0x80) == 0 )
+    {
+		*value = p[0];
+		p += 1;
+	}
+	else if ( (p[0] & 0xC0) == 0x80 && end - p >= 2 )
+    {
+		*value = ((p[0] & 0x3F) << 8) | p[1];
+		p += 2;
+	}
+	else if ( (p[0] & 0xE0) == 0xC0 && end - p >= 4 )
+    {
+		*value = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		p += 4;
+	}
+	else
+		return false;
+
+	return true;
+}
+
+bool ParseMethodSig(PCCOR_SIGNATURE sig, ULONG sigSize, DWORD* params, bool* hasThis, bool* returns)
+{
+	PCCOR_SIGNATURE end = sig + sigSize;
+	ULONG callConv, count;
+
+	if ( NULL == sig || !ReadSigData(sig, end, &callConv) ||
+		 (callConv & IMAGE_CEE_CS_CALLCONV_MASK) > IMAGE_CEE_CS_CALLCONV_VARARG )
+		return false;
+
+	if ( (callConv & IMAGE_CEE_CS_CALLCONV_GENERIC) && !ReadSigData(sig, end, &count) )
+		return false;
+
+	if ( !ReadSigData(sig, end, &count) )
+		return false;
+
+	// custom modifiers come before the return type
+	while ( sig < end && (*sig == ELEMENT_TYPE_CMOD_REQD || *sig == ELEMENT_TYPE_CMOD_OPT) )
+    {
+		ULONG token;
+		sig++;
+		if ( !ReadSigData(sig, end, &token) )
+			return false;
+	}
+
+	if ( sig >= end )
+		return false;
+
+	// an explicit this is the first of the parameters
+	*params = count;
+	*hasThis = (callConv & IMAGE_CEE_CS_CALLCONV_HASTHIS) && !(callConv & IMAGE_CEE_CS_CALLCONV_EXPLICITTHIS);
+	*returns = *sig != ELEMENT_TYPE_VOID;
+	return true;
+}
+
+StackVerifier::StackVerifier()
+{
+	_tables = NULL;
+	_codeSize = 0;
+	_maxStack = 0;
+	_returns = 0;
+	_depth = 0;
+	_end = 0;
+	_last = 0;
+	_pending = 0;
+	_failOffset = 0;
+	_active = false;
+	_failed = false;
+	SetTables(NULL);
+}
+
+void StackVerifier::SetTables(MetaDataTables* tables)
+{
+	_tables = tables;
+	for (int i = 0; i < STACK_CALL_CACHE; i++)
+		_calls[i].token = mdTokenNil;
+}
+
+void StackVerifier::Fail(DWORD offset)
+{
+	if ( !_failed )
+    {
+		_failed = true;
+		_failOffset = offset;
+	}
+}
+
+// Fixes the depth at target; offset is the instruction branching there.
+// Code already passed must have an instruction starting at target.
+bool StackVerifier::Record(DWORD target, DWORD depth, DWORD offset)
+{
+	if ( target >= _codeSize )
+    {
+		Fail(offset);
+		return false;
+	}
+
+	DWORD slot = _depths[target];
+	if ( target < _end )
+    {
+		if ( slot == STACK_UNSEEN || !(slot & STACK_START) || STACK_DEPTH(slot) != depth )
+        {
+			Fail(offset);
+			return false;
+		}
+	}
+	else if ( slot == STACK_UNSEEN )
+    {
+		_depths[target] = depth;
+		_pending++;
+	}
+	else if ( slot != depth )
+    {
+		Fail(offset);
+		return false;
+	}
+
+	return true;
+}
+
+// what a call, callvirt, calli or newobj takes off the stack and leaves on it
+bool StackVerifier::CallStack(const ILInstruction& instr, DWORD* pop, DWORD* push)
+{
+	CallSig& call = _calls[(RidFromToken(instr.token) ^ (instr.token >> 24)) & (STACK_CALL_CACHE - 1)];
+
+	if ( call.token != instr.token || IsNilToken(instr.token) )
+    {
+		PCCOR_SIGNATURE sig;
+		ULONG sigSize;
+
+		if ( NULL == _tables || FAILED(_tables->GetCallSignature(instr.token, &sig, &sigSize)) ||
+			 !ParseMethodSig(sig, sigSize, &call.params, &call.hasThis, &call.returns) )
+        {
+			call.token = mdTokenNil;
+			return false;
+		}
+		call.token = instr.token;
+	}
+
+	DWORD params = call.params;
+	bool hasThis = call.hasThis;
+	bool returns = call.returns;
+
+	switch ( instr.opcode )
+    {
+		case CEE_NEWOBJ:
+			// the new object stands in for this
+			*pop = params;
+			*push = 1;
+			break;
+
+		case CEE_CALLI:
+			// the function pointer goes on top of the arguments
+			*pop = params + (hasThis ? 1 : 0) + 1;
+			*push = returns ? 1 : 0;
+			break;
+
+		default:
+			*pop = params + (hasThis ? 1 : 0);
+			*push = returns ? 1 : 0;
+			break;
+	}
+
+	return true;
+}
+
+void StackVerifier::Begin(const COR_ILMETHOD_DECODER* header, PCCOR_SIGNATURE sig, ULONG sigSize)
+{
+	DWORD params;
+	bool hasThis, returns;
+
+	_active = false;
+	_failed = false;
+	_failOffset = 0;
+	_depth = 0;
+	_end = 0;
+	_last = 0;
+	_pending = 0;
+
+	if ( NULL == header || !ParseMethodSig(sig, sigSize, &params, &hasThis, &returns) )
+		return;
+
+	_codeSize = header->CodeSize;
+	_maxStack = header->MaxStack;
+	_returns = returns ? 1 : 0;
+	_depths.assign(_codeSize, STACK_UNSEEN);
+	_active = true;
+
+	// a protected block is entered with an empty stack, a catch or a
+	// filter with the exception object on it
+	if ( NULL != header->EH )
+    {
+		unsigned count = header->EH->EHCount();
+		for (unsigned i = 0; i < count; i++)
+        {
+			COR_ILMETHOD_SECT_EH_CLAUSE_FAT buffer;
+			const COR_ILMETHOD_SECT_EH_CLAUSE_FAT* clause = header->EH->EHClause(i, &buffer);
+			DWORD flags = (DWORD)clause->Flags;
+
+			Record(clause->TryOffset, 0, clause->TryOffset);
+
+			if ( flags & COR_ILEXCEPTION_CLAUSE_FILTER )
+            {
+				Record(clause->FilterOffset, 1, clause->FilterOffset);
+				Record(clause->HandlerOffset, 1, clause->HandlerOffset);
+			}
+			else if ( flags & (COR_ILEXCEPTION_CLAUSE_FINALLY | COR_ILEXCEPTION_CLAUSE_FAULT) )
+				Record(clause->HandlerOffset, 0, clause->HandlerOffset);
+			else
+				Record(clause->HandlerOffset, 1, clause->HandlerOffset);
+		}
+	}
+}
+
+void StackVerifier::Visit(const ILInstruction& instr)
+{
+	if ( !_active || _failed || instr.offset >= _codeSize )
+		return;
+
+	DWORD offset = instr.offset;
+	DWORD slot = _depths[offset];
+
+	// a branch got here first, or nothing did and the stack starts empty
+	if ( slot != STACK_UNSEEN )
+    {
+		_pending--;
+		if ( _depth == STACK_UNKNOWN )
+			_depth = slot;
+		else if ( _depth != slot )
+        {
+			Fail(offset);
+			return;
+		}
+	}
+	else if ( _depth == STACK_UNKNOWN )
+		_depth = 0;
+
+	_depths[offset] = _depth | STACK_START;
+	_end = offset + instr.length;
+	_last = offset;
+
+	DWORD pop = 0, push = 0;
+	if ( instr.opcode < CEE_COUNT )
+    {
+		pop = OpcodeInfo[instr.opcode].Pop;
+		push = OpcodeInfo[instr.opcode].Push;
+	}
+
+	// the calls and ret, kept off the path of everything else
+	if ( pop == OPCODE_VAR_STACK )
+    {
+		if ( instr.opcode == CEE_RET )
+			pop = _returns;
+		else if ( !CallStack(instr, &pop, &push) )
+        {
+			// nothing can be said past a call that can't be read
+			_active = false;
+			return;
+		}
+	}
+	else if ( instr.opcode == CEE_LEAVE || instr.opcode == CEE_LEAVE_S || instr.opcode == CEE_ENDFINALLY )
+		pop = _depth;   // these empty the stack
+
+	if ( pop > _depth )
+    {
+		Fail(offset);
+		return;
+	}
+
+	_depth = _depth - pop + push;
+	if ( _depth > _maxStack )
+    {
+		Fail(offset);
+		return;
+	}
+
+	ILFlowKind flow = GetFlowKind(instr.opcode, instr.format);
+	switch ( flow )
+    {
+		case FlowBranch:
+		case FlowCondBranch:
+			if ( instr.format == InlineSwitch )
+            {
+				for (DWORD n = 0; n < instr.numTargets; n++)
+                {
+					if ( !Record(SwitchTarget(instr, n), _depth, offset) )
+						return;
+				}
+			}
+            else if ( !Record(instr.target, _depth, offset) )
+				return;
+			break;
+
+		case FlowReturn:
+			// ret and endfilter leave their value as the only one, jmp
+			// passes on the arguments with nothing on the stack
+			if ( (instr.opcode == CEE_RET || instr.opcode == CEE_ENDFILTER || instr.opcode == CEE_JMP) && _depth != 0 )
+            {
+				Fail(offset);
+				return;
+			}
+			break;
+	}
+
+	if ( flow == FlowBranch || flow == FlowReturn )
+		_depth = STACK_UNKNOWN;
+}
+
+bool StackVerifier::End(DWORD* offset)
+{
+	if ( !_active )
+		return true;
+
+	_active = false;
+
+	if ( !_failed )
+    {
+		// a body that wasn't decoded to its end is somebody else's error
+		if ( _end != _codeSize )
+			return true;
+
+		// control can't run off the end of the body
+		if ( _depth != STACK_UNKNOWN )
+			Fail(_last);
+		else if ( 0 == _pending )
+			return true;
+
+		// a branch into the middle of an instruction
+		for (DWORD i = 0; i < _codeSize; i++)
+        {
+			if ( _depths[i] != STACK_UNSEEN && !(_depths[i] & STACK_START) )
+            {
+				Fail(i);
+				break;
+			}
+		}
+	}
+
+	*offset = _failOffset;
+	return false;
+}
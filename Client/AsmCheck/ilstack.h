@@ -0,0 +1,76 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// ilstack.h : evaluation stack depth check of one method body, fed the
+// instructions of the decode pass.  Catches the bodies the JIT would
+// refuse on every peer before the organism is ever sent out.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+#include "ilopcode.h"
+#include "mdtables.h"
+
+struct ILInstruction;
+
+#define STACK_CALL_CACHE 256    // call signatures remembered, a power of two
+
+// Tracks the stack depth in a single forward pass, the way ECMA-335
+// III.1.7.5 lays it out: a branch fixes the depth at its target, code
+// after an unconditional transfer that nothing has branched to yet
+// starts empty, and a backward branch must agree with what was seen.
+class StackVerifier {
+private:
+	// what ParseMethodSig made of the signature behind a call token
+	struct CallSig {
+		mdToken token;
+		DWORD params;
+		bool hasThis;
+		bool returns;
+	};
+
+	MetaDataTables* _tables;
+	DWORD _codeSize;
+	DWORD _maxStack;
+	DWORD _returns;             // values ret takes, 0 or 1
+	DWORD _depth;               // STACK_UNKNOWN after an unconditional transfer
+	DWORD _end;                 // where the next instruction should start
+	DWORD _last;                // offset of the last instruction seen
+	DWORD _pending;             // forward targets not reached yet
+	DWORD _failOffset;
+	bool _active;
+	bool _failed;
+
+	// depth at each offset, STACK_UNSEEN if nothing has been recorded
+	std::vector<DWORD> _depths;
+
+	// the same few methods are called over and over; direct mapped on the token
+	CallSig _calls[STACK_CALL_CACHE];
+
+	bool Record(DWORD target, DWORD depth, DWORD offset);
+	bool CallStack(const ILInstruction& instr, DWORD* pop, DWORD* push);
+	void Fail(DWORD offset);
+
+public:
+	StackVerifier();
+
+	// the tables of the assembly to check, forgetting the last one's calls
+	void SetTables(MetaDataTables* tables);
+
+	// starts a method; sig is its MethodDef signature
+	void Begin(const COR_ILMETHOD_DECODER* header, PCCOR_SIGNATURE sig, ULONG sigSize);
+	void Visit(const ILInstruction& instr);
+
+	// False if the body doesn't balance, with the IL offset it went wrong
+	// at.  Bodies not decoded to the end, or calling through a signature
+	// that can't be read, are left to the checks that stopped them.
+	bool End(DWORD* offset);
+};
+
+// Parameter count, implicit this and whether a value is returned, from
+// a MethodDef, MemberRef or StandAloneSig signature.  False for anything
+// that isn't a well formed method signature.
+bool ParseMethodSig(PCCOR_SIGNATURE sig, ULONG sigSize, DWORD* params, bool* hasThis, bool* returns);
@@ -0,0 +1,990 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// mdtables.cpp : metadata table reader working directly on the mapped file
+//
+
+#include "stdafx.h"
+#include <corerror.h>
+#include "mdtables.h"
+
+#define MD_U2(p) ((ULONG)(p)[0] | ((ULONG)(p)[1] << 8))
+#define MD_U4(p) ((ULONG)(p)[0] | ((ULONG)(p)[1] << 8) | ((ULONG)(p)[2] << 16) | ((ULONG)(p)[3] << 24))
+
+#define METADATA_SIGNATURE 0x424A5342	// "BSJB"
+
+// heap size flags of the #~ stream header
+#define HEAP_STRING_4 0x01
+#define HEAP_GUID_4   0x02
+#define HEAP_BLOB_4   0x04
+#define HEAP_EXTRA    0x40
+
+// column schema codes; values below ColCoded are table numbers
+#define ColCoded 0x40	// + coded index kind
+#define ColU2    0xF0
+#define ColU4    0xF1
+#define ColStr   0xF2
+#define ColGuid  0xF3
+#define ColBlob  0xF4
+#define ColEnd   0xFF
+
+// coded index kinds (ECMA-335 II.24.2.6)
+enum CodedIndex {
+	CiTypeDefOrRef = 0,
+	CiHasConstant,
+	CiHasCustomAttribute,
+	CiHasFieldMarshal,
+	CiHasDeclSecurity,
+	CiMemberRefParent,
+	CiHasSemantics,
+	CiMethodDefOrRef,
+	CiMemberForwarded,
+	CiImplementation,
+	CiCustomAttributeType,
+	CiResolutionScope,
+	CiTypeOrMethodDef,
+	CiCount
+};
+
+#define CI_UNUSED 0xFF
+
+static const struct {
+	BYTE bits;
+	BYTE count;
+	BYTE tables[22];
+} codedIndexes[CiCount] = {
+	{ 2, 3, { TblTypeDef, TblTypeRef, TblTypeSpec } },
+	{ 2, 3, { TblField, TblParam, TblProperty } },
+	{ 5, 22, { TblMethodDef, TblField, TblTypeRef, TblTypeDef, TblParam, TblInterfaceImpl,
+			   TblMemberRef, TblModule, TblDeclSecurity, TblProperty, TblEvent, TblStandAloneSig,
+			   TblModuleRef, TblTypeSpec, TblAssembly, TblAssemblyRef, TblFile, TblExportedType,
+			   TblManifestResource, TblGenericParam, TblGenericParamConstraint, TblMethodSpec } },
+	{ 1, 2, { TblField, TblParam } },
+	{ 2, 3, { TblTypeDef, TblMethodDef, TblAssembly } },
+	{ 3, 5, { TblTypeDef, TblTypeRef, TblModuleRef, TblMethodDef, TblTypeSpec } },
+	{ 1, 2, { TblEvent, TblProperty } },
+	{ 1, 2, { TblMethodDef, TblMemberRef } },
+	{ 1, 2, { TblField, TblMethodDef } },
+	{ 2, 3, { TblFile, TblAssemblyRef, TblExportedType } },
+	{ 3, 5, { CI_UNUSED, CI_UNUSED, TblMethodDef, TblMemberRef, CI_UNUSED } },
+	{ 2, 4, { TblModule, TblModuleRef, TblAssemblyRef, TblTypeRef } },
+	{ 1, 2, { TblTypeDef, TblMethodDef } },
+};
+
+// table layouts (ECMA-335 II.22), one row per table in table number order
+static const BYTE tableSchema[TblCount][MD_MAX_COLUMNS + 1] = {
+	{ ColU2, ColStr, ColGuid, ColGuid, ColGuid, ColEnd },						// Module
+	{ ColCoded + CiResolutionScope, ColStr, ColStr, ColEnd },					// TypeRef
+	{ ColU4, ColStr, ColStr, ColCoded + CiTypeDefOrRef, TblField, TblMethodDef, ColEnd },	// TypeDef
+	{ TblField, ColEnd },														// FieldPtr
+	{ ColU2, ColStr, ColBlob, ColEnd },											// Field
+	{ TblMethodDef, ColEnd },													// MethodPtr
+	{ ColU4, ColU2, ColU2, ColStr, ColBlob, TblParam, ColEnd },					// MethodDef
+	{ TblParam, ColEnd },														// ParamPtr
+	{ ColU2, ColU2, ColStr, ColEnd },											// Param
+	{ TblTypeDef, ColCoded + CiTypeDefOrRef, ColEnd },							// InterfaceImpl
+	{ ColCoded + CiMemberRefParent, ColStr, ColBlob, ColEnd },					// MemberRef
+	{ ColU2, ColCoded + CiHasConstant, ColBlob, ColEnd },						// Constant
+	{ ColCoded + CiHasCustomAttribute, ColCoded + CiCustomAttributeType, ColBlob, ColEnd },	// CustomAttribute
+	{ ColCoded + CiHasFieldMarshal, ColBlob, ColEnd },							// FieldMarshal
+	{ ColU2, ColCoded + CiHasDeclSecurity, ColBlob, ColEnd },					// DeclSecurity
+	{ ColU2, ColU4, TblTypeDef, ColEnd },										// ClassLayout
+	{ ColU4, TblField, ColEnd },												// FieldLayout
+	{ ColBlob, ColEnd },														// StandAloneSig
+	{ TblTypeDef, TblEvent, ColEnd },											// EventMap
+	{ TblEvent, ColEnd },														// EventPtr
+	{ ColU2, ColStr, ColCoded + CiTypeDefOrRef, ColEnd },						// Event
+	{ TblTypeDef, TblProperty, ColEnd },										// PropertyMap
+	{ TblProperty, ColEnd },													// PropertyPtr
+	{ ColU2, ColStr, ColBlob, ColEnd },											// Property
+	{ ColU2, TblMethodDef, ColCoded + CiHasSemantics, ColEnd },					// MethodSemantics
+	{ TblTypeDef, ColCoded + CiMethodDefOrRef, ColCoded + CiMethodDefOrRef, ColEnd },	// MethodImpl
+	{ ColStr, ColEnd },															// ModuleRef
+	{ ColBlob, ColEnd },														// TypeSpec
+	{ ColU2, ColCoded + CiMemberForwarded, ColStr, TblModuleRef, ColEnd },		// ImplMap
+	{ ColU4, TblField, ColEnd },												// FieldRVA
+	{ ColU4, ColU4, ColEnd },													// EncLog
+	{ ColU4, ColEnd },															// EncMap
+	{ ColU4, ColU2, ColU2, ColU2, ColU2, ColU4, ColBlob, ColStr, ColStr, ColEnd },	// Assembly
+	{ ColU4, ColEnd },															// AssemblyProcessor
+	{ ColU4, ColU4, ColU4, ColEnd },											// AssemblyOS
+	{ ColU2, ColU2, ColU2, ColU2, ColU4, ColBlob, ColStr, ColStr, ColBlob, ColEnd },	// AssemblyRef
+	{ ColU4, TblAssemblyRef, ColEnd },											// AssemblyRefProcessor
+	{ ColU4, ColU4, ColU4, TblAssemblyRef, ColEnd },							// AssemblyRefOS
+	{ ColU4, ColStr, ColBlob, ColEnd },											// File
+	{ ColU4, ColU4, ColStr, ColStr, ColCoded + CiImplementation, ColEnd },		// ExportedType
+	{ ColU4, ColU4, ColStr, ColCoded + CiImplementation, ColEnd },				// ManifestResource
+	{ TblTypeDef, TblTypeDef, ColEnd },											// NestedClass
+	{ ColU2, ColU2, ColCoded + CiTypeOrMethodDef, ColStr, ColEnd },				// GenericParam
+	{ ColCoded + CiMethodDefOrRef, ColBlob, ColEnd },							// MethodSpec
+	{ TblGenericParam, ColCoded + CiTypeDefOrRef, ColEnd },						// GenericParamConstraint
+};
+
+// column numbers used below
+#define TypeRefName       1
+#define TypeRefNamespace  2
+#define TypeDefFlags      0
+#define TypeDefName       1
+#define TypeDefNamespace  2
+#define TypeDefExtends    3
+#define TypeDefFieldList  4
+#define TypeDefMethodList 5
+#define FieldFlags        0
+#define FieldName         1
+#define FieldSignature    2
+#define MethodDefRva      0
+#define MethodDefImplFlags 1
+#define MethodDefFlags    2
+#define MethodDefName     3
+#define MethodDefSignature 4
+#define MemberRefClass    0
+#define MemberRefName     1
+#define MemberRefSig      2
+#define AssemblyPublicKey 6
+#define TypeRefScope      0
+#define TypeSpecSignature 0
+#define StandAloneSigSignature 0
+#define MethodSpecMethod  0
+#define NestedClassNested 0
+#define NestedClassEnclosing 1
+
+// method header formats (ECMA-335 II.25.4)
+#define IL_HEADER_FORMAT_MASK 0x03
+#define IL_HEADER_TINY        0x02
+#define IL_HEADER_FAT         0x03
+#define IL_FAT_HEADER_SIZE    12
+#define IL_MORE_SECTS         0x0008    // fat header flag, data sections follow the code
+#define IL_SECT_FAT           0x40      // section kind bits
+#define IL_SECT_MORE          0x80
+#define IL_SECT_HEADER_SIZE   4
+
+static mdToken DecodeCodedIndex(int kind, ULONG value)
+{
+	ULONG tag = value & ((1 << codedIndexes[kind].bits) - 1);
+	ULONG rid = value >> codedIndexes[kind].bits;
+
+	if ( tag >= codedIndexes[kind].count || codedIndexes[kind].tables[tag] == CI_UNUSED )
+		return mdTokenNil;
+
+	// token types are the table number in the high byte
+	return TokenFromRid(rid, (ULONG)codedIndexes[kind].tables[tag] << 24);
+}
+
+unsigned long StringHashA(LPCSTR name)
+{
+	unsigned long h = 0, g;
+	while ( *name )
+	{
+		h = ( h << 4 ) + (unsigned char)*name++;
+		if ( (g = (h & 0xF0000000)) != 0 )
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static unsigned long HashStep(unsigned long h, unsigned char c)
+{
+	unsigned long g;
+	h = ( h << 4 ) + c;
+	if ( (g = (h & 0xF0000000)) != 0 )
+		h ^= g >> 24;
+	return h & ~g;
+}
+
+unsigned long TypeName::Hash() const
+{
+	unsigned long h = 0;
+	LPCSTR p;
+
+	if ( *nameSpace )
+	{
+		for (p = nameSpace; *p; p++)
+			h = HashStep(h, (unsigned char)*p);
+		h = HashStep(h, '.');
+	}
+	for (p = name; *p; p++)
+		h = HashStep(h, (unsigned char)*p);
+
+	return h;
+}
+
+bool TypeName::Equals(LPCSTR fullName) const
+{
+	LPCSTR p = fullName;
+
+	if ( *nameSpace )
+	{
+		LPCSTR ns = nameSpace;
+		while ( *ns && *ns == *p )
+		{
+			ns++;
+			p++;
+		}
+		if ( *ns || *p != '.' )
+			return false;
+		p++;
+	}
+
+	return strcmp(name, p) == 0;
+}
+
+int WidenName(LPCSTR name, WCHAR* buffer, int len)
+{
+	int cnt = MultiByteToWideChar(CP_UTF8, 0, name, -1, buffer, len);
+	if ( cnt == 0 )
+	{
+		// too long or not valid UTF-8, keep what fits
+		buffer[len - 1] = L'\0';
+		cnt = (int)wcslen(buffer) + 1;
+	}
+	return cnt - 1;
+}
+
+int WidenTypeName(const TypeName& name, WCHAR* buffer, int len)
+{
+	int cnt = 0;
+
+	if ( *name.nameSpace )
+	{
+		cnt = WidenName(name.nameSpace, buffer, len);
+		if ( cnt + 2 < len )
+			buffer[cnt++] = L'.';
+	}
+	return cnt + WidenName(name.name, buffer + cnt, len - cnt);
+}
+
+
+MetaDataTables::MetaDataTables()
+{
+	_base = NULL;
+	_size = 0;
+	_corHeader = NULL;
+	_strings = _blob = _guid = _userStrings = _tableStream = NULL;
+	_stringsSize = _blobSize = _guidSize = _userStringsSize = _tableStreamSize = 0;
+	_heapSizes = 0;
+	_inited = false;
+	ZeroMemory(_rows, sizeof(_rows));
+	ZeroMemory(_tables, sizeof(_tables));
+	ZeroMemory(_rowSize, sizeof(_rowSize));
+}
+
+// Maps an RVA to the file offset it was loaded from, checking that
+// size bytes starting there are inside both the section and the file.
+const BYTE* MetaDataTables::RvaToPointer(PIMAGE_NT_HEADERS headers, ULONG rva, ULONG size)
+{
+	PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(headers);
+
+	for (ULONG i = 0; i < headers->FileHeader.NumberOfSections; i++, section++)
+	{
+		if ( (const BYTE*)(section + 1) > _base + _size )
+			break;
+
+		if ( rva >= section->VirtualAddress &&
+			 rva - section->VirtualAddress < section->SizeOfRawData )
+		{
+			ULONGLONG offset = (ULONGLONG)section->PointerToRawData + (rva - section->VirtualAddress);
+
+			if ( rva - section->VirtualAddress + (ULONGLONG)size > section->SizeOfRawData ||
+				 offset + size > _size )
+				return NULL;
+
+			return _base + (ULONG)offset;
+		}
+	}
+
+	return NULL;
+}
+
+HRESULT MetaDataTables::Init(const BYTE* base, ULONG size, PIMAGE_NT_HEADERS headers)
+{
+	_base = base;
+	_size = size;
+	_inited = false;
+	_fieldPtrIndex.clear();
+	_methodPtrIndex.clear();
+
+	if ( NULL == headers || (const BYTE*)headers < base ||
+		 (const BYTE*)headers + sizeof(IMAGE_NT_HEADERS64) > base + size )
+		return CLDB_E_FILE_CORRUPT;
+
+	// the data directories sit at different offsets in PE32 and PE32+
+	IMAGE_DATA_DIRECTORY* corDir;
+	if ( headers->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC )
+		corDir = &((PIMAGE_NT_HEADERS64)headers)->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR];
+	else
+		corDir = &headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR];
+
+	const IMAGE_COR20_HEADER* corHeader =
+		(const IMAGE_COR20_HEADER*)RvaToPointer(headers, corDir->VirtualAddress, sizeof(IMAGE_COR20_HEADER));
+	if ( NULL == corHeader )
+		return CLDB_E_FILE_CORRUPT;
+	_corHeader = corHeader;
+
+	ULONG mdSize = corHeader->MetaData.Size;
+	const BYTE* md = RvaToPointer(headers, corHeader->MetaData.VirtualAddress, mdSize);
+	if ( NULL == md || mdSize < 20 || MD_U4(md) != METADATA_SIGNATURE )
+		return CLDB_E_FILE_CORRUPT;
+
+	// signature, versions, reserved, version length and string, flags, stream count
+	ULONG versionLen = MD_U4(md + 12);
+	if ( versionLen > mdSize - 20 )
+		return CLDB_E_FILE_CORRUPT;
+
+	ULONG pos = 16 + versionLen;
+	ULONG streams = MD_U2(md + pos + 2);
+	pos += 4;
+
+	for (ULONG i = 0; i < streams; i++)
+	{
+		if ( pos + 8 > mdSize )
+			return CLDB_E_FILE_CORRUPT;
+
+		ULONG offset = MD_U4(md + pos);
+		ULONG streamSize = MD_U4(md + pos + 4);
+		LPCSTR name = (LPCSTR)(md + pos + 8);
+
+		// names are NUL terminated and padded to four bytes, at most 32 long
+		ULONG nameLen = 0;
+		while ( pos + 8 + nameLen < mdSize && nameLen < 32 && name[nameLen] )
+			nameLen++;
+		if ( pos + 8 + nameLen >= mdSize || name[nameLen] )
+			return CLDB_E_FILE_CORRUPT;
+		pos += 8 + ((nameLen + 4) & ~3);
+
+		if ( offset > mdSize || streamSize > mdSize - offset )
+			return CLDB_E_FILE_CORRUPT;
+
+		if ( !strcmp(name, "#~") || !strcmp(name, "#-") )
+		{
+			_tableStream = md + offset;
+			_tableStreamSize = streamSize;
+		}
+		else if ( !strcmp(name, "#Strings") )
+		{
+			_strings = md + offset;
+			_stringsSize = streamSize;
+		}
+		else if ( !strcmp(name, "#Blob") )
+		{
+			_blob = md + offset;
+			_blobSize = streamSize;
+		}
+		else if ( !strcmp(name, "#GUID") )
+		{
+			_guid = md + offset;
+			_guidSize = streamSize;
+		}
+		else if ( !strcmp(name, "#US") )
+		{
+			_userStrings = md + offset;
+			_userStringsSize = streamSize;
+		}
+	}
+
+	// every string handed out must end inside the heap
+	if ( NULL == _tableStream ||
+		 (_stringsSize > 0 && _strings[_stringsSize - 1] != '\0') )
+		return CLDB_E_FILE_CORRUPT;
+
+	if ( !ComputeLayout() )
+		return CLDB_E_FILE_CORRUPT;
+
+	IndexPointerTable(TblFieldPtr, TblField, _fieldPtrIndex);
+	IndexPointerTable(TblMethodPtr, TblMethodDef, _methodPtrIndex);
+
+	_inited = true;
+	return S_OK;
+}
+
+ULONG MetaDataTables::CodedIndexSize(int kind)
+{
+	ULONG maxRows = 0;
+
+	for (int i = 0; i < codedIndexes[kind].count; i++)
+	{
+		BYTE table = codedIndexes[kind].tables[i];
+		if ( table != CI_UNUSED && _rows[table] > maxRows )
+			maxRows = _rows[table];
+	}
+
+	return (maxRows < (1UL << (16 - codedIndexes[kind].bits))) ? 2 : 4;
+}
+
+bool MetaDataTables::ComputeLayout()
+{
+	// reserved, major, minor, heap sizes, reserved, valid, sorted
+	if ( _tableStreamSize < 24 )
+		return false;
+
+	_heapSizes = _tableStream[6];
+	ULONG validLo = MD_U4(_tableStream + 8);
+	ULONG validHi = MD_U4(_tableStream + 12);
+	ULONG pos = 24;
+
+	for (int t = 0; t < 64; t++)
+	{
+		bool present = (t < 32) ? ((validLo >> t) & 1) != 0 : ((validHi >> (t - 32)) & 1) != 0;
+		if ( !present )
+			continue;
+
+		// we can't size tables we don't know about
+		if ( t >= TblCount || pos + 4 > _tableStreamSize )
+			return false;
+
+		_rows[t] = MD_U4(_tableStream + pos);
+		pos += 4;
+	}
+
+	if ( _heapSizes & HEAP_EXTRA )
+		pos += 4;
+
+	ULONGLONG cursor = pos;
+
+	for (int t = 0; t < TblCount; t++)
+	{
+		ULONG offset = 0;
+
+		for (int c = 0; tableSchema[t][c] != ColEnd; c++)
+		{
+			BYTE col = tableSchema[t][c];
+			ULONG colSize;
+
+			switch ( col )
+			{
+				case ColU2:
+					colSize = 2;
+					break;
+				case ColU4:
+					colSize = 4;
+					break;
+				case ColStr:
+					colSize = (_heapSizes & HEAP_STRING_4) ? 4 : 2;
+					break;
+				case ColGuid:
+					colSize = (_heapSizes & HEAP_GUID_4) ? 4 : 2;
+					break;
+				case ColBlob:
+					colSize = (_heapSizes & HEAP_BLOB_4) ? 4 : 2;
+					break;
+				default:
+					if ( col >= ColCoded )
+						colSize = CodedIndexSize(col - ColCoded);
+					else
+						colSize = (_rows[col] < 0x10000) ? 2 : 4;
+					break;
+			}
+
+			_colOffset[t][c] = (BYTE)offset;
+			_colSize[t][c] = (BYTE)colSize;
+			offset += colSize;
+		}
+
+		_rowSize[t] = offset;
+		_tables[t] = _tableStream + (ULONG)min(cursor, (ULONGLONG)_tableStreamSize);
+		cursor += (ULONGLONG)_rows[t] * offset;
+
+		if ( cursor > _tableStreamSize )
+			return false;
+	}
+
+	return true;
+}
+
+ULONG MetaDataTables::GetColumn(MetaDataTable table, ULONG rid, int col)
+{
+	if ( rid == 0 || rid > _rows[table] )
+		return 0;
+
+	const BYTE* p = _tables[table] + (rid - 1) * _rowSize[table] + _colOffset[table][col];
+	return (_colSize[table][col] == 2) ? MD_U2(p) : MD_U4(p);
+}
+
+LPCSTR MetaDataTables::GetString(ULONG index)
+{
+	if ( index >= _stringsSize )
+		return "";
+
+	return (LPCSTR)_strings + index;
+}
+
+bool MetaDataTables::GetBlob(ULONG index, PCCOR_SIGNATURE* data, ULONG* size)
+{
+	if ( index >= _blobSize )
+		return false;
+
+	const BYTE* p = _blob + index;
+	ULONG avail = _blobSize - index;
+	ULONG len, hdr;
+
+	if ( (p[0] & 0x80) == 0 )
+	{
+		len = p[0];
+		hdr = 1;
+	}
+	else if ( (p[0] & 0xC0) == 0x80 && avail >= 2 )
+	{
+		len = ((p[0] & 0x3F) << 8) | p[1];
+		hdr = 2;
+	}
+	else if ( (p[0] & 0xE0) == 0xC0 && avail >= 4 )
+	{
+		len = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		hdr = 4;
+	}
+	else
+		return false;
+
+	if ( len > avail - hdr )
+		return false;
+
+	*data = p + hdr;
+	*size = len;
+	return true;
+}
+
+// Type names for TypeDef and TypeRef tokens, the member name for MemberRefs.
+// Other token types have no name here and come back empty with S_FALSE.
+HRESULT MetaDataTables::GetTypeName(mdToken tok, TypeName* name)
+{
+	ULONG rid = RidFromToken(tok);
+	*name = TypeName();
+
+	if ( !rid )
+		return E_FAIL;
+
+	switch (TypeFromToken(tok))
+	{
+		case mdtTypeDef:
+			if ( rid > _rows[TblTypeDef] )
+				return CLDB_E_FILE_CORRUPT;
+			name->nameSpace = GetString(GetColumn(TblTypeDef, rid, TypeDefNamespace));
+			name->name = GetString(GetColumn(TblTypeDef, rid, TypeDefName));
+			return S_OK;
+
+		case mdtTypeRef:
+			if ( rid > _rows[TblTypeRef] )
+				return CLDB_E_FILE_CORRUPT;
+			name->nameSpace = GetString(GetColumn(TblTypeRef, rid, TypeRefNamespace));
+			name->name = GetString(GetColumn(TblTypeRef, rid, TypeRefName));
+			return S_OK;
+
+		case mdtMemberRef:
+			return GetMemberName(tok, &name->name);
+	}
+
+	return S_FALSE;
+}
+
+HRESULT MetaDataTables::GetMemberName(mdToken tok, LPCSTR* name)
+{
+	ULONG rid = RidFromToken(tok);
+	*name = "";
+
+	switch (TypeFromToken(tok))
+	{
+		case mdtFieldDef:
+			if ( !rid || rid > _rows[TblField] )
+				return CLDB_E_FILE_CORRUPT;
+			*name = GetString(GetColumn(TblField, rid, FieldName));
+			return S_OK;
+
+		case mdtMethodDef:
+			if ( !rid || rid > _rows[TblMethodDef] )
+				return CLDB_E_FILE_CORRUPT;
+			*name = GetString(GetColumn(TblMethodDef, rid, MethodDefName));
+			return S_OK;
+
+		case mdtMemberRef:
+			if ( !rid || rid > _rows[TblMemberRef] )
+				return CLDB_E_FILE_CORRUPT;
+			*name = GetString(GetColumn(TblMemberRef, rid, MemberRefName));
+			return S_OK;
+	}
+
+	return E_FAIL;
+}
+
+HRESULT MetaDataTables::GetMemberRefProps(mdMemberRef tok, mdToken* classTok, LPCSTR* name,
+										  PCCOR_SIGNATURE* sig, ULONG* sigSize)
+{
+	ULONG rid = RidFromToken(tok);
+
+	if ( TypeFromToken(tok) != mdtMemberRef || !rid || rid > _rows[TblMemberRef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	if ( NULL != classTok )
+		*classTok = DecodeCodedIndex(CiMemberRefParent, GetColumn(TblMemberRef, rid, MemberRefClass));
+
+	if ( NULL != name )
+		*name = GetString(GetColumn(TblMemberRef, rid, MemberRefName));
+
+	if ( NULL != sig && NULL != sigSize )
+	{
+		if ( !GetBlob(GetColumn(TblMemberRef, rid, MemberRefSig), sig, sigSize) )
+		{
+			*sig = NULL;
+			*sigSize = 0;
+		}
+	}
+
+	return S_OK;
+}
+
+// Inverts a pointer table once, so FindOwner needn't scan it for every
+// member it is asked about.  The first pointer to a row wins, as a scan
+// would have it.
+void MetaDataTables::IndexPointerTable(MetaDataTable ptrTable, MetaDataTable listTable, std::vector<ULONG>& index)
+{
+	index.clear();
+	if ( 0 == _rows[ptrTable] )
+		return;
+
+	index.assign(_rows[listTable] + 1, 0);
+	for (ULONG i = 1; i <= _rows[ptrTable]; i++)
+	{
+		ULONG rid = GetColumn(ptrTable, i, 0);
+		if ( rid > 0 && rid <= _rows[listTable] && 0 == index[rid] )
+			index[rid] = i;
+	}
+}
+
+// Finds the TypeDef whose field or method list holds the given row.  The
+// lists are runs of ascending start indexes, so the owner is the last type
+// starting at or before the row.
+ULONG MetaDataTables::FindOwner(MetaDataTable listTable, int listColumn, ULONG memberRid)
+{
+	const std::vector<ULONG>& ptrIndex = (listTable == TblField) ? _fieldPtrIndex : _methodPtrIndex;
+	ULONG index = memberRid;
+
+	// uncompressed metadata lists through the pointer tables
+	if ( !ptrIndex.empty() )
+	{
+		index = (memberRid < ptrIndex.size()) ? ptrIndex[memberRid] : 0;
+		if ( index == 0 )
+			return 0;
+	}
+
+	ULONG lo = 1, hi = _rows[TblTypeDef], owner = 0;
+	while ( lo <= hi )
+	{
+		ULONG mid = lo + (hi - lo) / 2;
+		if ( GetColumn(TblTypeDef, mid, listColumn) <= index )
+		{
+			owner = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return owner;
+}
+
+HRESULT MetaDataTables::GetMemberParent(mdToken tok, mdTypeDef* classTok)
+{
+	ULONG rid = RidFromToken(tok);
+	ULONG owner = 0;
+
+	switch (TypeFromToken(tok))
+	{
+		case mdtFieldDef:
+			if ( rid && rid <= _rows[TblField] )
+				owner = FindOwner(TblField, TypeDefFieldList, rid);
+			break;
+
+		case mdtMethodDef:
+			if ( rid && rid <= _rows[TblMethodDef] )
+				owner = FindOwner(TblMethodDef, TypeDefMethodList, rid);
+			break;
+	}
+
+	if ( owner == 0 )
+	{
+		*classTok = mdTypeDefNil;
+		return CLDB_E_FILE_CORRUPT;
+	}
+
+	*classTok = TokenFromRid(owner, mdtTypeDef);
+	return S_OK;
+}
+
+HRESULT MetaDataTables::GetTypeDefProps(mdTypeDef tok, DWORD* flags, mdToken* extends)
+{
+	ULONG rid = RidFromToken(tok);
+
+	if ( TypeFromToken(tok) != mdtTypeDef || !rid || rid > _rows[TblTypeDef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	if ( NULL != flags )
+		*flags = GetColumn(TblTypeDef, rid, TypeDefFlags);
+
+	if ( NULL != extends )
+		*extends = DecodeCodedIndex(CiTypeDefOrRef, GetColumn(TblTypeDef, rid, TypeDefExtends));
+
+	return S_OK;
+}
+
+// The fields or methods of a type are the list entries [*first, *end),
+// from the type's list column up to the next type's.  Entries are turned
+// into tokens with GetListMember.
+HRESULT MetaDataTables::GetMemberList(mdTypeDef tok, MetaDataTable listTable, ULONG* first, ULONG* end)
+{
+	ULONG rid = RidFromToken(tok);
+	MetaDataTable ptrTable = (listTable == TblField) ? TblFieldPtr : TblMethodPtr;
+	int listColumn = (listTable == TblField) ? TypeDefFieldList : TypeDefMethodList;
+	ULONG listRows = (_rows[ptrTable] > 0) ? _rows[ptrTable] : _rows[listTable];
+
+	*first = *end = 0;
+
+	if ( TypeFromToken(tok) != mdtTypeDef || !rid || rid > _rows[TblTypeDef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	ULONG start = GetColumn(TblTypeDef, rid, listColumn);
+	ULONG stop = (rid < _rows[TblTypeDef]) ? GetColumn(TblTypeDef, rid + 1, listColumn) : listRows + 1;
+
+	// an empty list may point one past the end of the table
+	if ( start == 0 || start > listRows + 1 || stop < start || stop > listRows + 1 )
+		return CLDB_E_FILE_CORRUPT;
+
+	*first = start;
+	*end = stop;
+	return S_OK;
+}
+
+mdToken MetaDataTables::GetListMember(MetaDataTable listTable, ULONG index)
+{
+	MetaDataTable ptrTable = (listTable == TblField) ? TblFieldPtr : TblMethodPtr;
+	ULONG rid = (_rows[ptrTable] > 0) ? GetColumn(ptrTable, index, 0) : index;
+
+	return TokenFromRid(rid, (listTable == TblField) ? mdtFieldDef : mdtMethodDef);
+}
+
+HRESULT MetaDataTables::GetMethodProps(mdMethodDef tok, DWORD* attrs, DWORD* implFlags,
+									   PCCOR_SIGNATURE* sig, ULONG* sigSize, ULONG* rva)
+{
+	ULONG rid = RidFromToken(tok);
+
+	if ( TypeFromToken(tok) != mdtMethodDef || !rid || rid > _rows[TblMethodDef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	*attrs = GetColumn(TblMethodDef, rid, MethodDefFlags);
+	*implFlags = GetColumn(TblMethodDef, rid, MethodDefImplFlags);
+	*rva = GetColumn(TblMethodDef, rid, MethodDefRva);
+
+	if ( !GetBlob(GetColumn(TblMethodDef, rid, MethodDefSignature), sig, sigSize) )
+		return CLDB_E_FILE_CORRUPT;
+
+	return S_OK;
+}
+
+HRESULT MetaDataTables::GetFieldProps(mdFieldDef tok, DWORD* attrs, PCCOR_SIGNATURE* sig, ULONG* sigSize)
+{
+	ULONG rid = RidFromToken(tok);
+
+	if ( TypeFromToken(tok) != mdtFieldDef || !rid || rid > _rows[TblField] )
+		return CLDB_E_FILE_CORRUPT;
+
+	*attrs = GetColumn(TblField, rid, FieldFlags);
+
+	if ( !GetBlob(GetColumn(TblField, rid, FieldSignature), sig, sigSize) )
+		return CLDB_E_FILE_CORRUPT;
+
+	return S_OK;
+}
+
+HRESULT MetaDataTables::GetTypeSpec(mdTypeSpec tok, PCCOR_SIGNATURE* sig, ULONG* sigSize)
+{
+	ULONG rid = RidFromToken(tok);
+
+	if ( TypeFromToken(tok) != mdtTypeSpec || !rid || rid > _rows[TblTypeSpec] )
+		return CLDB_E_FILE_CORRUPT;
+
+	if ( !GetBlob(GetColumn(TblTypeSpec, rid, TypeSpecSignature), sig, sigSize) )
+		return CLDB_E_FILE_CORRUPT;
+
+	return S_OK;
+}
+
+// The signature a call instruction goes through: the MethodDef or
+// MemberRef of call, callvirt and newobj, the generic method a MethodSpec
+// instantiates, or the StandAloneSig of calli.
+HRESULT MetaDataTables::GetCallSignature(mdToken tok, PCCOR_SIGNATURE* sig, ULONG* sigSize)
+{
+	ULONG rid = RidFromToken(tok);
+	DWORD attrs, implFlags;
+	ULONG rva;
+
+	switch ( TypeFromToken(tok) )
+	{
+		case mdtMethodDef:
+			return GetMethodProps(tok, &attrs, &implFlags, sig, sigSize, &rva);
+
+		case mdtMemberRef:
+			*sig = NULL;
+			if ( FAILED(GetMemberRefProps(tok, NULL, NULL, sig, sigSize)) || NULL == *sig )
+				return CLDB_E_FILE_CORRUPT;
+			return S_OK;
+
+		case mdtMethodSpec:
+			if ( !rid || rid > _rows[TblMethodSpec] )
+				return CLDB_E_FILE_CORRUPT;
+
+			// a MethodSpec never instantiates another MethodSpec
+			tok = DecodeCodedIndex(CiMethodDefOrRef, GetColumn(TblMethodSpec, rid, MethodSpecMethod));
+			if ( TypeFromToken(tok) == mdtMethodSpec || IsNilToken(tok) )
+				return CLDB_E_FILE_CORRUPT;
+			return GetCallSignature(tok, sig, sigSize);
+
+		case mdtSignature:
+			if ( !rid || rid > _rows[TblStandAloneSig] ||
+				 !GetBlob(GetColumn(TblStandAloneSig, rid, StandAloneSigSignature), sig, sigSize) )
+				return CLDB_E_FILE_CORRUPT;
+			return S_OK;
+	}
+
+	return CLDB_E_FILE_CORRUPT;
+}
+
+// The type a TypeDef or TypeRef is nested in, S_FALSE for a type at
+// namespace scope.  NestedClass is sorted on the nested type.
+HRESULT MetaDataTables::GetEnclosingType(mdToken tok, mdToken* enclosing)
+{
+	ULONG rid = RidFromToken(tok);
+
+	*enclosing = mdTokenNil;
+
+	if ( TypeFromToken(tok) == mdtTypeRef )
+	{
+		if ( !rid || rid > _rows[TblTypeRef] )
+			return CLDB_E_FILE_CORRUPT;
+
+		mdToken scope = DecodeCodedIndex(CiResolutionScope, GetColumn(TblTypeRef, rid, TypeRefScope));
+		if ( TypeFromToken(scope) != mdtTypeRef || !RidFromToken(scope) )
+			return S_FALSE;
+
+		*enclosing = scope;
+		return S_OK;
+	}
+
+	if ( TypeFromToken(tok) != mdtTypeDef || !rid || rid > _rows[TblTypeDef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	ULONG lo = 1, hi = _rows[TblNestedClass];
+	while ( lo <= hi )
+	{
+		ULONG mid = lo + (hi - lo) / 2;
+		ULONG nested = GetColumn(TblNestedClass, mid, NestedClassNested);
+		if ( nested == rid )
+		{
+			*enclosing = TokenFromRid(GetColumn(TblNestedClass, mid, NestedClassEnclosing), mdtTypeDef);
+			return S_OK;
+		}
+		if ( nested < rid )
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return S_FALSE;
+}
+
+bool MetaDataTables::GetAssemblyPublicKey(const BYTE** key, ULONG* size)
+{
+	PCCOR_SIGNATURE blob = NULL;
+
+	if ( _rows[TblAssembly] == 0 ||
+		 !GetBlob(GetColumn(TblAssembly, 1, AssemblyPublicKey), &blob, size) )
+		return false;
+
+	*key = (const BYTE*)blob;
+	return *size > 0;
+}
+
+// Code size from the header of a method body, without decoding it.
+// S_FALSE for methods that have no body.
+HRESULT MetaDataTables::GetMethodCodeSize(PIMAGE_NT_HEADERS headers, ULONG rid, ULONG* codeSize)
+{
+	*codeSize = 0;
+
+	if ( rid == 0 || rid > _rows[TblMethodDef] )
+		return CLDB_E_FILE_CORRUPT;
+
+	ULONG rva = GetColumn(TblMethodDef, rid, MethodDefRva);
+	if ( rva == 0 )
+		return S_FALSE;
+
+	const BYTE* header = RvaToPointer(headers, rva, 1);
+	if ( NULL == header )
+		return CLDB_E_FILE_CORRUPT;
+
+	switch ( header[0] & IL_HEADER_FORMAT_MASK )
+    {
+		case IL_HEADER_TINY:
+			*codeSize = header[0] >> 2;
+			return S_OK;
+
+		case IL_HEADER_FAT:
+			header = RvaToPointer(headers, rva, IL_FAT_HEADER_SIZE);
+			if ( NULL == header )
+				return CLDB_E_FILE_CORRUPT;
+			*codeSize = MD_U4(header + 4);
+			return S_OK;
+	}
+
+	return CLDB_E_FILE_CORRUPT;
+}
+
+const BYTE* MetaDataTables::GetMethodBody(PIMAGE_NT_HEADERS headers, ULONG rva)
+{
+	const BYTE* body = RvaToPointer(headers, rva, 1);
+	if ( NULL == body )
+		return NULL;
+
+	switch ( body[0] & IL_HEADER_FORMAT_MASK )
+    {
+		case IL_HEADER_TINY:
+			return RvaToPointer(headers, rva, 1 + (body[0] >> 2));
+
+		case IL_HEADER_FAT:
+			break;
+
+		default:
+			return NULL;
+	}
+
+	body = RvaToPointer(headers, rva, IL_FAT_HEADER_SIZE);
+	if ( NULL == body )
+		return NULL;
+
+	// the header size is in dwords, in the top four bits of the flags
+	ULONG headerSize = (body[1] >> 4) * 4;
+	ULONGLONG end = (ULONGLONG)headerSize + MD_U4(body + 4);
+	if ( headerSize < IL_FAT_HEADER_SIZE || end > _size || NULL == RvaToPointer(headers, rva, (ULONG)end) )
+		return NULL;
+
+	if ( !(MD_U2(body) & IL_MORE_SECTS) )
+		return body;
+
+	// each section starts on a dword boundary after the one before; a
+	// section has to be at least its own header long, so this ends
+	for (;;)
+    {
+		end = (end + 3) & ~(ULONGLONG)3;
+		if ( end + IL_SECT_HEADER_SIZE > _size || NULL == RvaToPointer(headers, rva, (ULONG)end + IL_SECT_HEADER_SIZE) )
+			return NULL;
+
+		const BYTE* sect = body + (ULONG)end;
+		ULONG dataSize = (sect[0] & IL_SECT_FAT) ? (sect[1] | (sect[2] << 8) | (sect[3] << 16)) : sect[1];
+		if ( dataSize < IL_SECT_HEADER_SIZE )
+			return NULL;
+
+		end += dataSize;
+		if ( end > _size || NULL == RvaToPointer(headers, rva, (ULONG)end) )
+			return NULL;
+
+		if ( !(sect[0] & IL_SECT_MORE) )
+			return body;
+	}
+}
@@ -0,0 +1,175 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// mdtables.h : read-only access to the ECMA-335 metadata tables of a
+// mapped image.  Names are handed out as pointers into the #Strings heap
+// (UTF-8, NUL terminated), nothing is copied.
+//
+
+#pragma once
+#pragma unmanaged
+
+#include <vector>
+
+// metadata table numbers (ECMA-335 II.22)
+enum MetaDataTable {
+	TblModule = 0x00,
+	TblTypeRef = 0x01,
+	TblTypeDef = 0x02,
+	TblFieldPtr = 0x03,
+	TblField = 0x04,
+	TblMethodPtr = 0x05,
+	TblMethodDef = 0x06,
+	TblParamPtr = 0x07,
+	TblParam = 0x08,
+	TblInterfaceImpl = 0x09,
+	TblMemberRef = 0x0A,
+	TblConstant = 0x0B,
+	TblCustomAttribute = 0x0C,
+	TblFieldMarshal = 0x0D,
+	TblDeclSecurity = 0x0E,
+	TblClassLayout = 0x0F,
+	TblFieldLayout = 0x10,
+	TblStandAloneSig = 0x11,
+	TblEventMap = 0x12,
+	TblEventPtr = 0x13,
+	TblEvent = 0x14,
+	TblPropertyMap = 0x15,
+	TblPropertyPtr = 0x16,
+	TblProperty = 0x17,
+	TblMethodSemantics = 0x18,
+	TblMethodImpl = 0x19,
+	TblModuleRef = 0x1A,
+	TblTypeSpec = 0x1B,
+	TblImplMap = 0x1C,
+	TblFieldRVA = 0x1D,
+	TblEncLog = 0x1E,
+	TblEncMap = 0x1F,
+	TblAssembly = 0x20,
+	TblAssemblyProcessor = 0x21,
+	TblAssemblyOS = 0x22,
+	TblAssemblyRef = 0x23,
+	TblAssemblyRefProcessor = 0x24,
+	TblAssemblyRefOS = 0x25,
+	TblFile = 0x26,
+	TblExportedType = 0x27,
+	TblManifestResource = 0x28,
+	TblNestedClass = 0x29,
+	TblGenericParam = 0x2A,
+	TblMethodSpec = 0x2B,
+	TblGenericParamConstraint = 0x2C,
+	TblCount
+};
+
+#define MD_MAX_COLUMNS 9
+
+// A type name as two views into the #Strings heap.  Neither pointer
+// is ever NULL; the namespace is "" for nested and global types.
+struct TypeName {
+	LPCSTR nameSpace;
+	LPCSTR name;
+
+	TypeName() : nameSpace(""), name("") {}
+	explicit TypeName(LPCSTR nm) : nameSpace(""), name(nm) {}
+	TypeName(LPCSTR ns, LPCSTR nm) : nameSpace(ns), name(nm) {}
+
+	bool IsEmpty() const {
+		return *name == '\0' && *nameSpace == '\0';
+	}
+
+	// compare against a dotted full name such as "System.Threading.Thread"
+	bool Equals(LPCSTR fullName) const;
+
+	// same hash as StringHashA over the dotted full name
+	unsigned long Hash() const;
+};
+
+// the hash TypeName::Hash produces, for plain strings
+unsigned long StringHashA(LPCSTR name);
+
+// turn a UTF-8 name into UTF-16 for reporting, always terminates buffer
+int WidenName(LPCSTR name, WCHAR* buffer, int len);
+int WidenTypeName(const TypeName& name, WCHAR* buffer, int len);
+
+class MetaDataTables {
+private:
+	const BYTE* _base;
+	ULONG _size;
+	const IMAGE_COR20_HEADER* _corHeader;
+
+	const BYTE* _strings;
+	ULONG _stringsSize;
+	const BYTE* _blob;
+	ULONG _blobSize;
+	const BYTE* _guid;
+	ULONG _guidSize;
+	const BYTE* _userStrings;
+	ULONG _userStringsSize;
+	const BYTE* _tableStream;
+	ULONG _tableStreamSize;
+
+	ULONG _rows[TblCount];
+	const BYTE* _tables[TblCount];
+	ULONG _rowSize[TblCount];
+	BYTE _colOffset[TblCount][MD_MAX_COLUMNS];
+	BYTE _colSize[TblCount][MD_MAX_COLUMNS];
+	BYTE _heapSizes;
+
+	bool _inited;
+
+	// FieldPtr and MethodPtr row of each Field and MethodDef row, 0 for
+	// none; only filled in for uncompressed metadata
+	std::vector<ULONG> _fieldPtrIndex;
+	std::vector<ULONG> _methodPtrIndex;
+
+	ULONG CodedIndexSize(int kind);
+	bool ComputeLayout();
+	void IndexPointerTable(MetaDataTable ptrTable, MetaDataTable listTable, std::vector<ULONG>& index);
+	ULONG FindOwner(MetaDataTable listTable, int listColumn, ULONG memberRid);
+
+public:
+	MetaDataTables();
+
+	// Locates the CLI header and metadata streams.  base and size
+	// describe the file as mapped, not as laid out by the loader.
+	HRESULT Init(const BYTE* base, ULONG size, PIMAGE_NT_HEADERS headers);
+
+	bool IsInited() { return _inited; }
+	const IMAGE_COR20_HEADER* GetCorHeader() { return _corHeader; }
+
+	const BYTE* RvaToPointer(PIMAGE_NT_HEADERS headers, ULONG rva, ULONG size);
+
+	ULONG GetRowCount(MetaDataTable table) { return _rows[table]; }
+	ULONG GetStringsSize() { return _stringsSize; }
+	ULONG GetBlobSize() { return _blobSize; }
+	ULONG GetGuidSize() { return _guidSize; }
+	ULONG GetUserStringsSize() { return _userStringsSize; }
+	ULONG GetColumn(MetaDataTable table, ULONG rid, int col);
+
+	LPCSTR GetString(ULONG index);
+	bool GetBlob(ULONG index, PCCOR_SIGNATURE* data, ULONG* size);
+
+	HRESULT GetTypeName(mdToken tok, TypeName* name);
+	HRESULT GetMemberName(mdToken tok, LPCSTR* name);
+	HRESULT GetMemberRefProps(mdMemberRef tok, mdToken* classTok, LPCSTR* name,
+							  PCCOR_SIGNATURE* sig, ULONG* sigSize);
+	HRESULT GetMemberParent(mdToken tok, mdTypeDef* classTok);
+
+	HRESULT GetTypeDefProps(mdTypeDef tok, DWORD* flags, mdToken* extends);
+	HRESULT GetMemberList(mdTypeDef tok, MetaDataTable listTable, ULONG* first, ULONG* end);
+	mdToken GetListMember(MetaDataTable listTable, ULONG index);
+	HRESULT GetMethodProps(mdMethodDef tok, DWORD* attrs, DWORD* implFlags,
+						   PCCOR_SIGNATURE* sig, ULONG* sigSize, ULONG* rva);
+	HRESULT GetFieldProps(mdFieldDef tok, DWORD* attrs, PCCOR_SIGNATURE* sig, ULONG* sigSize);
+	HRESULT GetTypeSpec(mdTypeSpec tok, PCCOR_SIGNATURE* sig, ULONG* sigSize);
+	HRESULT GetCallSignature(mdToken tok, PCCOR_SIGNATURE* sig, ULONG* sigSize);
+	HRESULT GetEnclosingType(mdToken tok, mdToken* enclosing);
+	bool GetAssemblyPublicKey(const BYTE** key, ULONG* size);
+	HRESULT GetMethodCodeSize(PIMAGE_NT_HEADERS headers, ULONG rid, ULONG* codeSize);
+
+	// The header of the method body at rva, NULL unless the header,
+	// code and every extra data section lie inside the file.
+	// COR_ILMETHOD_DECODER trusts the sizes it reads; this doesn't.
+	const BYTE* GetMethodBody(PIMAGE_NT_HEADERS headers, ULONG rva);
+};
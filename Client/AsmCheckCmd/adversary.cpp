@@ -0,0 +1,390 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// adversary.cpp : builds the adversarial regression corpus.  Every image
+// is a 32 bit IL-only DLL with one .text section, laid out with file and
+// section alignment equal so an RVA is also the file offset:
+//
+//     headers | CLI header | method body | metadata
+//
+// The metadata is the least the validator reads: <Module>, one type and
+// its methods, with every heap index two bytes wide.
+//
+
+#include "stdafx.h"
+#include "adversary.h"
+
+typedef std::vector<BYTE> byteList;
+
+#define IMAGE_ALIGNMENT     0x200   // file and section alignment both
+#define CLI_HEADER_SIZE     72
+#define PE_HEADER_OFFSET    0x40
+
+#define TABLE_MODULE        0x00
+#define TABLE_TYPEDEF       0x02
+#define TABLE_METHODPTR     0x05
+#define TABLE_METHODDEF     0x06
+
+// offsets into the strings heap below
+#define STRING_MODULE       1
+#define STRING_TYPE         10
+#define STRING_METHOD       20
+
+#define METHOD_FLAGS        0x0086  // public hidebysig
+#define ABSTRACT_FLAGS      0x05C6  // public hidebysig virtual newslot abstract
+#define TYPE_FLAGS          0x00100001  // public beforefieldinit
+
+#define CALL_TOKEN          0x06000001  // the method itself
+#define LARGE_BODY_CALLS    20000       // ldarg.0, call pairs: 120KB of IL, under the default method size limit
+#define LARGE_METHOD_ROWS   0xFFF0      // just under the default table row limit
+
+static const char strings[] = "\0<Module>\0Adversary\0Run\0";
+static const BYTE blob[] = { 0x00, 0x03, 0x20, 0x00, 0x01 };   // instance void(), at 1
+static const BYTE guid[16] = { 0x41, 0x64, 0x76, 0x65, 0x72, 0x73, 0x61, 0x72, 0x79, 0x43, 0x6F, 0x72, 0x70, 0x75, 0x73, 0x31 };
+static const BYTE userStrings[4] = { 0 };
+
+static void Put16(byteList& b, size_t at, ULONG value)
+{
+	b[at] = (BYTE)value;
+	b[at + 1] = (BYTE)(value >> 8);
+}
+
+static void Put32(byteList& b, size_t at, ULONG value)
+{
+	Put16(b, at, value & 0xFFFF);
+	Put16(b, at + 2, value >> 16);
+}
+
+static void Append16(byteList& b, ULONG value)
+{
+	b.resize(b.size() + 2);
+	Put16(b, b.size() - 2, value);
+}
+
+static void Append32(byteList& b, ULONG value)
+{
+	b.resize(b.size() + 4);
+	Put32(b, b.size() - 4, value);
+}
+
+static void AppendBytes(byteList& b, const void* p, size_t size)
+{
+	b.insert(b.end(), (const BYTE*)p, (const BYTE*)p + size);
+}
+
+static void Align(byteList& b, size_t alignment)
+{
+	b.resize((b.size() + alignment - 1) & ~(alignment - 1), 0);
+}
+
+// a tiny header, for code under 64 bytes
+static void TinyBody(byteList& body, const BYTE* code, ULONG size)
+{
+	body.clear();
+	body.push_back((BYTE)((size << 2) | 0x02));
+	AppendBytes(body, code, size);
+}
+
+// a fat header claiming codeSize, whatever the code that follows
+static void FatBody(byteList& body, bool moreSects, ULONG maxStack, ULONG codeSize, const BYTE* code, ULONG size)
+{
+	body.clear();
+	Append16(body, moreSects ? 0x300B : 0x3003);
+	Append16(body, maxStack);
+	Append32(body, codeSize);
+	Append32(body, 0);
+	AppendBytes(body, code, size);
+}
+
+// a section after the code, with the kind and size of its header only
+static void AppendSection(byteList& body, BYTE kind, ULONG dataSize)
+{
+	Align(body, 4);
+	body.push_back(kind);
+	body.push_back((BYTE)dataSize);
+	body.push_back((BYTE)(dataSize >> 8));
+	body.push_back((BYTE)(dataSize >> 16));
+}
+
+// ldarg.0, call Run over and over: straight line code with nothing wrong
+// but its length
+static void LargeBody(byteList& body)
+{
+	byteList code;
+	for (ULONG i = 0; i < LARGE_BODY_CALLS; i++)
+    {
+		code.push_back(0x02);
+		code.push_back(0x28);
+		Append32(code, CALL_TOKEN);
+	}
+	code.push_back(0x2A);
+
+	FatBody(body, false, 1, (ULONG)code.size(), &code[0], (ULONG)code.size());
+}
+
+// The tables stream.  With pointerTable, MethodDef is reached through
+// MethodPtr, listed backwards so the one method with a body is found last.
+static void BuildTables(ULONG bodyRVA, ULONG methodRows, bool pointerTable, byteList& tables)
+{
+	Append32(tables, 0);
+	tables.push_back(2);    // version 2.0
+	tables.push_back(0);
+	tables.push_back(0);    // heap sizes: every index two bytes
+	tables.push_back(1);
+
+	ULONG valid = (1 << TABLE_MODULE) | (1 << TABLE_TYPEDEF) | (1 << TABLE_METHODDEF);
+	if ( pointerTable )
+		valid |= 1 << TABLE_METHODPTR;
+	Append32(tables, valid);
+	Append32(tables, 0);
+	Append32(tables, 0);    // sorted
+	Append32(tables, 0);
+
+	// row counts, in table order
+	Append32(tables, 1);
+	Append32(tables, 2);
+	if ( pointerTable )
+		Append32(tables, methodRows);
+	Append32(tables, methodRows);
+
+	// Module
+	Append16(tables, 0);
+	Append16(tables, STRING_TYPE);
+	Append16(tables, 1);
+	Append16(tables, 0);
+	Append16(tables, 0);
+
+	// TypeDef: <Module> with nothing in it, then the type with every method
+	Append32(tables, 0);
+	Append16(tables, STRING_MODULE);
+	Append16(tables, 0);
+	Append16(tables, 0);
+	Append16(tables, 1);
+	Append16(tables, 1);
+
+	Append32(tables, TYPE_FLAGS);
+	Append16(tables, STRING_TYPE);
+	Append16(tables, 0);
+	Append16(tables, 0);
+	Append16(tables, 1);
+	Append16(tables, 1);
+
+	if ( pointerTable )
+    {
+		for (ULONG i = 0; i < methodRows; i++)
+			Append16(tables, methodRows - i);
+	}
+
+	// MethodDef: the first has the body, the rest have none
+	for (ULONG i = 0; i < methodRows; i++)
+    {
+		Append32(tables, (0 == i) ? bodyRVA : 0);
+		Append16(tables, 0);
+		Append16(tables, (0 == i) ? METHOD_FLAGS : ABSTRACT_FLAGS);
+		Append16(tables, STRING_METHOD);
+		Append16(tables, 1);
+		Append16(tables, 1);
+	}
+
+	Align(tables, 4);
+}
+
+// the metadata root, its stream headers and the streams
+static void BuildMetadata(ULONG bodyRVA, ULONG methodRows, bool pointerTable, byteList& metadata)
+{
+	byteList tables;
+	BuildTables(bodyRVA, methodRows, pointerTable, tables);
+
+	byteList heaps[5];
+	heaps[0] = tables;
+	AppendBytes(heaps[1], strings, sizeof(strings) - 1);
+	Align(heaps[1], 4);
+	AppendBytes(heaps[2], userStrings, sizeof(userStrings));
+	AppendBytes(heaps[3], guid, sizeof(guid));
+	AppendBytes(heaps[4], blob, sizeof(blob));
+	Align(heaps[4], 4);
+
+	// the uncompressed name makes the reader find the pointer tables
+	const char* names[5] = { pointerTable ? "#-" : "#~", "#Strings", "#US", "#GUID", "#Blob" };
+	static const char version[12] = "v2.0.50727";
+
+	Append32(metadata, 0x424A5342);     // BSJB
+	Append16(metadata, 1);
+	Append16(metadata, 1);
+	Append32(metadata, 0);
+	Append32(metadata, sizeof(version));
+	AppendBytes(metadata, version, sizeof(version));
+	Append16(metadata, 0);
+	Append16(metadata, 5);
+
+	size_t headersSize = 0;
+	for (int i = 0; i < 5; i++)
+		headersSize += 8 + ((strlen(names[i]) + 4) & ~3);
+
+	ULONG offset = (ULONG)(metadata.size() + headersSize);
+	for (int i = 0; i < 5; i++)
+    {
+		Append32(metadata, offset);
+		Append32(metadata, (ULONG)heaps[i].size());
+		AppendBytes(metadata, names[i], strlen(names[i]) + 1);
+		Align(metadata, 4);
+
+		offset += (ULONG)heaps[i].size();
+	}
+
+	for (int i = 0; i < 5; i++)
+		AppendBytes(metadata, &heaps[i][0], heaps[i].size());
+}
+
+static void BuildImage(const byteList& body, ULONG methodRows, bool pointerTable, byteList& image)
+{
+	byteList section(CLI_HEADER_SIZE, 0);
+
+	ULONG bodyRVA = IMAGE_ALIGNMENT + (ULONG)section.size();
+	AppendBytes(section, &body[0], body.size());
+	Align(section, 4);
+
+	ULONG metadataRVA = IMAGE_ALIGNMENT + (ULONG)section.size();
+	byteList metadata;
+	BuildMetadata(bodyRVA, methodRows, pointerTable, metadata);
+	AppendBytes(section, &metadata[0], metadata.size());
+
+	// CLI header
+	Put32(section, 0, CLI_HEADER_SIZE);
+	Put16(section, 4, 2);
+	Put16(section, 6, 5);
+	Put32(section, 8, metadataRVA);
+	Put32(section, 12, (ULONG)metadata.size());
+	Put32(section, 16, 1);      // IL only
+
+	ULONG virtualSize = (ULONG)section.size();
+	Align(section, IMAGE_ALIGNMENT);
+
+	image.assign(IMAGE_ALIGNMENT, 0);
+
+	// DOS header
+	image[0] = 'M';
+	image[1] = 'Z';
+	Put32(image, 0x3C, PE_HEADER_OFFSET);
+
+	// file header
+	size_t pe = PE_HEADER_OFFSET;
+	Put32(image, pe, 0x00004550);       // PE\0\0
+	Put16(image, pe + 4, 0x014C);       // i386
+	Put16(image, pe + 6, 1);
+	Put16(image, pe + 20, 0xE0);        // optional header size
+	Put16(image, pe + 22, 0x2102);      // executable, 32 bit, DLL
+
+	// optional header
+	size_t optional = pe + 24;
+	Put16(image, optional, 0x010B);     // PE32
+	Put32(image, optional + 28, 0x00400000);
+	Put32(image, optional + 32, IMAGE_ALIGNMENT);
+	Put32(image, optional + 36, IMAGE_ALIGNMENT);
+	Put16(image, optional + 40, 4);
+	Put16(image, optional + 48, 4);
+	Put32(image, optional + 56, IMAGE_ALIGNMENT + (ULONG)section.size());
+	Put32(image, optional + 60, IMAGE_ALIGNMENT);
+	Put16(image, optional + 68, 3);     // console
+	Put32(image, optional + 92, 16);
+	Put32(image, optional + 96 + 14 * 8, IMAGE_ALIGNMENT);     // the CLI header directory
+	Put32(image, optional + 100 + 14 * 8, CLI_HEADER_SIZE);
+
+	// section header
+	size_t header = optional + 0xE0;
+	memcpy(&image[header], ".text", 5);
+	Put32(image, header + 8, virtualSize);
+	Put32(image, header + 12, IMAGE_ALIGNMENT);
+	Put32(image, header + 16, (ULONG)section.size());
+	Put32(image, header + 20, IMAGE_ALIGNMENT);
+	Put32(image, header + 36, 0x60000020);  // code, execute, read
+
+	AppendBytes(image, &section[0], section.size());
+}
+
+static bool WriteImage(LPCWSTR dir, LPCWSTR name, const byteList& image, AdversaryExpect expect, std::vector<AdversaryInput>& inputs)
+{
+	AdversaryInput input;
+	input.path = std::wstring(dir) + L"\\" + name + L".dll";
+	input.expect = expect;
+
+	FILE* file = _wfopen(input.path.c_str(), L"wb");
+	if ( NULL == file )
+    {
+		fwprintf(stderr, L"asmcheckcmd: Can't write %s\n", input.path.c_str());
+		return false;
+	}
+
+	bool written = (image.size() == fwrite(&image[0], 1, image.size(), file));
+	if ( 0 != fclose(file) )
+		written = false;
+
+	if ( !written )
+    {
+		fwprintf(stderr, L"asmcheckcmd: Can't write %s\n", input.path.c_str());
+		return false;
+	}
+
+	inputs.push_back(input);
+	return true;
+}
+
+bool WriteAdversaryCorpus(LPCWSTR dir, std::vector<AdversaryInput>& inputs)
+{
+	static const BYTE switchCountMax[] = { 0x45, 0xFF, 0xFF, 0xFF, 0xFF, 0x2A };
+	static const BYTE switchTruncated[] = { 0x45, 0x10, 0x00, 0x00, 0x00, 0x2A };
+	static const BYTE operandTruncated[] = { 0x28, 0x01, 0x00 };
+	static const BYTE branchOutside[] = { 0x38, 0x00, 0x00, 0x00, 0x40, 0x2A };
+	static const BYTE prefixTruncated[] = { 0xFE };
+	static const BYTE ret[] = { 0x2A };
+
+	byteList body, image;
+	bool ok = true;
+
+	// decoding has to stop at the end of the body, not read past it
+	TinyBody(body, switchCountMax, sizeof(switchCountMax));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"switch-count-max", image, ExpectRejected, inputs) && ok;
+
+	TinyBody(body, switchTruncated, sizeof(switchTruncated));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"switch-truncated", image, ExpectRejected, inputs) && ok;
+
+	TinyBody(body, operandTruncated, sizeof(operandTruncated));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"operand-truncated", image, ExpectRejected, inputs) && ok;
+
+	TinyBody(body, branchOutside, sizeof(branchOutside));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"branch-out-of-body", image, ExpectRejected, inputs) && ok;
+
+	TinyBody(body, prefixTruncated, sizeof(prefixTruncated));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"prefix-truncated", image, ExpectRejected, inputs) && ok;
+
+	// headers that claim more than the file holds
+	FatBody(body, false, 8, 0x7FFFFFF0, ret, sizeof(ret));
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"code-past-end", image, ExpectRejected, inputs) && ok;
+
+	FatBody(body, true, 8, sizeof(ret), ret, sizeof(ret));
+	AppendSection(body, 0x41, 0xFFFFF0);    // fat EH table
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"eh-past-end", image, ExpectRejected, inputs) && ok;
+
+	FatBody(body, true, 8, sizeof(ret), ret, sizeof(ret));
+	AppendSection(body, 0x81, 0);           // more sections, none of them any size
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"eh-empty-section", image, ExpectRejected, inputs) && ok;
+
+	// well formed, but as large as the limits allow
+	LargeBody(body);
+	BuildImage(body, 1, false, image);
+	ok = WriteImage(dir, L"straight-line-calls", image, ExpectBounded, inputs) && ok;
+
+	BuildImage(body, LARGE_METHOD_ROWS, true, image);
+	ok = WriteImage(dir, L"method-ptr-scan", image, ExpectBounded, inputs) && ok;
+
+	return ok;
+}
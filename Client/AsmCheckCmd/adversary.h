@@ -0,0 +1,30 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// adversary.h : crafted assemblies that have broken the validator's time
+// or memory bounds before, built from scratch so the regression corpus
+// needs no binaries checked in.  Each is one type with one method whose
+// body is the attack; asmcheckcmd --adversarial writes and validates them.
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+
+#define ADVERSARY_TIME_LIMIT 5000   // milliseconds; every input is done well within this
+
+// what validating a crafted input has to come to
+enum AdversaryExpect {
+	ExpectRejected,     // fail, for a body that is malformed
+	ExpectBounded       // any verdict but timed_out, for a body that is only large
+};
+
+struct AdversaryInput {
+	std::wstring path;
+	AdversaryExpect expect;
+};
+
+// Writes the corpus into dir, which must exist, and lists what was written.
+bool WriteAdversaryCorpus(LPCWSTR dir, std::vector<AdversaryInput>& inputs);
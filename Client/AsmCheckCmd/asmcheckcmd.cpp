@@ -0,0 +1,559 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+
+// asmcheckcmd.cpp : command line driver for asmcheck.dll, for vetting
+// uploads from scripts and for profiling the validator outside the
+// client.  Validates files, directories (recursively) and lists of paths
+// read from stdin, several at a time, and writes one line per assembly
+// as each verdict comes in:
+//
+//     verdict <TAB> milliseconds <TAB> methods <TAB> instructions <TAB> peak bytes <TAB> path
+//
+// verdict is pass, fail, timed_out, cancelled or error for a file that
+// couldn't be validated at all.  A count of each goes to stderr at the
+// end.  The exit code is 0 if every assembly passed, otherwise the
+// EXIT_SOME_* bits of what happened.  Ctrl+C cancels the validations
+// running and skips the rest.
+//
+// --adversarial DIR writes the crafted inputs of adversary.h into DIR and
+// validates them along with the rest; one whose verdict isn't what it
+// has to be is reported on stderr and counts as an error.
+//
+// --stress N holds the validator to the contract in asmcheckapi.h that
+// any number of validations may run at once: the paths are validated one
+// at a time, then N at a time, and an assembly whose verdict, counts,
+// content hash or diagnostics differ between the two is reported on
+// stderr and counts as an error.  Both passes run at interactive
+// priority, so the validator doesn't hold the second one to the few
+// slots it gives bulk work, and without --index, since bodies one pass
+// adds to the index would change what the other one checks.
+//
+
+#include "stdafx.h"
+#include <process.h>
+#include <vector>
+#include <string>
+#include "adversary.h"
+
+#define EXIT_ALL_PASSED     0
+#define EXIT_SOME_FAILED    1
+#define EXIT_SOME_STOPPED   2   // timed out or cancelled
+#define EXIT_SOME_ERRORS    4   // bad arguments, missing files
+
+// WaitForMultipleObjects waits for at most this many threads
+#define MAX_JOBS MAXIMUM_WAIT_OBJECTS
+
+typedef std::vector<std::wstring> pathList;
+
+// what --stress compares between its passes
+struct Outcome {
+	ULONG methodCount;
+	ULONG instructionCount;
+	BYTE contentHash[ASMCHECK_HASH_SIZE];
+	std::wstring diagnostics;   // a line per diagnostic, fields tab separated
+};
+
+static pathList g_paths;
+static std::vector<DWORD> g_verdicts;       // of each path, as it comes in
+static std::vector<Outcome> g_outcomes;     // likewise, with --stress
+static std::vector<AdversaryInput> g_adversaries;   // the last paths of all
+static size_t g_firstAdversary;
+static volatile LONG g_next;
+static volatile LONG g_cancel;
+static volatile LONG g_counts[ASMCHECK_VERDICT_COUNT];
+static bool g_pathErrors;
+static bool g_listing;
+static ULONG g_stressJobs;      // 0 unless --stress
+static ASMCHECK_OPTIONS g_options;
+static CRITICAL_SECTION g_outputLock;
+
+static const char* verdictNames[ASMCHECK_VERDICT_COUNT] = {
+	"error",
+	"pass",
+	"fail",
+	"timed_out",
+	"cancelled"
+};
+
+static int Usage()
+{
+	fwprintf(stderr,
+		L"usage: asmcheckcmd [options] [file | directory | -] ...\n"
+		L"Validates organism assemblies; directories are searched for .dll and .exe\n"
+		L"files, - or no paths at all reads paths from stdin, one per line.\n"
+		L"\n"
+		L"  -j, --jobs N         validations run at once, default one per processor\n"
+		L"  --time-limit MS      give up on an assembly after MS milliseconds\n"
+		L"  --allowlist FILE     only allow the members on FILE (see BuildAllowlist)\n"
+		L"  --index FILE         skip method bodies FILE knows to be clean, and add to it\n"
+		L"  --strong-name        require a valid strong name signature\n"
+		L"  --listing            write the IL of each assembly, with its violations,\n"
+		L"                       to the assembly's path with .il appended\n"
+		L"  --adversarial DIR    write the adversarial regression inputs to DIR and\n"
+		L"                       check each is rejected or finishes in time\n"
+		L"  --stress N           validate everything one at a time, then N at a time,\n"
+		L"                       and check every verdict and diagnostic comes out\n"
+		L"                       the same; --index is ignored\n");
+
+	return EXIT_SOME_ERRORS;
+}
+
+static bool IsAssemblyFile(LPCWSTR name)
+{
+	LPCWSTR extension = wcsrchr(name, L'.');
+
+	return NULL != extension && (0 == _wcsicmp(extension, L".dll") || 0 == _wcsicmp(extension, L".exe"));
+}
+
+static void ScanDirectory(const std::wstring& directory)
+{
+	WIN32_FIND_DATAW data;
+	std::wstring pattern = directory + L"\\*";
+
+	HANDLE find = FindFirstFileW(pattern.c_str(), &data);
+	if ( find == INVALID_HANDLE_VALUE )
+    {
+		fwprintf(stderr, L"asmcheckcmd: Can't read directory %s\n", directory.c_str());
+		g_pathErrors = true;
+		return;
+	}
+
+	do
+    {
+		if ( 0 == wcscmp(data.cFileName, L".") || 0 == wcscmp(data.cFileName, L"..") )
+			continue;
+
+		std::wstring path = directory + L"\\" + data.cFileName;
+		if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+        {
+			// junctions can lead back up the tree
+			if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) )
+				ScanDirectory(path);
+		}
+		else if ( IsAssemblyFile(data.cFileName) )
+			g_paths.push_back(path);
+	}
+	while ( FindNextFileW(find, &data) );
+
+	FindClose(find);
+}
+
+// a file is validated whatever its name, a directory is searched
+static void AddPath(LPCWSTR path)
+{
+	DWORD attributes = GetFileAttributesW(path);
+
+	if ( attributes == INVALID_FILE_ATTRIBUTES )
+    {
+		fwprintf(stderr, L"asmcheckcmd: Can't find %s\n", path);
+		g_pathErrors = true;
+	}
+	else if ( attributes & FILE_ATTRIBUTE_DIRECTORY )
+    {
+		std::wstring directory = path;
+		while ( directory.length() > 1 && (directory[directory.length() - 1] == L'\\' || directory[directory.length() - 1] == L'/') )
+			directory.erase(directory.length() - 1);
+
+		ScanDirectory(directory);
+	}
+	else
+		g_paths.push_back(path);
+}
+
+static void ReadPathList()
+{
+	WCHAR line[MAX_PATH + 2];
+
+	while ( NULL != fgetws(line, sizeof(line) / sizeof(line[0]), stdin) )
+    {
+		size_t length = wcslen(line);
+		while ( length > 0 && (line[length - 1] == L'\n' || line[length - 1] == L'\r') )
+			line[--length] = L'\0';
+
+		if ( length > 0 )
+			AddPath(line);
+	}
+}
+
+static void AppendField(std::wstring& text, LPCWSTR field)
+{
+	if ( NULL != field )
+		text += field;
+	text += L'\t';
+}
+
+static void AppendNumber(std::wstring& text, ULONG number)
+{
+	WCHAR digits[16];
+
+	_snwprintf(digits, sizeof(digits) / sizeof(digits[0]), L"%lu", number);
+	AppendField(text, digits);
+}
+
+// the diagnostics of result, one to a line, offsets and all
+static void FormatDiagnostics(const ASMCHECK_RESULT& result, std::wstring& text)
+{
+	text.clear();
+
+	for (ULONG d = 0; d < result.diagnosticCount; d++)
+    {
+		const ASMCHECK_DIAGNOSTIC& diagnostic = result.diagnostics[d];
+
+		AppendNumber(text, diagnostic.errorContext);
+		AppendField(text, diagnostic.typeName);
+		AppendField(text, diagnostic.memberName);
+		AppendField(text, diagnostic.container);
+		AppendField(text, diagnostic.detail);
+		AppendField(text, diagnostic.message);
+		AppendNumber(text, diagnostic.count);
+		for (ULONG o = 0; o < diagnostic.offsetCount && o < ASMCHECK_MAX_OFFSETS; o++)
+			AppendNumber(text, diagnostic.offsets[o]);
+
+		text += L'\n';
+	}
+}
+
+static void ValidateOne(size_t index)
+{
+	const std::wstring& path = g_paths[index];
+	ASMCHECK_STATS stats;
+	LARGE_INTEGER start, end, frequency;
+
+	ZeroMemory(&stats, sizeof(stats));
+	stats.cbSize = sizeof(stats);
+
+	// the workers share g_options, the listing is per path
+	ASMCHECK_OPTIONS options = g_options;
+	std::wstring listing;
+	if ( g_listing )
+    {
+		listing = path + L".il";
+		options.listingFile = listing.c_str();
+	}
+
+	// a crafted input that hangs shouldn't hang the run
+	if ( index >= g_firstAdversary && 0 == options.timeLimit )
+		options.timeLimit = ADVERSARY_TIME_LIMIT;
+
+	// the time includes any wait for a slot in the validator, which
+	// runs no more validations at once than there are processors
+	QueryPerformanceCounter(&start);
+	if ( 0 != g_stressJobs )
+    {
+		ASMCHECK_RESULT result;
+		ZeroMemory(&result, sizeof(result));
+		result.cbSize = sizeof(result);
+		result.cbDiagnostic = sizeof(ASMCHECK_DIAGNOSTIC);
+
+		CheckAssemblyWithResult(path.c_str(), &options, &stats, &result);
+
+		Outcome& outcome = g_outcomes[index];
+		outcome.methodCount = stats.methodCount;
+		outcome.instructionCount = stats.instructionCount;
+		CopyMemory(outcome.contentHash, stats.contentHash, sizeof(outcome.contentHash));
+		FormatDiagnostics(result, outcome.diagnostics);
+		FreeCheckResult(&result);
+	}
+	else
+		CheckAssemblyWithOptions(path.c_str(), &options, &stats);
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&frequency);
+
+	double millis = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+	DWORD verdict = (stats.verdict < ASMCHECK_VERDICT_COUNT) ? stats.verdict : ASMCHECK_VERDICT_NONE;
+	InterlockedIncrement(&g_counts[verdict]);
+	g_verdicts[index] = verdict;
+
+	EnterCriticalSection(&g_outputLock);
+	wprintf(L"%S\t%.3f\t%lu\t%lu\t%lu\t%s\n", verdictNames[verdict], millis,
+			stats.methodCount, stats.instructionCount, (ULONG)stats.peakMemory, path.c_str());
+	fflush(stdout);
+	LeaveCriticalSection(&g_outputLock);
+}
+
+static unsigned __stdcall Worker(void* /* context */)
+{
+	while ( 0 == g_cancel )
+    {
+		LONG i = InterlockedIncrement(&g_next) - 1;
+		if ( i >= (LONG)g_paths.size() )
+			break;
+
+		ValidateOne((size_t)i);
+	}
+
+	return 0;
+}
+
+static BOOL WINAPI CtrlHandler(DWORD type)
+{
+	if ( type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT )
+		return FALSE;
+
+	InterlockedExchange(&g_cancel, 1);
+	return TRUE;
+}
+
+// Each adversarial input has to be rejected, or for one that is only
+// large, finished in time.  A run that was cancelled proves nothing.
+static bool CheckAdversaries()
+{
+	bool held = true;
+
+	for (size_t i = 0; i < g_adversaries.size() && 0 == g_cancel; i++)
+    {
+		DWORD verdict = g_verdicts[g_firstAdversary + i];
+		bool expected;
+
+		if ( g_adversaries[i].expect == ExpectRejected )
+			expected = (verdict == ASMCHECK_VERDICT_FAILED);
+		else
+			expected = (verdict == ASMCHECK_VERDICT_PASSED || verdict == ASMCHECK_VERDICT_FAILED);
+
+		if ( !expected )
+        {
+			fwprintf(stderr, L"asmcheckcmd: %S instead of %s for %s\n", verdictNames[verdict],
+					 (g_adversaries[i].expect == ExpectRejected) ? L"fail" : L"pass or fail",
+					 g_adversaries[i].path.c_str());
+			held = false;
+		}
+	}
+
+	return held;
+}
+
+// Validates every path with jobs threads, then writes the totals.
+static void RunPass(ULONG jobs)
+{
+	g_next = 0;
+	for (int v = 0; v < ASMCHECK_VERDICT_COUNT; v++)
+		g_counts[v] = 0;
+
+	if ( jobs > MAX_JOBS )
+		jobs = MAX_JOBS;
+	if ( jobs > g_paths.size() )
+		jobs = (ULONG)g_paths.size();
+
+	LARGE_INTEGER start, end, frequency;
+	QueryPerformanceCounter(&start);
+
+	HANDLE threads[MAX_JOBS];
+	ULONG started = 0;
+	for (ULONG j = 0; j < jobs; j++)
+    {
+		threads[started] = (HANDLE)_beginthreadex(NULL, 0, Worker, NULL, 0, NULL);
+		if ( NULL != threads[started] )
+			started++;
+	}
+
+	// without any thread at all, the work is done here
+	if ( 0 == started )
+		Worker(NULL);
+	else
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+
+	for (ULONG j = 0; j < started; j++)
+		CloseHandle(threads[j]);
+
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&frequency);
+
+	fwprintf(stderr, L"asmcheckcmd: %lu assemblies in %.3f s: %ld passed, %ld failed, %ld timed out, %ld cancelled, %ld errors\n",
+			 (ULONG)g_paths.size(), (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart,
+			 g_counts[ASMCHECK_VERDICT_PASSED], g_counts[ASMCHECK_VERDICT_FAILED],
+			 g_counts[ASMCHECK_VERDICT_TIMED_OUT], g_counts[ASMCHECK_VERDICT_CANCELLED],
+			 g_counts[ASMCHECK_VERDICT_NONE]);
+}
+
+// A verdict, count, hash or diagnostic that changes with the number of
+// validations running at once means state leaks between them.  Timing
+// out depends on the load, so an assembly stopped in either pass is
+// left out.
+static bool CompareOutcomes(const std::vector<DWORD>& serial, const std::vector<Outcome>& serialOutcomes)
+{
+	bool same = true;
+
+	for (size_t i = 0; i < g_paths.size() && 0 == g_cancel; i++)
+    {
+		DWORD before = serial[i];
+		DWORD after = g_verdicts[i];
+
+		if ( before == ASMCHECK_VERDICT_TIMED_OUT || before == ASMCHECK_VERDICT_CANCELLED ||
+			 after == ASMCHECK_VERDICT_TIMED_OUT || after == ASMCHECK_VERDICT_CANCELLED )
+			continue;
+
+		if ( before != after )
+        {
+			fwprintf(stderr, L"asmcheckcmd: %S with 1 job but %S with %lu for %s\n",
+					 verdictNames[before], verdictNames[after], g_stressJobs, g_paths[i].c_str());
+			same = false;
+			continue;
+		}
+
+		const Outcome& one = serialOutcomes[i];
+		const Outcome& many = g_outcomes[i];
+
+		if ( one.methodCount != many.methodCount || one.instructionCount != many.instructionCount ||
+			 0 != memcmp(one.contentHash, many.contentHash, sizeof(one.contentHash)) )
+        {
+			fwprintf(stderr, L"asmcheckcmd: %lu methods, %lu instructions with 1 job but %lu, %lu with %lu for %s\n",
+					 one.methodCount, one.instructionCount, many.methodCount, many.instructionCount,
+					 g_stressJobs, g_paths[i].c_str());
+			same = false;
+		}
+
+		if ( one.diagnostics != many.diagnostics )
+        {
+			fwprintf(stderr, L"asmcheckcmd: different diagnostics with 1 job and with %lu for %s\n",
+					 g_stressJobs, g_paths[i].c_str());
+			same = false;
+		}
+	}
+
+	return same;
+}
+
+// the value after a numeric option
+static bool NumberArg(int argc, WCHAR* argv[], int& i, ULONG* value)
+{
+	WCHAR* end;
+
+	if ( ++i >= argc )
+		return false;
+
+	*value = wcstoul(argv[i], &end, 10);
+	return end != argv[i] && *end == L'\0';
+}
+
+int wmain(int argc, WCHAR* argv[])
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	ULONG jobs = info.dwNumberOfProcessors;
+	bool readStdin = false;
+	bool sawPath = false;
+
+	ZeroMemory(&g_options, sizeof(g_options));
+	g_options.cbSize = sizeof(g_options);
+	g_options.priority = ASMCHECK_PRIORITY_BULK;
+	g_options.cancel = &g_cancel;
+
+	for (int i = 1; i < argc; i++)
+    {
+		LPCWSTR arg = argv[i];
+
+		if ( 0 == wcscmp(arg, L"-j") || 0 == wcscmp(arg, L"--jobs") )
+        {
+			if ( !NumberArg(argc, argv, i, &jobs) || 0 == jobs )
+				return Usage();
+		}
+		else if ( 0 == wcscmp(arg, L"--time-limit") )
+        {
+			if ( !NumberArg(argc, argv, i, &g_options.timeLimit) )
+				return Usage();
+		}
+		else if ( 0 == wcscmp(arg, L"--allowlist") )
+        {
+			if ( ++i >= argc )
+				return Usage();
+			g_options.allowlistFile = argv[i];
+			g_options.checkFlags |= CHECK_FLAGS_ALLOWLIST;
+		}
+		else if ( 0 == wcscmp(arg, L"--index") )
+        {
+			if ( ++i >= argc )
+				return Usage();
+			g_options.fingerprintIndex = argv[i];
+		}
+		else if ( 0 == wcscmp(arg, L"--strong-name") )
+			g_options.checkFlags |= CHECK_FLAGS_STRONG_NAME;
+		else if ( 0 == wcscmp(arg, L"--listing") )
+			g_listing = true;
+		else if ( 0 == wcscmp(arg, L"--stress") )
+        {
+			if ( !NumberArg(argc, argv, i, &g_stressJobs) || 0 == g_stressJobs )
+				return Usage();
+		}
+		else if ( 0 == wcscmp(arg, L"--adversarial") )
+        {
+			if ( ++i >= argc )
+				return Usage();
+
+			if ( !CreateDirectoryW(argv[i], NULL) && GetLastError() != ERROR_ALREADY_EXISTS )
+            {
+				fwprintf(stderr, L"asmcheckcmd: Can't create directory %s\n", argv[i]);
+				g_pathErrors = true;
+			}
+			else if ( !WriteAdversaryCorpus(argv[i], g_adversaries) )
+				g_pathErrors = true;
+
+			sawPath = true;
+		}
+		else if ( 0 == wcscmp(arg, L"-") )
+			readStdin = true;
+		else if ( arg[0] == L'-' )
+			return Usage();
+		else
+        {
+			AddPath(arg);
+			sawPath = true;
+		}
+	}
+
+	if ( readStdin || !sawPath )
+		ReadPathList();
+
+	// after every other path, so they are told apart by index
+	g_firstAdversary = g_paths.size();
+	for (size_t i = 0; i < g_adversaries.size(); i++)
+		g_paths.push_back(g_adversaries[i].path);
+
+	g_verdicts.assign(g_paths.size(), ASMCHECK_VERDICT_NONE);
+
+	if ( 0 != g_stressJobs )
+    {
+		if ( NULL != g_options.fingerprintIndex )
+        {
+			fwprintf(stderr, L"asmcheckcmd: --index is ignored with --stress\n");
+			g_options.fingerprintIndex = NULL;
+		}
+
+		g_options.priority = ASMCHECK_PRIORITY_INTERACTIVE;
+		g_options.checkFlags |= CHECK_FLAGS_CONTENT_HASH;
+		g_outcomes.resize(g_paths.size());
+	}
+
+	InitializeCriticalSection(&g_outputLock);
+	SetConsoleCtrlHandler(CtrlHandler, TRUE);
+
+	// the counts and verdicts of the last pass are the ones reported
+	bool verdictsSame = true;
+	if ( 0 != g_stressJobs )
+    {
+		RunPass(1);
+		std::vector<DWORD> serial = g_verdicts;
+		std::vector<Outcome> serialOutcomes = g_outcomes;
+
+		RunPass(g_stressJobs);
+		verdictsSame = CompareOutcomes(serial, serialOutcomes);
+	}
+	else
+		RunPass(jobs);
+
+	bool adversariesHeld = CheckAdversaries();
+
+	SetConsoleCtrlHandler(CtrlHandler, FALSE);
+	DeleteCriticalSection(&g_outputLock);
+
+	int exitCode = EXIT_ALL_PASSED;
+	if ( 0 != g_counts[ASMCHECK_VERDICT_FAILED] )
+		exitCode |= EXIT_SOME_FAILED;
+	if ( 0 != g_counts[ASMCHECK_VERDICT_TIMED_OUT] || 0 != g_counts[ASMCHECK_VERDICT_CANCELLED] || 0 != g_cancel )
+		exitCode |= EXIT_SOME_STOPPED;
+	if ( 0 != g_counts[ASMCHECK_VERDICT_NONE] || g_pathErrors || !adversariesHeld || !verdictsSame )
+		exitCode |= EXIT_SOME_ERRORS;
+
+	return exitCode;
+}
@@ -0,0 +1,7 @@
+//------------------------------------------------------------------------------
+//      Copyright (c) Microsoft Corporation.  All rights reserved.
+//------------------------------------------------------------------------------
+// stdafx.cpp : source file that includes just the standard includes
+// asmcheckcmd.pch will be the pre-compiled header
+// stdafx.obj will contain the pre-compiled type information
+#include "stdafx.h"